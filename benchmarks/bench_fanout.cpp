@@ -0,0 +1,333 @@
+//
+// Fan-out throughput of the videotee against the viewer count. A synthetic videotestsrc stream is encoded
+// once up front, then pushed as fast as possible through videotee into N viewer branches built like the
+// ones of start_webrtcbin() (queue ! payloader of the codec, with the payloader probes) ending in fakesinks.
+// Each mode adds what a viewer branch carries with its options: the audio branch (audiotee ! queue !
+// rtpopuspay), the pacer or batched egress probe where nicesink would be, and the shared retransmission
+// probes on the payloader.
+//
+#define RTSP_WEBRTC_NO_MAIN
+
+#include "rtsp_webrtc_1_n.cpp"
+#include "bench_util.h"
+
+#define FANOUT_FRAMES 900 //30 s of 720p30
+#define FANOUT_CODEC CODEC_H264
+#define FANOUT_BITRATE 4000 //kbps
+#define FANOUT_KEY_INT 60
+#define FANOUT_VIDEO \
+    "videotestsrc num-buffers=" G_STRINGIFY (FANOUT_FRAMES) " pattern=ball ! " \
+    "video/x-raw,width=1280,height=720,framerate=30/1 ! "
+#define FANOUT_AUDIO \
+    "audiotestsrc num-buffers=1500 samplesperbuffer=960 wave=ticks ! audioconvert ! audioresample ! opusenc ! " \
+    "appsink name=encoded sync=FALSE" //30 s of 20 ms frames
+#define FANOUT_PACING_KBPS G_MAXINT //Far above any fan-out rate, the pacer only does its accounting
+
+struct FanoutMode {
+    const gchar *name;
+    gboolean audio;
+    gboolean pacing;
+    gboolean batched_egress; //Cannot be combined with pacing
+    gboolean rtx_shared;
+};
+
+static const FanoutMode FANOUT_MODES[] = {
+        {"video", FALSE, FALSE, FALSE, FALSE},
+        {"audio", TRUE, FALSE, FALSE, FALSE},
+        {"pacing_rtx_shared", FALSE, TRUE, FALSE, TRUE},
+        {"egress_rtx_shared", FALSE, FALSE, TRUE, TRUE},
+};
+
+static const gint FANOUT_VIEWERS[] = {1, 2, 5, 10, 25, 50, 100, 200};
+
+static std::atomic<guint64> payloaded_packets{0};
+
+static GstPadProbeReturn count_packets_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        payloaded_packets += gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST (info));
+    else
+        payloaded_packets++;
+    return GST_PAD_PROBE_OK;
+}
+
+/* The encoded frames of a description ending in appsink name=encoded, and their caps */
+static gboolean encode_source(const std::string &description, std::vector<GstBuffer *> &frames, GstCaps **caps) {
+    GError *error = NULL;
+    GstElement *pipeline, *appsink;
+    GstSample *sample;
+
+    pipeline = gst_parse_launch(description.c_str(), &error);
+    if (error) {
+        g_printerr("Failed to parse launch: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    appsink = gst_bin_get_by_name(GST_BIN (pipeline), "encoded");
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    while (true) {
+        g_signal_emit_by_name(appsink, "pull-sample", &sample);
+        if (!sample)
+            break;
+        if (!*caps)
+            *caps = gst_caps_ref(gst_sample_get_caps(sample));
+        frames.push_back(gst_buffer_ref(gst_sample_get_buffer(sample)));
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(appsink);
+    gst_object_unref(pipeline);
+    return !frames.empty() && *caps;
+}
+
+/* The video of FANOUT_CODEC through the encoder of its transcode */
+static std::string video_encode_description(void) {
+    const VideoCodecInfo &codec = VIDEO_CODECS[FANOUT_CODEC];
+    gchar *encoder = g_strdup_printf(codec.encoder, FANOUT_KEY_INT, FANOUT_BITRATE);
+    std::string description = std::string(FANOUT_VIDEO) + encoder +
+                              (codec.record_parser ? std::string(" ! ") + codec.record_parser : std::string("")) +
+                              " ! appsink name=encoded sync=FALSE";
+    g_free(encoder);
+    return description;
+}
+
+static void push_frames(GstElement *appsrc, const std::vector<GstBuffer *> *frames, guint64 *bytes) {
+    GstFlowReturn ret;
+
+    for (GstBuffer *frame : *frames) {
+        *bytes += gst_buffer_get_size(frame);
+        g_signal_emit_by_name(appsrc, "push-buffer", frame, &ret);
+        if (ret != GST_FLOW_OK)
+            break;
+    }
+    g_signal_emit_by_name(appsrc, "end-of-stream", &ret);
+}
+
+/* A viewer of the branch named after peer_id, with the probes start_webrtcbin() and nicesink would add */
+static WebrtcViewerPtr setup_viewer(GstElement *pipeline, const std::string &peer_id, const FanoutMode &mode,
+                                    const RtxStorePtr &store, GSocket *socket, const std::string &address) {
+    WebrtcViewerPtr viewer = std::make_shared<WebrtcViewer>();
+    GstElement *payloader, *sink;
+    GstPad *pad;
+    gchar *tmp;
+
+    viewer->peer_id = peer_id;
+    viewer->pipeline = pipeline;
+    viewer->video_codec = FANOUT_CODEC;
+    viewer->timeline.mark(JOIN_DTLS_CONNECTED); //The probes only act on a connected viewer
+    if (mode.rtx_shared)
+        viewer->rtx_store = store;
+
+    tmp = g_strdup_printf("%s-%s", VIDEO_CODECS[FANOUT_CODEC].pay, peer_id.c_str());
+    payloader = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    pad = gst_element_get_static_pad(payloader, "src");
+    //As WebrtcViewer::add_payloader_probes()
+    gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      join_first_rtp_probe, viewer.get(), NULL);
+    if (viewer->rtx_store) {
+        gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          rtx_packet_probe, viewer.get(), NULL);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, rtx_request_probe, viewer.get(), NULL);
+    }
+    gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      count_packets_probe, NULL, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(payloader);
+
+    //In place of the nicesink of the viewer
+    tmp = g_strdup_printf("sink-%s", peer_id.c_str());
+    sink = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    pad = gst_element_get_static_pad(sink, "sink");
+    if (mode.pacing) {
+        viewer->pacer.kbps = FANOUT_PACING_KBPS;
+        gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          pacing_probe, viewer.get(), NULL);
+    }
+    if (mode.batched_egress) {
+        batchedEgress.attach(viewer.get());
+        {
+            std::lock_guard<std::mutex> guard(viewer->egress_lock);
+            viewer->egress_socket = G_SOCKET (g_object_ref(socket));
+            viewer->egress_address = address;
+        }
+        gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          egress_probe, viewer.get(), NULL);
+    }
+    gst_object_unref(pad);
+    gst_object_unref(sink);
+    return viewer;
+}
+
+/* A UDP socket on loopback and the struct sockaddr of a second one that receives and drops the egress */
+static gboolean open_egress_sockets(GSocket **socket, GSocket **receiver, std::string &address) {
+    GInetAddress *loopback = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+    GSocketAddress *local = g_inet_socket_address_new(loopback, 0);
+    GSocketAddress *bound = NULL;
+    struct sockaddr_storage native;
+    gboolean ret = FALSE;
+
+    *socket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+    *receiver = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+    if (!*socket || !*receiver || !g_socket_bind(*receiver, local, FALSE, NULL))
+        goto done;
+    bound = g_socket_get_local_address(*receiver, NULL);
+    if (!bound || !g_socket_address_to_native(bound, &native, sizeof(native), NULL))
+        goto done;
+    g_socket_set_blocking(*socket, FALSE);
+    address.assign((const gchar *) &native, g_socket_address_get_native_size(bound));
+    ret = TRUE;
+
+    done:
+    if (bound)
+        g_object_unref(bound);
+    g_object_unref(local);
+    g_object_unref(loopback);
+    return ret;
+}
+
+static gboolean run_fanout(JsonBuilder *builder, const FanoutMode &mode, gint viewers,
+                           const std::vector<GstBuffer *> &frames, GstCaps *caps,
+                           const std::vector<GstBuffer *> &audio_frames, GstCaps *audio_caps,
+                           GSocket *socket, const std::string &address) {
+    const VideoCodecInfo &codec = VIDEO_CODECS[FANOUT_CODEC];
+    //The viewer queues block instead of leaking, every frame reaches every viewer at the pushed rate
+    std::string description = "appsrc name=source format=time block=TRUE max-bytes=4194304 ! "
+                              "tee name=videotee allow-not-linked=TRUE ";
+    std::vector<WebrtcViewerPtr> branches;
+    RtxStorePtr store = std::make_shared<RtxStore>();
+    GError *error = NULL;
+    GstElement *pipeline, *appsrc, *audiosrc = NULL;
+    GstMessage *message;
+    GstBus *bus;
+    gint64 start, elapsed;
+    gdouble cpu_start, cpu;
+    guint64 bytes = 0, audio_bytes = 0;
+    std::thread audio_thread;
+
+    if (mode.audio)
+        description += "appsrc name=audiosource format=time block=TRUE ! tee name=audiotee allow-not-linked=TRUE ";
+    for (gint viewer = 0; viewer < viewers; viewer++) {
+        std::string peer_id = std::to_string(viewer);
+        description += "videotee. ! queue name=queue-" + peer_id + " ! " + codec.pay + " name=" + codec.pay + "-" +
+                       peer_id + " pt=" + std::to_string(codec.pt) +
+                       (FANOUT_CODEC == CODEC_H264 || FANOUT_CODEC == CODEC_H265 ? " config-interval=-1" : "") +
+                       " ! fakesink name=sink-" + peer_id + " sync=FALSE async=FALSE ";
+        if (mode.audio)
+            description += "audiotee. ! queue name=audioqueue-" + peer_id + " ! rtpopuspay name=rtpopuspay-" +
+                           peer_id + " pt=111 ! fakesink sync=FALSE async=FALSE ";
+    }
+    pipeline = gst_parse_launch(description.c_str(), &error);
+    if (error) {
+        g_printerr("Failed to parse launch: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    for (gint viewer = 0; viewer < viewers; viewer++)
+        branches.push_back(setup_viewer(pipeline, std::to_string(viewer), mode, store, socket, address));
+    appsrc = gst_bin_get_by_name(GST_BIN (pipeline), "source");
+    g_object_set(appsrc, "caps", caps, NULL);
+    if (mode.audio) {
+        audiosrc = gst_bin_get_by_name(GST_BIN (pipeline), "audiosource");
+        g_object_set(audiosrc, "caps", audio_caps, NULL);
+    }
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    payloaded_packets = 0;
+
+    cpu_start = bench_cpu_seconds();
+    start = bench_now_ns();
+    if (audiosrc)
+        audio_thread = std::thread(push_frames, audiosrc, &audio_frames, &audio_bytes);
+    push_frames(appsrc, &frames, &bytes);
+    if (audio_thread.joinable())
+        audio_thread.join();
+    bus = gst_element_get_bus(pipeline);
+    message = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE,
+                                         (GstMessageType) (GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    elapsed = bench_now_ns() - start;
+    cpu = bench_cpu_seconds() - cpu_start;
+    if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR)
+        g_printerr("Fan-out to %d viewers failed\n", viewers);
+
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "name");
+    json_builder_add_string_value(builder, (std::string("fanout_") + mode.name).c_str());
+    json_builder_set_member_name(builder, "codec");
+    json_builder_add_string_value(builder, codec.name);
+    json_builder_set_member_name(builder, "viewers");
+    json_builder_add_int_value(builder, viewers);
+    json_builder_set_member_name(builder, "frames");
+    json_builder_add_int_value(builder, frames.size());
+    json_builder_set_member_name(builder, "seconds");
+    json_builder_add_double_value(builder, elapsed / 1e9);
+    json_builder_set_member_name(builder, "cpu_seconds");
+    json_builder_add_double_value(builder, cpu);
+    json_builder_set_member_name(builder, "frames_per_second");
+    json_builder_add_double_value(builder, frames.size() * 1e9 / elapsed);
+    json_builder_set_member_name(builder, "viewer_frames_per_second");
+    json_builder_add_double_value(builder, frames.size() * viewers * 1e9 / elapsed);
+    json_builder_set_member_name(builder, "packets_per_second");
+    json_builder_add_double_value(builder, payloaded_packets * 1e9 / elapsed);
+    json_builder_set_member_name(builder, "egress_mbps");
+    json_builder_add_double_value(builder, (bytes + audio_bytes) * 8.0 * viewers * 1e3 / elapsed);
+    json_builder_set_member_name(builder, "cpu_us_per_viewer_frame");
+    json_builder_add_double_value(builder, cpu * 1e6 / (frames.size() * viewers));
+    json_builder_end_object(builder);
+    g_printerr("fanout %-18s %4d viewers: %9.0f frames/s, %10.0f viewer frames/s, %10.0f packets/s, "
+               "%.2f us CPU per viewer frame\n", mode.name, viewers, frames.size() * 1e9 / elapsed,
+               frames.size() * viewers * 1e9 / elapsed, payloaded_packets * 1e9 / elapsed,
+               cpu * 1e6 / (frames.size() * viewers));
+
+    gst_message_unref(message);
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    for (auto &viewer : branches) {
+        if (mode.batched_egress)
+            batchedEgress.detach(viewer.get());
+    }
+    if (audiosrc)
+        gst_object_unref(audiosrc);
+    gst_object_unref(appsrc);
+    gst_object_unref(pipeline);
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<GstBuffer *> frames, audio_frames;
+    GstCaps *caps = NULL, *audio_caps = NULL;
+    GSocket *socket = NULL, *receiver = NULL;
+    std::string address;
+    JsonBuilder *builder;
+    int ret = 0;
+
+    gst_init(&argc, &argv);
+    if (!encode_source(video_encode_description(), frames, &caps) ||
+        !encode_source(FANOUT_AUDIO, audio_frames, &audio_caps)) {
+        g_printerr("Failed to encode the synthetic source\n");
+        return 1;
+    }
+    if (!open_egress_sockets(&socket, &receiver, address)) {
+        g_printerr("Failed to open the loopback sockets of the batched egress\n");
+        return 1;
+    }
+    batchedEgress.start();
+    builder = bench_begin("fanout");
+    for (const FanoutMode &mode : FANOUT_MODES) {
+        for (gint viewers : FANOUT_VIEWERS) {
+            if (!run_fanout(builder, mode, viewers, frames, caps, audio_frames, audio_caps, socket, address)) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+    for (GstBuffer *frame : frames)
+        gst_buffer_unref(frame);
+    for (GstBuffer *frame : audio_frames)
+        gst_buffer_unref(frame);
+    gst_caps_unref(caps);
+    gst_caps_unref(audio_caps);
+    g_object_unref(receiver);
+    g_object_unref(socket);
+    ret |= bench_finish(builder, argc, argv);
+    return ret;
+}
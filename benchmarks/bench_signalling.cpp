@@ -0,0 +1,126 @@
+//
+// Microbenchmarks of the signalling hot paths of rtsp2webrtc_1_n: the H264 fmtp rewrite applied to
+// every offer and JSON encode/decode of SDP and ICE messages.
+//
+#define RTSP_WEBRTC_NO_MAIN
+
+#include "rtsp_webrtc_1_n.cpp"
+#include "bench_util.h"
+
+#define SIGNALLING_ITERATIONS 20000
+
+//Offer of webrtcbin for the H264 stream of a camera
+#define BENCH_OFFER_SDP \
+    "v=0\r\n" \
+    "o=- 1786225542354536520 0 IN IP4 0.0.0.0\r\n" \
+    "s=-\r\n" \
+    "t=0 0\r\n" \
+    "a=ice-options:trickle\r\n" \
+    "a=group:BUNDLE video0\r\n" \
+    "m=video 9 UDP/TLS/RTP/SAVPF 96\r\n" \
+    "c=IN IP4 0.0.0.0\r\n" \
+    "a=setup:actpass\r\n" \
+    "a=ice-ufrag:GVj4eLGaZRV6q1iL8X0tXjVaGkeRr/aE\r\n" \
+    "a=ice-pwd:lcqpY0mqC1FWqIHyGHsyrbNVdQpB6gyN\r\n" \
+    "a=rtcp-mux\r\n" \
+    "a=rtcp-rsize\r\n" \
+    "a=sendonly\r\n" \
+    "a=rtpmap:96 H264/90000\r\n" \
+    "a=rtcp-fb:96 nack\r\n" \
+    "a=rtcp-fb:96 nack pli\r\n" \
+    "a=framerate:30\r\n" \
+    "a=fmtp:96 packetization-mode=1;profile-level-id=640028;" \
+    "sprop-parameter-sets=Z2QAKKzZQHgCJ+XARAAAAwAEAAADAPA8YMZY,aOvjyyLA\r\n" \
+    "a=ssrc:3476227010 msid:user2318584524@host-2f8a0b5c webrtctransceiver0\r\n" \
+    "a=ssrc:3476227010 cname:user2318584524@host-2f8a0b5c\r\n" \
+    "a=mid:video0\r\n" \
+    "a=fingerprint:sha-256 4B:E1:5B:0C:79:E2:8F:6E:5A:94:B1:0F:D1:5E:E5:41:" \
+    "19:2F:2A:E1:AE:E3:95:50:5A:13:1B:C5:4D:62:85:0B\r\n"
+
+#define BENCH_CANDIDATE "candidate:1 1 UDP 2015363327 192.168.1.20 46127 typ host"
+
+/* The server logs every offer it rewrites, the terminal would be timed along with the rewrite */
+static void discard_print(const gchar *string) {
+}
+
+/* The way on_server_message takes an SDP message apart */
+static void decode_sdp_message(const gchar *text) {
+    JsonParser *parser = json_parser_new();
+    JsonObject *object, *child;
+    GstSDPMessage *sdp;
+    const gchar *sdp_text;
+
+    if (!json_parser_load_from_data(parser, text, -1, NULL))
+        g_error("Failed to parse %s", text);
+    object = json_node_get_object(json_parser_get_root(parser));
+    child = json_object_get_object_member(object, "sdp");
+    g_assert_cmpstr (json_object_get_string_member(child, "type"), ==, "offer");
+    sdp_text = json_object_get_string_member(child, "sdp");
+    gst_sdp_message_new(&sdp);
+    gst_sdp_message_parse_buffer((const guint8 *) sdp_text, strlen(sdp_text), sdp);
+    gst_sdp_message_free(sdp);
+    g_object_unref(parser);
+}
+
+static void decode_ice_message(const gchar *text) {
+    JsonParser *parser = json_parser_new();
+    JsonObject *object, *child;
+
+    if (!json_parser_load_from_data(parser, text, -1, NULL))
+        g_error("Failed to parse %s", text);
+    object = json_node_get_object(json_parser_get_root(parser));
+    child = json_object_get_object_member(object, "ice");
+    g_assert_nonnull (json_object_get_string_member(child, "candidate"));
+    json_object_get_int_member(child, "sdpMLineIndex");
+    g_object_unref(parser);
+}
+
+int main(int argc, char *argv[]) {
+    GstSDPMessage *offer;
+    gchar *sdp_text, *offer_json, *ice_json;
+    JsonBuilder *builder;
+
+    gst_init(&argc, &argv);
+    g_set_print_handler(discard_print);
+    builder = bench_begin("signalling");
+
+    gst_sdp_message_new(&offer);
+    gst_sdp_message_parse_buffer((const guint8 *) BENCH_OFFER_SDP, strlen(BENCH_OFFER_SDP), offer);
+    sdp_text = gst_sdp_message_as_text(offer);
+    offer_json = sdp_message("offer", sdp_text);
+    ice_json = ice_candidate_message(0, BENCH_CANDIDATE);
+
+    //The rewrite changes the message, each iteration works on a copy so the copy is timed on its own too
+    bench_run(builder, "sdp_copy", SIGNALLING_ITERATIONS, [&]() {
+        GstSDPMessage *copy;
+        gst_sdp_message_copy(offer, &copy);
+        gst_sdp_message_free(copy);
+    });
+    bench_run(builder, "sdp_copy_h264_fmtp_rewrite", SIGNALLING_ITERATIONS, [&]() {
+        GstSDPMessage *copy;
+        gst_sdp_message_copy(offer, &copy);
+        update_h264_fmtp(copy);
+        gst_sdp_message_free(copy);
+    });
+    bench_run(builder, "sdp_as_text", SIGNALLING_ITERATIONS, [&]() {
+        g_free(gst_sdp_message_as_text(offer));
+    });
+    bench_run(builder, "json_encode_sdp", SIGNALLING_ITERATIONS, [&]() {
+        g_free(sdp_message("offer", sdp_text));
+    });
+    bench_run(builder, "json_encode_ice", SIGNALLING_ITERATIONS, [&]() {
+        g_free(ice_candidate_message(0, BENCH_CANDIDATE));
+    });
+    bench_run(builder, "json_decode_sdp_and_parse", SIGNALLING_ITERATIONS, [&]() {
+        decode_sdp_message(offer_json);
+    });
+    bench_run(builder, "json_decode_ice", SIGNALLING_ITERATIONS, [&]() {
+        decode_ice_message(ice_json);
+    });
+
+    g_free(ice_json);
+    g_free(offer_json);
+    g_free(sdp_text);
+    gst_sdp_message_free(offer);
+    return bench_finish(builder, argc, argv);
+}
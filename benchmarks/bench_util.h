@@ -0,0 +1,125 @@
+//
+// Timing and JSON output shared by the benchmarks. Every benchmark writes one JSON document with its
+// results to the file given as first argument, or to stdout, and its progress to stderr.
+//
+#ifndef GST_WEBRTC_EXAMPLE_BENCH_UTIL_H
+#define GST_WEBRTC_EXAMPLE_BENCH_UTIL_H
+
+#include <gst/gst.h>
+#include <json-glib/json-glib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+static gint64 bench_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * G_GINT64_CONSTANT (1000000000) + now.tv_nsec;
+}
+
+/* User plus system CPU time of the process, all threads */
+static gdouble bench_cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static gint64 bench_percentile(const std::vector<gint64> &sorted, gdouble p) {
+    return sorted[MIN(sorted.size() - 1, (gsize) (p * (sorted.size() - 1) + 0.5))];
+}
+
+/* Adds {"name", "iterations", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "max_ns"} to the results array */
+static void bench_add_samples(JsonBuilder *builder, const gchar *name, std::vector<gint64> samples) {
+    gint64 total = 0;
+
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    for (gint64 sample : samples)
+        total += sample;
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "name");
+    json_builder_add_string_value(builder, name);
+    json_builder_set_member_name(builder, "iterations");
+    json_builder_add_int_value(builder, samples.size());
+    json_builder_set_member_name(builder, "mean_ns");
+    json_builder_add_int_value(builder, total / (gint64) samples.size());
+    json_builder_set_member_name(builder, "p50_ns");
+    json_builder_add_int_value(builder, bench_percentile(samples, 0.5));
+    json_builder_set_member_name(builder, "p90_ns");
+    json_builder_add_int_value(builder, bench_percentile(samples, 0.9));
+    json_builder_set_member_name(builder, "p99_ns");
+    json_builder_add_int_value(builder, bench_percentile(samples, 0.99));
+    json_builder_set_member_name(builder, "max_ns");
+    json_builder_add_int_value(builder, samples.back());
+    json_builder_end_object(builder);
+    g_printerr("%-28s %8" G_GSIZE_FORMAT " iterations, mean %10.0f ns, p50 %10" G_GINT64_FORMAT " ns, p99 %10"
+               G_GINT64_FORMAT " ns\n", name, samples.size(), (gdouble) total / samples.size(),
+               bench_percentile(samples, 0.5), bench_percentile(samples, 0.99));
+}
+
+/* Times every call of op, after a tenth as many untimed warmup calls */
+template<typename Op>
+static void bench_run(JsonBuilder *builder, const gchar *name, gint iterations, Op op) {
+    std::vector<gint64> samples;
+
+    for (gint i = 0; i < iterations / 10; i++)
+        op();
+    samples.reserve(iterations);
+    for (gint i = 0; i < iterations; i++) {
+        gint64 start = bench_now_ns();
+        op();
+        samples.push_back(bench_now_ns() - start);
+    }
+    bench_add_samples(builder, name, samples);
+}
+
+/* Opens {"suite", "gstreamer", "timestamp", "results": [...]}, close with bench_finish */
+static JsonBuilder *bench_begin(const gchar *suite) {
+    JsonBuilder *builder = json_builder_new();
+    gchar *version = gst_version_string();
+
+    json_builder_begin_object(builder);
+    json_builder_set_member_name(builder, "suite");
+    json_builder_add_string_value(builder, suite);
+    json_builder_set_member_name(builder, "gstreamer");
+    json_builder_add_string_value(builder, version);
+    json_builder_set_member_name(builder, "timestamp");
+    json_builder_add_int_value(builder, g_get_real_time() / G_USEC_PER_SEC);
+    json_builder_set_member_name(builder, "results");
+    json_builder_begin_array(builder);
+    g_free(version);
+    return builder;
+}
+
+static int bench_finish(JsonBuilder *builder, int argc, char *argv[]) {
+    JsonGenerator *generator = json_generator_new();
+    JsonNode *root;
+    GError *error = NULL;
+    int ret = 0;
+
+    json_builder_end_array(builder);
+    json_builder_end_object(builder);
+    root = json_builder_get_root(builder);
+    json_generator_set_root(generator, root);
+    json_generator_set_pretty(generator, TRUE);
+    if (argc > 1) {
+        if (!json_generator_to_file(generator, argv[1], &error)) {
+            g_printerr("Failed to write %s: %s\n", argv[1], error->message);
+            g_error_free(error);
+            ret = 1;
+        }
+    } else {
+        gchar *text = json_generator_to_data(generator, NULL);
+        fprintf(stdout, "%s\n", text);
+        g_free(text);
+    }
+    json_node_free(root);
+    g_object_unref(generator);
+    g_object_unref(builder);
+    return ret;
+}
+
+#endif //GST_WEBRTC_EXAMPLE_BENCH_UTIL_H
@@ -0,0 +1,157 @@
+//
+// Viewer attach/detach of rtsp2webrtc_1_n: WebrtcViewer::start_webrtcbin() and remove_peer_from_pipeline()
+// on a live synthetic H264 source, without a signalling server. Negotiation stops at the created offer. Each
+// mode sets the options that add to a viewer branch: the audio branch, the pacer and batched egress probes
+// on nicesink and the shared retransmission probes on the payloader.
+//
+#define RTSP_WEBRTC_NO_MAIN
+
+#include "rtsp_webrtc_1_n.cpp"
+#include "bench_util.h"
+
+#define ATTACH_CYCLES 100
+#define ATTACH_CONCURRENT 50 //Viewers attached on top of each other before detaching them all
+#define OFFER_TIMEOUT_MS 5000
+
+#define BENCH_SOURCE \
+    "videotestsrc is-live=TRUE pattern=ball ! video/x-raw,width=640,height=360,framerate=30/1 ! " \
+    "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=30 ! " \
+    "video/x-h264,profile=constrained-baseline ! h264parse ! tee name=videotee ! queue ! fakesink"
+#define BENCH_AUDIO_SOURCE \
+    " audiotestsrc is-live=TRUE wave=ticks ! audioconvert ! audioresample ! opusenc ! " \
+    "tee name=audiotee ! queue ! fakesink"
+
+struct AttachMode {
+    const gchar *name;
+    gboolean audio;
+    gboolean pacing;
+    gboolean batched_egress; //Cannot be combined with pacing
+    gint rtx_mode;
+};
+
+static const AttachMode ATTACH_MODES[] = {
+        {"video", FALSE, FALSE, FALSE, RTX_WEBRTCBIN},
+        {"audio_pacing_rtx_shared", TRUE, TRUE, FALSE, RTX_SHARED},
+        {"audio_egress_rtx_shared", TRUE, FALSE, TRUE, RTX_SHARED},
+};
+
+//Kept until exit, webrtcbin callbacks may still be running for removed viewers
+static std::vector<WebrtcViewerPtr> bench_viewers;
+
+static WebrtcViewerPtr attach_viewer(GstElement *pipeline, gint index, std::vector<gint64> &attach_ns,
+                                     std::vector<gint64> &offer_ns) {
+    WebrtcViewerPtr viewer = std::make_shared<WebrtcViewer>();
+    gint64 start, deadline;
+
+    viewer->peer_id = std::to_string(100000 + index);
+    viewer->pipeline = pipeline;
+    viewer->pipeline_execution_id = -1;
+    bench_viewers.push_back(viewer);
+
+    start = bench_now_ns();
+    if (!viewer->start_webrtcbin())
+        g_error("start_webrtcbin failed for %s", viewer->peer_id.c_str());
+    attach_ns.push_back(bench_now_ns() - start);
+
+    deadline = start + (gint64) OFFER_TIMEOUT_MS * 1000000;
+    while (!viewer->timeline.reached(JOIN_OFFER_SENT) && bench_now_ns() < deadline)
+        g_usleep(100);
+    if (viewer->timeline.reached(JOIN_OFFER_SENT))
+        offer_ns.push_back(bench_now_ns() - start);
+    else
+        g_printerr("No offer for viewer %s within %d ms\n", viewer->peer_id.c_str(), OFFER_TIMEOUT_MS);
+    return viewer;
+}
+
+static void detach_viewer(WebrtcViewerPtr viewer, std::vector<gint64> &detach_ns) {
+    gint64 start = bench_now_ns();
+    viewer->remove_peer_from_pipeline();
+    detach_ns.push_back(bench_now_ns() - start);
+}
+
+/* Starts the source of a mode with what start_streaming() adds for it, NULL on failure */
+static GstElement *start_source(const AttachMode &mode) {
+    std::string description = std::string(BENCH_SOURCE) + (mode.audio ? BENCH_AUDIO_SOURCE : "");
+    GstElement *pipeline;
+    GError *error = NULL;
+
+    pipeline = gst_parse_launch(description.c_str(), &error);
+    if (error) {
+        g_printerr("Failed to parse launch: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    g_object_set_data(G_OBJECT (pipeline), "video-codec", GINT_TO_POINTER (CODEC_H264));
+    if (mode.rtx_mode == RTX_SHARED)
+        g_object_set_data_full(G_OBJECT (pipeline), "rtx-store", new RtxStorePtr(std::make_shared<RtxStore>()),
+                               free_rtx_store);
+    if (gst_element_set_state(pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE ||
+        gst_element_get_state(pipeline, NULL, NULL, 5 * GST_SECOND) == GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Failed to start the source\n");
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+static gboolean run_mode(JsonBuilder *builder, const AttachMode &mode, gint &index) {
+    std::vector<gint64> attach_ns, offer_ns, detach_ns;
+    std::vector<WebrtcViewerPtr> attached;
+    GstElement *pipeline;
+    std::string name;
+
+    PACING = mode.pacing;
+    BATCHED_EGRESS = mode.batched_egress;
+    RTX_MODE = mode.rtx_mode;
+    pipeline = start_source(mode);
+    if (!pipeline)
+        return FALSE;
+
+    //One viewer at a time
+    for (gint cycle = 0; cycle < ATTACH_CYCLES; cycle++)
+        detach_viewer(attach_viewer(pipeline, index++, attach_ns, offer_ns), detach_ns);
+    name = std::string("attach_single_") + mode.name;
+    bench_add_samples(builder, name.c_str(), attach_ns);
+    name = std::string("attach_to_offer_single_") + mode.name;
+    bench_add_samples(builder, name.c_str(), offer_ns);
+    name = std::string("detach_single_") + mode.name;
+    bench_add_samples(builder, name.c_str(), detach_ns);
+
+    //Growing fan-out, every attach and detach sees up to ATTACH_CONCURRENT other branches on the tee
+    attach_ns.clear();
+    offer_ns.clear();
+    detach_ns.clear();
+    for (gint viewer = 0; viewer < ATTACH_CONCURRENT; viewer++)
+        attached.push_back(attach_viewer(pipeline, index++, attach_ns, offer_ns));
+    for (auto &viewer : attached)
+        detach_viewer(viewer, detach_ns);
+    name = std::string("attach_concurrent_") + mode.name;
+    bench_add_samples(builder, name.c_str(), attach_ns);
+    name = std::string("attach_to_offer_concurrent_") + mode.name;
+    bench_add_samples(builder, name.c_str(), offer_ns);
+    name = std::string("detach_concurrent_") + mode.name;
+    bench_add_samples(builder, name.c_str(), detach_ns);
+
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    JsonBuilder *builder;
+    gint index = 0;
+    int ret = 0;
+
+    gst_init(&argc, &argv);
+    builder = bench_begin("viewer_attach");
+    batchedEgress.start();
+    for (const AttachMode &mode : ATTACH_MODES) {
+        if (!run_mode(builder, mode, index)) {
+            ret = 1;
+            break;
+        }
+    }
+    ret |= bench_finish(builder, argc, argv);
+    return ret;
+}
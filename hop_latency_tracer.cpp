@@ -0,0 +1,649 @@
+//
+// GstTracer plugin measuring the latency of every frame between checkpoint pads of the fan-out pipeline, and
+// optionally the CPU time spent in each element, exported as Chrome trace / Perfetto JSON.
+//
+// GST_PLUGIN_PATH=|BUILD DIR| GST_TRACERS="hoplatency(file=/tmp/hops.json)" ./rtsp2webrtc_1_n ...
+//
+// Parameters, comma separated:
+//  pads=A+B+...   checkpoints as element.pad patterns with * wildcards, in pipeline order. Default
+//                 rtspdepay.src+videotee.src_*+queue-*.src+rtph264pay-*.src+nicesink*.sink
+//  file=PATH      trace written every interval and at exit (default hop_latency_trace.json)
+//  interval=S     seconds between trace writes (default 10)
+//  cpu=1          also measure thread CPU time per element on every push (costs two clock reads per push)
+//  max-events=N   trace events kept, oldest dropped first (default 500000)
+//
+// Frames are followed by buffer PTS, which depayloader, tee, queue, payloader and srtp keep. Each checkpoint
+// pad records the first buffer of a frame passing it. Branches are told apart by the suffix after the last '-' of
+// the top level element name (the peer id of queue-<peer>, rtph264pay-<peer> and webrtcbin <peer>), so a hop is
+// measured against the previous checkpoint of the same viewer whenever there is one, else against the tee src
+// pad feeding the viewer.
+//
+// Nothing is locked globally per buffer. A checkpoint pad keeps the frames it saw and the hops ending at it,
+// written by its own streaming thread, and remembers the checkpoint its frames came from. CPU times are kept per
+// streaming thread. The report merges pads and threads every interval.
+//
+#include <gst/gst.h>
+#include <gst/gsttracer.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#ifndef PACKAGE
+#define PACKAGE "gst-webrtc-example"
+#endif
+#define VERSION "1.0"
+#define GST_LICENSE "LGPL"
+#define GST_PACKAGE_NAME "gst-webrtc-example"
+#define GST_PACKAGE_ORIGIN "https://github.com/sampleref/gst-webrtc-example"
+
+#define DEFAULT_PADS "rtspdepay.src+videotee.src_*+queue-*.src+rtph264pay-*.src+nicesink*.sink"
+#define DEFAULT_FILE "hop_latency_trace.json"
+#define HISTOGRAM_BUCKETS 24 //Powers of two in us, the last one open ended
+#define FRAME_EXPIRY (5 * GST_SECOND) //Frames not seen for this long are forgotten
+#define UPSTREAM_RESCAN GST_SECOND //Between lookups of the previous checkpoint while none saw the frames
+
+GST_DEBUG_CATEGORY_STATIC (hop_latency_debug);
+#define GST_CAT_DEFAULT hop_latency_debug
+
+struct HopHistogram {
+    guint64 count = 0;
+    guint64 sum_us = 0;
+    guint64 max_us = 0;
+    guint64 buckets[HISTOGRAM_BUCKETS] = {0};
+
+    void add(guint64 us) {
+        guint bucket = 0;
+        while (bucket < HISTOGRAM_BUCKETS - 1 && us >= (1ull << bucket))
+            bucket++;
+        buckets[bucket]++;
+        count++;
+        sum_us += us;
+        max_us = MAX(max_us, us);
+    }
+
+    void merge(const HopHistogram &other) {
+        for (guint bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+            buckets[bucket] += other.buckets[bucket];
+        count += other.count;
+        sum_us += other.sum_us;
+        max_us = MAX(max_us, other.max_us);
+    }
+
+    //Upper bound of the bucket holding the percentile
+    guint64 percentile(gdouble p) const {
+        guint64 rank = (guint64) (p * count), seen = 0;
+        for (guint bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+            seen += buckets[bucket];
+            if (seen > rank)
+                return bucket < HISTOGRAM_BUCKETS - 1 ? (1ull << bucket) : max_us;
+        }
+        return max_us;
+    }
+};
+
+struct TraceEvent {
+    guint track;
+    GstClockTime start;
+    GstClockTime duration;
+    guint from_stage;
+};
+
+/*
+ * Checkpoint a pad resolved to, cached on the pad and kept by the state until the report after the pad is gone.
+ * Only the streaming thread pushing through the pad writes it. Its lock is otherwise taken by the next checkpoint
+ * looking up when a frame passed here, and by the report draining the hops and events.
+ */
+struct PadCheckpoint {
+    PadCheckpoint() { g_mutex_init(&lock); }
+
+    ~PadCheckpoint() { g_mutex_clear(&lock); }
+
+    gint stage = -1; //-1 when the pad is no checkpoint
+    guint track = 0;
+    std::string branch;
+    std::string peer_branch; //Of the element the pad pushes into, tells the src pads of a tee apart
+
+    GMutex lock;
+    std::unordered_map<GstClockTime, GstClockTime> seen; //Time the first buffer of a frame passed, by PTS
+    std::deque<std::pair<GstClockTime, GstClockTime>> seen_order; //(time, PTS), oldest first
+    std::map<guint, HopHistogram> hops; //Ending here since the last report, by the stage they started at
+    std::deque<TraceEvent> events; //Since the last report
+    gboolean retired = FALSE; //The pad is gone
+
+    std::weak_ptr<PadCheckpoint> upstream; //Previous checkpoint of the last frame, streaming thread only
+    GstClockTime rescan_after = 0;
+};
+
+typedef std::shared_ptr<PadCheckpoint> PadCheckpointPtr;
+
+/* CPU time of the elements pushed into on one streaming thread, kept by the state until the report after the
+ * thread exits */
+struct ThreadCpu {
+    ThreadCpu() { g_mutex_init(&lock); }
+
+    ~ThreadCpu() { g_mutex_clear(&lock); }
+
+    struct Frame {
+        GstElement *element;
+        guint64 start_ns;
+        guint64 child_ns;
+    };
+    std::vector<Frame> stack; //Thread only
+    GMutex lock; //Guards the fields below against the report
+    std::unordered_map<GstElement *, std::pair<std::string, guint64>> self_ns;
+    gboolean exited = FALSE;
+};
+
+typedef std::shared_ptr<ThreadCpu> ThreadCpuPtr;
+
+/* Hands the CPU times of a streaming thread over to the report when the thread exits */
+struct ThreadCpuHolder {
+    ~ThreadCpuHolder() {
+        if (!cpu)
+            return;
+        g_mutex_lock(&cpu->lock);
+        cpu->exited = TRUE;
+        g_mutex_unlock(&cpu->lock);
+    }
+
+    ThreadCpuPtr cpu;
+};
+
+typedef struct _GstHopLatencyTracer GstHopLatencyTracer;
+typedef struct _GstHopLatencyTracerClass GstHopLatencyTracerClass;
+
+struct HopLatencyState {
+    std::vector<std::string> patterns;
+    std::string file = DEFAULT_FILE;
+    guint interval = 10;
+    gboolean cpu = FALSE;
+    guint max_events = 500000;
+
+    GMutex lock; //Taken for a new pad or thread, a lookup of the previous checkpoint and the report
+    std::vector<std::vector<PadCheckpointPtr>> stages; //Checkpoint pads of each stage
+    std::vector<ThreadCpuPtr> cpu_threads;
+    std::map<std::pair<guint, guint>, HopHistogram> hops; //Merged at the reports, (from stage, to stage)
+    std::deque<TraceEvent> events; //Merged at the reports
+    std::vector<std::string> tracks; //Concrete pad names, index is the trace tid
+    std::map<std::string, guint64> cpu_ns; //Element name to self CPU time, merged at the reports
+
+    GThread *writer = NULL;
+    GCond wakeup;
+    gboolean stopping = FALSE;
+};
+
+struct _GstHopLatencyTracer {
+    GstTracer parent;
+    HopLatencyState *state;
+};
+
+struct _GstHopLatencyTracerClass {
+    GstTracerClass parent_class;
+};
+
+#define GST_TYPE_HOP_LATENCY_TRACER (gst_hop_latency_tracer_get_type())
+#define GST_HOP_LATENCY_TRACER(obj) ((GstHopLatencyTracer *) (obj))
+
+GType gst_hop_latency_tracer_get_type(void);
+
+G_DEFINE_TYPE (GstHopLatencyTracer, gst_hop_latency_tracer, GST_TYPE_TRACER);
+
+static GQuark checkpoint_quark;
+static thread_local ThreadCpuHolder thread_cpu;
+
+/* The pad is gone, the report drops the checkpoint after merging it */
+static void free_checkpoint(gpointer data) {
+    PadCheckpointPtr *checkpoint = static_cast<PadCheckpointPtr *>(data);
+    g_mutex_lock(&(*checkpoint)->lock);
+    (*checkpoint)->retired = TRUE;
+    (*checkpoint)->seen.clear();
+    (*checkpoint)->seen_order.clear();
+    g_mutex_unlock(&(*checkpoint)->lock);
+    delete checkpoint;
+}
+
+static std::vector<std::string> split(const std::string &text, char separator) {
+    std::vector<std::string> parts;
+    size_t start = 0, end;
+    while ((end = text.find(separator, start)) != std::string::npos) {
+        parts.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    parts.push_back(text.substr(start));
+    return parts;
+}
+
+/* Top level element under the pipeline, whose name identifies the branch */
+static std::string branch_of(GstElement *element) {
+    GstObject *object = GST_OBJECT (element);
+    while (GST_OBJECT_PARENT (object) && GST_OBJECT_PARENT (GST_OBJECT_PARENT (object)))
+        object = GST_OBJECT_PARENT (object);
+    const gchar *name = GST_OBJECT_NAME (object);
+    const gchar *dash = strrchr(name, '-');
+    return dash ? dash + 1 : name;
+}
+
+static PadCheckpointPtr resolve_checkpoint(HopLatencyState *state, GstPad *pad) {
+    PadCheckpointPtr *cached = static_cast<PadCheckpointPtr *>(g_object_get_qdata(G_OBJECT (pad), checkpoint_quark));
+    if (cached)
+        return *cached;
+
+    PadCheckpointPtr checkpoint = std::make_shared<PadCheckpoint>();
+    GstObject *parent = GST_OBJECT_PARENT (pad);
+    if (parent && GST_IS_ELEMENT (parent)) {
+        gchar *name = g_strdup_printf("%s.%s", GST_OBJECT_NAME (parent), GST_OBJECT_NAME (pad));
+        for (guint stage = 0; stage < state->patterns.size(); stage++) {
+            if (g_pattern_match_simple(state->patterns[stage].c_str(), name)) {
+                GstPad *peer = GST_PAD_PEER (pad);
+                GstObject *peer_parent = peer ? GST_OBJECT_PARENT (peer) : NULL;
+                checkpoint->stage = (gint) stage;
+                checkpoint->branch = branch_of(GST_ELEMENT (parent));
+                if (peer_parent && GST_IS_ELEMENT (peer_parent))
+                    checkpoint->peer_branch = branch_of(GST_ELEMENT (peer_parent));
+                g_mutex_lock(&state->lock);
+                checkpoint->track = (guint) state->tracks.size();
+                state->tracks.push_back(name);
+                state->stages[stage].push_back(checkpoint);
+                g_mutex_unlock(&state->lock);
+                break;
+            }
+        }
+        g_free(name);
+    }
+    //Pads are checked once, concurrent first pushes may both resolve, the last one stays
+    g_object_set_qdata_full(G_OBJECT (pad), checkpoint_quark, new PadCheckpointPtr(checkpoint), free_checkpoint);
+    return checkpoint;
+}
+
+/* Frames are remembered for FRAME_EXPIRY after passing, called with the checkpoint's lock */
+static void expire_seen(PadCheckpoint *checkpoint, GstClockTime now) {
+    while (!checkpoint->seen_order.empty() && checkpoint->seen_order.front().first + FRAME_EXPIRY <= now) {
+        checkpoint->seen.erase(checkpoint->seen_order.front().second);
+        checkpoint->seen_order.pop_front();
+    }
+}
+
+static gboolean seen_time(PadCheckpoint *checkpoint, GstClockTime pts, GstClockTime *time) {
+    g_mutex_lock(&checkpoint->lock);
+    auto it = checkpoint->seen.find(pts);
+    gboolean found = it != checkpoint->seen.end();
+    if (found)
+        *time = it->second;
+    g_mutex_unlock(&checkpoint->lock);
+    return found;
+}
+
+/*
+ * Checkpoint of the previous stage a frame passed before this one: the one of the same branch, else the tee src
+ * pad feeding this branch, else the last one to see the frame. The result is kept while it keeps seeing the frames.
+ */
+static PadCheckpointPtr find_upstream(HopLatencyState *state, PadCheckpoint *checkpoint, GstClockTime pts,
+                                      GstClockTime *time) {
+    PadCheckpointPtr found;
+    gint rank = -1;
+
+    g_mutex_lock(&state->lock);
+    for (const PadCheckpointPtr &candidate : state->stages[checkpoint->stage - 1]) {
+        GstClockTime seen;
+        gint candidate_rank = candidate->branch == checkpoint->branch ? 2 :
+                              candidate->peer_branch == checkpoint->branch ? 1 : 0;
+        if (candidate_rank < rank || !seen_time(candidate.get(), pts, &seen))
+            continue;
+        if (candidate_rank > rank || seen > *time) {
+            found = candidate;
+            rank = candidate_rank;
+            *time = seen;
+        }
+    }
+    g_mutex_unlock(&state->lock);
+    return found;
+}
+
+static void record_checkpoint(HopLatencyState *state, PadCheckpoint *checkpoint, GstClockTime ts, GstClockTime pts) {
+    PadCheckpointPtr previous;
+    GstClockTime previous_time = 0;
+    gboolean first;
+
+    g_mutex_lock(&checkpoint->lock);
+    expire_seen(checkpoint, ts);
+    //Only the first buffer of a frame counts at each checkpoint
+    first = checkpoint->seen.emplace(pts, ts).second;
+    if (first)
+        checkpoint->seen_order.push_back(std::make_pair(ts, pts));
+    g_mutex_unlock(&checkpoint->lock);
+    if (!first || checkpoint->stage == 0)
+        return;
+
+    previous = checkpoint->upstream.lock();
+    if (!previous || !seen_time(previous.get(), pts, &previous_time)) {
+        //A branch fed from outside the checkpoints would otherwise look up every frame
+        if (ts < checkpoint->rescan_after)
+            return;
+        previous = find_upstream(state, checkpoint, pts, &previous_time);
+        if (!previous) {
+            checkpoint->rescan_after = ts + UPSTREAM_RESCAN;
+            return;
+        }
+        checkpoint->upstream = previous;
+    }
+    if (ts < previous_time)
+        return;
+    g_mutex_lock(&checkpoint->lock);
+    checkpoint->hops[previous->stage].add((ts - previous_time) / 1000);
+    checkpoint->events.push_back({checkpoint->track, previous_time, ts - previous_time, (guint) previous->stage});
+    if (checkpoint->events.size() > state->max_events)
+        checkpoint->events.pop_front();
+    g_mutex_unlock(&checkpoint->lock);
+}
+
+static void on_buffer(HopLatencyState *state, GstClockTime ts, GstPad *pad, GstBuffer *buffer) {
+    if (!GST_BUFFER_PTS_IS_VALID (buffer))
+        return;
+    PadCheckpointPtr checkpoint = resolve_checkpoint(state, pad);
+    if (checkpoint->stage < 0) {
+        //Checkpoints may name sink pads, match the receiving side of the push too
+        GstPad *peer = GST_PAD_PEER (pad);
+        if (!peer)
+            return;
+        checkpoint = resolve_checkpoint(state, peer);
+        if (checkpoint->stage < 0)
+            return;
+    }
+    record_checkpoint(state, checkpoint.get(), ts, GST_BUFFER_PTS (buffer));
+}
+
+static guint64 thread_cpu_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (guint64) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Drains the checkpoints and threads into the state, with its lock. The ones whose pad or thread is gone are
+ * dropped after their last drain */
+static void merge_accumulators(HopLatencyState *state) {
+    for (std::vector<PadCheckpointPtr> &stage : state->stages) {
+        for (auto it = stage.begin(); it != stage.end();) {
+            PadCheckpoint *checkpoint = it->get();
+            gboolean retired;
+            g_mutex_lock(&checkpoint->lock);
+            for (auto &hop : checkpoint->hops)
+                state->hops[std::make_pair(hop.first, (guint) checkpoint->stage)].merge(hop.second);
+            checkpoint->hops.clear();
+            state->events.insert(state->events.end(), checkpoint->events.begin(), checkpoint->events.end());
+            checkpoint->events.clear();
+            retired = checkpoint->retired;
+            g_mutex_unlock(&checkpoint->lock);
+            it = retired ? stage.erase(it) : it + 1;
+        }
+    }
+    while (state->events.size() > state->max_events)
+        state->events.pop_front();
+
+    for (auto it = state->cpu_threads.begin(); it != state->cpu_threads.end();) {
+        ThreadCpu *cpu = it->get();
+        gboolean exited;
+        g_mutex_lock(&cpu->lock);
+        for (auto &element : cpu->self_ns)
+            state->cpu_ns[element.second.first] += element.second.second;
+        cpu->self_ns.clear();
+        exited = cpu->exited;
+        g_mutex_unlock(&cpu->lock);
+        it = exited ? state->cpu_threads.erase(it) : it + 1;
+    }
+}
+
+/* Element doing the work of a push, the parent of the peer pad or of the ghost pad it proxies */
+static GstElement *receiving_element(GstPad *pad) {
+    GstPad *peer = GST_PAD_PEER (pad);
+    GstObject *parent = peer ? GST_OBJECT_PARENT (peer) : NULL;
+    if (parent && GST_IS_PAD (parent))
+        parent = GST_OBJECT_PARENT (parent);
+    return parent && GST_IS_ELEMENT (parent) ? GST_ELEMENT (parent) : NULL;
+}
+
+static void cpu_push_pre(HopLatencyState *state, GstPad *pad) {
+    if (!thread_cpu.cpu) {
+        thread_cpu.cpu = std::make_shared<ThreadCpu>();
+        g_mutex_lock(&state->lock);
+        state->cpu_threads.push_back(thread_cpu.cpu);
+        g_mutex_unlock(&state->lock);
+    }
+    thread_cpu.cpu->stack.push_back({receiving_element(pad), thread_cpu_ns(), 0});
+}
+
+static void cpu_push_post(void) {
+    ThreadCpu *cpu = thread_cpu.cpu.get();
+    if (!cpu || cpu->stack.empty())
+        return;
+    ThreadCpu::Frame frame = cpu->stack.back();
+    cpu->stack.pop_back();
+    guint64 inclusive = thread_cpu_ns() - frame.start_ns;
+    if (!cpu->stack.empty())
+        cpu->stack.back().child_ns += inclusive;
+    if (!frame.element)
+        return;
+    g_mutex_lock(&cpu->lock);
+    auto inserted = cpu->self_ns.emplace(frame.element, std::make_pair(std::string(), (guint64) 0));
+    if (inserted.second)
+        inserted.first->second.first = GST_OBJECT_NAME (frame.element);
+    inserted.first->second.second += inclusive > frame.child_ns ? inclusive - frame.child_ns : 0;
+    g_mutex_unlock(&cpu->lock);
+}
+
+static void do_push_buffer_pre(GstTracer *self, GstClockTime ts, GstPad *pad, GstBuffer *buffer) {
+    HopLatencyState *state = GST_HOP_LATENCY_TRACER (self)->state;
+    on_buffer(state, ts, pad, buffer);
+    if (state->cpu)
+        cpu_push_pre(state, pad);
+}
+
+static void do_push_list_pre(GstTracer *self, GstClockTime ts, GstPad *pad, GstBufferList *list) {
+    HopLatencyState *state = GST_HOP_LATENCY_TRACER (self)->state;
+    if (gst_buffer_list_length(list) > 0)
+        on_buffer(state, ts, pad, gst_buffer_list_get(list, 0));
+    if (state->cpu)
+        cpu_push_pre(state, pad);
+}
+
+static void do_push_post(GstTracer *self, GstClockTime ts, GstPad *pad, GstFlowReturn res) {
+    HopLatencyState *state = GST_HOP_LATENCY_TRACER (self)->state;
+    if (state->cpu)
+        cpu_push_post();
+}
+
+static std::string json_escape(const std::string &text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+static void write_trace(HopLatencyState *state) {
+    std::string tmp_path = state->file + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "w");
+    if (!file) {
+        GST_WARNING("Cannot write %s", tmp_path.c_str());
+        return;
+    }
+
+    g_mutex_lock(&state->lock);
+    merge_accumulators(state);
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "{\"ph\": \"M\", \"pid\": 1, \"name\": \"process_name\", \"args\": {\"name\": \"hop latency\"}}");
+    for (guint track = 0; track < state->tracks.size(); track++)
+        fprintf(file, ",\n{\"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"name\": \"thread_name\", \"args\": {\"name\": \"%s\"}}",
+                track, json_escape(state->tracks[track]).c_str());
+    for (const TraceEvent &event : state->events)
+        fprintf(file, ",\n{\"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"cat\": \"hop\", \"name\": \"from %s\", "
+                      "\"ts\": %.3f, \"dur\": %.3f}", event.track,
+                json_escape(state->patterns[event.from_stage]).c_str(), event.start / 1000.0, event.duration / 1000.0);
+    fprintf(file, "\n], \"otherData\": {\"hops\": [");
+    gboolean first = TRUE;
+    for (auto &it : state->hops) {
+        const HopHistogram &histogram = it.second;
+        fprintf(file, "%s\n{\"from\": \"%s\", \"to\": \"%s\", \"count\": %" G_GUINT64_FORMAT ", \"mean_us\": %.1f, "
+                      "\"p50_us\": %" G_GUINT64_FORMAT ", \"p99_us\": %" G_GUINT64_FORMAT ", \"max_us\": %"
+                      G_GUINT64_FORMAT ", \"histogram_us_log2\": [", first ? "" : ",",
+                json_escape(state->patterns[it.first.first]).c_str(),
+                json_escape(state->patterns[it.first.second]).c_str(), histogram.count,
+                histogram.count ? (gdouble) histogram.sum_us / histogram.count : 0.0, histogram.percentile(0.5),
+                histogram.percentile(0.99), histogram.max_us);
+        for (guint bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+            fprintf(file, "%s%" G_GUINT64_FORMAT, bucket ? ", " : "", histogram.buckets[bucket]);
+        fprintf(file, "]}");
+        first = FALSE;
+    }
+    fprintf(file, "],\n\"cpu_ms\": {");
+    first = TRUE;
+    for (auto &it : state->cpu_ns) {
+        fprintf(file, "%s\"%s\": %.3f", first ? "" : ", ", json_escape(it.first).c_str(), it.second / 1e6);
+        first = FALSE;
+    }
+    fprintf(file, "}}}\n");
+    g_mutex_unlock(&state->lock);
+
+    fclose(file);
+    //Readers never see a half written trace
+    rename(tmp_path.c_str(), state->file.c_str());
+}
+
+static void print_summary(HopLatencyState *state) {
+    g_mutex_lock(&state->lock);
+    merge_accumulators(state);
+    for (auto &it : state->hops) {
+        g_print("hoplatency %s -> %s: %" G_GUINT64_FORMAT " frames, p50 %" G_GUINT64_FORMAT " us, p99 %"
+                G_GUINT64_FORMAT " us, max %" G_GUINT64_FORMAT " us\n",
+                state->patterns[it.first.first].c_str(), state->patterns[it.first.second].c_str(), it.second.count,
+                it.second.percentile(0.5), it.second.percentile(0.99), it.second.max_us);
+    }
+    g_mutex_unlock(&state->lock);
+}
+
+static gpointer trace_writer(gpointer data) {
+    HopLatencyState *state = static_cast<HopLatencyState *>(data);
+    g_mutex_lock(&state->lock);
+    while (!state->stopping) {
+        gint64 deadline = g_get_monotonic_time() + state->interval * G_TIME_SPAN_SECOND;
+        while (!state->stopping && g_cond_wait_until(&state->wakeup, &state->lock, deadline));
+        if (state->stopping)
+            break;
+        g_mutex_unlock(&state->lock);
+        write_trace(state);
+        g_mutex_lock(&state->lock);
+    }
+    g_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+/* The binaries exit without gst_deinit, so the final trace is written from here */
+static GstHopLatencyTracer *exit_tracer = NULL;
+
+static void write_trace_at_exit(void) {
+    if (exit_tracer) {
+        write_trace(exit_tracer->state);
+        print_summary(exit_tracer->state);
+    }
+}
+
+static void parse_params(HopLatencyState *state, const gchar *params) {
+    std::string pads = DEFAULT_PADS;
+    if (params) {
+        for (const std::string &param : split(params, ',')) {
+            size_t equals = param.find('=');
+            if (equals == std::string::npos)
+                continue;
+            std::string key = param.substr(0, equals), value = param.substr(equals + 1);
+            if (key == "pads")
+                pads = value;
+            else if (key == "file")
+                state->file = value;
+            else if (key == "interval")
+                state->interval = MAX(1, atoi(value.c_str()));
+            else if (key == "cpu")
+                state->cpu = value == "1" || value == "true";
+            else if (key == "max-events")
+                state->max_events = (guint) MAX(1, atoi(value.c_str()));
+            else
+                GST_WARNING("Unknown parameter %s", key.c_str());
+        }
+    }
+    state->patterns = split(pads, '+');
+    state->stages.resize(state->patterns.size());
+}
+
+static void gst_hop_latency_tracer_constructed(GObject *object) {
+    GstHopLatencyTracer *self = GST_HOP_LATENCY_TRACER (object);
+    gchar *params = NULL;
+
+    G_OBJECT_CLASS (gst_hop_latency_tracer_parent_class)->constructed(object);
+    g_object_get(object, "params", &params, NULL);
+    parse_params(self->state, params);
+    g_free(params);
+
+    GST_INFO("Checkpoints %u, trace %s every %u s, cpu %d", (guint) self->state->patterns.size(),
+             self->state->file.c_str(), self->state->interval, self->state->cpu);
+    self->state->writer = g_thread_new("hoplatency-writer", trace_writer, self->state);
+    if (!exit_tracer) {
+        exit_tracer = self;
+        atexit(write_trace_at_exit);
+    }
+}
+
+static void gst_hop_latency_tracer_finalize(GObject *object) {
+    GstHopLatencyTracer *self = GST_HOP_LATENCY_TRACER (object);
+    HopLatencyState *state = self->state;
+
+    g_mutex_lock(&state->lock);
+    state->stopping = TRUE;
+    g_cond_signal(&state->wakeup);
+    g_mutex_unlock(&state->lock);
+    g_thread_join(state->writer);
+    write_trace(state);
+    print_summary(state);
+    if (exit_tracer == self)
+        exit_tracer = NULL;
+
+    g_mutex_clear(&state->lock);
+    g_cond_clear(&state->wakeup);
+    delete state;
+    G_OBJECT_CLASS (gst_hop_latency_tracer_parent_class)->finalize(object);
+}
+
+static void gst_hop_latency_tracer_class_init(GstHopLatencyTracerClass *klass) {
+    GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+    gobject_class->constructed = gst_hop_latency_tracer_constructed;
+    gobject_class->finalize = gst_hop_latency_tracer_finalize;
+    checkpoint_quark = g_quark_from_static_string("hoplatency-checkpoint");
+}
+
+static void gst_hop_latency_tracer_init(GstHopLatencyTracer *self) {
+    GstTracer *tracer = GST_TRACER (self);
+
+    self->state = new HopLatencyState();
+    g_mutex_init(&self->state->lock);
+    g_cond_init(&self->state->wakeup);
+    gst_tracing_register_hook(tracer, "pad-push-pre", G_CALLBACK (do_push_buffer_pre));
+    gst_tracing_register_hook(tracer, "pad-push-list-pre", G_CALLBACK (do_push_list_pre));
+    gst_tracing_register_hook(tracer, "pad-push-post", G_CALLBACK (do_push_post));
+    gst_tracing_register_hook(tracer, "pad-push-list-post", G_CALLBACK (do_push_post));
+}
+
+static gboolean plugin_init(GstPlugin *plugin) {
+    GST_DEBUG_CATEGORY_INIT (hop_latency_debug, "hoplatency", 0, "per hop latency tracer");
+    return gst_tracer_register(plugin, "hoplatency", GST_TYPE_HOP_LATENCY_TRACER);
+}
+
+GST_PLUGIN_DEFINE (GST_VERSION_MAJOR, GST_VERSION_MINOR, hoplatency,
+                   "Per hop latency and element CPU time of the webrtc fan-out pipeline",
+                   plugin_init, VERSION, GST_LICENSE, GST_PACKAGE_NAME, GST_PACKAGE_ORIGIN)
@@ -0,0 +1,217 @@
+//
+// Memory mapped reader for libpcap captures of RTP streams.
+//
+#include "pcap_reader.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+//Link layer types of the capture header
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+
+#define PCAP_GLOBAL_HEADER_LEN 24
+#define PCAP_RECORD_HEADER_LEN 16
+
+static uint16_t read_be16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+bool PcapFilter::set(const std::string &ip, const std::string &port) {
+    struct in_addr address;
+
+    any_ip = ip.empty();
+    if (!any_ip) {
+        if (inet_pton(AF_INET, ip.c_str(), &address) != 1)
+            return false;
+        src_ip = ntohl(address.s_addr);
+    }
+    src_port = port.empty() ? -1 : atoi(port.c_str());
+    return src_port >= -1 && src_port <= 65535;
+}
+
+bool PcapFilter::matches(const PcapPacket &packet) const {
+    return (any_ip || packet.src_ip == src_ip) && (src_port < 0 || packet.src_port == src_port);
+}
+
+PcapReader::~PcapReader() {
+    close();
+}
+
+bool PcapReader::open(const std::string &path) {
+    struct stat file_stat;
+    uint32_t magic;
+
+    close();
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fstat(fd, &file_stat) < 0) {
+        last_error = path + ": " + strerror(errno);
+        close();
+        return false;
+    }
+    length = (size_t) file_stat.st_size;
+    if (length < PCAP_GLOBAL_HEADER_LEN) {
+        last_error = path + ": too short for a pcap file";
+        close();
+        return false;
+    }
+    void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        last_error = path + ": mmap failed: " + strerror(errno);
+        data = NULL;
+        close();
+        return false;
+    }
+    data = static_cast<const uint8_t *>(mapping);
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    memcpy(&magic, data, sizeof(magic));
+    switch (magic) {
+        case 0xa1b2c3d4:
+            swapped = false;
+            nanosecond = false;
+            break;
+        case 0xd4c3b2a1:
+            swapped = true;
+            nanosecond = false;
+            break;
+        case 0xa1b23c4d:
+            swapped = false;
+            nanosecond = true;
+            break;
+        case 0x4d3cb2a1:
+            swapped = true;
+            nanosecond = true;
+            break;
+        default:
+            last_error = path + ": not a libpcap file (pcapng is not supported)";
+            close();
+            return false;
+    }
+    linktype = read32(data + 20) & 0x0fffffff;
+    offset = PCAP_GLOBAL_HEADER_LEN;
+    return true;
+}
+
+void PcapReader::close(void) {
+    if (data)
+        munmap((void *) data, length);
+    if (fd >= 0)
+        ::close(fd);
+    data = NULL;
+    fd = -1;
+    length = 0;
+    offset = 0;
+}
+
+void PcapReader::rewind(void) {
+    offset = PCAP_GLOBAL_HEADER_LEN;
+}
+
+uint32_t PcapReader::read32(const uint8_t *p) const {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return swapped ? __builtin_bswap32(value) : value;
+}
+
+bool PcapReader::next_udp_packet(PcapPacket *packet) {
+    while (data && offset + PCAP_RECORD_HEADER_LEN <= length) {
+        const uint8_t *record = data + offset;
+        uint32_t seconds = read32(record);
+        uint32_t fraction = read32(record + 4);
+        uint32_t captured_len = read32(record + 8);
+
+        if (offset + PCAP_RECORD_HEADER_LEN + captured_len > length) {
+            //Truncated last record of a capture that was still being written
+            offset = length;
+            return false;
+        }
+        offset += PCAP_RECORD_HEADER_LEN + captured_len;
+
+        packet->timestamp_ns = (uint64_t) seconds * 1000000000ull + (nanosecond ? fraction : fraction * 1000ull);
+        if (parse_frame(record + PCAP_RECORD_HEADER_LEN, captured_len, packet))
+            return true;
+    }
+    return false;
+}
+
+bool PcapReader::parse_frame(const uint8_t *frame, size_t frame_len, PcapPacket *packet) const {
+    size_t ip_offset;
+    uint16_t ethertype = 0x0800;
+
+    switch (linktype) {
+        case LINKTYPE_ETHERNET:
+            if (frame_len < 14)
+                return false;
+            ip_offset = 14;
+            ethertype = read_be16(frame + 12);
+            //802.1Q and 802.1ad tags
+            while ((ethertype == 0x8100 || ethertype == 0x88a8) && frame_len >= ip_offset + 4) {
+                ethertype = read_be16(frame + ip_offset + 2);
+                ip_offset += 4;
+            }
+            break;
+        case LINKTYPE_LINUX_SLL:
+            if (frame_len < 16)
+                return false;
+            ethertype = read_be16(frame + 14);
+            ip_offset = 16;
+            break;
+        case LINKTYPE_LINUX_SLL2:
+            if (frame_len < 20)
+                return false;
+            ethertype = read_be16(frame);
+            ip_offset = 20;
+            break;
+        case LINKTYPE_NULL:
+            ip_offset = 4;
+            break;
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            ip_offset = 0;
+            break;
+        default:
+            return false;
+    }
+    if (ethertype != 0x0800 || frame_len < ip_offset + 20)
+        return false;
+
+    const uint8_t *ip = frame + ip_offset;
+    size_t ip_header_len = (ip[0] & 0x0f) * 4;
+    uint16_t fragment = read_be16(ip + 6);
+    if ((ip[0] >> 4) != 4 || ip[9] != 17 || ip_header_len < 20 || (fragment & 0x3fff) != 0)
+        return false;
+
+    size_t udp_offset = ip_offset + ip_header_len;
+    if (frame_len < udp_offset + 8)
+        return false;
+    const uint8_t *udp = frame + udp_offset;
+    size_t udp_len = read_be16(udp + 4);
+    if (udp_len < 8)
+        return false;
+
+    packet->src_ip = read_be32(ip + 12);
+    packet->dst_ip = read_be32(ip + 16);
+    packet->src_port = read_be16(udp);
+    packet->dst_port = read_be16(udp + 2);
+    packet->payload = udp + 8;
+    //Snap length may have cut the datagram
+    packet->payload_len = udp_len - 8;
+    if (udp_offset + udp_len > frame_len)
+        packet->payload_len = frame_len - udp_offset - 8;
+    return true;
+}
@@ -0,0 +1,80 @@
+//
+// Memory mapped reader for libpcap captures of RTP streams, shared by the pcap replay ingest of
+// rtsp2webrtc_1_n and the rtp_pcap_analyzer tool.
+//
+#ifndef GST_WEBRTC_EXAMPLE_PCAP_READER_H
+#define GST_WEBRTC_EXAMPLE_PCAP_READER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* UDP datagram of a capture, payload points into the mapped file */
+struct PcapPacket {
+    uint64_t timestamp_ns; //Capture time
+    uint32_t src_ip; //Host byte order
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    const uint8_t *payload;
+    size_t payload_len;
+};
+
+/* Filter with the src-ip/src-port semantics of pcapparse, empty values match any packet */
+class PcapFilter {
+
+public:
+    //Methods
+    bool set(const std::string &src_ip, const std::string &src_port);
+
+    bool matches(const PcapPacket &packet) const;
+
+private:
+    bool any_ip = true;
+    uint32_t src_ip = 0;
+    int src_port = -1;
+};
+
+class PcapReader {
+
+public:
+    PcapReader() = default;
+
+    PcapReader(const PcapReader &) = delete;
+
+    PcapReader &operator=(const PcapReader &) = delete;
+
+    ~PcapReader();
+
+    //Methods
+    bool open(const std::string &path);
+
+    void close(void);
+
+    void rewind(void);
+
+    /* Next IPv4 UDP datagram in capture order, other frames and IP fragments are skipped */
+    bool next_udp_packet(PcapPacket *packet);
+
+    size_t size(void) const { return length; }
+
+    size_t position(void) const { return offset; }
+
+    const std::string &error(void) const { return last_error; }
+
+private:
+    int fd = -1;
+    const uint8_t *data = NULL;
+    size_t length = 0;
+    size_t offset = 0;
+    bool swapped = false;
+    bool nanosecond = false;
+    uint32_t linktype = 0;
+    std::string last_error;
+
+    uint32_t read32(const uint8_t *p) const;
+
+    bool parse_frame(const uint8_t *frame, size_t frame_len, PcapPacket *packet) const;
+};
+
+#endif //GST_WEBRTC_EXAMPLE_PCAP_READER_H
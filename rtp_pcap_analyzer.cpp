@@ -0,0 +1,420 @@
+//
+// Offline analysis of the RTP streams of a pcap capture, reports per SSRC sequence gaps, reordering,
+// timestamp jumps, interarrival jitter, H264 frame/IDR cadence and bitrate over time as JSON.
+//
+// ./rtp_pcap_analyzer [--clock-rate=HZ] [--interval-ms=MS] |PCAP FILE PATH| [|RTP SOURCE IP| [|RTP SOURCE PORT|]]
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "pcap_reader.h"
+
+#define RTP_HEADER_LEN 12
+#define MAX_REORDER_WINDOW 3000 //Older packets are counted as late duplicates/restarts, not reordering
+#define MAX_TIMESTAMP_JUMPS 100 //Listed individually in the output
+#define MAX_BITRATE_INTERVALS 100000 //Of the bitrate series, packets captured later are counted but not charted
+
+//Upper bounds in ms of the interarrival jitter histogram buckets, the last one is open ended
+static const double JITTER_BUCKETS_MS[] = {1, 2, 5, 10, 20, 50, 100, 200};
+#define JITTER_BUCKET_COUNT (sizeof(JITTER_BUCKETS_MS) / sizeof(JITTER_BUCKETS_MS[0]) + 1)
+
+uint32_t CLOCK_RATE = 90000;
+uint64_t INTERVAL_NS = 1000000000ull;
+
+struct TimestampJump {
+    uint64_t capture_ns;
+    uint16_t seq;
+    int64_t delta; //RTP ticks from the previous frame
+};
+
+struct SsrcStats {
+    uint32_t ssrc = 0;
+    uint32_t src_ip = 0, dst_ip = 0;
+    uint16_t src_port = 0, dst_port = 0;
+    uint8_t payload_type = 0;
+
+    uint64_t packets = 0, bytes = 0;
+    uint64_t first_capture = 0, last_capture = 0;
+
+    //Sequence tracking on extended (32 bit) sequence numbers
+    bool have_seq = false;
+    int64_t base_seq = 0, max_seq = 0;
+    uint64_t gaps = 0, missing = 0, reordered = 0, duplicates = 0;
+    int64_t max_reorder_depth = 0;
+    std::vector<int64_t> recent; //Extended seq of the last MAX_REORDER_WINDOW packets, for duplicate detection
+
+    //RFC 3550 interarrival jitter
+    bool have_transit = false;
+    double transit = 0, jitter = 0, max_jitter = 0;
+    uint64_t jitter_histogram[JITTER_BUCKET_COUNT] = {0};
+
+    //Frames are delimited by RTP timestamp changes
+    bool have_frame = false;
+    uint32_t frame_ts = 0;
+    uint64_t frame_bytes = 0, frame_capture = 0;
+    bool frame_idr = false;
+    uint64_t frames = 0, frame_bytes_max = 0;
+    std::vector<uint64_t> frame_sizes;
+    int64_t nominal_delta = 0; //Most common positive timestamp delta between frames
+    std::map<int64_t, uint64_t> ts_deltas;
+    uint64_t ts_jumps = 0, ts_backwards = 0;
+    std::vector<TimestampJump> jump_list;
+
+    uint64_t idr_frames = 0, last_idr_frame = 0, last_idr_capture = 0;
+    std::vector<uint64_t> idr_interval_frames;
+    std::vector<double> idr_interval_ms;
+    std::vector<uint64_t> idr_sizes;
+
+    std::vector<uint64_t> interval_bytes; //Bytes per INTERVAL_NS since first_capture
+    uint64_t beyond_intervals = 0; //Packets past MAX_BITRATE_INTERVALS, a corrupt or far jumping capture timestamp
+};
+
+static uint16_t read_be16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static std::string ip_string(uint32_t ip) {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff);
+    return text;
+}
+
+/* H264 payload (RFC 6184) carries an IDR slice or the start of one */
+static bool h264_payload_has_idr(const uint8_t *payload, size_t len) {
+    if (len < 1)
+        return false;
+    uint8_t type = payload[0] & 0x1f;
+    if (type == 5)
+        return true;
+    if (type == 28 && len >= 2) //FU-A, start fragment
+        return (payload[1] & 0x80) && (payload[1] & 0x1f) == 5;
+    if (type == 24) { //STAP-A
+        size_t offset = 1;
+        while (offset + 3 <= len) {
+            size_t nal_len = read_be16(payload + offset);
+            if (nal_len > 0 && (payload[offset + 2] & 0x1f) == 5)
+                return true;
+            offset += 2 + nal_len;
+        }
+    }
+    return false;
+}
+
+static void finish_frame(SsrcStats &stats) {
+    if (!stats.have_frame)
+        return;
+    stats.frames++;
+    stats.frame_sizes.push_back(stats.frame_bytes);
+    stats.frame_bytes_max = std::max(stats.frame_bytes_max, stats.frame_bytes);
+    if (stats.frame_idr) {
+        if (stats.idr_frames > 0) {
+            stats.idr_interval_frames.push_back(stats.frames - stats.last_idr_frame);
+            stats.idr_interval_ms.push_back((stats.frame_capture - stats.last_idr_capture) / 1e6);
+        }
+        stats.idr_frames++;
+        stats.last_idr_frame = stats.frames;
+        stats.last_idr_capture = stats.frame_capture;
+        stats.idr_sizes.push_back(stats.frame_bytes);
+    }
+}
+
+static void track_sequence(SsrcStats &stats, uint16_t seq) {
+    if (!stats.have_seq) {
+        stats.have_seq = true;
+        stats.base_seq = stats.max_seq = seq;
+        stats.recent.push_back(seq);
+        return;
+    }
+    //Extend relative to the highest sequence number seen so far
+    int64_t extended = stats.max_seq + (int16_t) (seq - (uint16_t) stats.max_seq);
+    if (extended > stats.max_seq) {
+        if (extended > stats.max_seq + 1) {
+            stats.gaps++;
+            stats.missing += extended - stats.max_seq - 1;
+        }
+        stats.max_seq = extended;
+    } else if (std::find(stats.recent.begin(), stats.recent.end(), extended) != stats.recent.end()) {
+        stats.duplicates++;
+    } else if (stats.max_seq - extended < MAX_REORDER_WINDOW) {
+        //Late packet filled a hole counted as missing before
+        stats.reordered++;
+        if (stats.missing > 0)
+            stats.missing--;
+        stats.max_reorder_depth = std::max(stats.max_reorder_depth, stats.max_seq - extended);
+    }
+    stats.recent.push_back(extended);
+    if (stats.recent.size() > MAX_REORDER_WINDOW)
+        stats.recent.erase(stats.recent.begin(), stats.recent.begin() + MAX_REORDER_WINDOW / 2);
+}
+
+static void track_timing(SsrcStats &stats, uint64_t capture_ns, uint32_t rtp_ts, uint16_t seq,
+                         size_t payload_len, const uint8_t *payload) {
+    //RFC 3550 A.8 with arrival in RTP clock units
+    double arrival = (double) capture_ns * CLOCK_RATE / 1e9;
+    double transit = arrival - rtp_ts;
+    if (stats.have_transit) {
+        double d = fabs(transit - stats.transit);
+        //A wrapped or restarted RTP clock is not jitter
+        if (d < CLOCK_RATE * 10.0) {
+            stats.jitter += (d - stats.jitter) / 16;
+            stats.max_jitter = std::max(stats.max_jitter, stats.jitter);
+            double d_ms = d * 1000 / CLOCK_RATE;
+            size_t bucket = 0;
+            while (bucket < JITTER_BUCKET_COUNT - 1 && d_ms >= JITTER_BUCKETS_MS[bucket])
+                bucket++;
+            stats.jitter_histogram[bucket]++;
+        }
+    }
+    stats.have_transit = true;
+    stats.transit = transit;
+
+    if (stats.have_frame && rtp_ts == stats.frame_ts) {
+        stats.frame_bytes += payload_len;
+        stats.frame_idr |= h264_payload_has_idr(payload, payload_len);
+        return;
+    }
+    if (stats.have_frame) {
+        int64_t delta = (int32_t) (rtp_ts - stats.frame_ts);
+        if (delta < 0) {
+            //Reordered packet of an older frame, keep accumulating into the current one
+            if (-delta < (int64_t) CLOCK_RATE) {
+                stats.frame_bytes += payload_len;
+                return;
+            }
+            stats.ts_backwards++;
+        } else {
+            stats.ts_deltas[delta]++;
+        }
+        //Jumps are deltas well off the nominal frame interval once it is known
+        if (stats.nominal_delta > 0 && (delta < 0 || delta > stats.nominal_delta * 3)) {
+            stats.ts_jumps++;
+            if (stats.jump_list.size() < MAX_TIMESTAMP_JUMPS)
+                stats.jump_list.push_back({capture_ns, seq, delta});
+        }
+        if (stats.frames % 32 == 0 && !stats.ts_deltas.empty()) {
+            stats.nominal_delta = std::max_element(stats.ts_deltas.begin(), stats.ts_deltas.end(),
+                                                   [](const std::pair<const int64_t, uint64_t> &a,
+                                                      const std::pair<const int64_t, uint64_t> &b) {
+                                                       return a.second < b.second;
+                                                   })->first;
+        }
+        finish_frame(stats);
+    }
+    stats.have_frame = true;
+    stats.frame_ts = rtp_ts;
+    stats.frame_bytes = payload_len;
+    stats.frame_capture = capture_ns;
+    stats.frame_idr = h264_payload_has_idr(payload, payload_len);
+}
+
+static uint64_t percentile(std::vector<uint64_t> values, double p) {
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t) (p * (values.size() - 1) + 0.5))];
+}
+
+static double mean(const std::vector<double> &values) {
+    double sum = 0;
+    for (double value: values)
+        sum += value;
+    return values.empty() ? 0 : sum / values.size();
+}
+
+static std::string json_escape(const char *text) {
+    std::string escaped;
+    for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            escaped += '\\';
+            escaped += *c;
+        } else if ((unsigned char) *c < 0x20) {
+            char control[8];
+            snprintf(control, sizeof(control), "\\u%04x", (unsigned char) *c);
+            escaped += control;
+        } else {
+            escaped += *c;
+        }
+    }
+    return escaped;
+}
+
+static void print_stream(const SsrcStats &stats, bool last) {
+    double duration = (stats.last_capture - stats.first_capture) / 1e9;
+    int64_t expected = stats.have_seq ? stats.max_seq - stats.base_seq + 1 : 0;
+    std::vector<double> frame_interval_ms;
+
+    printf("    {\n");
+    printf("      \"ssrc\": \"0x%08x\",\n", stats.ssrc);
+    printf("      \"payload_type\": %u,\n", stats.payload_type);
+    printf("      \"src\": \"%s:%u\",\n", ip_string(stats.src_ip).c_str(), stats.src_port);
+    printf("      \"dst\": \"%s:%u\",\n", ip_string(stats.dst_ip).c_str(), stats.dst_port);
+    printf("      \"duration_s\": %.3f,\n", duration);
+    printf("      \"packets\": %llu,\n", (unsigned long long) stats.packets);
+    printf("      \"bytes\": %llu,\n", (unsigned long long) stats.bytes);
+    printf("      \"sequence\": {\"expected\": %lld, \"missing\": %llu, \"loss_percent\": %.3f, \"gaps\": %llu, "
+           "\"reordered\": %llu, \"max_reorder_depth\": %lld, \"duplicates\": %llu},\n",
+           (long long) expected, (unsigned long long) stats.missing,
+           expected > 0 ? 100.0 * stats.missing / expected : 0.0, (unsigned long long) stats.gaps,
+           (unsigned long long) stats.reordered, (long long) stats.max_reorder_depth,
+           (unsigned long long) stats.duplicates);
+
+    printf("      \"timestamps\": {\"nominal_frame_delta\": %lld, \"jumps\": %llu, \"backwards\": %llu, \"jump_list\": [",
+           (long long) stats.nominal_delta, (unsigned long long) stats.ts_jumps,
+           (unsigned long long) stats.ts_backwards);
+    for (size_t i = 0; i < stats.jump_list.size(); i++) {
+        const TimestampJump &jump = stats.jump_list[i];
+        printf("%s{\"offset_s\": %.6f, \"seq\": %u, \"delta\": %lld}", i ? ", " : "",
+               (jump.capture_ns - stats.first_capture) / 1e9, jump.seq, (long long) jump.delta);
+    }
+    printf("]},\n");
+
+    printf("      \"jitter\": {\"final_ms\": %.3f, \"max_ms\": %.3f, \"histogram_ms\": [",
+           stats.jitter * 1000 / CLOCK_RATE, stats.max_jitter * 1000 / CLOCK_RATE);
+    for (size_t i = 0; i < JITTER_BUCKET_COUNT; i++) {
+        if (i < JITTER_BUCKET_COUNT - 1)
+            printf("%s{\"lt\": %g, \"count\": %llu}", i ? ", " : "", JITTER_BUCKETS_MS[i],
+                   (unsigned long long) stats.jitter_histogram[i]);
+        else
+            printf(", {\"ge\": %g, \"count\": %llu}", JITTER_BUCKETS_MS[i - 1],
+                   (unsigned long long) stats.jitter_histogram[i]);
+    }
+    printf("]},\n");
+
+    printf("      \"frames\": {\"count\": %llu, \"fps\": %.2f, \"size_p50\": %llu, \"size_p95\": %llu, \"size_max\": %llu},\n",
+           (unsigned long long) stats.frames, duration > 0 ? stats.frames / duration : 0.0,
+           (unsigned long long) percentile(stats.frame_sizes, 0.5),
+           (unsigned long long) percentile(stats.frame_sizes, 0.95), (unsigned long long) stats.frame_bytes_max);
+
+    std::vector<uint64_t> idr_interval_frames = stats.idr_interval_frames;
+    printf("      \"idr\": {\"count\": %llu, \"interval_frames_min\": %llu, \"interval_frames_max\": %llu, "
+           "\"interval_ms_mean\": %.1f, \"size_p50\": %llu, \"size_max\": %llu},\n",
+           (unsigned long long) stats.idr_frames, (unsigned long long) percentile(idr_interval_frames, 0),
+           (unsigned long long) percentile(idr_interval_frames, 1), mean(stats.idr_interval_ms),
+           (unsigned long long) percentile(stats.idr_sizes, 0.5), (unsigned long long) percentile(stats.idr_sizes, 1));
+
+    printf("      \"bitrate_kbps\": {\"interval_ms\": %llu, \"series\": [", (unsigned long long) (INTERVAL_NS / 1000000));
+    for (size_t i = 0; i < stats.interval_bytes.size(); i++)
+        printf("%s%.1f", i ? ", " : "", stats.interval_bytes[i] * 8.0 / (INTERVAL_NS / 1e9) / 1000);
+    printf("], \"beyond_series_packets\": %llu}\n", (unsigned long long) stats.beyond_intervals);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<const char *> positional;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--clock-rate=", 13) == 0)
+            CLOCK_RATE = (uint32_t) strtoul(argv[i] + 13, NULL, 10);
+        else if (strncmp(argv[i], "--interval-ms=", 14) == 0)
+            INTERVAL_NS = strtoull(argv[i] + 14, NULL, 10) * 1000000ull;
+        else
+            positional.push_back(argv[i]);
+    }
+    if (positional.empty() || positional.size() > 3 || CLOCK_RATE == 0 || INTERVAL_NS == 0) {
+        fprintf(stderr, "Usage: %s [--clock-rate=HZ] [--interval-ms=MS] |PCAP FILE PATH| "
+                        "[|RTP SOURCE IP| [|RTP SOURCE PORT|]]\n", argv[0]);
+        return -1;
+    }
+
+    PcapReader reader;
+    PcapFilter filter;
+    if (!reader.open(positional[0])) {
+        fprintf(stderr, "%s\n", reader.error().c_str());
+        return -1;
+    }
+    if (!filter.set(positional.size() > 1 ? positional[1] : "", positional.size() > 2 ? positional[2] : "")) {
+        fprintf(stderr, "Invalid source filter\n");
+        return -1;
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    std::map<uint32_t, SsrcStats> streams;
+    std::vector<uint32_t> order; //SSRCs in order of appearance
+    uint64_t udp_packets = 0, skipped = 0;
+    PcapPacket packet;
+    while (reader.next_udp_packet(&packet)) {
+        udp_packets++;
+        //RTP version 2, RTCP payload types 72-76 (with marker) are not media
+        if (!filter.matches(packet) || packet.payload_len < RTP_HEADER_LEN || (packet.payload[0] >> 6) != 2 ||
+            (packet.payload[1] >= 200 && packet.payload[1] <= 204)) {
+            skipped++;
+            continue;
+        }
+        const uint8_t *rtp = packet.payload;
+        size_t header_len = RTP_HEADER_LEN + (rtp[0] & 0x0f) * 4;
+        if ((rtp[0] & 0x10) && packet.payload_len >= header_len + 4)
+            header_len += 4 + read_be16(rtp + header_len + 2) * 4;
+        if (header_len > packet.payload_len) {
+            skipped++;
+            continue;
+        }
+        size_t payload_len = packet.payload_len - header_len;
+        if ((rtp[0] & 0x20) && payload_len > 0)
+            payload_len -= std::min<size_t>(rtp[packet.payload_len - 1], payload_len);
+
+        uint32_t ssrc = read_be32(rtp + 8);
+        std::map<uint32_t, SsrcStats>::iterator found = streams.find(ssrc);
+        if (found == streams.end()) {
+            SsrcStats &created = streams[ssrc];
+            created.ssrc = ssrc;
+            created.src_ip = packet.src_ip;
+            created.dst_ip = packet.dst_ip;
+            created.src_port = packet.src_port;
+            created.dst_port = packet.dst_port;
+            created.payload_type = rtp[1] & 0x7f;
+            created.first_capture = packet.timestamp_ns;
+            order.push_back(ssrc);
+            found = streams.find(ssrc);
+        }
+        SsrcStats &stats = found->second;
+        stats.packets++;
+        stats.bytes += packet.payload_len;
+        stats.last_capture = std::max(stats.last_capture, packet.timestamp_ns);
+        if (packet.timestamp_ns >= stats.first_capture) {
+            //The series is sized by capture timestamps, one far off must not allocate up to it
+            uint64_t interval = (packet.timestamp_ns - stats.first_capture) / INTERVAL_NS;
+            if (interval >= MAX_BITRATE_INTERVALS) {
+                stats.beyond_intervals++;
+            } else {
+                if (interval >= stats.interval_bytes.size())
+                    stats.interval_bytes.resize(interval + 1, 0);
+                stats.interval_bytes[interval] += packet.payload_len;
+            }
+        }
+        track_sequence(stats, read_be16(rtp + 2));
+        track_timing(stats, packet.timestamp_ns, read_be32(rtp + 4), read_be16(rtp + 2), payload_len,
+                     rtp + header_len);
+    }
+    for (std::map<uint32_t, SsrcStats>::iterator it = streams.begin(); it != streams.end(); ++it)
+        finish_frame(it->second);
+
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    printf("{\n");
+    printf("  \"file\": \"%s\",\n", json_escape(positional[0]).c_str());
+    printf("  \"file_bytes\": %llu,\n", (unsigned long long) reader.size());
+    printf("  \"analysis_s\": %.3f,\n", elapsed);
+    printf("  \"clock_rate\": %u,\n", CLOCK_RATE);
+    printf("  \"udp_packets\": %llu,\n", (unsigned long long) udp_packets);
+    printf("  \"skipped_packets\": %llu,\n", (unsigned long long) skipped);
+    printf("  \"streams\": [\n");
+    for (size_t i = 0; i < order.size(); i++)
+        print_stream(streams[order[i]], i + 1 == order.size());
+    printf("  ]\n");
+    printf("}\n");
+    return 0;
+}
@@ -10,6 +10,9 @@
 #define GST_USE_UNSTABLE_API
 
 #include <gst/webrtc/webrtc.h>
+#include <gst/rtp/rtp.h>
+#include <gio/gio.h>
+#include <nice/agent.h>
 
 /* For signalling */
 #include <libsoup/soup.h>
@@ -21,18 +24,33 @@
 #include <stdio.h>
 #include <map>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <execinfo.h>
 #include <signal.h>
 #include <time.h>
+#include <math.h>
 #include <string>
 #include <regex>
 #include <iostream>
 #include <list>
+#include <deque>
+#include <vector>
+#include <fstream>
+#include <sstream>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+#include "pcap_reader.h"
+#include "sei_timestamp.h"
 
 using namespace std;
 
@@ -42,20 +60,198 @@ const std::string PROFILE_LEVEL_ID_REGEX = "profile-level-id=*[A-za-z0-9]*;";
 const std::string H264_BROWSER_PROFILE_LEVEL_ID = "profile-level-id=42e01f;";
 const bool CHANGE_PROFILE_LEVEL_ID = true;
 
-const std::string BASE_RECORDING_PATH = "/mnt/av/";
+std::string BASE_RECORDING_PATH = "/mnt/av/";
 std::string SIGNAL_SERVER = "wss://127.0.0.1:8443";
 
-const bool FROM_PCAP = true;
-const bool START_WEBRTC = true;
+enum IngestMode {
+    INGEST_PCAP = 0,
+    INGEST_RTSP = 1,
+    INGEST_MULTICAST = 2,
+};
+
+enum PcapReplayMode {
+    PCAP_REPLAY_PACED = 0, /* capture timing, once */
+    PCAP_REPLAY_LOOP = 1, /* capture timing, forever */
+    PCAP_REPLAY_MAX_SPEED = 2, /* as fast as the pipeline accepts, once */
+};
+
+IngestMode INGEST_MODE = INGEST_PCAP;
+PcapReplayMode PCAP_REPLAY_MODE = PCAP_REPLAY_PACED;
+bool START_WEBRTC = true; //Cleared by the tests, which attach stand-in viewers instead
 std::string PCAP_PATH = "";
 std::string PCAP_SRC_IP = "";
 std::string PCAP_SRC_PORT = "";
 std::string PEER_ID = "";
+gdouble PEER_RAMP_RATE = 10; //Viewers added per second when a range of peer ids is entered
+gboolean SEI_TIMESTAMP = FALSE; //Insert a wallclock SEI into every access unit entering the videotee
+gint METRICS_PORT = 0; //Prometheus endpoint on localhost, 0 disables it
+gint METRICS_INTERVAL = 5; //Seconds between get-stats collections
+GstClock *PIPELINE_CLOCK = NULL; //Clock forced on the pipeline, the tests use a GstTestClock
+gint SOAK_CYCLES = 0; //Join/leave cycles of the soak mode, 0 disables it
+gint SOAK_DWELL = 5; //Seconds the soak viewers stay connected in each cycle
+gint SOAK_WARMUP = 3; //Cycles before the soak baseline is taken, pools and caches fill up in them
+gint SOAK_MAX_GROWTH = 256; //KB of RSS growth per cycle above which the soak fails
+std::string RTSP_URL = "rtsp://10.142.138.91/z3-1.mp4";
+std::string BACKUP_RTSP_URL = ""; //Hot standby camera url, enables source failover
+gint FAILOVER_TIMEOUT = 500; //ms without buffers after which the standby source takes over
+gboolean AUDIO = FALSE; //Camera audio as Opus to every viewer and into the recording, rtsp ingest only
+std::string RTSP_TRANSPORT = "auto"; //auto, udp, tcp or multicast
+gint UDP_BUFFER_SIZE = 0; //0 sizes the ingest socket buffers from INGEST_BITRATE
+gint INGEST_BITRATE = 8000; //Expected peak ingest bitrate in kbps
+gdouble TRANSPORT_FALLBACK_LOSS = 2.0; //Loss percentage that makes auto transport fall back to TCP
+#define TRANSPORT_FALLBACK_HOLD 600 //s after a fall back to TCP from which the next restart tries UDP again
+std::string MULTICAST_ADDRESS = "";
+gint MULTICAST_PORT = 0;
+std::string MULTICAST_IFACE = "";
+std::string MULTICAST_CAPS = "application/x-rtp,media=video,encoding-name=H264,clock-rate=90000,payload=96";
+
+/* One output of the transcoding ladder, index 0 is the camera stream itself */
+struct Rendition {
+    gint height; //0 for the native stream
+    gint bitrate; //kbps of the encoder
+    std::string tee_name;
+};
+
+std::vector<Rendition> RENDITIONS = {{0, 0, "videotee"}};
+gint DEFAULT_RENDITION = 0; //Index into RENDITIONS that new viewers start on
+#define LADDER_KEY_INT 60 //Frames between the regular keyframes of the ladder encoders
+
+//Frame thinning of a viewer branch, without transcoding
+enum ThinningLevel {
+    THIN_NONE = 0, /* every frame */
+    THIN_DISPOSABLE = 1, /* drops the frames no other frame references, nal_ref_idc 0 */
+    THIN_KEYFRAMES = 2, /* keyframes only */
+};
+
+static const gchar *THINNING_NAMES[] = {"none", "disposable", "keyframes"};
+gint THINNING = THIN_NONE; //Level every viewer asks for, e.g. for grid views
+gboolean ADAPTIVE_RENDITIONS = FALSE; //Moves every viewer between RENDITIONS and thinning levels on its bandwidth estimate
+gint IMPAIR_KBPS = 0; //Egress link rate of every viewer in the impairment stage, 0 for unlimited
+gdouble IMPAIR_LOSS = 0; //Random egress loss percentage of every viewer
+gboolean PACING = FALSE; //Spreads the datagrams of every viewer at its egress instead of sending frames as bursts
+
+//Rendition controller
+#define ADAPT_INTERVAL 1 //Seconds between bandwidth estimates
+#define ADAPT_HEADROOM 0.85 //Share of the estimate a rendition may take
+#define ADAPT_HOLD 2 //Seconds after a switch before the next one, the new rendition needs its keyframe first
+#define ADAPT_UP_DELAY 8 //Seconds the estimate must allow the next rendition up before moving there
+#define ADAPT_MAX_UP_DELAY 64 //Bound of the up delay, doubled after every move up that had to be undone
+#define REMB_TIMEOUT 3 //Seconds a REMB of the viewer caps the estimate
+#define REMB_MAX_KBPS 10000000 //Bound of a REMB, the 6 bit exponent reaches 2^81 bps
+#define IMPAIR_BURST_MS 50 //Bucket depth of the impairment rate limit
+#define PACING_FACTOR 2.5 //Pacing rate over the bandwidth estimate, a keyframe leaves within a few frame intervals
+#define VIEWER_QUEUE_TIME 1000 //ms queue-<peer> holds before it drops, a slow viewer never blocks the videotee
+#define PACING_MAX_DELAY 100 //ms the pacer may run behind, datagrams beyond that backlog are sent at once
+gboolean BATCHED_EGRESS = FALSE; //Sends the datagrams of all viewers from one thread with sendmmsg and UDP GSO
+#define EGRESS_TICK_MS 2 //Between flushes of the batched egress, a frame's packets leave together
+#define EGRESS_BATCH 64 //Messages per sendmmsg, a viewer with that many datagrams queued is flushed at once
+#define EGRESS_GSO_SEGMENTS 64 //Datagrams per GSO send, UDP_MAX_SEGMENTS of the kernel
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+//Keyframe requests of the viewers, in ms
+gint KEYFRAME_REQUEST_INTERVAL = 1000; //Between requests sent upstream for one tee
+gint KEYFRAME_CACHE_AGE = 1000; //Up to which a request is answered from the cached frames, 0 never does
+#define KEYFRAME_REPLAY_FRAMES 10 //Dependent frames cached after a keyframe, later requests go upstream
+#define KEYFRAME_REPLAY_GAP 100 //ms at most between two replayed frames, of a stream with long pauses
+
+//Retransmission of the packets viewers NACK
+enum RtxMode {
+    RTX_OFF = 0, /* NACK is not negotiated */
+    RTX_WEBRTCBIN = 1, /* RTX with a history per viewer in webrtcbin */
+    RTX_SHARED = 2, /* one history per source, see RtxStore */
+};
+
+static const gchar *RTX_MODE_NAMES[] = {"off", "webrtcbin", "shared"};
+gint RTX_MODE = RTX_WEBRTCBIN;
+gint RTX_HISTORY = 1000; //ms of packets kept for retransmission
+#define RTX_HEADER_SIZE 16 //Bytes of RTP and payload header a viewer keeps per packet
+
+gboolean ADAPTIVE_FEC = FALSE; //ULPFEC/RED protection sized per viewer from its loss and RTT
+#define FEC_MIN_LOSS 0.01 //Loss below which NACK alone is enough
+#define FEC_NACK_RTT 0.05 //RTT in s under which NACK recovers in time unless loss is high
+#define FEC_HIGH_LOSS 0.05
+#define FEC_HOLD 10 //Seconds a lower protection must be enough before it is applied
+static const gint FEC_LEVELS[] = {0, 10, 20, 33, 50}; //fec-percentage steps, per media packet
+
+//Ingest jitterbuffer, latencies in ms
+gboolean ADAPTIVE_JITTERBUFFER = FALSE;
+gint JITTERBUFFER_LATENCY = 100;
+gint JITTERBUFFER_MIN_LATENCY = 20;
+gint JITTERBUFFER_MAX_LATENCY = 500;
 
 #define STUN_SERVER " stun-server=stun://stun.l.google.com:19302 "
 #define RTP_CAPS_OPUS "application/x-rtp,media=audio,encoding-name=OPUS,payload="
+#define AUDIO_TRANSCODE "audioconvert ! audioresample ! opusenc" //Once per source for cameras without Opus
 #define RTP_CAPS_VP8 "application/x-rtp,media=video,encoding-name=VP8,payload="
+#define RTP_CAPS_VP9 "application/x-rtp,media=video,encoding-name=VP9,payload="
+#define RTP_CAPS_H265 "application/x-rtp,media=video,encoding-name=H265,payload="
 #define RTP_CAPS_H264 "application/x-rtp,media=video,encoding-name=H264,payload=96"
+#define PCAP_RTP_CAPS RTP_CAPS_H264 ",clock-rate=90000"
+#define PCAP_RTP_CLOCK_RATE 90000
+
+//Video codecs passed from the camera to the viewers as they are
+enum VideoCodec {
+    CODEC_H264 = 0,
+    CODEC_H265 = 1,
+    CODEC_VP8 = 2,
+    CODEC_VP9 = 3,
+    CODEC_COUNT
+};
+
+struct VideoCodecInfo {
+    const gchar *name; //Of --fallback-codec and the transcode elements
+    const gchar *encoding_name;
+    const gchar *depay;
+    const gchar *pay;
+    const gchar *rtp_caps; //Of the viewer payloader
+    gint pt; //A payload type of its own, one offer carries the camera's codec and the fallback
+    const gchar *decoder; //Of the shared transcode from this codec
+    const gchar *encoder; //Of the shared transcode into this codec, keyframe interval and kbps filled in
+    const gchar *record_parser; //In front of mp4mux, NULL when mp4 cannot carry the codec
+};
+
+static const VideoCodecInfo VIDEO_CODECS[CODEC_COUNT] = {
+        {"h264", "H264", "rtph264depay", "rtph264pay", RTP_CAPS_H264, 96, "avdec_h264",
+                "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=%d bitrate=%d ! "
+                "video/x-h264,profile=constrained-baseline", "h264parse"},
+        {"h265", "H265", "rtph265depay", "rtph265pay", RTP_CAPS_H265 "98", 98, "avdec_h265",
+                "x265enc tune=zerolatency speed-preset=ultrafast key-int-max=%d bitrate=%d", "h265parse"},
+        {"vp8", "VP8", "rtpvp8depay", "rtpvp8pay", RTP_CAPS_VP8 "100", 100, "vp8dec",
+                "vp8enc deadline=1 keyframe-max-dist=%d target-bitrate=%d000", NULL},
+        {"vp9", "VP9", "rtpvp9depay", "rtpvp9pay", RTP_CAPS_VP9 "101", 101, "vp9dec",
+                "vp9enc deadline=1 keyframe-max-dist=%d target-bitrate=%d000", "vp9parse"},
+};
+
+gint FALLBACK_CODEC = CODEC_H264; //Offered next to the camera's codec, -1 for none
+gint TRANSCODE_BITRATE = 2000; //kbps of the shared transcode into FALLBACK_CODEC
+
+/* VideoCodec of an RTP encoding-name, -1 when the viewer branch has no payloader for it */
+static gint video_codec_from_encoding(const gchar *encoding) {
+    for (gint codec = 0; codec < CODEC_COUNT; codec++) {
+        if (encoding && g_ascii_strcasecmp(encoding, VIDEO_CODECS[codec].encoding_name) == 0)
+            return codec;
+    }
+    return -1;
+}
+
+/* VideoCodec of RTP caps such as MULTICAST_CAPS, -1 when unsupported */
+static gint caps_video_codec(const gchar *caps_string) {
+    GstCaps *caps = gst_caps_from_string(caps_string);
+    gint codec = -1;
+
+    if (caps && !gst_caps_is_empty(caps))
+        codec = video_codec_from_encoding(gst_structure_get_string(gst_caps_get_structure(caps, 0), "encoding-name"));
+    if (caps)
+        gst_caps_unref(caps);
+    return codec;
+}
+
+/* VideoCodec of the videotee, H264 until the rtsp ingest has seen the camera's caps */
+static gint ingest_codec(GstElement *pipeline) {
+    return GPOINTER_TO_INT (g_object_get_data(G_OBJECT (pipeline), "video-codec"));
+}
 
 
 enum AppState {
@@ -86,37 +282,456 @@ enum PipelineState {
     STOPPED = 4,
 };
 
+/*
+ * Watches the RTP packets entering an ingest rtpjitterbuffer and, in adaptive mode, resizes its
+ * latency from the measured interarrival jitter (RFC 3550 A.8) and reorder depth, between
+ * JITTERBUFFER_MIN_LATENCY and JITTERBUFFER_MAX_LATENCY.
+ */
+class JitterBufferTuner {
+
+public:
+    //Attributes
+    GstElement *jitterbuffer = NULL;
+    std::string name;
+    guint clock_rate = 90000;
+    gboolean adaptive = FALSE;
+    guint min_latency = 0;
+    guint max_latency = 0;
+
+    //Exported values, guarded by lock
+    std::mutex lock;
+    guint latency = 0;
+    gdouble jitter_ms = 0;
+    guint reorder_depth = 0;
+    guint64 num_pushed = 0;
+    guint64 num_lost = 0;
+    guint64 num_late = 0;
+    guint64 bytes_received = 0;
+    gdouble loss_fraction = 0; //Of the last window
+
+    //Called from the streaming thread once per measurement window
+    void (*window_callback)(JitterBufferTuner *tuner, gpointer user_data) = NULL;
+    gpointer window_callback_data = NULL;
+
+    //Methods
+    void attach(GstElement *element);
+
+    void on_rtp_packet(guint16 seq, guint32 rtp_ts, GstClockTime arrival, gsize size);
+
+private:
+    gboolean have_previous = FALSE;
+    GstClockTime previous_arrival = 0;
+    guint32 previous_rtp_ts = 0;
+    guint16 highest_seq = 0;
+    guint window_reorder_depth = 0;
+    gdouble mean_interarrival_ms = 0;
+    GstClockTime window_start = GST_CLOCK_TIME_NONE;
+    guint64 previous_num_late = 0;
+    guint64 previous_num_lost = 0;
+    guint64 previous_num_pushed = 0;
+    guint shrink_windows = 0;
+
+    gboolean on_rtp_packet_locked(guint16 seq, guint32 rtp_ts, GstClockTime arrival, gsize size);
+
+    void end_of_window(GstClockTime now);
+};
+
+typedef std::shared_ptr<JitterBufferTuner> JitterBufferTunerPtr;
+
+//Milestones of a viewer join, in the order they normally happen
+enum JoinMilestone {
+    JOIN_WS_CONNECTED = 0,
+    JOIN_HELLO,
+    JOIN_SESSION_OK,
+    JOIN_NEGOTIATION_NEEDED,
+    JOIN_OFFER_SENT,
+    JOIN_ANSWER_APPLIED,
+    JOIN_FIRST_CANDIDATE, /* local */
+    JOIN_LAST_CANDIDATE,
+    JOIN_ICE_CONNECTED,
+    JOIN_DTLS_CONNECTED, /* peer connection state connected, ICE and DTLS done */
+    JOIN_FIRST_RTP, /* first packet payloaded after DTLS */
+    JOIN_FIRST_KEYFRAME, /* first keyframe from the videotee after DTLS, the viewer can decode */
+    JOIN_MILESTONE_COUNT
+};
+
+static const gchar *JOIN_MILESTONE_NAMES[JOIN_MILESTONE_COUNT] = {
+        "ws_connected", "hello", "session_ok", "negotiation_needed", "offer_sent", "answer_applied",
+        "first_candidate", "last_candidate", "ice_connected", "dtls_connected", "first_rtp", "first_keyframe"
+};
+
+/* Monotonic timestamps of the join milestones of one viewer, marked from any thread */
+class JoinTimeline {
+
+public:
+    JoinTimeline() : origin(g_get_monotonic_time()) {
+        for (auto &stamp : stamps)
+            stamp = 0;
+    }
+
+    //Attributes
+    gint64 origin; //Viewer created
+
+    //Methods
+    void mark(JoinMilestone milestone) {
+        gint64 expected = 0;
+        if (milestone == JOIN_LAST_CANDIDATE)
+            stamps[milestone] = g_get_monotonic_time();
+        else
+            stamps[milestone].compare_exchange_strong(expected, g_get_monotonic_time());
+    }
+
+    gboolean reached(JoinMilestone milestone) const { return stamps[milestone] != 0; }
+
+    //us since origin, -1 when not reached
+    gint64 offset(JoinMilestone milestone) const {
+        gint64 stamp = stamps[milestone];
+        return stamp ? stamp - origin : -1;
+    }
+
+    std::string describe(void) const;
+
+private:
+    std::atomic<gint64> stamps[JOIN_MILESTONE_COUNT];
+};
+
+/* Totals of the RTCP feedback in a webrtcbin "get-stats" reply */
+struct FeedbackStats {
+    gdouble bytes_sent = 0;
+    gdouble packets_sent = 0;
+    gdouble nack = 0; //NACKs, PLIs and FIRs received
+    gdouble pli = 0;
+    gdouble fir = 0;
+    gdouble packets_lost = 0; //Reported by the viewer
+    gdouble fraction_lost = 0; //Of the last receiver report, 0 to 1
+    gdouble rtt = 0; //Seconds
+};
+
+/*
+ * Send side bandwidth estimate of one viewer from the RTCP feedback its webrtcbin receives, after the
+ * loss based controller of GCC: +8% per report while receiver reports and NACKs show under 2% loss, back
+ * off by half the loss above 10%, and down to 85% of the sent rate when the RTT doubles over its minimum.
+ * A REMB of the viewer caps the estimate while it is fresh.
+ */
+class BandwidthEstimator {
+
+public:
+    //Attributes
+    std::mutex lock; //REMB arrives on the RTCP thread, reports on the get-stats reply
+    gdouble estimate_kbps = 0; //0 until the first report
+    gdouble sent_kbps = 0;
+    gdouble loss = 0; //Of the last report, receiver report or NACK rate
+    gdouble rtt = 0; //Seconds
+    gdouble remb_kbps = 0;
+
+    //Methods
+    void on_remb(gdouble kbps);
+
+    //Returns the new estimate, start_kbps seeds the first one
+    gdouble on_report(const FeedbackStats &stats, gdouble start_kbps, gdouble max_kbps);
+
+private:
+    gint64 updated = 0;
+    gint64 remb_updated = 0;
+    FeedbackStats previous;
+    gdouble min_rtt = 0;
+};
+
+/*
+ * In-process network impairment of one viewer's egress, for exercising the rendition controller
+ * without netem: random loss and a token bucket that drops whatever exceeds the link rate. Applies
+ * once DTLS is connected, so the handshake is never impaired.
+ */
+class Impairment {
+
+public:
+    //Attributes
+    std::atomic<gint> kbps{0}; //0 for an unlimited link
+    std::atomic<gdouble> loss{0}; //Percent
+
+    //Methods
+    gboolean pass(gsize size);
+
+private:
+    std::mutex lock; //One nicesink per transport
+    gdouble tokens = 0; //Bytes
+    gint64 updated = 0;
+};
+
+/* Departure times of the datagrams of one viewer at the pacing rate, a packet train instead of a burst */
+class Pacer {
+
+public:
+    //Attributes
+    std::atomic<gint> kbps{0}; //0 until the viewer has a rate
+    std::mutex lock; //RTP and RTCP reach the nicesink on different threads
+    guint64 packets = 0; //Guarded by lock
+    guint64 held = 0;
+    gint64 held_us = 0;
+    gint64 longest_us = 0;
+
+    //Methods
+    gint64 wait(gsize size);
+
+private:
+    gint64 next_send = 0;
+};
+
+/*
+ * Keyframe requests of the viewers of one tee, the videotee or a rendition tee, which PLI and FIR reach
+ * as GstForceKeyUnit events. A request is answered with the last keyframe and the newest frames depending
+ * on it while that keyframe is at most KEYFRAME_CACHE_AGE old and followed by at most KEYFRAME_REPLAY_FRAMES
+ * frames, replayed to that viewer alone. Otherwise requests are coalesced
+ * into at most one upstream per KEYFRAME_REQUEST_INTERVAL, to the encoder of a rendition or through
+ * rtph264depay and rtspsrc to the camera.
+ */
+class KeyframeArbiter {
+
+public:
+    ~KeyframeArbiter() { clear_frames(); }
+
+    //Attributes
+    std::mutex lock;
+    guint64 requests = 0; //From the viewers
+    guint64 served = 0; //Answered from the cache
+    guint64 forwarded = 0; //Sent upstream
+
+    //Methods
+    void on_buffer(GstPad *sinkpad, GstBuffer *buffer);
+
+    //Cached frames for the viewer to replay, or none when it has to wait for the next keyframe
+    std::vector<GstBuffer *> on_request(gboolean replay);
+
+private:
+    std::vector<GstBuffer *> frames; //The last keyframe and the frames since, empty when too many
+    gint64 keyframe_time = 0;
+    gint64 last_forward = 0;
+    gboolean forward_pending = FALSE;
+
+    void clear_frames(void);
+};
+
+/*
+ * Retransmission history of one source, shared by its viewers. The payloaders of all viewers cut the
+ * same access units at the same places, so their packets carry the same payload memory. Each payload
+ * is kept here once, for RTX_HISTORY ms, while a viewer only records the RTP header it sent with it and
+ * rebuilds the packet when a NACK asks for it.
+ */
+class RtxStore {
+
+public:
+    struct Payload {
+        ~Payload() { gst_buffer_unref(buffer); }
+
+        GstBuffer *buffer; //Memory of the packet after the header
+    };
+
+    typedef std::shared_ptr<Payload> PayloadPtr;
+
+    //Methods
+    PayloadPtr share(GstBuffer *packet, gsize header_size, gint64 now);
+
+private:
+    //The memory a payload starts in, identical for every viewer
+    struct Key {
+        const GstMemory *parent;
+        gsize offset;
+        gsize size;
+
+        bool operator<(const Key &other) const {
+            return parent != other.parent ? parent < other.parent : offset != other.offset ?
+                                                                    offset < other.offset : size < other.size;
+        }
+    };
+
+    std::mutex lock;
+    std::map<Key, std::pair<gint64, PayloadPtr>> payloads;
+    std::deque<std::pair<gint64, Key>> expiry;
+};
+
+typedef std::shared_ptr<RtxStore> RtxStorePtr;
+
+/* Packet a viewer sent, rebuilt from the header and the shared payload on a NACK */
+struct RtxRecord {
+    gint64 time;
+    guint16 seq;
+    guint8 header_size;
+    guint8 header[RTX_HEADER_SIZE];
+    RtxStore::PayloadPtr payload;
+};
+
+static std::atomic<gint> live_viewers{0}; //WebrtcViewer instances, back to 0 after every soak cycle
+static std::atomic<gint> live_launch_tasks{0}; //Signalling threads still running
+
 class WebrtcViewer {
 
 public:
+    WebrtcViewer() { live_viewers++; }
+
+    WebrtcViewer(const WebrtcViewer &) = delete;
+
+    WebrtcViewer &operator=(const WebrtcViewer &) = delete;
+
+    ~WebrtcViewer() {
+        if (loop)
+            g_main_loop_unref(loop);
+        for (GstBuffer *frame : keyframe_replay)
+            gst_buffer_unref(frame);
+        if (egress_socket)
+            g_object_unref(egress_socket);
+        live_viewers--;
+    }
+
     //Attributes
     GstElement *pipeline;
     GstElement *webrtc1;
-    GMainLoop *loop;
-    SoupSession *session;
+    std::mutex webrtc_lock; //Guards webrtc1 against the metrics collector
+    GMainLoop *loop = NULL; //Kept until the viewer is gone, remove_peer_from_pipeline() may quit it late
+    SoupSession *session = NULL; //Signalling objects, owned and released by the launch thread
     SoupWebsocketConnection *ws_conn = NULL;
+    std::string close_reason; //Sent in the websocket close frame when the server drops the viewer
+    std::mutex rendition_lock; //Guards the rendition fields below against the keyframe probe
+    gint rendition = 0; //Index into RENDITIONS of the stream the viewer gets
+    gint pending_rendition = -1; //Switched to at its next keyframe
+    GstPad *rendition_pad = NULL; //Funnel sink pads fed by the active and the pending rendition
+    GstPad *pending_pad = NULL;
+    BandwidthEstimator bandwidth;
+    Impairment impairment;
+    Pacer pacer;
+    std::mutex egress_lock; //Guards the selected pair below against the agent's context and the egress thread
+    GSocket *egress_socket = NULL; //Plain UDP socket of the selected pair, NULL to send through nicesink
+    std::string egress_address; //struct sockaddr of the remote candidate
+    gboolean egress_attached = FALSE; //Counted by the batched egress, guarded by egress_lock
+    std::atomic<gint> video_codec{CODEC_H264}; //VideoCodec of the viewer's payloader
+    gint fallback_pt = 0; //Of FALLBACK_CODEC in the offer, 0 when it was not offered
+    gboolean transcoded = FALSE; //Fed from the shared transcode into FALLBACK_CODEC instead of the videotee
+    std::atomic<gint> thinning{THIN_NONE}; //ThinningLevel from the next frame, of the request and the controller
+    gint thinning_applied = THIN_NONE; //Streaming thread of the thinning probe, lowered at keyframes only
+    std::atomic<bool> overrun{false}; //queue-<peer> dropped frames, the next ones up to a keyframe are dropped too
+    H264Framing thinning_framing;
+    std::vector<GstBuffer *> keyframe_replay; //Cached frames sent ahead of the next buffer, guarded by rendition_lock
+    RtxStorePtr rtx_store; //Of the source, with RTX_SHARED
+    std::mutex rtx_lock; //Guards the retransmission fields below against the RTCP thread
+    std::deque<RtxRecord> rtx_history;
+    std::vector<guint16> rtx_requested; //NACKed, sent ahead of the next packet
+    guint64 rtx_sent = 0;
+    guint64 rtx_missed = 0; //NACKed after leaving the history
+    GstClockTime last_pts = GST_CLOCK_TIME_NONE; //Streaming thread of the viewer queue
+    gboolean replaying = FALSE;
     enum AppState app_state = APP_STATE_UNKNOWN;
     int pipeline_execution_id;
     std::string peer_id;
     std::string server_url = SIGNAL_SERVER.c_str();
     gboolean disable_ssl = FALSE;
+    JoinTimeline timeline;
+    std::atomic<bool> timeline_recorded{false};
 
     //Methods
     gboolean start_webrtcbin(void);
 
+    void record_join_timeline(void);
+
     void remove_peer_from_pipeline(void);
 
     void close_peer_from_server(void);
 
+    GstPad *link_rendition(gint index, gboolean at_keyframe);
+
+    gboolean switch_rendition(gint index);
+
+    void adapt_rendition(gdouble estimate_kbps);
+
+    void set_thinning(gint level);
+
+    void request_keyframe(void);
+
+    void adapt_fec(gdouble loss, gdouble rtt);
+
+    gboolean select_answered_codec(const GstSDPMessage *sdp);
+
     gboolean setup_call(void);
 
     void connect_to_websocket_server_async(void);
 
     void remove_webrtc_peer_from_pipelinehandler_map();
+
+private:
+    //Rendition controller, run on the get-stats reply under bandwidth.lock
+    gint64 adapt_switched = 0; //Monotonic us of the last switch
+    gint64 adapt_up_since = 0; //Since when the estimate allows the next rendition up
+    gboolean adapt_went_up = FALSE; //Last switch was a move up
+    gint adapt_up_delay = ADAPT_UP_DELAY;
+    gint adapt_thinning = THIN_NONE; //Added by the controller below the cheapest rendition
+    gdouble adapt_thinned_kbps[THIN_KEYFRAMES] = {0, 0}; //Sent rate before each thinning step
+    gint requested_thinning = THIN_NONE;
+    gint fec_percentage = 0; //Applied to the transceiver
+    gint64 fec_lower_since = 0; //Since when a lower protection would be enough
+
+    void apply_thinning(void);
+
+    GstElement *create_video_payloader(gint pt);
+
+    void add_payloader_probes(GstElement *payloader);
+
+    gboolean use_transcode(gint codec, gint pt);
 };
 
 typedef std::shared_ptr<WebrtcViewer> WebrtcViewerPtr;
 
+/*
+ * Feeds the RTP packets of a capture that match the src ip/port filter into the ingest appsrc.
+ * The capture is memory mapped and, unless sequence numbers and timestamps are rewritten for
+ * looping, the buffers point right into the mapping.
+ */
+class PcapReplay {
+
+public:
+    //Attributes
+    PcapReplayMode mode = PCAP_REPLAY_PACED;
+    GstElement *appsrc = NULL;
+
+    //Methods
+    gboolean open(const std::string &path, const std::string &src_ip, const std::string &src_port);
+
+    void start(GstElement *element);
+
+    void stop(void);
+
+private:
+    std::shared_ptr<PcapReader> reader;
+    PcapFilter filter;
+    std::thread feeder;
+    std::mutex lock;
+    GstClock *clock = NULL;
+    GstClockTime base_time = 0;
+    GstClockID pending = NULL; //Pacing wait of the feeder, unscheduled by stop()
+    bool running = false;
+
+    void run(void);
+
+    gboolean push(GstBuffer *buffer);
+};
+
+typedef std::shared_ptr<PcapReplay> PcapReplayPtr;
+
+class RtspPipelineHandler;
+
+/* One rtspsrc ! rtph264depay branch feeding the source selector in front of videotee when a
+ * hot standby url is configured */
+class SourceBranch {
+
+public:
+    //Attributes
+    RtspPipelineHandler *handler = NULL;
+    int index = 0;
+    std::string url;
+    std::string source_name;
+    std::string depay_name;
+    GstPad *selector_pad = NULL;
+    std::atomic<gint64> last_buffer_time{0};
+    std::atomic<bool> restarting{false};
+};
+
 class RtspPipelineHandler {
 
 public:
@@ -126,12 +741,50 @@ public:
     std::string rtsp_url;
     int pipeline_execution_id;
     int current_file_index = 0;
-    PipelineState pipelineState = STARTED;
+    std::atomic<PipelineState> pipelineState{STARTED}; //Only the restart that moves it off PLAYING runs
+    std::atomic<bool> startup_peer_pending{false}; //PEER_ID waits for the camera's codec, see link_video_ingest()
     std::map<std::string, WebrtcViewerPtr> peers; //Connected webrtc peers with key as remote peer id
+    std::mutex peers_lock; //Guards peers against the metrics collector
+    std::list<JitterBufferTunerPtr> jitterbuffer_tuners; //One per ingest jitterbuffer, guarded by ingest_lock
+    gboolean force_tcp = FALSE; //Set once auto transport fell back to TCP, until TRANSPORT_FALLBACK_HOLD
+    gint64 force_tcp_time = 0;
+    std::mutex ingest_lock;
+    std::list<GstElement *> ingest_udpsrcs; //Receiving sockets of the source, guarded by ingest_lock
+    guint64 ingest_socket_drops = 0; //Kernel drops summed over ingest_udpsrcs
+    gint64 last_socket_check = 0;
+    guint lossy_windows = 0;
+    std::string backup_rtsp_url; //Empty when failover is disabled
+    GstElement *source_selector = NULL; //Owned while the failover pipeline runs
+    SourceBranch source_branches[2]; //Primary and backup
+    std::atomic<int> active_branch{0};
+    std::atomic<int> pending_branch{-1}; //Branch to switch to at its next keyframe
+    std::atomic<guint> failover_generation{0}; //Bumped on every pipeline (re)start
+    PcapReplayPtr pcap_replay;
 
     //Methods
     gboolean start_streaming();
 
+    std::string rtsp_source_description(const std::string &name, const std::string &url,
+                                        const std::string &depay_name);
+
+    void setup_source_failover(void);
+
+    void failover_watchdog(guint generation);
+
+    gboolean handle_source_error(GstMessage *message);
+
+    void restart_source_branch(int index, guint generation);
+
+    void add_jitterbuffer_tuner(GstElement *jitterbuffer);
+
+    void add_ingest_udpsrc(GstElement *udpsrc);
+
+    guint64 update_ingest_socket_drops(void);
+
+    void on_ingest_window(JitterBufferTuner *tuner);
+
+    std::string rtsp_protocols(void);
+
     gboolean stop_streaming(void);
 
     std::string prepare_next_file_name(void);
@@ -141,15 +794,95 @@ public:
 typedef std::shared_ptr<RtspPipelineHandler> RtspPipelineHandlerPtr;
 
 static std::map<int, RtspPipelineHandlerPtr> pipelineHandlers;
+static std::mutex handlers_lock; //Guards pipelineHandlers and their pipeline against the metrics collector
 
 void add_webrtc_peer(RtspPipelineHandler *pipelineHandlerPtr, std::string peer_id);
 
+static void pause_play_pipeline(gpointer data);
+
+static void release_transcode(GstElement *pipeline, gint codec);
+
+#define JOIN_REPORT_EVERY 50 //Completed joins between aggregate reports
+#define JOIN_MAX_SAMPLES 10000 //Offsets kept per milestone for the percentiles of a long run
+
+static std::mutex join_stats_lock;
+static std::vector<gint64> join_stats[JOIN_MILESTONE_COUNT]; //Offsets in us, a reservoir of the recorded viewers
+static guint64 join_stats_seen[JOIN_MILESTONE_COUNT]; //Viewers that reached each milestone
+static guint joins_recorded = 0;
+
+std::string JoinTimeline::describe(void) const {
+    std::string text;
+    for (int milestone = 0; milestone < JOIN_MILESTONE_COUNT; milestone++) {
+        gint64 us = offset((JoinMilestone) milestone);
+        gchar *tmp = us < 0 ? g_strdup_printf(" %s=-", JOIN_MILESTONE_NAMES[milestone]) :
+                     g_strdup_printf(" %s=%.1f", JOIN_MILESTONE_NAMES[milestone], us / 1000.0);
+        text += tmp;
+        g_free(tmp);
+    }
+    return text;
+}
+
+static gint64 join_percentile(std::vector<gint64> &sorted, gdouble p) {
+    return sorted[MIN(sorted.size() - 1, (gsize) (p * (sorted.size() - 1) + 0.5))];
+}
+
+/* p50/p90/p99/max ms since viewer creation of every milestone, over all recorded viewers */
+static void print_join_percentiles(void) {
+    std::lock_guard<std::mutex> guard(join_stats_lock);
+    g_print("Join timeline over %u viewers, ms since viewer created (reached p50 p90 p99 max):\n", joins_recorded);
+    for (int milestone = 0; milestone < JOIN_MILESTONE_COUNT; milestone++) {
+        std::vector<gint64> sorted = join_stats[milestone];
+        if (sorted.empty()) {
+            g_print("  %-18s 0\n", JOIN_MILESTONE_NAMES[milestone]);
+            continue;
+        }
+        std::sort(sorted.begin(), sorted.end());
+        g_print("  %-18s %" G_GUINT64_FORMAT " %.1f %.1f %.1f %.1f\n", JOIN_MILESTONE_NAMES[milestone],
+                join_stats_seen[milestone],
+                join_percentile(sorted, 0.5) / 1000.0, join_percentile(sorted, 0.9) / 1000.0,
+                join_percentile(sorted, 0.99) / 1000.0, sorted.back() / 1000.0);
+    }
+}
+
+/* Once per viewer, when it got its first keyframe or is removed before that */
+void WebrtcViewer::record_join_timeline(void) {
+    guint recorded;
+    if (timeline_recorded.exchange(true))
+        return;
+    g_print("Join timeline peer %s (ms):%s\n", peer_id.c_str(), timeline.describe().c_str());
+    {
+        std::lock_guard<std::mutex> guard(join_stats_lock);
+        for (int milestone = 0; milestone < JOIN_MILESTONE_COUNT; milestone++) {
+            if (!timeline.reached((JoinMilestone) milestone))
+                continue;
+            //Reservoir sampling, the percentiles stay unbiased with bounded memory
+            guint64 slot = join_stats_seen[milestone]++;
+            if (slot >= JOIN_MAX_SAMPLES)
+                slot = (guint64) (g_random_double() * join_stats_seen[milestone]);
+            if (slot < join_stats[milestone].size())
+                join_stats[milestone][slot] = timeline.offset((JoinMilestone) milestone);
+            else if (slot < JOIN_MAX_SAMPLES)
+                join_stats[milestone].push_back(timeline.offset((JoinMilestone) milestone));
+        }
+        recorded = ++joins_recorded;
+    }
+    if (recorded % JOIN_REPORT_EVERY == 0)
+        print_join_percentiles();
+}
+
 void WebrtcViewer::remove_webrtc_peer_from_pipelinehandler_map() {
-    auto it_pipeline = pipelineHandlers.find(pipeline_execution_id);
-    if (it_pipeline != pipelineHandlers.end()) {
-        auto it_peer = it_pipeline->second->peers.find(peer_id);
-        if (it_peer != it_pipeline->second->peers.end()) {
-            it_pipeline->second->peers.erase(it_peer);
+    RtspPipelineHandlerPtr handler;
+    {
+        std::lock_guard<std::mutex> guard(handlers_lock);
+        auto it_pipeline = pipelineHandlers.find(pipeline_execution_id);
+        if (it_pipeline != pipelineHandlers.end())
+            handler = it_pipeline->second;
+    }
+    if (handler) {
+        std::lock_guard<std::mutex> guard(handler->peers_lock);
+        auto it_peer = handler->peers.find(peer_id);
+        if (it_peer != handler->peers.end()) {
+            handler->peers.erase(it_peer);
             g_print("Deleted webrtc peer from map for peer %s\n", peer_id.c_str());
         }
     }
@@ -167,7 +900,7 @@ gboolean cleanup_and_quit_loop(const gchar *msg, enum AppState state, WebrtcView
             /* This will call us again */
             soup_websocket_connection_close(webrtcViewer->ws_conn, 1000, "");
         else
-            g_object_unref(webrtcViewer->ws_conn);
+            g_clear_object(&webrtcViewer->ws_conn);
     }
 
     /* To allow usage as a GSourceFunc */
@@ -272,16 +1005,11 @@ on_incoming_stream(GstElement *webrtc, GstPad *pad, GstElement *pipe) {
     gst_element_link(webrtc, decodebin);
 }
 
-void static send_ice_candidate_message(GstElement *webrtc G_GNUC_UNUSED, guint mlineindex,
-                                       gchar *candidate, WebrtcViewer *user_data G_GNUC_UNUSED) {
+/* {"ice": {"candidate": ..., "sdpMLineIndex": ...}} */
+static gchar *ice_candidate_message(guint mlineindex, const gchar *candidate) {
     gchar *text;
     JsonObject *ice, *msg;
 
-    if (user_data->app_state < PEER_CALL_NEGOTIATING) {
-        cleanup_and_quit_loop("Can't send ICE, not in call", APP_STATE_ERROR, user_data);
-        return;
-    }
-
     ice = json_object_new();
     json_object_set_string_member(ice, "candidate", candidate);
     json_object_set_int_member(ice, "sdpMLineIndex", mlineindex);
@@ -289,35 +1017,161 @@ void static send_ice_candidate_message(GstElement *webrtc G_GNUC_UNUSED, guint m
     json_object_set_object_member(msg, "ice", ice);
     text = get_string_from_json_object(msg);
     json_object_unref(msg);
+    return text;
+}
+
+/* {"sdp": {"type": ..., "sdp": ...}} */
+static gchar *sdp_message(const gchar *type, const gchar *sdp_text) {
+    gchar *text;
+    JsonObject *msg, *sdp;
+
+    sdp = json_object_new();
+    json_object_set_string_member(sdp, "type", type);
+    json_object_set_string_member(sdp, "sdp", sdp_text);
+    msg = json_object_new();
+    json_object_set_object_member(msg, "sdp", sdp);
+    text = get_string_from_json_object(msg);
+    json_object_unref(msg);
+    return text;
+}
+
+void static send_ice_candidate_message(GstElement *webrtc G_GNUC_UNUSED, guint mlineindex,
+                                       gchar *candidate, WebrtcViewer *user_data G_GNUC_UNUSED) {
+    gchar *text;
+
+    if (user_data->app_state < PEER_CALL_NEGOTIATING) {
+        cleanup_and_quit_loop("Can't send ICE, not in call", APP_STATE_ERROR, user_data);
+        return;
+    }
+
+    text = ice_candidate_message(mlineindex, candidate);
+    user_data->timeline.mark(JOIN_FIRST_CANDIDATE);
+    user_data->timeline.mark(JOIN_LAST_CANDIDATE);
 
-    soup_websocket_connection_send_text(user_data->ws_conn, text);
+    //Viewers of the benchmarks have no signalling connection
+    if (user_data->ws_conn)
+        soup_websocket_connection_send_text(user_data->ws_conn, text);
     g_free(text);
 }
 
 void static send_sdp_offer(GstWebRTCSessionDescription *offer, WebrtcViewer *webrtcViewer) {
-    gchar *text;
-    JsonObject *msg, *sdp;
+    gchar *text, *sdp_text;
 
     if (webrtcViewer->app_state < PEER_CALL_NEGOTIATING) {
         cleanup_and_quit_loop("Can't send offer, not in call", APP_STATE_ERROR, webrtcViewer);
         return;
     }
 
-    text = gst_sdp_message_as_text(offer->sdp);
-    g_print("Sending offer:\n%s\n", text);
+    sdp_text = gst_sdp_message_as_text(offer->sdp);
+    g_print("Sending offer:\n%s\n", sdp_text);
+    text = sdp_message("offer", sdp_text);
+    g_free(sdp_text);
 
-    sdp = json_object_new();
-    json_object_set_string_member(sdp, "type", "offer");
-    json_object_set_string_member(sdp, "sdp", text);
+    if (webrtcViewer->ws_conn)
+        soup_websocket_connection_send_text(webrtcViewer->ws_conn, text);
     g_free(text);
+    webrtcViewer->timeline.mark(JOIN_OFFER_SENT);
+}
 
-    msg = json_object_new();
-    json_object_set_object_member(msg, "sdp", sdp);
-    text = get_string_from_json_object(msg);
-    json_object_unref(msg);
+/* Browser compatible profile-level-id and level-asymmetry-allowed in the H264 fmtp of the first media */
+static void update_h264_fmtp(GstSDPMessage *sdp) {
+    const gchar *text_fmtp = gst_sdp_media_get_attribute_val(
+            (GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0), "fmtp");
+    if (text_fmtp != NULL && strstr(text_fmtp, "profile-level-id") != NULL) {
+        g_print("Found source fmtp attribute as:  %s\n", text_fmtp);
+        std::string delimiter = ";";
+        std::string fmtp_attr(text_fmtp);
+        fmtp_attr.append(LEVEL_ASYMMETRY_ALLOWED);
+        //Replacing profile-level-id
+        fmtp_attr = std::regex_replace(fmtp_attr, std::regex(PROFILE_LEVEL_ID_REGEX),
+                                       H264_BROWSER_PROFILE_LEVEL_ID);
+        g_print("Updated fmtp attribute as: %s\n", fmtp_attr.c_str());
+
+        guint attr_len = gst_sdp_media_attributes_len(
+                (GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0));
+        g_print("Attributes Length: %d\n", attr_len);
+        guint fmtp_index = 0;
+        for (guint index = 0; index < attr_len; index++) {
+            const GstSDPAttribute *gstSDPAttribute = gst_sdp_media_get_attribute(
+                    (GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0), index);
+            const gchar *attr_val = gstSDPAttribute->value;
+            if (attr_val != NULL && strstr(attr_val, "profile-level-id") != NULL) {
+                g_print("Found fmtp attribute at index: %d\n", index);
+                fmtp_index = index;
+            }
+        }
+        if (fmtp_index > 0) {
+            g_print("Replacing fmtp attribute at index: %d \n", fmtp_index);
+            gst_sdp_media_remove_attribute((GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0),
+                                           fmtp_index);
+            gst_sdp_media_add_attribute((GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0), "fmtp",
+                                        fmtp_attr.c_str());
+            //Frame rate hard code - Disabled
+            /*gst_sdp_media_add_attribute((GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0), "framerate", "29.985014985014985");*/
+        }
+    }
+}
 
-    soup_websocket_connection_send_text(webrtcViewer->ws_conn, text);
-    g_free(text);
+/* Negotiates generic NACK for the video payloads, the shared history answers it instead of RTX */
+static void add_nack_feedback(GstSDPMessage *sdp) {
+    GstSDPMedia *media = (GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0);
+    for (guint format = 0; format < gst_sdp_media_formats_len(media); format++) {
+        gint pt = atoi(gst_sdp_media_get_format(media, format));
+        gboolean video = FALSE, found = FALSE;
+        gchar *value;
+
+        //Not for the RTX, RED and ULPFEC payloads
+        for (const VideoCodecInfo &codec : VIDEO_CODECS)
+            video = video || codec.pt == pt;
+        if (!video)
+            continue;
+        value = g_strdup_printf("%d nack", pt);
+        for (guint index = 0; index < gst_sdp_media_attributes_len(media); index++) {
+            const GstSDPAttribute *attribute = gst_sdp_media_get_attribute(media, index);
+            found = found || (g_strcmp0(attribute->key, "rtcp-fb") == 0 && g_strcmp0(attribute->value, value) == 0);
+        }
+        if (!found)
+            gst_sdp_media_add_attribute(media, "rtcp-fb", value);
+        g_free(value);
+    }
+}
+
+/*
+ * Offers codec after the camera's one in the video media, for viewers that cannot decode the camera's
+ * codec. webrtcbin only offers the codec the payloader is linked with, so it is added to the SDP like the
+ * fmtp above. Returns its payload type, the table's one unless webrtcbin already took that.
+ */
+static gint add_fallback_codec(GstSDPMessage *sdp, gint codec) {
+    GstSDPMedia *media = (GstSDPMedia *) &g_array_index(sdp->medias, GstSDPMedia, 0);
+    gint pt;
+    gchar *value;
+
+    for (pt = VIDEO_CODECS[codec].pt; pt <= 127; pt++) {
+        gboolean taken = FALSE;
+        for (guint format = 0; format < gst_sdp_media_formats_len(media); format++)
+            taken = taken || atoi(gst_sdp_media_get_format(media, format)) == pt;
+        if (!taken)
+            break;
+    }
+    if (pt > 127)
+        return 0;
+
+    value = g_strdup_printf("%d", pt);
+    gst_sdp_media_add_format(media, value);
+    g_free(value);
+    value = g_strdup_printf("%d %s/90000", pt, VIDEO_CODECS[codec].encoding_name);
+    gst_sdp_media_add_attribute(media, "rtpmap", value);
+    g_free(value);
+    if (codec == CODEC_H264) {
+        std::string fmtp = std::to_string(pt) + " packetization-mode=1;" + H264_BROWSER_PROFILE_LEVEL_ID +
+                           LEVEL_ASYMMETRY_ALLOWED.substr(1);
+        gst_sdp_media_add_attribute(media, "fmtp", fmtp.c_str());
+    }
+    value = g_strdup_printf("%d nack pli", pt);
+    gst_sdp_media_add_attribute(media, "rtcp-fb", value);
+    g_free(value);
+    g_print("Offering %s as payload %d next to the camera's codec\n", VIDEO_CODECS[codec].encoding_name, pt);
+    return pt;
 }
 
 /* Offer created by our pipeline, to be sent to the peer */
@@ -333,45 +1187,13 @@ static void on_offer_created(GstPromise *promise, gpointer user_data) {
                       GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, NULL);
     gst_promise_unref(promise);
 
-
-    if (CHANGE_PROFILE_LEVEL_ID) {
-        const gchar *text_fmtp = gst_sdp_media_get_attribute_val(
-                (GstSDPMedia *) &g_array_index(offer->sdp->medias, GstSDPMedia, 0), "fmtp");
-        if (strstr(text_fmtp, "profile-level-id") != NULL) {
-            g_print("Found source fmtp attribute as:  %s\n", text_fmtp);
-            std::string delimiter = ";";
-            std::string fmtp_attr(text_fmtp);
-            fmtp_attr.append(LEVEL_ASYMMETRY_ALLOWED);
-            //Replacing profile-level-id
-            fmtp_attr = std::regex_replace(fmtp_attr, std::regex(PROFILE_LEVEL_ID_REGEX),
-                                           H264_BROWSER_PROFILE_LEVEL_ID);
-            printf("Updated fmtp attribute as: %s\n", fmtp_attr.c_str());
-
-            guint attr_len = gst_sdp_media_attributes_len(
-                    (GstSDPMedia *) &g_array_index(offer->sdp->medias, GstSDPMedia, 0));
-            printf("Attributes Length: %d\n", attr_len);
-            guint fmtp_index;
-            for (guint index = 0; index < attr_len; index++) {
-                const GstSDPAttribute *gstSDPAttribute = gst_sdp_media_get_attribute(
-                        (GstSDPMedia *) &g_array_index(offer->sdp->medias, GstSDPMedia, 0), index);
-                const gchar *attr_val = gstSDPAttribute->value;
-                if (attr_val != NULL && strstr(attr_val, "profile-level-id") != NULL) {
-                    printf("Found fmtp attribute at index: %d\n", index);
-                    fmtp_index = index;
-                }
-            }
-            if (fmtp_index > 0) {
-                printf("Replacing fmtp attribute at index: %d \n", fmtp_index);
-                gst_sdp_media_remove_attribute((GstSDPMedia *) &g_array_index(offer->sdp->medias, GstSDPMedia, 0),
-                                               fmtp_index);
-                gst_sdp_media_add_attribute((GstSDPMedia *) &g_array_index(offer->sdp->medias, GstSDPMedia, 0), "fmtp",
-                                            fmtp_attr.c_str());
-                //Frame rate hard code - Disabled
-                /*gst_sdp_media_add_attribute((GstSDPMedia *) &g_array_index(offer->sdp->medias, GstSDPMedia, 0), "framerate", "29.985014985014985");*/
-            }
-        }
-    }
-
+    if (CHANGE_PROFILE_LEVEL_ID && webrtcViewer->video_codec == CODEC_H264)
+        update_h264_fmtp(offer->sdp);
+    //Not once the viewer is on the fallback, a renegotiation then offers that alone
+    if (FALLBACK_CODEC >= 0 && FALLBACK_CODEC != webrtcViewer->video_codec)
+        webrtcViewer->fallback_pt = add_fallback_codec(offer->sdp, FALLBACK_CODEC);
+    if (RTX_MODE == RTX_SHARED)
+        add_nack_feedback(offer->sdp);
 
     promise = gst_promise_new();
     g_signal_emit_by_name(webrtcViewer->webrtc1, "set-local-description", offer, promise);
@@ -386,6 +1208,7 @@ static void on_offer_created(GstPromise *promise, gpointer user_data) {
 void static on_negotiation_needed(GstElement *element, WebrtcViewer *user_data) {
     GstPromise *promise;
     WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    webrtcViewer->timeline.mark(JOIN_NEGOTIATION_NEEDED);
     webrtcViewer->app_state = PEER_CALL_NEGOTIATING;
     promise = gst_promise_new_with_change_func(on_offer_created, webrtcViewer, NULL);;
     g_signal_emit_by_name(webrtcViewer->webrtc1, "create-offer", NULL, promise);
@@ -425,20 +1248,1147 @@ connect_data_channel_signals(GObject *data_channel) {
                       NULL);
 }
 
-void WebrtcViewer::close_peer_from_server(void) {
-    g_print("Closing peer connection from server for: %s\n", peer_id.c_str());
-    if (session) {
-        g_print("Closing session for peer: %s\n", peer_id.c_str());
-        //soup_session_abort(session);
-        g_object_unref(session);
-    }
-    std::string message = "Pipeline closed due to source disconnection, please retry and connect again";
-    if (ws_conn) {
-        g_print("Closing websocket connection for peer: %s\n", peer_id.c_str());
-        if (soup_websocket_connection_get_state(ws_conn) == SOUP_WEBSOCKET_STATE_OPEN)
-            soup_websocket_connection_close(ws_conn, SOUP_WEBSOCKET_CLOSE_BAD_DATA, message.c_str());
-        g_object_unref(ws_conn);
-    }
+/* Unlinks a funnel sink pad of a viewer from its rendition tee and gives both request pads back,
+ * consumes the reference on pad */
+static void release_rendition_pad(GstPad *pad) {
+    GstPad *tee_pad = gst_pad_get_peer(pad);
+    GstElement *funnel = gst_pad_get_parent_element(pad);
+
+    if (tee_pad) {
+        GstElement *tee = gst_pad_get_parent_element(tee_pad);
+        gst_pad_unlink(tee_pad, pad);
+        if (tee) {
+            gst_element_release_request_pad(tee, tee_pad);
+            gst_object_unref(tee);
+        }
+        gst_object_unref(tee_pad);
+    }
+    if (funnel) {
+        gst_element_release_request_pad(funnel, pad);
+        gst_object_unref(funnel);
+    }
+    gst_object_unref(pad);
+}
+
+static GstPadProbeReturn drop_buffer_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    return GST_PAD_PROBE_DROP;
+}
+
+/* Holds back the pending rendition of a viewer until its first keyframe, which completes the switch */
+static GstPadProbeReturn rendition_keyframe_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    GstPad *previous;
+
+    if (GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER(info), GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_DROP;
+    {
+        std::lock_guard<std::mutex> guard(webrtcViewer->rendition_lock);
+        if (pad != webrtcViewer->pending_pad)
+            return GST_PAD_PROBE_DROP; //Superseded by a later switch, released by it
+        previous = webrtcViewer->rendition_pad;
+        webrtcViewer->rendition_pad = pad;
+        webrtcViewer->pending_pad = NULL;
+        webrtcViewer->rendition = webrtcViewer->pending_rendition;
+        webrtcViewer->pending_rendition = -1;
+        g_print("Switched peer %s to rendition %s at keyframe\n", webrtcViewer->peer_id.c_str(),
+                RENDITIONS[webrtcViewer->rendition].tee_name.c_str());
+    }
+    /* Nothing of the previous rendition may follow this keyframe. Its pads are released off the
+     * streaming thread, which must not take the locks of the other tee */
+    if (previous) {
+        gst_pad_add_probe(previous, GST_PAD_PROBE_TYPE_BUFFER, drop_buffer_probe, NULL, NULL);
+        std::thread(release_rendition_pad, previous).detach();
+    }
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/* Links the tee of a rendition to a new sink pad of the viewer's funnel and returns that pad. With
+ * at_keyframe its buffers are dropped until rendition_keyframe_probe() switches over */
+GstPad *WebrtcViewer::link_rendition(gint index, gboolean at_keyframe) {
+    GstElement *tee, *funnel;
+    GstPad *srcpad, *sinkpad;
+    gchar *tmp;
+
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), RENDITIONS[index].tee_name.c_str());
+    tmp = g_strdup_printf("funnel-%s", peer_id.c_str());
+    funnel = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    if (!tee || !funnel) {
+        g_printerr("No %s or funnel for peer %s\n", RENDITIONS[index].tee_name.c_str(), peer_id.c_str());
+        if (tee)
+            gst_object_unref(tee);
+        if (funnel)
+            gst_object_unref(funnel);
+        return NULL;
+    }
+
+    srcpad = gst_element_get_request_pad(tee, "src_%u");
+    sinkpad = gst_element_get_request_pad(funnel, "sink_%u");
+    if (at_keyframe)
+        gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, rendition_keyframe_probe, this, NULL);
+    if (gst_pad_link(srcpad, sinkpad) != GST_PAD_LINK_OK) {
+        g_printerr("Failed to link %s to peer %s\n", RENDITIONS[index].tee_name.c_str(), peer_id.c_str());
+        gst_element_release_request_pad(tee, srcpad);
+        gst_element_release_request_pad(funnel, sinkpad);
+        gst_object_unref(sinkpad);
+        sinkpad = NULL;
+    }
+    gst_object_unref(srcpad);
+    gst_object_unref(tee);
+    gst_object_unref(funnel);
+    return sinkpad;
+}
+
+/* Moves the viewer to another rendition at the next keyframe of that rendition, asking its encoder
+ * (or the camera) for one right away */
+gboolean WebrtcViewer::switch_rendition(gint index) {
+    GstPad *pad, *superseded;
+
+    if (index < 0 || index >= (gint) RENDITIONS.size() || RENDITIONS.size() < 2)
+        return FALSE;
+    {
+        std::lock_guard<std::mutex> guard(rendition_lock);
+        if (!rendition_pad || index == pending_rendition || (index == rendition && pending_rendition == -1))
+            return TRUE;
+        superseded = pending_pad;
+        pending_pad = NULL;
+        pending_rendition = -1;
+        if (index != rendition) {
+            pending_pad = link_rendition(index, TRUE);
+            if (pending_pad)
+                pending_rendition = index;
+        }
+        pad = pending_pad ? GST_PAD (gst_object_ref(pending_pad)) : NULL;
+    }
+    if (superseded) {
+        gst_pad_add_probe(superseded, GST_PAD_PROBE_TYPE_BUFFER, drop_buffer_probe, NULL, NULL);
+        release_rendition_pad(superseded);
+    }
+    if (!pad)
+        return index == rendition;
+    g_print("Switching peer %s to rendition %s at its next keyframe\n", peer_id.c_str(),
+            RENDITIONS[index].tee_name.c_str());
+    gst_pad_push_event(pad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                                 gst_structure_new("GstForceKeyUnit", "all-headers",
+                                                                   G_TYPE_BOOLEAN, TRUE, NULL)));
+    gst_object_unref(pad);
+    return TRUE;
+}
+
+void KeyframeArbiter::clear_frames(void) {
+    for (GstBuffer *frame : frames)
+        gst_buffer_unref(frame);
+    frames.clear();
+}
+
+/* Streaming thread of the tee sink pad */
+void KeyframeArbiter::on_buffer(GstPad *sinkpad, GstBuffer *buffer) {
+    gint64 now = g_get_monotonic_time();
+    gboolean forward = FALSE;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+            //Whoever asked gets this one
+            clear_frames();
+            keyframe_time = now;
+            forward_pending = FALSE;
+            if (KEYFRAME_CACHE_AGE > 0)
+                frames.push_back(gst_buffer_ref(buffer));
+        } else if (!frames.empty()) {
+            if (frames.size() <= KEYFRAME_REPLAY_FRAMES)
+                frames.push_back(gst_buffer_ref(buffer));
+            else
+                clear_frames();
+        }
+        if (forward_pending && now - last_forward >= (gint64) KEYFRAME_REQUEST_INTERVAL * 1000) {
+            forward_pending = FALSE;
+            last_forward = now;
+            forwarded++;
+            forward = TRUE;
+        }
+    }
+    if (forward)
+        gst_pad_push_event(sinkpad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                                         gst_structure_new("GstForceKeyUnit", "all-headers",
+                                                                           G_TYPE_BOOLEAN, TRUE, NULL)));
+}
+
+std::vector<GstBuffer *> KeyframeArbiter::on_request(gboolean replay) {
+    std::vector<GstBuffer *> replayed;
+    std::lock_guard<std::mutex> guard(lock);
+
+    requests++;
+    if (replay && !frames.empty() && g_get_monotonic_time() - keyframe_time <= (gint64) KEYFRAME_CACHE_AGE * 1000) {
+        served++;
+        for (GstBuffer *frame : frames)
+            replayed.push_back(gst_buffer_ref(frame));
+        return replayed;
+    }
+    //Sent with the next buffer the interval allows
+    forward_pending = TRUE;
+    return replayed;
+}
+
+static GstPadProbeReturn keyframe_cache_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    static_cast<KeyframeArbiter *>(user_data)->on_buffer(pad, GST_PAD_PROBE_INFO_BUFFER (info));
+    return GST_PAD_PROBE_OK;
+}
+
+static void free_keyframe_arbiter(gpointer data) {
+    delete static_cast<KeyframeArbiter *>(data);
+}
+
+/* Hands a PLI or FIR of the viewer to the arbiter of the tee it is fed from. During a rendition
+ * switch the keyframe has to come from the new rendition, so it is never replayed from the cache */
+void WebrtcViewer::request_keyframe(void) {
+    std::vector<GstBuffer *> frames;
+    KeyframeArbiter *arbiter;
+    GstElement *tee;
+    std::string tee_name;
+    gint index;
+    gboolean switching;
+    {
+        std::lock_guard<std::mutex> guard(rendition_lock);
+        switching = pending_rendition >= 0;
+        index = switching ? pending_rendition : rendition;
+    }
+
+    tee_name = transcoded ? std::string("transcodetee-") + VIDEO_CODECS[video_codec].name : RENDITIONS[index].tee_name;
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), tee_name.c_str());
+    if (!tee)
+        return;
+    arbiter = static_cast<KeyframeArbiter *>(g_object_get_data(G_OBJECT (tee), "keyframe-arbiter"));
+    if (arbiter)
+        frames = arbiter->on_request(!switching);
+    gst_object_unref(tee);
+    if (frames.empty())
+        return;
+
+    std::lock_guard<std::mutex> guard(rendition_lock);
+    for (GstBuffer *frame : keyframe_replay)
+        gst_buffer_unref(frame);
+    keyframe_replay = frames;
+}
+
+/* PLI and FIR leave webrtcbin as GstForceKeyUnit, they go to the arbiter instead of upstream. The ones the
+ * server raises itself on the viewer queue pass, they need a new keyframe */
+static GstPadProbeReturn keyframe_request_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    gboolean server = FALSE;
+
+    if (!gst_event_has_name(event, "GstForceKeyUnit"))
+        return GST_PAD_PROBE_OK;
+    if (gst_structure_get_boolean(gst_event_get_structure(event), "server-raised", &server) && server)
+        return GST_PAD_PROBE_OK;
+    static_cast<WebrtcViewer *>(user_data)->request_keyframe();
+    return GST_PAD_PROBE_DROP;
+}
+
+/*
+ * Sends the cached frames the arbiter answered with ahead of the next buffer of the viewer queue. The
+ * ones still queued behind that buffer follow anyway, so only older frames are replayed, restamped into
+ * the gap before it to keep the timestamps rising. They leave at the stream's own frame interval, on the
+ * streaming thread of the viewer queue, whose leaky queue keeps the videotee going meanwhile.
+ */
+static GstPadProbeReturn keyframe_replay_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstClockTime pts = GST_BUFFER_PTS (buffer);
+    std::vector<GstBuffer *> frames;
+    guint count = 0;
+
+    if (webrtcViewer->replaying)
+        return GST_PAD_PROBE_OK;
+    {
+        std::lock_guard<std::mutex> guard(webrtcViewer->rendition_lock);
+        frames.swap(webrtcViewer->keyframe_replay);
+    }
+    if (GST_CLOCK_TIME_IS_VALID (pts)) {
+        while (count < frames.size() && GST_BUFFER_PTS (frames[count]) < pts)
+            count++;
+    }
+    if (count > 0) {
+        GstClockTime start = webrtcViewer->last_pts;
+        if (!GST_CLOCK_TIME_IS_VALID (start) || start >= pts)
+            start = pts - MIN(pts, 40 * GST_MSECOND);
+        webrtcViewer->replaying = TRUE;
+        for (guint i = 0; i < count; i++) {
+            GstBuffer *out = gst_buffer_copy(frames[i]);
+            GST_BUFFER_PTS (out) = GST_BUFFER_DTS (out) = start + (pts - start) * (i + 1) / (count + 1);
+            GST_BUFFER_DURATION (out) = GST_CLOCK_TIME_NONE;
+            if (gst_pad_push(pad, out) != GST_FLOW_OK)
+                break;
+            GstClockTime next = i + 1 < count ? GST_BUFFER_PTS (frames[i + 1]) : pts;
+            if (GST_CLOCK_TIME_IS_VALID (next) && GST_CLOCK_TIME_IS_VALID (GST_BUFFER_PTS (frames[i])) &&
+                next > GST_BUFFER_PTS (frames[i]))
+                g_usleep(MIN(next - GST_BUFFER_PTS (frames[i]), KEYFRAME_REPLAY_GAP * GST_MSECOND) / GST_USECOND);
+        }
+        webrtcViewer->replaying = FALSE;
+        g_print("Answered keyframe request of peer %s with %u cached frames\n", webrtcViewer->peer_id.c_str(), count);
+    }
+    for (GstBuffer *frame : frames)
+        gst_buffer_unref(frame);
+    webrtcViewer->last_pts = pts;
+    return GST_PAD_PROBE_OK;
+}
+
+RtxStore::PayloadPtr RtxStore::share(GstBuffer *packet, gsize header_size, gint64 now) {
+    GstMemory *memory;
+    Key key;
+    PayloadPtr payload;
+    gsize size = gst_buffer_get_size(packet) - header_size;
+
+    //Only payloads starting in a memory of their own are shared, the header memory is per viewer
+    if (gst_buffer_n_memory(packet) < 2 || gst_buffer_get_sizes_range(packet, 0, 1, NULL, NULL) != header_size) {
+        payload = std::make_shared<Payload>();
+        payload->buffer = gst_buffer_copy_region(packet, GST_BUFFER_COPY_MEMORY, header_size, size);
+        return payload;
+    }
+    memory = gst_buffer_peek_memory(packet, 1);
+    key.parent = memory->parent ? memory->parent : memory;
+    key.offset = memory->offset;
+    key.size = size;
+
+    std::lock_guard<std::mutex> guard(lock);
+    while (!expiry.empty() && now - expiry.front().first > (gint64) RTX_HISTORY * 1000) {
+        auto it = payloads.find(expiry.front().second);
+        if (it != payloads.end() && it->second.first == expiry.front().first)
+            payloads.erase(it);
+        expiry.pop_front();
+    }
+    auto it = payloads.find(key);
+    if (it != payloads.end())
+        return it->second.second;
+    payload = std::make_shared<Payload>();
+    payload->buffer = gst_buffer_copy_region(packet, GST_BUFFER_COPY_MEMORY, header_size, size);
+    //The entry keeps the memory alive, so the key cannot be reused while it is here
+    payloads[key] = std::make_pair(now, payload);
+    expiry.emplace_back(now, key);
+    return payload;
+}
+
+static void free_rtx_store(gpointer data) {
+    delete static_cast<RtxStorePtr *>(data);
+}
+
+static void record_rtx_packet(WebrtcViewer *webrtcViewer, GstBuffer *packet, gint64 now) {
+    RtxRecord record;
+    gsize first = gst_buffer_get_sizes_range(packet, 0, 1, NULL, NULL);
+
+    if (GST_BUFFER_FLAG_IS_SET(packet, GST_RTP_BUFFER_FLAG_RETRANSMISSION) || gst_buffer_get_size(packet) < 12)
+        return;
+    record.time = now;
+    record.header_size = (guint8) (first >= 12 && first <= RTX_HEADER_SIZE ? first : 12);
+    gst_buffer_extract(packet, 0, record.header, record.header_size);
+    record.seq = (guint16) ((record.header[2] << 8) | record.header[3]);
+    record.payload = webrtcViewer->rtx_store->share(packet, record.header_size, now);
+
+    std::lock_guard<std::mutex> guard(webrtcViewer->rtx_lock);
+    webrtcViewer->rtx_history.push_back(std::move(record));
+    while (now - webrtcViewer->rtx_history.front().time > (gint64) RTX_HISTORY * 1000)
+        webrtcViewer->rtx_history.pop_front();
+}
+
+static gboolean record_rtx_list_packet(GstBuffer **buffer, guint idx, gpointer user_data) {
+    record_rtx_packet(static_cast<WebrtcViewer *>(user_data), *buffer, g_get_monotonic_time());
+    return TRUE;
+}
+
+/*
+ * Records the packets leaving the viewer's payloader and sends the NACKed ones ahead of them. NACKs arrive
+ * on the RTCP thread, the retransmissions go out on the streaming thread so they never race the
+ * payloader or wait on the RTP session from inside its RTCP handling.
+ */
+static GstPadProbeReturn rtx_packet_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    std::vector<GstBuffer *> resend;
+    gint64 now = g_get_monotonic_time();
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+        gst_buffer_list_foreach(GST_PAD_PROBE_INFO_BUFFER_LIST (info), record_rtx_list_packet, webrtcViewer);
+    else if (!GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER (info), GST_RTP_BUFFER_FLAG_RETRANSMISSION))
+        record_rtx_packet(webrtcViewer, GST_PAD_PROBE_INFO_BUFFER (info), now);
+    else
+        return GST_PAD_PROBE_OK;
+
+    {
+        std::lock_guard<std::mutex> guard(webrtcViewer->rtx_lock);
+        for (guint16 seq : webrtcViewer->rtx_requested) {
+            auto it = std::find_if(webrtcViewer->rtx_history.rbegin(), webrtcViewer->rtx_history.rend(),
+                                   [seq](const RtxRecord &record) { return record.seq == seq; });
+            if (it == webrtcViewer->rtx_history.rend()) {
+                webrtcViewer->rtx_missed++;
+                continue;
+            }
+            GstBuffer *packet = gst_buffer_new_allocate(NULL, it->header_size, NULL);
+            gst_buffer_fill(packet, 0, it->header, it->header_size);
+            gst_buffer_copy_into(packet, it->payload->buffer, GST_BUFFER_COPY_MEMORY, 0, -1);
+            GST_BUFFER_FLAG_SET(packet, GST_RTP_BUFFER_FLAG_RETRANSMISSION);
+            resend.push_back(packet);
+        }
+        webrtcViewer->rtx_requested.clear();
+        webrtcViewer->rtx_sent += resend.size();
+    }
+    for (GstBuffer *packet : resend)
+        gst_pad_push(pad, packet);
+    return GST_PAD_PROBE_OK;
+}
+
+/* rtpsession turns every NACKed sequence number into a GstRTPRetransmissionRequest upstream */
+static GstPadProbeReturn rtx_request_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+    guint seqnum;
+
+    if (!gst_event_has_name(event, "GstRTPRetransmissionRequest"))
+        return GST_PAD_PROBE_OK;
+    if (gst_structure_get_uint(gst_event_get_structure(event), "seqnum", &seqnum)) {
+        std::lock_guard<std::mutex> guard(webrtcViewer->rtx_lock);
+        if (std::find(webrtcViewer->rtx_requested.begin(), webrtcViewer->rtx_requested.end(), seqnum) ==
+            webrtcViewer->rtx_requested.end())
+            webrtcViewer->rtx_requested.push_back((guint16) seqnum);
+    }
+    return GST_PAD_PROBE_DROP;
+}
+
+/* Numeric stats field of any type as double, the types differ between GStreamer versions */
+static gboolean stats_number(const GstStructure *stats, const gchar *field, gdouble *number) {
+    const GValue *value = gst_structure_get_value(stats, field);
+    GValue converted = G_VALUE_INIT;
+
+    if (!value || !g_value_type_transformable(G_VALUE_TYPE (value), G_TYPE_DOUBLE))
+        return FALSE;
+    g_value_init(&converted, G_TYPE_DOUBLE);
+    g_value_transform(value, &converted);
+    *number = g_value_get_double(&converted);
+    g_value_unset(&converted);
+    return TRUE;
+}
+
+/* Sums the outbound RTP and remote inbound RTP stats of a "get-stats" reply, RTT and loss are the worst */
+static void read_feedback_stats(const GstStructure *reply, FeedbackStats *totals) {
+    //One structure per stats object, keyed by its id
+    for (gint i = 0; i < gst_structure_n_fields(reply); i++) {
+        const GValue *value = gst_structure_get_value(reply, gst_structure_nth_field_name(reply, i));
+        const GstStructure *stats;
+        GstWebRTCStatsType type;
+        gdouble number;
+
+        if (!GST_VALUE_HOLDS_STRUCTURE (value))
+            continue;
+        stats = gst_value_get_structure(value);
+        if (!gst_structure_get_enum(stats, "type", GST_TYPE_WEBRTC_STATS_TYPE, (gint *) &type))
+            continue;
+        if (type == GST_WEBRTC_STATS_OUTBOUND_RTP) {
+            if (stats_number(stats, "bytes-sent", &number))
+                totals->bytes_sent += number;
+            if (stats_number(stats, "packets-sent", &number))
+                totals->packets_sent += number;
+            if (stats_number(stats, "nack-count", &number))
+                totals->nack += number;
+            if (stats_number(stats, "pli-count", &number))
+                totals->pli += number;
+            if (stats_number(stats, "fir-count", &number))
+                totals->fir += number;
+        } else if (type == GST_WEBRTC_STATS_REMOTE_INBOUND_RTP) {
+            if (stats_number(stats, "packets-lost", &number))
+                totals->packets_lost += number;
+            if (stats_number(stats, "fraction-lost", &number))
+                totals->fraction_lost = MAX(totals->fraction_lost, number);
+            if (stats_number(stats, "round-trip-time", &number))
+                totals->rtt = MAX(totals->rtt, number);
+        }
+    }
+}
+
+void BandwidthEstimator::on_remb(gdouble kbps) {
+    std::lock_guard<std::mutex> guard(lock);
+    remb_kbps = kbps;
+    remb_updated = g_get_monotonic_time();
+}
+
+gdouble BandwidthEstimator::on_report(const FeedbackStats &stats, gdouble start_kbps, gdouble max_kbps) {
+    gint64 now = g_get_monotonic_time();
+    gdouble packets, reported;
+
+    //First report, or counters of a new session
+    if (!updated || stats.bytes_sent < previous.bytes_sent) {
+        estimate_kbps = start_kbps;
+        updated = now;
+        previous = stats;
+        return estimate_kbps;
+    }
+    sent_kbps = (stats.bytes_sent - previous.bytes_sent) * 8.0 / ((now - updated) / 1e3);
+    packets = stats.packets_sent - previous.packets_sent;
+    //The last receiver report stays in the stats, count its loss only once
+    reported = stats.packets_lost != previous.packets_lost ? stats.fraction_lost : 0;
+    loss = MAX(reported, packets > 0 ? MIN((stats.nack - previous.nack) / packets, 1.0) : 0);
+    rtt = stats.rtt;
+    if (rtt > 0 && (min_rtt == 0 || rtt < min_rtt))
+        min_rtt = rtt;
+
+    if (loss > 0.10)
+        estimate_kbps *= 1 - 0.5 * loss;
+    else if (loss < 0.02)
+        estimate_kbps *= 1.08;
+    //Queues building up on the path
+    if (min_rtt > 0 && rtt > 2 * min_rtt + 0.02 && sent_kbps > 0)
+        estimate_kbps = MIN(estimate_kbps, 0.85 * sent_kbps);
+    if (remb_updated && now - remb_updated < REMB_TIMEOUT * G_USEC_PER_SEC)
+        estimate_kbps = MIN(estimate_kbps, remb_kbps);
+    //Sending less than the estimate never proves it, keep the probing bounded
+    estimate_kbps = CLAMP(estimate_kbps, 50.0, max_kbps);
+
+    updated = now;
+    previous = stats;
+    return estimate_kbps;
+}
+
+/* kbps a rendition is assumed to take, the native stream counts as the expected ingest bitrate */
+static gdouble rendition_cost(gint index) {
+    return index == 0 ? INGEST_BITRATE : RENDITIONS[index].bitrate;
+}
+
+/*
+ * Moves the viewer to the best rendition the estimate allows: down at once when the current one no
+ * longer fits, up one rendition at a time once the estimate allowed it for the up delay. That delay
+ * doubles whenever a move up has to be undone within it. Below the cheapest rendition frames are
+ * thinned out, one level at a time, and restored before any move up. Called under bandwidth.lock.
+ */
+void WebrtcViewer::adapt_rendition(gdouble estimate_kbps) {
+    gint64 now = g_get_monotonic_time();
+    gdouble budget = estimate_kbps * ADAPT_HEADROOM;
+    gint current, target = -1, cheapest = 0, up = -1, next;
+    gint thinning_step = 0;
+    gboolean can_go_up;
+    {
+        std::lock_guard<std::mutex> guard(rendition_lock);
+        current = pending_rendition >= 0 ? pending_rendition : rendition;
+    }
+
+    for (gint index = 0; index < (gint) RENDITIONS.size(); index++) {
+        gdouble cost = rendition_cost(index);
+        if (cost < rendition_cost(cheapest))
+            cheapest = index;
+        if (cost <= budget && (target < 0 || cost > rendition_cost(target)))
+            target = index;
+        if (cost > rendition_cost(current) && (up < 0 || cost < rendition_cost(up)))
+            up = index;
+    }
+    if (target < 0)
+        target = cheapest;
+    if (adapt_thinning > THIN_NONE)
+        can_go_up = adapt_thinned_kbps[adapt_thinning - 1] <= budget;
+    else
+        can_go_up = up >= 0 && rendition_cost(up) <= budget;
+    if (!can_go_up)
+        adapt_up_since = 0;
+    else if (!adapt_up_since)
+        adapt_up_since = now;
+    if (now - adapt_switched < ADAPT_HOLD * G_USEC_PER_SEC)
+        return;
+
+    next = current;
+    if (rendition_cost(target) < rendition_cost(current)) {
+        next = target;
+    } else if (current == cheapest && bandwidth.sent_kbps > budget && adapt_thinning < THIN_KEYFRAMES) {
+        //The cheapest rendition is still too much, measured as sent since thinning changes its cost
+        thinning_step = 1;
+    } else if (adapt_up_since && now - adapt_up_since >= adapt_up_delay * G_USEC_PER_SEC) {
+        if (adapt_thinning > THIN_NONE)
+            thinning_step = -1;
+        else
+            next = up;
+    }
+    if (next == current && thinning_step == 0)
+        return;
+
+    if (rendition_cost(next) < rendition_cost(current) || thinning_step > 0) {
+        if (adapt_went_up && now - adapt_switched < adapt_up_delay * G_USEC_PER_SEC)
+            adapt_up_delay = MIN(adapt_up_delay * 2, ADAPT_MAX_UP_DELAY);
+        else
+            adapt_up_delay = ADAPT_UP_DELAY;
+        adapt_went_up = FALSE;
+    } else {
+        adapt_went_up = TRUE;
+    }
+    adapt_switched = now;
+    adapt_up_since = 0;
+
+    if (thinning_step) {
+        if (thinning_step > 0)
+            adapt_thinned_kbps[adapt_thinning] = bandwidth.sent_kbps;
+        adapt_thinning += thinning_step;
+        g_print("Viewer %s estimate %.0f kbps (sent %.0f kbps, loss %.1f%%, rtt %.0f ms, remb %.0f kbps), "
+                "thinning %s\n", peer_id.c_str(), estimate_kbps, bandwidth.sent_kbps, bandwidth.loss * 100,
+                bandwidth.rtt * 1e3, bandwidth.remb_kbps, THINNING_NAMES[adapt_thinning]);
+        apply_thinning();
+        return;
+    }
+    g_print("Viewer %s estimate %.0f kbps (sent %.0f kbps, loss %.1f%%, rtt %.0f ms, remb %.0f kbps), "
+            "rendition %d -> %d\n", peer_id.c_str(), estimate_kbps, bandwidth.sent_kbps, bandwidth.loss * 100,
+            bandwidth.rtt * 1e3, bandwidth.remb_kbps, RENDITIONS[current].height, RENDITIONS[next].height);
+    if (!switch_rendition(next))
+        adapt_switched = 0;
+}
+
+/* Thinning the viewer or the operator asks for, the controller may add to it */
+void WebrtcViewer::set_thinning(gint level) {
+    std::lock_guard<std::mutex> guard(bandwidth.lock);
+    requested_thinning = CLAMP(level, THIN_NONE, THIN_KEYFRAMES);
+    apply_thinning();
+}
+
+/* Called under bandwidth.lock. Lowering the level takes effect at the next keyframe, asked for here */
+void WebrtcViewer::apply_thinning(void) {
+    gint level = MAX(requested_thinning, adapt_thinning);
+    gint previous = thinning.exchange(level);
+    gchar *name;
+    GstElement *queue;
+
+    if (previous != THIN_KEYFRAMES || level == THIN_KEYFRAMES || !pipeline)
+        return;
+    name = g_strdup_printf("queue-%s", peer_id.c_str());
+    queue = gst_bin_get_by_name(GST_BIN (pipeline), name);
+    g_free(name);
+    if (!queue)
+        return;
+    GstPad *srcpad = gst_element_get_static_pad(queue, "src");
+    gst_pad_send_event(srcpad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                                    gst_structure_new("GstForceKeyUnit", "all-headers",
+                                                                      G_TYPE_BOOLEAN, TRUE, "server-raised",
+                                                                      G_TYPE_BOOLEAN, TRUE, NULL)));
+    gst_object_unref(srcpad);
+    gst_object_unref(queue);
+}
+
+/* Thins the frames between queue-<peer> and the payloader of the viewer. Raising the level applies at once,
+ * leaving keyframes only waits for a keyframe as the frames in between reference dropped ones */
+static GstPadProbeReturn thinning_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    gint level = webrtcViewer->thinning;
+    GstBuffer *buffer;
+    GstMapInfo map;
+    gint ref_idc;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+        if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            update_h264_framing(caps, &webrtcViewer->thinning_framing);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    if (webrtcViewer->overrun.exchange(false))
+        webrtcViewer->thinning_applied = THIN_KEYFRAMES;
+    if (!GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) || level > webrtcViewer->thinning_applied ||
+        webrtcViewer->thinning_applied == THIN_DISPOSABLE)
+        webrtcViewer->thinning_applied = level;
+    if (webrtcViewer->thinning_applied == THIN_NONE || !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_OK;
+    if (webrtcViewer->thinning_applied == THIN_KEYFRAMES)
+        return GST_PAD_PROBE_DROP;
+    //nal_ref_idc is H264's, the other codecs keep their non-reference frames
+    if (webrtcViewer->video_codec != CODEC_H264)
+        return GST_PAD_PROBE_OK;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_PAD_PROBE_OK;
+    ref_idc = h264_au_nal_ref_idc(map.data, map.size, webrtcViewer->thinning_framing);
+    gst_buffer_unmap(buffer, &map);
+    return ref_idc == 0 ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+/* The leaky queue-<peer> drops its oldest frames, the ones after them reference what was dropped */
+static void on_viewer_queue_overrun(GstElement *queue, gpointer user_data) {
+    static_cast<WebrtcViewer *>(user_data)->overrun = true;
+}
+
+/*
+ * Sizes the ULPFEC protection of the viewer from the loss and RTT of its last report. FEC recovers a
+ * packet without a round trip, so it pays off once loss is regular and NACK takes long: about three
+ * times the loss in protection, none at low loss, and none at short RTT unless the loss is high. More
+ * protection applies at once, less after FEC_HOLD. Called under bandwidth.lock.
+ */
+void WebrtcViewer::adapt_fec(gdouble loss, gdouble rtt) {
+    gint64 now = g_get_monotonic_time();
+    gint target = 0;
+    GstWebRTCRTPTransceiver *trans = NULL;
+
+    if (loss >= FEC_MIN_LOSS && (rtt >= FEC_NACK_RTT || loss >= FEC_HIGH_LOSS)) {
+        for (gint level : FEC_LEVELS) {
+            target = level;
+            if (level >= loss * 300)
+                break;
+        }
+    }
+    if (target < fec_percentage) {
+        if (!fec_lower_since)
+            fec_lower_since = now;
+        if (now - fec_lower_since < FEC_HOLD * G_USEC_PER_SEC)
+            return;
+    }
+    fec_lower_since = 0;
+    if (target == fec_percentage || !webrtc1)
+        return;
+
+    g_signal_emit_by_name(webrtc1, "get-transceiver", 0, &trans);
+    if (!trans)
+        return;
+    g_object_set(trans, "fec-percentage", (guint) target, NULL);
+    g_object_unref(trans);
+    g_print("Viewer %s FEC protection %d%% -> %d%% (loss %.1f%%, rtt %.0f ms)\n", peer_id.c_str(), fec_percentage,
+            target, loss * 100, rtt * 1e3);
+    fec_percentage = target;
+}
+
+/* REMB of the viewer, application layer feedback with the "REMB" identifier */
+static void on_feedback_rtcp(GObject *session, guint type, guint fbtype, guint sender_ssrc, guint media_ssrc,
+                             GstBuffer *fci, WebrtcViewer *webrtcViewer) {
+    GstMapInfo map;
+
+    if (type != GST_RTCP_TYPE_PSFB || fbtype != GST_RTCP_PSFB_TYPE_AFB || !fci ||
+        !gst_buffer_map(fci, &map, GST_MAP_READ))
+        return;
+    //"REMB", SSRC count, 6 bit exponent and 18 bit mantissa of the bitrate in bps
+    if (map.size >= 8 && memcmp(map.data, "REMB", 4) == 0) {
+        guint32 mantissa = ((map.data[5] & 0x3) << 16) | (map.data[6] << 8) | map.data[7];
+        webrtcViewer->bandwidth.on_remb(MIN (ldexp(mantissa, map.data[5] >> 2) / 1e3, REMB_MAX_KBPS));
+    }
+    gst_buffer_unmap(fci, &map);
+}
+
+gboolean Impairment::pass(gsize size) {
+    gint rate = kbps;
+    gdouble percent = loss;
+    gint64 now;
+    gdouble depth;
+
+    if (percent > 0 && g_random_double_range(0, 100) < percent)
+        return FALSE;
+    if (rate <= 0)
+        return TRUE;
+    std::lock_guard<std::mutex> guard(lock);
+    now = g_get_monotonic_time();
+    depth = MAX(rate / 8.0 * IMPAIR_BURST_MS, 6000.0);
+    tokens = updated ? MIN(tokens + (now - updated) * rate / 8e3, depth) : depth;
+    updated = now;
+    if (tokens < size)
+        return FALSE;
+    tokens -= size;
+    return TRUE;
+}
+
+/* Microseconds to hold a datagram so it leaves after the ones before it at the pacing rate */
+gint64 Pacer::wait(gsize size) {
+    gint rate = kbps;
+    gint64 now, delay;
+
+    if (rate <= 0)
+        return 0;
+    std::lock_guard<std::mutex> guard(lock);
+    now = g_get_monotonic_time();
+    packets++;
+    /* The viewer's streaming thread waits here, so it may fall at most PACING_MAX_DELAY behind the stream.
+     * Past that the datagram goes out unpaced instead of holding the queue in front, and the videotee */
+    if (next_send - now > PACING_MAX_DELAY * 1000)
+        return 0;
+    delay = MAX(next_send - now, 0);
+    next_send = now + delay + (gint64) (size * 8e3 / rate);
+    if (delay > 0) {
+        held++;
+        held_us += delay;
+        longest_us = MAX(longest_us, delay);
+    }
+    return delay;
+}
+
+static gboolean pace_list_buffer(GstBuffer **buffer, guint idx, gpointer user_data) {
+    gst_pad_chain(static_cast<GstPad *>(user_data), *buffer);
+    *buffer = NULL;
+    return TRUE;
+}
+
+/*
+ * Pacer at the nicesink of a viewer, ahead of the impairment stage. Holds the streaming thread of the
+ * viewer until the datagram's departure time. The payloader hands over the fragments of a NAL as one
+ * list, it is chained a datagram at a time. RTCP (payload type 200-204 in the clear header) is not held.
+ */
+static GstPadProbeReturn pacing_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    GstBuffer *buffer;
+    guint8 header[2];
+    gint64 delay;
+
+    if (!webrtcViewer->timeline.reached(JOIN_DTLS_CONNECTED) || webrtcViewer->pacer.kbps <= 0)
+        return GST_PAD_PROBE_OK;
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+        gst_buffer_list_foreach(list, pace_list_buffer, pad);
+        return GST_PAD_PROBE_DROP;
+    }
+    buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+    if (gst_buffer_extract(buffer, 0, header, 2) == 2 && header[1] >= 200 && header[1] <= 204)
+        return GST_PAD_PROBE_OK;
+    delay = webrtcViewer->pacer.wait(gst_buffer_get_size(buffer));
+    if (delay > 0)
+        g_usleep(delay);
+    return GST_PAD_PROBE_OK;
+}
+
+static gboolean impair_list_buffer(GstBuffer **buffer, guint idx, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    if (!webrtcViewer->impairment.pass(gst_buffer_get_size(*buffer))) {
+        gst_buffer_unref(*buffer);
+        *buffer = NULL;
+    }
+    return TRUE;
+}
+
+/* Impairment stage at the nicesink of a viewer, every buffer is one datagram */
+static GstPadProbeReturn impairment_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    GstBufferList *list;
+
+    if (!webrtcViewer->timeline.reached(JOIN_DTLS_CONNECTED))
+        return GST_PAD_PROBE_OK;
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+        gst_buffer_list_foreach(list, impair_list_buffer, webrtcViewer);
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+        return gst_buffer_list_length(list) ? GST_PAD_PROBE_OK : GST_PAD_PROBE_DROP;
+    }
+    if (webrtcViewer->impairment.pass(gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info))))
+        return GST_PAD_PROBE_OK;
+    return GST_PAD_PROBE_DROP;
+}
+
+/*
+ * Egress of the SRTP datagrams of all viewers. nicesink sends every datagram with its own sendmsg, here they
+ * are collected per viewer and flushed every EGRESS_TICK_MS from one thread, or as soon as a viewer has
+ * EGRESS_BATCH of them: a run of equally sized datagrams (the FU-A fragments of a frame) becomes one UDP GSO
+ * send where the kernel has UDP_SEGMENT, and all sends of a viewer go out in one sendmmsg. Only used on plain
+ * UDP pairs, relayed and TCP pairs stay with nicesink. The thread runs while viewers are attached.
+ */
+class BatchedEgress {
+
+public:
+    //Attributes
+    std::atomic<guint64> packets{0};
+    std::atomic<guint64> bytes{0};
+    std::atomic<guint64> syscalls{0};
+    std::atomic<guint64> dropped{0}; //Socket buffer full, as nicesink drops on a would block
+
+    //Methods
+    void start(void);
+
+    void attach(WebrtcViewer *viewer);
+
+    void detach(WebrtcViewer *viewer);
+
+    void queue(WebrtcViewer *viewer, GstBuffer *buffer);
+
+private:
+    std::mutex lock; //Guards pending, full and stopping, taken under a viewer's egress_lock
+    std::condition_variable wakeup;
+    std::map<WebrtcViewer *, std::vector<GstBuffer *>> pending;
+    gboolean full = FALSE; //A viewer reached EGRESS_BATCH
+    gboolean stopping = FALSE;
+    std::mutex flush_lock; //Held for a whole flush, a detached viewer is not in one after taking it
+    std::mutex thread_lock; //Serializes attach and detach
+    std::thread thread;
+    guint viewers = 0; //Attached, guarded by thread_lock
+    gboolean gso = FALSE; //Probed by start() before the first viewer attaches, then egress thread only
+
+    void run(void);
+
+    void flush(std::map<WebrtcViewer *, std::vector<GstBuffer *>> &flushed);
+
+    void send(GSocket *socket, const std::string &address, std::vector<GstBuffer *> &buffers);
+};
+
+static BatchedEgress batchedEgress;
+
+void BatchedEgress::start(void) {
+    gint fd = socket(AF_INET, SOCK_DGRAM, 0);
+    gint segment = 1200;
+
+    //Kernels before 4.18 reject the option
+    gso = fd >= 0 && setsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+    if (fd >= 0)
+        close(fd);
+    g_print("Batched egress every %d ms with sendmmsg, UDP GSO %s\n", EGRESS_TICK_MS,
+            gso ? "enabled" : "not supported by the kernel");
+}
+
+/* The first viewer starts the egress thread */
+void BatchedEgress::attach(WebrtcViewer *viewer) {
+    std::lock_guard<std::mutex> guard(thread_lock);
+    {
+        std::lock_guard<std::mutex> egress_guard(viewer->egress_lock);
+        if (viewer->egress_attached)
+            return;
+        viewer->egress_attached = TRUE;
+    }
+    if (viewers++ > 0)
+        return;
+    {
+        std::lock_guard<std::mutex> batch_guard(lock);
+        stopping = FALSE;
+    }
+    thread = std::thread(&BatchedEgress::run, this);
+}
+
+/*
+ * Drops the viewer's socket and queued datagrams before its agent closes the socket, whose fd may be reused
+ * right after. The last viewer stops and joins the egress thread.
+ */
+void BatchedEgress::detach(WebrtcViewer *viewer) {
+    std::lock_guard<std::mutex> guard(thread_lock);
+    {
+        std::lock_guard<std::mutex> egress_guard(viewer->egress_lock);
+        if (!viewer->egress_attached)
+            return;
+        viewer->egress_attached = FALSE;
+        if (viewer->egress_socket)
+            g_object_unref(viewer->egress_socket);
+        viewer->egress_socket = NULL;
+    }
+    {
+        std::lock_guard<std::mutex> flush_guard(flush_lock);
+        std::lock_guard<std::mutex> batch_guard(lock);
+        auto it = pending.find(viewer);
+        if (it != pending.end()) {
+            for (GstBuffer *buffer : it->second)
+                gst_buffer_unref(buffer);
+            pending.erase(it);
+        }
+    }
+    if (--viewers > 0)
+        return;
+    {
+        std::lock_guard<std::mutex> batch_guard(lock);
+        stopping = TRUE;
+    }
+    wakeup.notify_one();
+    thread.join();
+}
+
+void BatchedEgress::queue(WebrtcViewer *viewer, GstBuffer *buffer) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<GstBuffer *> &buffers = pending[viewer];
+    buffers.push_back(buffer);
+    if (buffers.size() == EGRESS_BATCH) {
+        full = TRUE;
+        wakeup.notify_one();
+    }
+}
+
+void BatchedEgress::run(void) {
+    std::map<WebrtcViewer *, std::vector<GstBuffer *>> flushed;
+
+    while (TRUE) {
+        std::lock_guard<std::mutex> flush_guard(flush_lock);
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wakeup.wait_for(guard, std::chrono::milliseconds(EGRESS_TICK_MS), [this] { return full || stopping; });
+            flushed.swap(pending);
+            full = FALSE;
+            if (stopping && flushed.empty())
+                break;
+        }
+        flush(flushed);
+    }
+}
+
+/* Sends the datagrams of every viewer on the socket of its selected pair, referenced under its egress_lock */
+void BatchedEgress::flush(std::map<WebrtcViewer *, std::vector<GstBuffer *>> &flushed) {
+    for (auto &it : flushed) {
+        WebrtcViewer *viewer = it.first;
+        std::lock_guard<std::mutex> guard(viewer->egress_lock);
+        //A socket libnice closed since is not written to, its fd may be reused already
+        if (!viewer->egress_socket || g_socket_is_closed(viewer->egress_socket)) {
+            dropped += it.second.size();
+            for (GstBuffer *buffer : it.second)
+                gst_buffer_unref(buffer);
+            continue;
+        }
+        GSocket *socket = G_SOCKET (g_object_ref(viewer->egress_socket));
+        send(socket, viewer->egress_address, it.second);
+        g_object_unref(socket);
+    }
+    flushed.clear();
+}
+
+void BatchedEgress::send(GSocket *socket, const std::string &address, std::vector<GstBuffer *> &buffers) {
+    gint fd = g_socket_get_fd(socket);
+    std::vector<GstMapInfo> maps(buffers.size());
+    std::vector<struct iovec> iov(buffers.size());
+    struct mmsghdr messages[EGRESS_BATCH];
+    gsize segments[EGRESS_BATCH];
+    union {
+        gchar buf[CMSG_SPACE(sizeof(guint16))];
+        struct cmsghdr align;
+    } control[EGRESS_BATCH];
+    gsize mapped = 0, next = 0;
+
+    for (; mapped < buffers.size() && gst_buffer_map(buffers[mapped], &maps[mapped], GST_MAP_READ); mapped++) {
+        iov[mapped].iov_base = maps[mapped].data;
+        iov[mapped].iov_len = maps[mapped].size;
+    }
+    while (next < mapped) {
+        gint count = 0;
+        gsize index = next, size = 0;
+
+        for (; count < EGRESS_BATCH && index < mapped; count++) {
+            struct msghdr &header = messages[count].msg_hdr;
+            gsize length = iov[index].iov_len;
+
+            //Every segment but the last has the size of the first
+            segments[count] = 1;
+            size = length;
+            while (gso && index + segments[count] < mapped && segments[count] < EGRESS_GSO_SEGMENTS &&
+                   iov[index + segments[count] - 1].iov_len == length &&
+                   iov[index + segments[count]].iov_len <= length && size + length <= 65000) {
+                size += iov[index + segments[count]].iov_len;
+                segments[count]++;
+            }
+            memset(&messages[count], 0, sizeof(messages[count]));
+            header.msg_name = (void *) address.data();
+            header.msg_namelen = (socklen_t) address.size();
+            header.msg_iov = &iov[index];
+            header.msg_iovlen = segments[count];
+            if (segments[count] > 1) {
+                header.msg_control = control[count].buf;
+                header.msg_controllen = sizeof(control[count].buf);
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(guint16));
+                *(guint16 *) CMSG_DATA(cmsg) = (guint16) length;
+            }
+            index += segments[count];
+        }
+
+        gint sent = sendmmsg(fd, messages, count, 0);
+        syscalls++;
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && gso && (errno == EIO || errno == EINVAL)) {
+            //No checksum offload on the route, every later flush goes without segmentation
+            g_printerr("UDP GSO send failed (%s), sending without it\n", g_strerror(errno));
+            gso = FALSE;
+            continue;
+        }
+        if (sent < 0) {
+            dropped += mapped - next;
+            break;
+        }
+        for (gint message = 0; message < sent; message++) {
+            for (gsize segment = 0; segment < segments[message]; segment++)
+                bytes += iov[next + segment].iov_len;
+            packets += segments[message];
+            next += segments[message];
+        }
+    }
+    dropped += buffers.size() - mapped;
+    for (gsize i = 0; i < buffers.size(); i++) {
+        if (i < mapped)
+            gst_buffer_unmap(buffers[i], &maps[i]);
+        gst_buffer_unref(buffers[i]);
+    }
+}
+
+/* Follows the selected pair of the viewer's agent, a plain UDP one is sent on by the batched egress */
+static void on_new_selected_pair(NiceAgent *agent, guint stream_id, guint component_id, NiceCandidate *local,
+                                 NiceCandidate *remote, gpointer data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(data);
+    GSocket *socket = NULL;
+    struct sockaddr_storage address;
+
+    if (component_id != NICE_COMPONENT_TYPE_RTP)
+        return;
+    if (local->transport == NICE_CANDIDATE_TRANSPORT_UDP && local->type != NICE_CANDIDATE_TYPE_RELAYED)
+        socket = nice_agent_get_selected_socket(agent, stream_id, component_id);
+    nice_address_copy_to_sockaddr(&remote->addr, (struct sockaddr *) &address);
+
+    std::lock_guard<std::mutex> guard(webrtcViewer->egress_lock);
+    //Detached viewers are on their way out, the agent closes its sockets
+    if (!webrtcViewer->egress_attached) {
+        if (socket)
+            g_object_unref(socket);
+        return;
+    }
+    if (webrtcViewer->egress_socket)
+        g_object_unref(webrtcViewer->egress_socket);
+    webrtcViewer->egress_socket = socket;
+    webrtcViewer->egress_address.assign((const gchar *) &address, address.ss_family == AF_INET6 ?
+                                                                  sizeof(struct sockaddr_in6) :
+                                                                  sizeof(struct sockaddr_in));
+    g_print("Viewer %s egress %s\n", webrtcViewer->peer_id.c_str(),
+            socket ? "batched" : "through nicesink, the selected pair is not plain UDP");
+}
+
+static gboolean egress_list_buffer(GstBuffer **buffer, guint idx, gpointer user_data) {
+    batchedEgress.queue(static_cast<WebrtcViewer *>(user_data), *buffer);
+    *buffer = NULL;
+    return TRUE;
+}
+
+/* Last probe at the nicesink of a viewer, hands its datagrams to the batched egress instead */
+static GstPadProbeReturn egress_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+
+    if (!webrtcViewer->timeline.reached(JOIN_DTLS_CONNECTED))
+        return GST_PAD_PROBE_OK;
+    std::lock_guard<std::mutex> guard(webrtcViewer->egress_lock);
+    if (!webrtcViewer->egress_socket)
+        return GST_PAD_PROBE_OK;
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        GstBufferList *list = gst_buffer_list_make_writable(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+        GST_PAD_PROBE_INFO_DATA(info) = list;
+        gst_buffer_list_foreach(list, egress_list_buffer, webrtcViewer);
+    } else {
+        batchedEgress.queue(webrtcViewer, gst_buffer_ref(GST_PAD_PROBE_INFO_BUFFER(info)));
+    }
+    return GST_PAD_PROBE_DROP;
+}
+
+static void on_webrtc_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer data) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+    NiceAgent *agent = NULL;
+    GstPad *sinkpad;
+
+    if (!factory || g_strcmp0(GST_OBJECT_NAME (factory), "nicesink") != 0)
+        return;
+    sinkpad = gst_element_get_static_pad(element, "sink");
+    if (PACING)
+        gst_pad_add_probe(sinkpad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          pacing_probe, data, NULL);
+    if (IMPAIR_KBPS > 0 || IMPAIR_LOSS > 0)
+        gst_pad_add_probe(sinkpad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          impairment_probe, data, NULL);
+    if (BATCHED_EGRESS) {
+        g_object_get(element, "agent", &agent, NULL);
+        if (agent) {
+            g_signal_connect(agent, "new-selected-pair-full", G_CALLBACK(on_new_selected_pair), data);
+            g_object_unref(agent);
+            gst_pad_add_probe(sinkpad,
+                              (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                              egress_probe, data, NULL);
+        }
+    }
+    gst_object_unref(sinkpad);
+}
+
+void WebrtcViewer::close_peer_from_server(void) {
+    g_print("Closing peer connection from server for: %s\n", peer_id.c_str());
+    /* The websocket and session belong to the main context of the launch thread, which closes and
+     * releases them once remove_peer_from_pipeline() quits its loop */
+    close_reason = "Pipeline closed due to source disconnection, please retry and connect again";
     remove_peer_from_pipeline();
     g_print("Closed peer connection from server for: %s\n", peer_id.c_str());
 }
@@ -446,12 +2396,19 @@ void WebrtcViewer::close_peer_from_server(void) {
 void WebrtcViewer::remove_peer_from_pipeline(void) {
     gchar *tmp;
     GstPad *srcpad, *sinkpad;
-    GstElement *webrtc, *rtph264pay, *queue, *tee;
+    GstElement *webrtc, *payloader, *rtpopuspay, *queue, *tee, *funnel;
 
-    if (webrtc1) {
-        gst_object_unref(webrtc1);
-    }
+    //Partial timeline of a viewer that never got to decode
+    record_join_timeline();
 
+    //Owned by the pipeline, gone with the removal below, the collector holds its own reference
+    {
+        std::lock_guard<std::mutex> guard(webrtc_lock);
+        webrtc1 = NULL;
+    }
+    //Before the agent closes the socket of the selected pair
+    if (BATCHED_EGRESS)
+        batchedEgress.detach(this);
     webrtc = gst_bin_get_by_name(GST_BIN (pipeline), this->peer_id.c_str());
     if (webrtc) {
         g_print("Removing existing webrtcbin for remote peer %s \n", this->peer_id.c_str());
@@ -460,13 +2417,13 @@ void WebrtcViewer::remove_peer_from_pipeline(void) {
         gst_object_unref(webrtc);
     }
 
-    tmp = g_strdup_printf("rtph264pay-%s", this->peer_id.c_str());
-    rtph264pay = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    tmp = g_strdup_printf("%s-%s", VIDEO_CODECS[video_codec].pay, this->peer_id.c_str());
+    payloader = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
     g_free(tmp);
-    if (rtph264pay) {
-        gst_element_set_state(rtph264pay, GST_STATE_NULL);
-        gst_bin_remove(GST_BIN(pipeline), rtph264pay);
-        gst_object_unref(rtph264pay);
+    if (payloader) {
+        gst_element_set_state(payloader, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN(pipeline), payloader);
+        gst_object_unref(payloader);
     }
 
     tmp = g_strdup_printf("queue-%s", this->peer_id.c_str());
@@ -485,23 +2442,373 @@ void WebrtcViewer::remove_peer_from_pipeline(void) {
         gst_bin_remove(GST_BIN (pipeline), queue);
         gst_object_unref(queue);
 
-        tee = gst_bin_get_by_name(GST_BIN (pipeline), "videotee");
-        if (tee) {
-            g_assert_nonnull (tee);
+        //Fed by the rendition funnel when a ladder is configured, released below
+        tee = gst_pad_get_parent_element(srcpad);
+        if (tee && GST_PAD_TEMPLATE_PRESENCE(GST_PAD_PAD_TEMPLATE(srcpad)) == GST_PAD_REQUEST)
+            gst_element_release_request_pad(tee, srcpad);
+        if (tee)
+            gst_object_unref(tee);
+        gst_object_unref(srcpad);
+    }
+    if (transcoded) {
+        release_transcode(pipeline, video_codec);
+        transcoded = FALSE;
+    }
+
+    tmp = g_strdup_printf("rtpopuspay-%s", this->peer_id.c_str());
+    rtpopuspay = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    if (rtpopuspay) {
+        gst_element_set_state(rtpopuspay, GST_STATE_NULL);
+        gst_bin_remove(GST_BIN (pipeline), rtpopuspay);
+        gst_object_unref(rtpopuspay);
+    }
+
+    tmp = g_strdup_printf("audioqueue-%s", this->peer_id.c_str());
+    queue = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    if (queue) {
+        gst_element_set_state(queue, GST_STATE_NULL);
+        sinkpad = gst_element_get_static_pad(queue, "sink");
+        srcpad = gst_pad_get_peer(sinkpad);
+        gst_object_unref(sinkpad);
+        gst_bin_remove(GST_BIN (pipeline), queue);
+        gst_object_unref(queue);
+        if (srcpad) {
+            tee = gst_pad_get_parent_element(srcpad);
             gst_element_release_request_pad(tee, srcpad);
-            gst_object_unref(srcpad);
             gst_object_unref(tee);
+            gst_object_unref(srcpad);
+        }
+    }
+
+    tmp = g_strdup_printf("funnel-%s", this->peer_id.c_str());
+    funnel = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    if (funnel) {
+        GstPad *pads[2];
+        {
+            std::lock_guard<std::mutex> guard(rendition_lock);
+            pads[0] = rendition_pad;
+            pads[1] = pending_pad;
+            rendition_pad = pending_pad = NULL;
+            pending_rendition = -1;
         }
+        gst_element_set_state(funnel, GST_STATE_NULL);
+        for (GstPad *pad : pads) {
+            if (pad)
+                release_rendition_pad(pad);
+        }
+        gst_bin_remove(GST_BIN (pipeline), funnel);
+        gst_object_unref(funnel);
     }
 
     if (loop) {
         g_main_quit(this->loop);
     }
 
+    if (rtx_store) {
+        std::lock_guard<std::mutex> guard(rtx_lock);
+        g_print("Peer %s retransmitted %" G_GUINT64_FORMAT " packets, %" G_GUINT64_FORMAT
+                " NACKed ones were out of the history\n", peer_id.c_str(), rtx_sent, rtx_missed);
+        rtx_history.clear();
+    }
+    if (PACING) {
+        std::lock_guard<std::mutex> guard(pacer.lock);
+        g_print("Peer %s paced %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " datagrams, %.1f ms on average, "
+                "%.1f ms at most\n", peer_id.c_str(), pacer.held, pacer.packets,
+                pacer.held ? pacer.held_us / 1e3 / pacer.held : 0.0, pacer.longest_us / 1e3);
+    }
     g_print("Removed webrtcbin peer for remote peer : %s\n", this->peer_id.c_str());
     remove_webrtc_peer_from_pipelinehandler_map();
 }
 
+static void on_ice_connection_state(GstElement *webrtc, GParamSpec *pspec, WebrtcViewer *webrtcViewer) {
+    GstWebRTCICEConnectionState state;
+    g_object_get(webrtc, "ice-connection-state", &state, NULL);
+    if (state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED || state == GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+        webrtcViewer->timeline.mark(JOIN_ICE_CONNECTED);
+}
+
+static void on_peer_connection_state(GstElement *webrtc, GParamSpec *pspec, WebrtcViewer *webrtcViewer) {
+    GstWebRTCPeerConnectionState state;
+    g_object_get(webrtc, "connection-state", &state, NULL);
+    if (state == GST_WEBRTC_PEER_CONNECTION_STATE_CONNECTED)
+        webrtcViewer->timeline.mark(JOIN_DTLS_CONNECTED);
+}
+
+/* First payloaded packet once DTLS is up, earlier ones are dropped by webrtcbin */
+static GstPadProbeReturn join_first_rtp_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    if (!webrtcViewer->timeline.reached(JOIN_DTLS_CONNECTED))
+        return GST_PAD_PROBE_OK;
+    webrtcViewer->timeline.mark(JOIN_FIRST_RTP);
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/* First keyframe entering the viewer branch once DTLS is up, the join is complete */
+static GstPadProbeReturn join_first_keyframe_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    if (!webrtcViewer->timeline.reached(JOIN_DTLS_CONNECTED) ||
+        GST_BUFFER_FLAG_IS_SET(GST_PAD_PROBE_INFO_BUFFER(info), GST_BUFFER_FLAG_DELTA_UNIT))
+        return GST_PAD_PROBE_OK;
+    webrtcViewer->timeline.mark(JOIN_FIRST_KEYFRAME);
+    webrtcViewer->record_join_timeline();
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/* Payloader of video_codec named after the viewer, rtph264pay-<peer> for the H264 of most cameras */
+GstElement *WebrtcViewer::create_video_payloader(gint pt) {
+    const VideoCodecInfo &codec = VIDEO_CODECS[video_codec];
+    GstElement *payloader;
+    GstCaps *caps;
+    GstPad *srcpad;
+    gchar *tmp;
+
+    tmp = g_strdup_printf("%s-%s", codec.pay, this->peer_id.c_str());
+    payloader = gst_element_factory_make(codec.pay, tmp);
+    g_free(tmp);
+    if (video_codec == CODEC_H264 || video_codec == CODEC_H265)
+        g_object_set(payloader, "config-interval", -1, NULL);
+    g_object_set(payloader, "pt", pt, NULL);
+    srcpad = gst_element_get_static_pad(payloader, "src");
+    caps = gst_caps_from_string(codec.rtp_caps);
+    gst_caps_set_simple(caps, "payload", G_TYPE_INT, pt, NULL);
+    gst_pad_set_caps(srcpad, caps);
+    gst_caps_unref(caps);
+    gst_object_unref(srcpad);
+    return payloader;
+}
+
+/* Join timeline and shared retransmission on the packets leaving the payloader */
+void WebrtcViewer::add_payloader_probes(GstElement *payloader) {
+    GstPad *srcpad = gst_element_get_static_pad(payloader, "src");
+
+    gst_pad_add_probe(srcpad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      join_first_rtp_probe, this, NULL);
+    if (rtx_store) {
+        gst_pad_add_probe(srcpad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          rtx_packet_probe, this, NULL);
+        gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, rtx_request_probe, this, NULL);
+    }
+    gst_object_unref(srcpad);
+}
+
+static std::mutex transcode_lock; //Viewers of one source may need the same transcode at once
+
+#define TRANSCODE_VIEWERS "transcode-viewers" //Object data of the transcode tee, guarded by transcode_lock
+
+/*
+ * Tee of the camera stream transcoded into codec, built by the first viewer that needs it and shared
+ * by all the others, so a codec costs one decode and one encode however many viewers need it. The
+ * queue drops instead of blocking the videotee when transcoding falls behind. Returns a reference
+ * and counts the caller as a viewer until release_transcode(), NULL when the transcode cannot be built.
+ */
+static GstElement *transcode_tee(GstElement *pipeline, gint codec) {
+    std::string tee_name = std::string("transcodetee-") + VIDEO_CODECS[codec].name;
+    GstElement *tee, *videotee, *transcode;
+    GstPad *srcpad, *sinkpad;
+    KeyframeArbiter *arbiter;
+    GError *error = NULL;
+    gchar *encoder;
+    std::string description;
+
+    std::lock_guard<std::mutex> guard(transcode_lock);
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), tee_name.c_str());
+    if (tee) {
+        gint viewers = GPOINTER_TO_INT (g_object_get_data(G_OBJECT (tee), TRANSCODE_VIEWERS));
+        g_object_set_data(G_OBJECT (tee), TRANSCODE_VIEWERS, GINT_TO_POINTER (viewers + 1));
+        return tee;
+    }
+
+    encoder = g_strdup_printf(VIDEO_CODECS[codec].encoder, LADDER_KEY_INT, TRANSCODE_BITRATE);
+    description = std::string("queue leaky=downstream max-size-buffers=0 max-size-bytes=0 "
+                              "max-size-time=1000000000 ! ") + VIDEO_CODECS[ingest_codec(pipeline)].decoder + " ! videoconvert ! " + encoder;
+    g_free(encoder);
+    transcode = gst_parse_bin_from_description(description.c_str(), TRUE, &error);
+    if (error) {
+        g_printerr("Cannot transcode %s to %s: %s\n", VIDEO_CODECS[ingest_codec(pipeline)].encoding_name,
+                   VIDEO_CODECS[codec].encoding_name, error->message);
+        g_error_free(error);
+        if (transcode)
+            gst_object_unref(transcode);
+        return NULL;
+    }
+    gst_element_set_name(transcode, (std::string("transcode-") + VIDEO_CODECS[codec].name).c_str());
+    tee = gst_element_factory_make("tee", tee_name.c_str());
+    g_object_set(tee, "allow-not-linked", TRUE, NULL);
+    g_object_set_data(G_OBJECT (tee), TRANSCODE_VIEWERS, GINT_TO_POINTER (1));
+    gst_bin_add_many(GST_BIN (pipeline), transcode, tee, NULL);
+    gst_element_link(transcode, tee);
+
+    //Keyframe requests of its viewers reach the encoder
+    arbiter = new KeyframeArbiter();
+    g_object_set_data_full(G_OBJECT (tee), "keyframe-arbiter", arbiter, free_keyframe_arbiter);
+    sinkpad = gst_element_get_static_pad(tee, "sink");
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_cache_probe, arbiter, NULL);
+    gst_object_unref(sinkpad);
+    gst_element_sync_state_with_parent(tee);
+    gst_element_sync_state_with_parent(transcode);
+
+    //Link videotee -> transcode once it is ready for buffers
+    videotee = gst_bin_get_by_name(GST_BIN (pipeline), "videotee");
+    srcpad = gst_element_get_request_pad(videotee, "src_%u");
+    sinkpad = gst_element_get_static_pad(transcode, "sink");
+    if (gst_pad_link(srcpad, sinkpad) != GST_PAD_LINK_OK)
+        g_printerr("Failed to link the %s transcode\n", VIDEO_CODECS[codec].encoding_name);
+    gst_object_unref(sinkpad);
+    gst_object_unref(srcpad);
+    gst_object_unref(videotee);
+    g_print("Transcoding %s to %s once for the viewers that need it\n",
+            VIDEO_CODECS[ingest_codec(pipeline)].encoding_name, VIDEO_CODECS[codec].encoding_name);
+    return GST_ELEMENT (gst_object_ref(tee));
+}
+
+/* Drops a viewer of the transcode into codec, the last one unlinks it from the videotee and removes it */
+static void release_transcode(GstElement *pipeline, gint codec) {
+    std::string tee_name = std::string("transcodetee-") + VIDEO_CODECS[codec].name;
+    std::string transcode_name = std::string("transcode-") + VIDEO_CODECS[codec].name;
+    GstElement *tee, *transcode, *videotee;
+    GstPad *srcpad, *sinkpad;
+    gint viewers;
+
+    std::lock_guard<std::mutex> guard(transcode_lock);
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), tee_name.c_str());
+    if (!tee)
+        return;
+    viewers = GPOINTER_TO_INT (g_object_get_data(G_OBJECT (tee), TRANSCODE_VIEWERS)) - 1;
+    g_object_set_data(G_OBJECT (tee), TRANSCODE_VIEWERS, GINT_TO_POINTER (viewers));
+    if (viewers > 0) {
+        gst_object_unref(tee);
+        return;
+    }
+
+    transcode = gst_bin_get_by_name(GST_BIN (pipeline), transcode_name.c_str());
+    g_assert_nonnull (transcode);
+    //Unlink videotee -> transcode first, no buffer reaches it while it shuts down
+    sinkpad = gst_element_get_static_pad(transcode, "sink");
+    srcpad = gst_pad_get_peer(sinkpad);
+    if (srcpad) {
+        gst_pad_unlink(srcpad, sinkpad);
+        videotee = gst_pad_get_parent_element(srcpad);
+        gst_element_release_request_pad(videotee, srcpad);
+        gst_object_unref(videotee);
+        gst_object_unref(srcpad);
+    }
+    gst_object_unref(sinkpad);
+
+    gst_element_set_state(transcode, GST_STATE_NULL);
+    gst_element_set_state(tee, GST_STATE_NULL);
+    gst_bin_remove_many(GST_BIN (pipeline), transcode, tee, NULL);
+    gst_object_unref(transcode);
+    gst_object_unref(tee);
+    g_print("Stopped the %s transcode, its last viewer left\n", VIDEO_CODECS[codec].encoding_name);
+}
+
+/*
+ * Moves the viewer from the videotee to the shared transcode into codec, for a viewer that answered with
+ * the fallback alone. Runs on the answer before DTLS is up, so none of the camera's stream was sent yet.
+ * The queue and its probes stay, the payloader is replaced on the same webrtcbin pad.
+ */
+gboolean WebrtcViewer::use_transcode(gint codec, gint pt) {
+    GstElement *queue, *payloader, *tee;
+    GstPad *srcpad, *sinkpad, *webrtcpad;
+    GstElement *parent;
+    gchar *tmp;
+    int ret;
+
+    //The ladder renditions are H264 already, a viewer without H264 gets the native stream or nothing
+    if (RENDITIONS.size() > 1) {
+        g_printerr("Viewer %s needs %s, transcoded viewers cannot use the rendition ladder\n", peer_id.c_str(),
+                   VIDEO_CODECS[codec].encoding_name);
+        return FALSE;
+    }
+    tee = transcode_tee(pipeline, codec);
+    if (!tee)
+        return FALSE;
+
+    tmp = g_strdup_printf("queue-%s", this->peer_id.c_str());
+    queue = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    tmp = g_strdup_printf("%s-%s", VIDEO_CODECS[video_codec].pay, this->peer_id.c_str());
+    payloader = gst_bin_get_by_name(GST_BIN (pipeline), tmp);
+    g_free(tmp);
+    g_assert_nonnull (queue);
+    g_assert_nonnull (payloader);
+    gst_element_set_state(queue, GST_STATE_NULL);
+    gst_element_set_state(payloader, GST_STATE_NULL);
+
+    //Unlink videotee -> queue
+    sinkpad = gst_element_get_static_pad(queue, "sink");
+    srcpad = gst_pad_get_peer(sinkpad);
+    g_assert_nonnull (srcpad);
+    gst_pad_unlink(srcpad, sinkpad);
+    parent = gst_pad_get_parent_element(srcpad);
+    gst_element_release_request_pad(parent, srcpad);
+    gst_object_unref(parent);
+    gst_object_unref(srcpad);
+
+    //Replace the payloader, the webrtcbin pad keeps its transceiver
+    srcpad = gst_element_get_static_pad(payloader, "src");
+    webrtcpad = gst_pad_get_peer(srcpad);
+    g_assert_nonnull (webrtcpad);
+    gst_object_unref(srcpad);
+    gst_bin_remove(GST_BIN (pipeline), payloader);
+    gst_object_unref(payloader);
+    video_codec = codec;
+    transcoded = TRUE;
+    payloader = create_video_payloader(pt);
+    gst_bin_add(GST_BIN (pipeline), payloader);
+    ret = gst_element_link(queue, payloader);
+    g_assert_true (ret);
+    srcpad = gst_element_get_static_pad(payloader, "src");
+    ret = gst_pad_link(srcpad, webrtcpad);
+    g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
+    gst_object_unref(srcpad);
+    gst_object_unref(webrtcpad);
+    add_payloader_probes(payloader);
+
+    //Link transcode tee -> queue
+    srcpad = gst_element_get_request_pad(tee, "src_%u");
+    ret = gst_pad_link(srcpad, sinkpad);
+    g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
+    gst_object_unref(srcpad);
+    gst_object_unref(sinkpad);
+    gst_object_unref(tee);
+
+    ret = gst_element_sync_state_with_parent(payloader);
+    g_assert_true (ret);
+    ret = gst_element_sync_state_with_parent(queue);
+    g_assert_true (ret);
+    gst_object_unref(queue);
+    g_print("Viewer %s cannot decode %s, sending it the %s transcode\n", peer_id.c_str(),
+            VIDEO_CODECS[ingest_codec(pipeline)].encoding_name, VIDEO_CODECS[codec].encoding_name);
+    return TRUE;
+}
+
+/* Keeps the camera's codec when the answer has it, else moves the viewer to the fallback it answered
+ * with. FALSE when the viewer took neither */
+gboolean WebrtcViewer::select_answered_codec(const GstSDPMessage *sdp) {
+    const GstSDPMedia *media = gst_sdp_message_medias_len(sdp) > 0 ? gst_sdp_message_get_media(sdp, 0) : NULL;
+    gboolean native = FALSE, fallback = FALSE;
+
+    if (!media || !fallback_pt || transcoded)
+        return TRUE;
+    for (guint format = 0; format < gst_sdp_media_formats_len(media); format++) {
+        gint pt = atoi(gst_sdp_media_get_format(media, format));
+        native = native || pt == VIDEO_CODECS[video_codec].pt;
+        fallback = fallback || pt == fallback_pt;
+    }
+    if (native)
+        return TRUE;
+    if (!fallback) {
+        g_printerr("Viewer %s answered with neither %s nor %s\n", peer_id.c_str(),
+                   VIDEO_CODECS[video_codec].encoding_name, VIDEO_CODECS[FALLBACK_CODEC].encoding_name);
+        return FALSE;
+    }
+    return use_transcode(FALLBACK_CODEC, fallback_pt);
+}
+
 gboolean WebrtcViewer::start_webrtcbin(void) {
 
     GstWebRTCRTPTransceiver *trans;
@@ -509,46 +2816,49 @@ gboolean WebrtcViewer::start_webrtcbin(void) {
 
     int ret;
     gchar *tmp;
-    GstElement *tee, *queue, *rtph264pay;
-    GstCaps *caps;
+    GstElement *tee, *queue, *payloader, *funnel = NULL, *audioqueue = NULL, *rtpopuspay = NULL;
     GstPad *srcpad, *sinkpad;
 
     //Create queue
     tmp = g_strdup_printf("queue-%s", this->peer_id.c_str());
     queue = gst_element_factory_make("queue", tmp);
-    //g_object_set(queue, "leaky", 2, NULL);
+    //A viewer that cannot keep up loses frames instead of blocking the tee of all the others
+    g_object_set(queue, "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time",
+                 (guint64) VIEWER_QUEUE_TIME * GST_MSECOND, NULL);
+    g_signal_connect (queue, "overrun", G_CALLBACK(on_viewer_queue_overrun), this);
     g_free(tmp);
 
-    //Create rtph264depay with caps
-    tmp = g_strdup_printf("rtph264pay-%s", this->peer_id.c_str());
-    rtph264pay = gst_element_factory_make("rtph264pay", tmp);
-    g_object_set(rtph264pay, "config-interval", -1, NULL);
-    g_object_set(rtph264pay, "pt", 96, NULL);
-    g_free(tmp);
-    srcpad = gst_element_get_static_pad(rtph264pay, "src");
-    caps = gst_caps_from_string(RTP_CAPS_H264);
-    gst_pad_set_caps(srcpad, caps);
-    gst_caps_unref(caps);
-    gst_object_unref(srcpad);
+    //The camera's codec as it is, viewers that cannot decode it answer with the fallback
+    video_codec = ingest_codec(pipeline);
+    payloader = create_video_payloader(VIDEO_CODECS[video_codec].pt);
 
     //Create webrtcbin
-    this->webrtc1 = gst_element_factory_make("webrtcbin", this->peer_id.c_str());
+    {
+        std::lock_guard<std::mutex> guard(webrtc_lock);
+        this->webrtc1 = gst_element_factory_make("webrtcbin", this->peer_id.c_str());
+    }
+    impairment.kbps = IMPAIR_KBPS;
+    impairment.loss = IMPAIR_LOSS;
+    if (IMPAIR_KBPS > 0 || IMPAIR_LOSS > 0 || PACING || BATCHED_EGRESS)
+        g_signal_connect (webrtc1, "deep-element-added", G_CALLBACK(on_webrtc_element_added), this);
+    if (BATCHED_EGRESS)
+        batchedEgress.attach(this);
 
     //Add elements to pipeline
-    gst_bin_add_many(GST_BIN (pipeline), queue, rtph264pay, this->webrtc1, NULL);
+    gst_bin_add_many(GST_BIN (pipeline), queue, payloader, this->webrtc1, NULL);
 
-    //Link queue -> rtph264depay
+    //Link queue -> payloader
     srcpad = gst_element_get_static_pad(queue, "src");
     g_assert_nonnull (srcpad);
-    sinkpad = gst_element_get_static_pad(rtph264pay, "sink");
+    sinkpad = gst_element_get_static_pad(payloader, "sink");
     g_assert_nonnull (sinkpad);
     ret = gst_pad_link(srcpad, sinkpad);
     g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
     gst_object_unref(srcpad);
     gst_object_unref(sinkpad);
 
-    //Link rtph264depay -> webrtcbin
-    srcpad = gst_element_get_static_pad(rtph264pay, "src");
+    //Link payloader -> webrtcbin
+    srcpad = gst_element_get_static_pad(payloader, "src");
     g_assert_nonnull (srcpad);
     sinkpad = gst_element_get_request_pad(this->webrtc1, "sink_%u");
     g_assert_nonnull (sinkpad);
@@ -557,20 +2867,110 @@ gboolean WebrtcViewer::start_webrtcbin(void) {
     gst_object_unref(srcpad);
     gst_object_unref(sinkpad);
 
-    //Link videotee -> queue
-    tee = gst_bin_get_by_name(GST_BIN (pipeline), "videotee");
-    g_assert_nonnull (tee);
-    srcpad = gst_element_get_request_pad(tee, "src_%u");
-    g_assert_nonnull (srcpad);
-    gst_object_unref(tee);
-    sinkpad = gst_element_get_static_pad(queue, "sink");
-    g_assert_nonnull (sinkpad);
-    ret = gst_pad_link(srcpad, sinkpad);
-    g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
+    //Link audiotee -> audioqueue -> rtpopuspay -> webrtcbin, second media after the video
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), "audiotee");
+    if (tee) {
+        sinkpad = gst_element_get_static_pad(tee, "sink");
+        if (gst_pad_is_linked(sinkpad)) {
+            tmp = g_strdup_printf("audioqueue-%s", this->peer_id.c_str());
+            audioqueue = gst_element_factory_make("queue", tmp);
+            //Every Opus packet decodes on its own, a stalled viewer loses audio instead of blocking the audiotee
+            g_object_set(audioqueue, "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time",
+                         (guint64) VIEWER_QUEUE_TIME * GST_MSECOND, NULL);
+            g_free(tmp);
+            tmp = g_strdup_printf("rtpopuspay-%s", this->peer_id.c_str());
+            rtpopuspay = gst_element_factory_make("rtpopuspay", tmp);
+            g_object_set(rtpopuspay, "pt", 111, NULL);
+            g_free(tmp);
+            gst_bin_add_many(GST_BIN (pipeline), audioqueue, rtpopuspay, NULL);
+            ret = gst_element_link(audioqueue, rtpopuspay);
+            g_assert_true (ret);
+            ret = gst_element_link_pads(rtpopuspay, "src", webrtc1, "sink_%u");
+            g_assert_true (ret);
+            ret = gst_element_link_pads(tee, "src_%u", audioqueue, "sink");
+            g_assert_true (ret);
+        }
+        gst_object_unref(sinkpad);
+        gst_object_unref(tee);
+    }
+
+    if (ADAPTIVE_RENDITIONS) {
+        //REMB reaches the internal RTP session of the video stream as feedback
+        GstElement *rtpbin = gst_bin_get_by_name(GST_BIN (webrtc1), "rtpbin");
+        GObject *session = NULL;
+        if (rtpbin) {
+            g_signal_emit_by_name(rtpbin, "get-internal-session", 0, &session);
+            gst_object_unref(rtpbin);
+        }
+        if (session) {
+            g_signal_connect (session, "on-feedback-rtcp", G_CALLBACK(on_feedback_rtcp), this);
+            g_object_unref(session);
+        } else {
+            g_print("No RTP session for REMB of peer %s, estimating from receiver reports\n", peer_id.c_str());
+        }
+    }
+
+    if (RENDITIONS.size() > 1) {
+        //Link the rendition tee -> funnel -> queue, switch_rendition() relinks the funnel at keyframes
+        tmp = g_strdup_printf("funnel-%s", this->peer_id.c_str());
+        funnel = gst_element_factory_make("funnel", tmp);
+        g_free(tmp);
+        gst_bin_add(GST_BIN (pipeline), funnel);
+        ret = gst_element_link(funnel, queue);
+        g_assert_true (ret);
+        {
+            std::lock_guard<std::mutex> guard(rendition_lock);
+            rendition = DEFAULT_RENDITION;
+            rendition_pad = link_rendition(rendition, FALSE);
+            g_assert_nonnull (rendition_pad);
+        }
+    } else {
+        //Link videotee -> queue
+        tee = gst_bin_get_by_name(GST_BIN (pipeline), "videotee");
+        g_assert_nonnull (tee);
+        srcpad = gst_element_get_request_pad(tee, "src_%u");
+        g_assert_nonnull (srcpad);
+        gst_object_unref(tee);
+        sinkpad = gst_element_get_static_pad(queue, "sink");
+        g_assert_nonnull (sinkpad);
+        ret = gst_pad_link(srcpad, sinkpad);
+        g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
+        gst_object_unref(srcpad);
+        gst_object_unref(sinkpad);
+    }
+
+    //Paced at the rate of the rendition it starts on until the first estimate
+    if (PACING)
+        pacer.kbps = (gint) (PACING_FACTOR * rendition_cost(rendition));
+
+    g_assert_nonnull (webrtc1);
+
+    //Keyframe requests, the replay goes ahead of the thinning
+    srcpad = gst_element_get_static_pad(queue, "src");
+    gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, keyframe_request_probe, this, NULL);
+    gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_replay_probe, this, NULL);
     gst_object_unref(srcpad);
+
+    //Frame thinning
+    thinning = THINNING;
+    requested_thinning = THINNING;
+    srcpad = gst_element_get_static_pad(queue, "src");
+    gst_pad_add_probe(srcpad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                      thinning_probe, this, NULL);
+    gst_object_unref(srcpad);
+
+    //Join timeline
+    sinkpad = gst_element_get_static_pad(queue, "sink");
+    gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER, join_first_keyframe_probe, this, NULL);
     gst_object_unref(sinkpad);
 
-    g_assert_nonnull (webrtc1);
+    //Retransmission from the shared history of the source
+    RtxStorePtr *store = static_cast<RtxStorePtr *>(g_object_get_data(G_OBJECT (pipeline), "rtx-store"));
+    if (RTX_MODE == RTX_SHARED && store)
+        rtx_store = *store;
+    add_payloader_probes(payloader);
+    g_signal_connect (webrtc1, "notify::ice-connection-state", G_CALLBACK(on_ice_connection_state), this);
+    g_signal_connect (webrtc1, "notify::connection-state", G_CALLBACK(on_peer_connection_state), this);
 
     /* This is the gstwebrtc entry point where we create the offer and so on. It
      * will be called when the pipeline goes to PLAYING. */
@@ -586,8 +2986,17 @@ gboolean WebrtcViewer::start_webrtcbin(void) {
     g_signal_emit_by_name(webrtc1, "get-transceivers", &transceivers);
     if (transceivers != NULL) {
         g_print("Changing webrtcbin to sendonly...\n");
+        //The audio transceiver, when there is one, is sendonly as well
+        for (guint index = 1; index < transceivers->len; index++)
+            g_array_index (transceivers, GstWebRTCRTPTransceiver *, index)->direction =
+                    GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY;
         trans = g_array_index (transceivers, GstWebRTCRTPTransceiver *, 0);
         trans->direction = GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY;
+        if (RTX_MODE == RTX_WEBRTCBIN)
+            g_object_set(trans, "do-nack", TRUE, NULL);
+        //Negotiated up front, the protection starts at 0% and follows the viewer's loss
+        if (ADAPTIVE_FEC)
+            g_object_set(trans, "fec-type", GST_WEBRTC_FEC_TYPE_ULP_RED, "fec-percentage", 0, NULL);
         g_object_unref(trans);
         g_array_unref(transceivers);
     }
@@ -601,16 +3010,28 @@ gboolean WebrtcViewer::start_webrtcbin(void) {
     /* Set to pipeline branch to PLAYING */
     ret = gst_element_sync_state_with_parent(queue);
     g_assert_true (ret);
-    ret = gst_element_sync_state_with_parent(rtph264pay);
+    ret = gst_element_sync_state_with_parent(payloader);
     g_assert_true (ret);
     ret = gst_element_sync_state_with_parent(webrtc1);
     g_assert_true (ret);
+    if (funnel) {
+        ret = gst_element_sync_state_with_parent(funnel);
+        g_assert_true (ret);
+    }
+    if (audioqueue) {
+        ret = gst_element_sync_state_with_parent(audioqueue);
+        g_assert_true (ret);
+        ret = gst_element_sync_state_with_parent(rtpopuspay);
+        g_assert_true (ret);
+    }
 
     return TRUE;
 
     err:
-    if (webrtc1)
+    {
+        std::lock_guard<std::mutex> guard(webrtc_lock);
         webrtc1 = NULL;
+    }
     return FALSE;
 }
 
@@ -665,6 +3086,10 @@ on_server_closed(SoupWebsocketConnection *conn G_GNUC_UNUSED,
     static_cast<WebrtcViewer *>(user_data)->remove_peer_from_pipeline();
 }
 
+static void on_answer_applied(GstPromise *promise, gpointer user_data) {
+    static_cast<WebrtcViewer *>(user_data)->timeline.mark(JOIN_ANSWER_APPLIED);
+}
+
 /* One mega message handler for our asynchronous calling mechanism */
 static void
 on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataType type,
@@ -696,6 +3121,7 @@ on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataType type,
             goto out;
         }
         webrtcViewer->app_state = SERVER_REGISTERED;
+        webrtcViewer->timeline.mark(JOIN_HELLO);
         g_print("Registered with server\n");
         /* Ask signalling server to connect us with a specific peer */
         if (!webrtcViewer->setup_call()) {
@@ -711,6 +3137,7 @@ on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataType type,
         }
 
         webrtcViewer->app_state = PEER_CONNECTED;
+        webrtcViewer->timeline.mark(JOIN_SESSION_OK);
         /* Start negotiation (exchange SDP and ICE candidates) */
         if (!webrtcViewer->start_webrtcbin())
             cleanup_and_quit_loop("ERROR: failed to start pipeline",
@@ -790,12 +3217,19 @@ on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataType type,
                                                         sdp);
             g_assert_nonnull (answer);
 
+            //Relinked before webrtcbin applies the answer, the viewer's caps then match it
+            if (!webrtcViewer->select_answered_codec(sdp)) {
+                gst_webrtc_session_description_free(answer);
+                cleanup_and_quit_loop("ERROR: viewer cannot decode any offered codec", PEER_CALL_ERROR, webrtcViewer);
+                g_object_unref(parser);
+                goto out;
+            }
+
             /* Set remote description on our pipeline */
             {
-                GstPromise *promise = gst_promise_new();
+                GstPromise *promise = gst_promise_new_with_change_func(on_answer_applied, webrtcViewer, NULL);
                 g_signal_emit_by_name(webrtcViewer->webrtc1, "set-remote-description", answer,
                                       promise);
-                gst_promise_interrupt(promise);
                 gst_promise_unref(promise);
             }
 
@@ -836,6 +3270,7 @@ on_server_connected(SoupSession *session, GAsyncResult *res,
     g_assert_nonnull (webrtcViewer->ws_conn);
 
     webrtcViewer->app_state = SERVER_CONNECTED;
+    webrtcViewer->timeline.mark(JOIN_WS_CONNECTED);
     g_print("Connected to signalling server\n");
 
     g_signal_connect (webrtcViewer->ws_conn, "closed", G_CALLBACK(on_server_closed), webrtcViewer);
@@ -869,6 +3304,7 @@ void WebrtcViewer::connect_to_websocket_server_async(void) {
     /* Once connected, we will register */
     soup_session_websocket_connect_async(session, message, NULL, NULL, NULL,
                                          (GAsyncReadyCallback) on_server_connected, this);
+    g_object_unref(message); //Queued by the session
     app_state = SERVER_CONNECTING;
 }
 
@@ -895,6 +3331,80 @@ check_plugins(void) {
     return ret;
 }
 
+/* Elements of the transcoding ladder, from gst-libav, x264 and the base plugins */
+static gboolean check_ladder_elements(void) {
+    const gchar *needed[] = {"avdec_h264", "x264enc", "videoscale", "videoconvert", "funnel", NULL};
+    gboolean ret = TRUE;
+
+    for (guint i = 0; needed[i]; i++) {
+        GstElementFactory *factory = gst_element_factory_find(needed[i]);
+        if (!factory) {
+            g_print("Element '%s' needed by --renditions not found\n", needed[i]);
+            ret = FALSE;
+            continue;
+        }
+        gst_object_unref(factory);
+    }
+    return ret;
+}
+
+/* "HEIGHT[:KBPS],..." of --renditions, appended to the native rendition */
+static gboolean parse_renditions(const gchar *arg) {
+    gchar **entries = g_strsplit(arg, ",", -1);
+    gboolean ret = TRUE;
+
+    for (gchar **entry = entries; *entry && ret; entry++) {
+        gchar *end;
+        gint64 height = g_ascii_strtoll(*entry, &end, 10);
+        gint64 bitrate = height * 3; //About 2 Mbit/s for 720p
+        if (*end == ':')
+            bitrate = g_ascii_strtoll(end + 1, &end, 10);
+        ret = *end == '\0' && height >= 16 && height <= 4320 && height % 2 == 0 && bitrate > 0;
+        for (const Rendition &rendition : RENDITIONS)
+            ret = ret && rendition.height != height;
+        if (ret)
+            RENDITIONS.push_back({(gint) height, (gint) bitrate, "videotee-" + std::to_string(height)});
+        else
+            g_printerr("Invalid rendition %s, expected an even unique HEIGHT[:KBPS]\n", *entry);
+    }
+    g_strfreev(entries);
+    return ret;
+}
+
+/* Index into RENDITIONS of a height, 0 is the native stream, -1 when there is no such rendition */
+static gint find_rendition(gint64 height) {
+    for (size_t index = 0; index < RENDITIONS.size(); index++) {
+        if (RENDITIONS[index].height == height)
+            return (gint) index;
+    }
+    return -1;
+}
+
+/*
+ * Decodes the camera stream once and encodes it once per rendition into its own tee, viewers are
+ * linked to one of those tees or the videotee itself. The queues drop instead of blocking the
+ * videotee when transcoding falls behind, the decoder recovers at the next keyframe.
+ */
+static std::string rendition_ladder_description(void) {
+    std::string description;
+
+    if (RENDITIONS.size() < 2)
+        return description;
+    description = "videotee. ! queue name=ladderqueue leaky=downstream max-size-buffers=0 max-size-bytes=0 "
+                  "max-size-time=1000000000 ! avdec_h264 name=ladderdecoder ! tee name=decodedtee ";
+    for (size_t index = 1; index < RENDITIONS.size(); index++) {
+        const Rendition &rendition = RENDITIONS[index];
+        std::string height = std::to_string(rendition.height);
+        description += "decodedtee. ! queue name=scalequeue-" + height + " leaky=downstream max-size-buffers=2 "
+                       "max-size-bytes=0 max-size-time=0 ! videoscale ! videoconvert ! video/x-raw,height=" + height +
+                       ",pixel-aspect-ratio=1/1 ! x264enc name=encoder-" + height + " tune=zerolatency "
+                       "speed-preset=ultrafast key-int-max=" + std::to_string(LADDER_KEY_INT) + " bitrate=" +
+                       std::to_string(rendition.bitrate) + " ! video/x-h264,profile=constrained-baseline ! "
+                       "tee name=" + rendition.tee_name + " allow-not-linked=TRUE ";
+    }
+    return description;
+}
+
 void handler(int sig) {
     void *array[10];
     size_t size;
@@ -908,23 +3418,108 @@ void handler(int sig) {
     exit(1);
 }
 
+static void free_viewer_ptr(gpointer data) {
+    delete static_cast<WebrtcViewerPtr *>(data);
+}
+
+static void on_adapt_stats(GstPromise *promise, gpointer data) {
+    WebrtcViewerPtr &viewer = *static_cast<WebrtcViewerPtr *>(data);
+    FeedbackStats stats;
+    gdouble max_kbps = 0;
+    gint current;
+
+    if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED || !gst_promise_get_reply(promise))
+        return;
+    read_feedback_stats(gst_promise_get_reply(promise), &stats);
+    for (size_t index = 0; index < RENDITIONS.size(); index++)
+        max_kbps = MAX(max_kbps, rendition_cost(index));
+    {
+        std::lock_guard<std::mutex> guard(viewer->rendition_lock);
+        current = viewer->rendition;
+    }
+    std::lock_guard<std::mutex> guard(viewer->bandwidth.lock);
+    gdouble estimate = viewer->bandwidth.on_report(stats, rendition_cost(current), 1.5 * max_kbps);
+    if (ADAPTIVE_RENDITIONS)
+        viewer->adapt_rendition(estimate);
+    if (ADAPTIVE_FEC)
+        viewer->adapt_fec(viewer->bandwidth.loss, viewer->bandwidth.rtt);
+    if (PACING) {
+        //Never below the rate of the rendition being sent, the backlog would only grow
+        gdouble floor_kbps;
+        {
+            std::lock_guard<std::mutex> rendition_guard(viewer->rendition_lock);
+            floor_kbps = rendition_cost(viewer->rendition);
+            if (viewer->pending_rendition >= 0)
+                floor_kbps = MAX(floor_kbps, rendition_cost(viewer->pending_rendition));
+        }
+        viewer->pacer.kbps = (gint) MAX(PACING_FACTOR * estimate, floor_kbps);
+    }
+}
+
+/* Asks the viewer's webrtcbin for its RTCP feedback every ADAPT_INTERVAL, on the launch thread */
+static gboolean adapt_rendition_timer(gpointer data) {
+    WebrtcViewerPtr &viewer = *static_cast<WebrtcViewerPtr *>(data);
+    GstPromise *promise;
+
+    if (viewer->app_state < PEER_CALL_STARTED || !viewer->webrtc1)
+        return G_SOURCE_CONTINUE;
+    promise = gst_promise_new_with_change_func(on_adapt_stats, new WebrtcViewerPtr(viewer), free_viewer_ptr);
+    g_signal_emit_by_name(viewer->webrtc1, "get-stats", NULL, promise);
+    gst_promise_unref(promise);
+    return G_SOURCE_CONTINUE;
+}
+
 class WebRTC_Launch_Task {
 public:
     void execute(WebrtcViewerPtr webrtcViewer) {
+        live_launch_tasks++;
         GMainContext *async_context = g_main_context_new();
         GMainLoop *loop = g_main_loop_new(async_context, FALSE);
+        GSource *adapt_timer = NULL;
         g_main_context_push_thread_default(async_context);
         webrtcViewer->disable_ssl = TRUE;
         webrtcViewer->loop = loop;
         g_print("WebRTC_Launch_Task:execute Creating webrtc bin for remote peer %s\n", webrtcViewer->peer_id.c_str());
         webrtcViewer->connect_to_websocket_server_async();
+        if (ADAPTIVE_RENDITIONS || ADAPTIVE_FEC || PACING) {
+            adapt_timer = g_timeout_source_new_seconds(ADAPT_INTERVAL);
+            g_source_set_callback(adapt_timer, adapt_rendition_timer, new WebrtcViewerPtr(webrtcViewer),
+                                  free_viewer_ptr);
+            g_source_attach(adapt_timer, async_context);
+        }
         g_main_loop_run(loop);
+        if (adapt_timer) {
+            g_source_destroy(adapt_timer);
+            g_source_unref(adapt_timer);
+        }
+        release_signalling(webrtcViewer.get(), async_context);
         g_main_context_pop_thread_default(async_context);
-        //g_main_loop_unref(loop); // As already quit is issued on this loop, no need to unref
+        //The loop keeps a reference on the context until the viewer is destroyed
         g_main_context_unref(async_context);
         g_print("WebRTC_Launch_Task:execute Exited for remote peer %s\n", webrtcViewer->peer_id.c_str());
+        live_launch_tasks--;
     }
 
+private:
+    void release_signalling(WebrtcViewer *webrtcViewer, GMainContext *async_context) {
+        //Cancels a connect still in flight, its callback runs with an error in the flush below
+        if (webrtcViewer->session)
+            soup_session_abort(webrtcViewer->session);
+        if (webrtcViewer->ws_conn) {
+            g_signal_handlers_disconnect_by_data(webrtcViewer->ws_conn, webrtcViewer);
+            if (soup_websocket_connection_get_state(webrtcViewer->ws_conn) == SOUP_WEBSOCKET_STATE_OPEN) {
+                if (webrtcViewer->close_reason.empty())
+                    soup_websocket_connection_close(webrtcViewer->ws_conn, SOUP_WEBSOCKET_CLOSE_NORMAL, NULL);
+                else
+                    soup_websocket_connection_close(webrtcViewer->ws_conn, SOUP_WEBSOCKET_CLOSE_BAD_DATA,
+                                                    webrtcViewer->close_reason.c_str());
+            }
+        }
+        //Flush the close frame
+        while (g_main_context_iteration(async_context, FALSE));
+        g_clear_object(&webrtcViewer->ws_conn);
+        g_clear_object(&webrtcViewer->session);
+    }
 };
 
 static int generate_random_int(void) {
@@ -1014,27 +3609,112 @@ static void start_recording_video(std::string file_path, GstElement *pipe1) {
     tee = gst_bin_get_by_name(GST_BIN (pipe1), "videotee");
     g_assert_nonnull (tee);
     srcpad = gst_element_get_request_pad(tee, "src_%u");
-    g_assert_nonnull (srcpad);
-    gst_object_unref(tee);
+    g_assert_nonnull (srcpad);
+    gst_object_unref(tee);
+    sinkpad = gst_element_get_static_pad(queue, "sink");
+    g_assert_nonnull (sinkpad);
+    ret = gst_pad_link(srcpad, sinkpad);
+    g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
+    gst_object_unref(srcpad);
+    gst_object_unref(sinkpad);
+
+    g_assert_nonnull (filesink);
+
+    ret = gst_element_sync_state_with_parent(queue);
+    g_assert_true (ret);
+    ret = gst_element_sync_state_with_parent(h264parse);
+    g_assert_true (ret);
+    ret = gst_element_sync_state_with_parent(mp4mux);
+    g_assert_true (ret);
+    ret = gst_element_sync_state_with_parent(filesink);
+    g_assert_true (ret);
+
+    g_print("Recording file to %s\n", file_path.c_str());
+}
+
+/* The Opus of the viewers goes into the recording too, no second encode. Added by link_audio_ingest() once the
+ * camera's audio is linked, before the first buffer, so mp4mux never waits on an audio track that stays empty */
+static void start_recording_audio(GstElement *pipeline) {
+    GstElement *tee, *mp4mux, *queue, *opusparse;
+    GstPad *srcpad, *sinkpad, *muxpad;
+    int ret;
+
+    mp4mux = gst_bin_get_by_name(GST_BIN (pipeline), "mp4mux-recorder");
+    if (!mp4mux)
+        return;
+    muxpad = gst_element_get_request_pad(mp4mux, "audio_%u");
+    gst_object_unref(mp4mux);
+    if (!muxpad) {
+        g_printerr("Recording without audio, the recorder has started\n");
+        return;
+    }
+    queue = gst_element_factory_make("queue", "queue-recorder-audio");
+    opusparse = gst_element_factory_make("opusparse", "opusparse-recorder");
+    gst_bin_add_many(GST_BIN (pipeline), queue, opusparse, NULL);
+    ret = gst_element_link(queue, opusparse);
+    g_assert_true (ret);
+    srcpad = gst_element_get_static_pad(opusparse, "src");
+    ret = gst_pad_link(srcpad, muxpad);
+    g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
+    gst_object_unref(srcpad);
+    gst_object_unref(muxpad);
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), "audiotee");
+    srcpad = gst_element_get_request_pad(tee, "src_%u");
     sinkpad = gst_element_get_static_pad(queue, "sink");
-    g_assert_nonnull (sinkpad);
     ret = gst_pad_link(srcpad, sinkpad);
     g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
     gst_object_unref(srcpad);
     gst_object_unref(sinkpad);
-
-    g_assert_nonnull (filesink);
-
+    gst_object_unref(tee);
     ret = gst_element_sync_state_with_parent(queue);
     g_assert_true (ret);
-    ret = gst_element_sync_state_with_parent(h264parse);
+    ret = gst_element_sync_state_with_parent(opusparse);
     g_assert_true (ret);
-    ret = gst_element_sync_state_with_parent(mp4mux);
+}
+
+/* Swaps the recorder's h264parse for the parser of the camera's codec, before the first buffer. mp4mux
+ * cannot carry VP8, its video pad is released and the recording keeps the audio alone */
+static void set_recorder_codec(GstElement *pipeline, gint codec) {
+    GstElement *queue, *parser, *mp4mux, *replacement;
+    GstPad *srcpad, *muxpad;
+    int ret;
+
+    if (codec == CODEC_H264)
+        return;
+    queue = gst_bin_get_by_name(GST_BIN (pipeline), "queue-recorder");
+    parser = gst_bin_get_by_name(GST_BIN (pipeline), "h264parse-recorder");
+    mp4mux = gst_bin_get_by_name(GST_BIN (pipeline), "mp4mux-recorder");
+    g_assert_nonnull (parser);
+    srcpad = gst_element_get_static_pad(parser, "src");
+    muxpad = gst_pad_get_peer(srcpad);
+    gst_object_unref(srcpad);
+    gst_element_set_state(parser, GST_STATE_NULL);
+    gst_bin_remove(GST_BIN (pipeline), parser);
+    gst_object_unref(parser);
+
+    if (VIDEO_CODECS[codec].record_parser) {
+        replacement = gst_element_factory_make(VIDEO_CODECS[codec].record_parser, "videoparse-recorder");
+        if (codec == CODEC_H265)
+            g_object_set(replacement, "config-interval", 1, NULL);
+        gst_bin_add(GST_BIN (pipeline), replacement);
+        srcpad = gst_element_get_static_pad(replacement, "src");
+        ret = gst_pad_link(srcpad, muxpad);
+        g_assert_cmpint (ret, ==, GST_PAD_LINK_OK);
+        gst_object_unref(srcpad);
+    } else {
+        g_print("mp4 cannot carry %s, recording without video\n", VIDEO_CODECS[codec].encoding_name);
+        gst_element_release_request_pad(mp4mux, muxpad);
+        replacement = gst_element_factory_make("fakesink", "videoparse-recorder");
+        g_object_set(replacement, "sync", FALSE, NULL);
+        gst_bin_add(GST_BIN (pipeline), replacement);
+    }
+    ret = gst_element_link(queue, replacement);
     g_assert_true (ret);
-    ret = gst_element_sync_state_with_parent(filesink);
+    ret = gst_element_sync_state_with_parent(replacement);
     g_assert_true (ret);
-
-    g_print("Recording file to %s\n", file_path.c_str());
+    gst_object_unref(muxpad);
+    gst_object_unref(mp4mux);
+    gst_object_unref(queue);
 }
 
 static gboolean check_rtsp_socket(std::string rtsp_url) {
@@ -1086,26 +3766,33 @@ static gboolean check_rtsp_socket(std::string rtsp_url) {
     return true;
 }
 
-static void pause_play_pipeline(gpointer data) {
-    RtspPipelineHandler *pipelineHandler = static_cast<RtspPipelineHandler *>(data);
-
-    if (pipelineHandler->pipelineState != PLAYING) {
-        return;
-    }
-    pipelineHandler->pipelineState = PAUSED;
+/* TRUE for the one caller that moves the pipeline off PLAYING and then restarts it */
+static gboolean claim_pipeline_restart(RtspPipelineHandler *pipelineHandler) {
+    PipelineState playing = PLAYING;
+    return pipelineHandler->pipelineState.compare_exchange_strong(playing, PAUSED);
+}
 
+static void restart_pipeline(RtspPipelineHandler *pipelineHandler) {
     if (pipelineHandler->stop_streaming()) {
         GstStateChangeReturn ret = gst_element_set_state(pipelineHandler->pipeline, GST_STATE_NULL);
         if (ret == GST_STATE_CHANGE_FAILURE) {
             g_printerr("pause_play_pipeline: Unable to set the pipeline to the NULL state.\n");
         }
     }
-    while (!check_rtsp_socket(pipelineHandler->rtsp_url)) {
+    while (INGEST_MODE == INGEST_RTSP && !check_rtsp_socket(pipelineHandler->rtsp_url) &&
+           (pipelineHandler->backup_rtsp_url.empty() || !check_rtsp_socket(pipelineHandler->backup_rtsp_url))) {
         std::this_thread::sleep_for(std::chrono::seconds(2));
     }
     pipelineHandler->start_streaming();
 }
 
+static void pause_play_pipeline(gpointer data) {
+    RtspPipelineHandler *pipelineHandler = static_cast<RtspPipelineHandler *>(data);
+
+    if (claim_pipeline_restart(pipelineHandler))
+        restart_pipeline(pipelineHandler);
+}
+
 static gboolean pipeline_bus_callback(GstBus *bus, GstMessage *message, gpointer data) {
     switch (GST_MESSAGE_TYPE (message)) {
         case GST_MESSAGE_ERROR: {
@@ -1113,6 +3800,21 @@ static gboolean pipeline_bus_callback(GstBus *bus, GstMessage *message, gpointer
             gchar *debug;
             gst_message_parse_error(message, &err, &debug);
             g_print("pipeline_bus_callback:GST_MESSAGE_ERROR Error/code : %s/%d\n", err->message, err->code);
+            if (static_cast<RtspPipelineHandler *>(data)->handle_source_error(message)) {
+                g_error_free(err);
+                g_free(debug);
+                break;
+            }
+            //The camera's stream does not fit the configuration, reconnecting would get the same stream
+            if (g_error_matches(err, GST_STREAM_ERROR, GST_STREAM_ERROR_CODEC_NOT_FOUND)) {
+                RtspPipelineHandler *pipelineHandler = static_cast<RtspPipelineHandler *>(data);
+                g_printerr("Source %s failed: %s\n", pipelineHandler->rtsp_url.c_str(), err->message);
+                pipelineHandler->pipelineState = PAUSED;
+                gst_element_set_state(pipelineHandler->pipeline, GST_STATE_NULL);
+                g_error_free(err);
+                g_free(debug);
+                return FALSE;
+            }
             if (err->code == 7) {
                 pause_play_pipeline(data);
                 g_error_free(err);
@@ -1123,17 +3825,860 @@ static gboolean pipeline_bus_callback(GstBus *bus, GstMessage *message, gpointer
             g_free(debug);
             break;
         }
-        case GST_MESSAGE_EOS: {
-            g_print("pipeline_bus_callback:GST_MESSAGE_EOS \n");
-            pause_play_pipeline(data);
-            return FALSE;
+        case GST_MESSAGE_EOS: {
+            g_print("pipeline_bus_callback:GST_MESSAGE_EOS \n");
+            //A paced or max speed replay plays the capture once, restarting would replay it forever
+            if (INGEST_MODE == INGEST_PCAP && PCAP_REPLAY_MODE != PCAP_REPLAY_LOOP) {
+                RtspPipelineHandler *pipelineHandler = static_cast<RtspPipelineHandler *>(data);
+                PipelineState playing = PLAYING;
+                if (pipelineHandler->pipelineState.compare_exchange_strong(playing, STOPPED))
+                    g_print("Capture %s replayed, not restarting the pipeline\n", PCAP_PATH.c_str());
+                return FALSE;
+            }
+            pause_play_pipeline(data);
+            return FALSE;
+        }
+        case GST_MESSAGE_APPLICATION: {
+            RtspPipelineHandler *pipelineHandler = static_cast<RtspPipelineHandler *>(data);
+            if (gst_message_has_name(message, "ingest-video-codec")) {
+                if (pipelineHandler->startup_peer_pending.exchange(false)) {
+                    add_webrtc_peer(pipelineHandler, PEER_ID);
+                    g_print("Video codec of the camera known, added peer %s\n", PEER_ID.c_str());
+                }
+                break;
+            }
+            if (!gst_message_has_name(message, "ingest-transport-fallback") || !claim_pipeline_restart(pipelineHandler))
+                break;
+            g_print("Reconnecting %s over TCP\n", pipelineHandler->rtsp_url.c_str());
+            pipelineHandler->force_tcp = TRUE;
+            pipelineHandler->force_tcp_time = g_get_monotonic_time();
+            //Posted from a streaming thread of the pipeline, which stopping it has to join
+            std::thread(restart_pipeline, pipelineHandler).detach();
+            break;
+        }
+        default: {
+            //g_print("pipeline_bus_callback:default Got %s message \n", GST_MESSAGE_TYPE_NAME (message));
+            break;
+        }
+    }
+    return TRUE;
+}
+
+static GstPadProbeReturn
+jitterbuffer_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    JitterBufferTuner *tuner = static_cast<JitterBufferTuner *>(user_data);
+
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+        if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gint clock_rate;
+            gst_event_parse_caps(event, &caps);
+            if (gst_structure_get_int(gst_caps_get_structure(caps, 0), "clock-rate", &clock_rate) &&
+                clock_rate > 0)
+                tuner->clock_rate = clock_rate;
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBufferList *list = NULL;
+    guint length = 1;
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+        length = gst_buffer_list_length(list);
+    }
+    for (guint index = 0; index < length; index++) {
+        GstBuffer *buffer = list ? gst_buffer_list_get(list, index) : GST_PAD_PROBE_INFO_BUFFER(info);
+        GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+        if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+            continue;
+        guint16 seq = gst_rtp_buffer_get_seq(&rtp);
+        guint32 rtp_ts = gst_rtp_buffer_get_timestamp(&rtp);
+        gst_rtp_buffer_unmap(&rtp);
+
+        //Network sources timestamp buffers on arrival, pcapparse with the capture time
+        GstClockTime arrival = GST_BUFFER_DTS_OR_PTS(buffer);
+        if (!GST_CLOCK_TIME_IS_VALID(arrival))
+            arrival = gst_util_get_timestamp();
+        tuner->on_rtp_packet(seq, rtp_ts, arrival, gst_buffer_get_size(buffer));
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+void JitterBufferTuner::attach(GstElement *element) {
+    GstPad *sinkpad;
+
+    jitterbuffer = element;
+    name = GST_ELEMENT_NAME(element);
+    g_object_get(jitterbuffer, "latency", &latency, NULL);
+    if (adaptive) {
+        latency = CLAMP(latency, min_latency, max_latency);
+        g_object_set(jitterbuffer, "latency", latency, NULL);
+    }
+
+    sinkpad = gst_element_get_static_pad(jitterbuffer, "sink");
+    g_assert_nonnull (sinkpad);
+    gst_pad_add_probe(sinkpad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST |
+                                                  GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                      jitterbuffer_sink_probe, this, NULL);
+    gst_object_unref(sinkpad);
+}
+
+void JitterBufferTuner::on_rtp_packet(guint16 seq, guint32 rtp_ts, GstClockTime arrival, gsize size) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!on_rtp_packet_locked(seq, rtp_ts, arrival, size))
+            return;
+    }
+    if (window_callback)
+        window_callback(this, window_callback_data);
+}
+
+gboolean JitterBufferTuner::on_rtp_packet_locked(guint16 seq, guint32 rtp_ts, GstClockTime arrival, gsize size) {
+    bytes_received += size;
+    if (!have_previous || arrival < window_start) {
+        have_previous = TRUE;
+        highest_seq = seq;
+        previous_arrival = arrival;
+        previous_rtp_ts = rtp_ts;
+        window_start = arrival;
+        return FALSE;
+    }
+
+    gint16 seq_delta = (gint16) (seq - highest_seq);
+    if (seq_delta > 0) {
+        gdouble arrival_delta_ms = (gdouble) (arrival - previous_arrival) / GST_MSECOND;
+        gdouble rtp_delta_ms = (gdouble) (gint32) (rtp_ts - previous_rtp_ts) * 1000.0 / clock_rate;
+        jitter_ms += (fabs(arrival_delta_ms - rtp_delta_ms) - jitter_ms) / 16.0;
+        mean_interarrival_ms += (arrival_delta_ms / seq_delta - mean_interarrival_ms) / 16.0;
+        highest_seq = seq;
+        previous_arrival = arrival;
+        previous_rtp_ts = rtp_ts;
+    } else if (seq_delta < 0) {
+        //How far behind the highest sequence number a packet arrives is the reorder depth
+        window_reorder_depth = std::max(window_reorder_depth, (guint) -seq_delta);
+    }
+
+    if (arrival - window_start < GST_SECOND)
+        return FALSE;
+    end_of_window(arrival);
+    return TRUE;
+}
+
+void JitterBufferTuner::end_of_window(GstClockTime now) {
+    GstStructure *stats = NULL;
+
+    g_object_get(jitterbuffer, "stats", &stats, NULL);
+    if (stats) {
+        gst_structure_get_uint64(stats, "num-pushed", &num_pushed);
+        gst_structure_get_uint64(stats, "num-lost", &num_lost);
+        gst_structure_get_uint64(stats, "num-late", &num_late);
+        gst_structure_free(stats);
+    }
+    guint64 window_lost = num_lost - previous_num_lost;
+    guint64 window_pushed = num_pushed - previous_num_pushed;
+    loss_fraction = window_lost + window_pushed > 0 ? (gdouble) window_lost / (window_lost + window_pushed) : 0;
+    previous_num_lost = num_lost;
+    previous_num_pushed = num_pushed;
+    reorder_depth = window_reorder_depth;
+    window_reorder_depth = 0;
+    window_start = now;
+
+    if (adaptive) {
+        /* Cover four times the smoothed jitter plus the time a reordered packet trails its
+         * successors, and grow further as long as packets still arrive too late */
+        gdouble target = 4 * jitter_ms + reorder_depth * mean_interarrival_ms + 10;
+        if (num_late > previous_num_late)
+            target = std::max(target, latency * 1.25);
+        guint target_latency = CLAMP((guint) target, min_latency, max_latency);
+        guint new_latency = latency;
+
+        if (target_latency >= latency) {
+            new_latency = target_latency;
+            shrink_windows = 0;
+        } else if (++shrink_windows >= 5) {
+            //Only shrink after 5 calm windows and then by 10% per window
+            new_latency = std::max(target_latency, latency - std::max(latency / 10, 1u));
+        }
+        if (new_latency != latency) {
+            g_print("JitterBufferTuner %s: latency %u -> %u ms (jitter %.2f ms, reorder depth %u, late %" G_GUINT64_FORMAT
+                    ", lost %" G_GUINT64_FORMAT ")\n",
+                    name.c_str(), latency, new_latency, jitter_ms, reorder_depth, num_late, num_lost);
+            latency = new_latency;
+            g_object_set(jitterbuffer, "latency", latency, NULL);
+        }
+    }
+    if (num_late > previous_num_late)
+        g_print("JitterBufferTuner %s: %" G_GUINT64_FORMAT " packets dropped as late at latency %u ms\n",
+                name.c_str(), num_late - previous_num_late, latency);
+    previous_num_late = num_late;
+}
+
+static void ingest_window_callback(JitterBufferTuner *tuner, gpointer data) {
+    static_cast<RtspPipelineHandler *>(data)->on_ingest_window(tuner);
+}
+
+static void on_rtpbin_new_jitterbuffer(GstElement *rtpbin, GstElement *jitterbuffer, guint session, guint ssrc,
+                                       gpointer data) {
+    g_print("New ingest jitterbuffer for session %u ssrc %u\n", session, ssrc);
+    static_cast<RtspPipelineHandler *>(data)->add_jitterbuffer_tuner(jitterbuffer);
+}
+
+static void on_rtspsrc_new_manager(GstElement *rtspsrc, GstElement *manager, gpointer data) {
+    g_signal_connect (manager, "new-jitterbuffer", G_CALLBACK(on_rtpbin_new_jitterbuffer), data);
+}
+
+void RtspPipelineHandler::add_jitterbuffer_tuner(GstElement *jitterbuffer) {
+    JitterBufferTunerPtr tuner = std::make_shared<JitterBufferTuner>();
+    tuner->adaptive = ADAPTIVE_JITTERBUFFER;
+    tuner->min_latency = JITTERBUFFER_MIN_LATENCY;
+    tuner->max_latency = JITTERBUFFER_MAX_LATENCY;
+    tuner->window_callback = ingest_window_callback;
+    tuner->window_callback_data = this;
+    tuner->attach(jitterbuffer);
+    {
+        std::lock_guard<std::mutex> guard(ingest_lock);
+        jitterbuffer_tuners.push_back(tuner);
+    }
+    g_print("Attached %s jitterbuffer tuner to %s with latency %u ms\n",
+            tuner->adaptive ? "adaptive" : "fixed", tuner->name.c_str(), tuner->latency);
+}
+
+/* Reads the kernel drop counter of /proc/net/udp{,6} for the socket with the given inode */
+static gboolean read_udp_socket_drops(unsigned long inode, guint64 *drops) {
+    const char *tables[] = {"/proc/net/udp", "/proc/net/udp6"};
+
+    for (const char *table : tables) {
+        std::ifstream file(table);
+        std::string line;
+        std::getline(file, line); //Header
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::vector<std::string> columns;
+            std::string column;
+            while (fields >> column)
+                columns.push_back(column);
+            //sl local rem st tx:rx tr:when retrnsmt uid timeout inode ref pointer drops
+            if (columns.size() < 13 || strtoul(columns[9].c_str(), NULL, 10) != inode)
+                continue;
+            *drops = strtoull(columns.back().c_str(), NULL, 10);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Socket receive buffer for the ingest, holding 500 ms at the expected peak bitrate so that a
+ * scheduling hiccup or an IDR burst on a high bitrate camera does not overflow it */
+static gint ingest_udp_buffer_size(void) {
+    if (UDP_BUFFER_SIZE > 0)
+        return UDP_BUFFER_SIZE;
+    return (gint) std::max<gint64>((gint64) INGEST_BITRATE * 1000 / 8 / 2, 524288);
+}
+
+static void check_udp_buffer_limit(void) {
+    std::ifstream file("/proc/sys/net/core/rmem_max");
+    gint64 rmem_max = 0;
+    if (!(file >> rmem_max))
+        return;
+    if (rmem_max < ingest_udp_buffer_size())
+        g_printerr("net.core.rmem_max is %" G_GINT64_FORMAT " bytes, ingest sockets will be capped below the "
+                   "requested %d bytes, raise it with: sysctl -w net.core.rmem_max=%d\n",
+                   rmem_max, ingest_udp_buffer_size(), ingest_udp_buffer_size());
+}
+
+static void on_deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer data) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+    if (factory && g_strcmp0(GST_OBJECT_NAME(factory), "udpsrc") == 0)
+        static_cast<RtspPipelineHandler *>(data)->add_ingest_udpsrc(element);
+}
+
+void RtspPipelineHandler::add_ingest_udpsrc(GstElement *udpsrc) {
+    std::lock_guard<std::mutex> guard(ingest_lock);
+    ingest_udpsrcs.push_back(GST_ELEMENT(gst_object_ref(udpsrc)));
+}
+
+guint64 RtspPipelineHandler::update_ingest_socket_drops(void) {
+    std::lock_guard<std::mutex> guard(ingest_lock);
+    gint64 now = g_get_monotonic_time();
+    guint64 total = 0;
+
+    if (now - last_socket_check < G_USEC_PER_SEC)
+        return 0;
+    last_socket_check = now;
+
+    for (GstElement *udpsrc : ingest_udpsrcs) {
+        GSocket *socket = NULL;
+        struct stat socket_stat;
+        guint64 drops;
+
+        g_object_get(udpsrc, "used-socket", &socket, NULL);
+        if (!socket)
+            continue;
+        if (fstat(g_socket_get_fd(socket), &socket_stat) == 0 && read_udp_socket_drops(socket_stat.st_ino, &drops))
+            total += drops;
+        g_object_unref(socket);
+    }
+
+    guint64 new_drops = total > ingest_socket_drops ? total - ingest_socket_drops : 0;
+    ingest_socket_drops = total;
+    if (new_drops > 0)
+        g_print("Ingest sockets of device %s dropped %" G_GUINT64_FORMAT " packets in the kernel (total %"
+                G_GUINT64_FORMAT ")\n", device_id.c_str(), new_drops, total);
+    return new_drops;
+}
+
+void RtspPipelineHandler::on_ingest_window(JitterBufferTuner *tuner) {
+    guint64 new_drops = update_ingest_socket_drops();
+
+    if (INGEST_MODE != INGEST_RTSP || RTSP_TRANSPORT != "auto" || force_tcp)
+        return;
+
+    if (tuner->loss_fraction * 100 > TRANSPORT_FALLBACK_LOSS || new_drops > 0)
+        lossy_windows++;
+    else
+        lossy_windows = 0;
+    if (lossy_windows < 3)
+        return;
+
+    g_print("Ingest of %s lossy for %u windows (%.2f%% lost), falling back to RTSP over TCP\n",
+            rtsp_url.c_str(), lossy_windows, tuner->loss_fraction * 100);
+    lossy_windows = 0;
+    //Restarted by the bus callback, like any other restart of the pipeline
+    gst_element_post_message(pipeline, gst_message_new_application(GST_OBJECT (pipeline),
+                                                                   gst_structure_new_empty(
+                                                                           "ingest-transport-fallback")));
+}
+
+std::string RtspPipelineHandler::rtsp_protocols(void) {
+    if (force_tcp && g_get_monotonic_time() - force_tcp_time > (gint64) TRANSPORT_FALLBACK_HOLD * G_USEC_PER_SEC) {
+        g_print("Ingest of %s over TCP for %d s, trying UDP again\n", rtsp_url.c_str(), TRANSPORT_FALLBACK_HOLD);
+        force_tcp = FALSE;
+    }
+    if (force_tcp || RTSP_TRANSPORT == "tcp")
+        return "tcp";
+    if (RTSP_TRANSPORT == "udp")
+        return "udp";
+    if (RTSP_TRANSPORT == "multicast")
+        return "udp-mcast";
+    //rtspsrc itself moves on to TCP when no UDP data arrives at all
+    return "udp+udp-mcast+tcp";
+}
+
+/* Depayloader of the camera's audio, Opus passes through and anything else becomes Opus once for all viewers */
+static const gchar *audio_ingest_description(const gchar *encoding) {
+    if (g_ascii_strcasecmp(encoding, "OPUS") == 0)
+        return "rtpopusdepay";
+    if (g_ascii_strcasecmp(encoding, "PCMU") == 0)
+        return "rtppcmudepay ! mulawdec ! " AUDIO_TRANSCODE;
+    if (g_ascii_strcasecmp(encoding, "PCMA") == 0)
+        return "rtppcmadepay ! alawdec ! " AUDIO_TRANSCODE;
+    if (g_ascii_strcasecmp(encoding, "MPEG4-GENERIC") == 0)
+        return "rtpmp4gdepay ! avdec_aac ! " AUDIO_TRANSCODE;
+    if (g_ascii_strcasecmp(encoding, "MP4A-LATM") == 0)
+        return "rtpmp4adepay ! avdec_aac_latm ! " AUDIO_TRANSCODE;
+    return NULL;
+}
+
+/* Links the audio stream of rtspsrc to the audiotee */
+static void link_audio_ingest(GstElement *pipeline, GstPad *pad, const gchar *encoding) {
+    GstElement *tee = NULL, *ingest;
+    GstPad *teepad = NULL, *sinkpad, *srcpad;
+    const gchar *description;
+    GError *error = NULL;
+    gboolean linked;
+
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), "audiotee");
+    teepad = gst_element_get_static_pad(tee, "sink");
+    if (gst_pad_is_linked(teepad))
+        goto done;
+    description = encoding ? audio_ingest_description(encoding) : NULL;
+    if (!description) {
+        g_print("Audio %s of the camera is not supported, video only\n", encoding ? encoding : "without encoding");
+        goto done;
+    }
+    ingest = gst_parse_bin_from_description(description, TRUE, &error);
+    if (error) {
+        g_printerr("Cannot ingest %s audio, video only: %s\n", encoding, error->message);
+        g_error_free(error);
+        goto done;
+    }
+    gst_element_set_name(ingest, "audioingest");
+    gst_bin_add(GST_BIN (pipeline), ingest);
+    sinkpad = gst_element_get_static_pad(ingest, "sink");
+    srcpad = gst_element_get_static_pad(ingest, "src");
+    linked = gst_pad_link(srcpad, teepad) == GST_PAD_LINK_OK && gst_pad_link(pad, sinkpad) == GST_PAD_LINK_OK;
+    gst_object_unref(sinkpad);
+    gst_object_unref(srcpad);
+    if (!linked) {
+        g_printerr("Failed to link the %s audio of the camera\n", encoding);
+        goto done;
+    }
+    start_recording_audio(pipeline);
+    gst_element_sync_state_with_parent(ingest);
+    g_print("Audio %s of the camera %s\n", encoding,
+            g_ascii_strcasecmp(encoding, "OPUS") == 0 ? "passed through" : "transcoded to Opus once");
+
+    done:
+    if (teepad)
+        gst_object_unref(teepad);
+    if (tee)
+        gst_object_unref(tee);
+}
+
+/* Links the video stream of rtspsrc to the videotee through the depayloader of its encoding-name, a stream
+ * that cannot be served fails the source with an error on the bus */
+static void link_video_ingest(GstElement *pipeline, GstElement *rtspsrc, GstPad *pad, const gchar *encoding) {
+    gint codec = video_codec_from_encoding(encoding);
+    GstElement *tee, *depay;
+    GstPad *teepad, *sinkpad, *srcpad;
+
+    tee = gst_bin_get_by_name(GST_BIN (pipeline), "videotee");
+    teepad = gst_element_get_static_pad(tee, "sink");
+    if (gst_pad_is_linked(teepad))
+        goto done;
+    if (codec < 0) {
+        GST_ELEMENT_ERROR (rtspsrc, STREAM, CODEC_NOT_FOUND,
+                           ("Video %s of the camera is not supported", encoding ? encoding : "without encoding"),
+                           (NULL));
+        goto done;
+    }
+    if (codec != CODEC_H264 && RENDITIONS.size() > 1) {
+        GST_ELEMENT_ERROR (rtspsrc, STREAM, CODEC_NOT_FOUND,
+                           ("The rendition ladder needs an H264 camera, the camera sends %s", encoding), (NULL));
+        goto done;
+    }
+    //Before the first buffer, the viewers joining from now on follow it
+    g_object_set_data(G_OBJECT (pipeline), "video-codec", GINT_TO_POINTER (codec));
+    set_recorder_codec(pipeline, codec);
+    //The bus callback adds the viewer start_streaming() held back for the codec
+    gst_element_post_message(pipeline, gst_message_new_application(GST_OBJECT (pipeline),
+                                                                   gst_structure_new_empty("ingest-video-codec")));
+
+    depay = gst_element_factory_make(VIDEO_CODECS[codec].depay, "rtspdepay");
+    gst_bin_add(GST_BIN (pipeline), depay);
+    sinkpad = gst_element_get_static_pad(depay, "sink");
+    srcpad = gst_element_get_static_pad(depay, "src");
+    if (gst_pad_link(srcpad, teepad) != GST_PAD_LINK_OK || gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK)
+        g_printerr("Failed to link the %s video of the camera\n", encoding);
+    gst_object_unref(sinkpad);
+    gst_object_unref(srcpad);
+    gst_element_sync_state_with_parent(depay);
+    g_print("Video %s of the camera passed through to the viewers\n", VIDEO_CODECS[codec].encoding_name);
+
+    done:
+    gst_object_unref(teepad);
+    gst_object_unref(tee);
+}
+
+/* Links the streams of rtspsrc by the encoding-name of their caps */
+static void on_rtspsrc_pad_added(GstElement *rtspsrc, GstPad *pad, gpointer user_data) {
+    GstElement *pipeline = GST_ELEMENT (user_data);
+    GstCaps *caps = gst_pad_get_current_caps(pad);
+    const GstStructure *structure;
+    const gchar *media, *encoding;
+
+    if (!caps)
+        return;
+    structure = gst_caps_get_structure(caps, 0);
+    media = gst_structure_get_string(structure, "media");
+    encoding = gst_structure_get_string(structure, "encoding-name");
+    if (g_strcmp0(media, "video") == 0)
+        link_video_ingest(pipeline, rtspsrc, pad, encoding);
+    else if (AUDIO && g_strcmp0(media, "audio") == 0)
+        link_audio_ingest(pipeline, pad, encoding);
+    gst_caps_unref(caps);
+}
+
+/* The recording only gets an audio track when link_audio_ingest() linked one */
+static void on_rtspsrc_no_more_pads(GstElement *rtspsrc, gpointer user_data) {
+    GstElement *tee = gst_bin_get_by_name(GST_BIN (user_data), "audiotee");
+    GstPad *teepad = gst_element_get_static_pad(tee, "sink");
+
+    if (!gst_pad_is_linked(teepad))
+        g_print("No audio stream from the camera, video only\n");
+    gst_object_unref(teepad);
+    gst_object_unref(tee);
+}
+
+std::string RtspPipelineHandler::rtsp_source_description(const std::string &name, const std::string &url,
+                                                         const std::string &depay_name) {
+    std::string description = string("rtspsrc name=") + name + " location=" + url +
+                              " latency=" + std::to_string(JITTERBUFFER_LATENCY) +
+                              " drop-on-latency=TRUE protocols=" + rtsp_protocols() +
+                              " udp-buffer-size=" + std::to_string(ingest_udp_buffer_size());
+    //Without a depay name the streams are linked by on_rtspsrc_pad_added() from their caps
+    if (!depay_name.empty())
+        description += " ! rtph264depay name=" + depay_name;
+    return description;
+}
+
+static GstPadProbeReturn
+source_branch_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    SourceBranch *branch = static_cast<SourceBranch *>(user_data);
+    RtspPipelineHandler *pipelineHandler = branch->handler;
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    branch->last_buffer_time = g_get_monotonic_time();
+    if (pipelineHandler->pending_branch == branch->index &&
+        !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+        //Switch before this keyframe is chained so that it is the first buffer forwarded
+        g_object_set(pipelineHandler->source_selector, "active-pad", pad, NULL);
+        pipelineHandler->active_branch = branch->index;
+        pipelineHandler->pending_branch = -1;
+        g_print("Switched device %s to source %s at keyframe\n", pipelineHandler->device_id.c_str(),
+                branch->url.c_str());
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void on_source_branch_pad_added(GstElement *rtspsrc, GstPad *pad, gpointer user_data) {
+    SourceBranch *branch = static_cast<SourceBranch *>(user_data);
+    GstElement *depay = gst_bin_get_by_name(GST_BIN (branch->handler->pipeline), branch->depay_name.c_str());
+    GstPad *sinkpad;
+
+    if (!depay)
+        return;
+    //gst_parse links the first pad only, relink after the branch was restarted
+    sinkpad = gst_element_get_static_pad(depay, "sink");
+    if (!gst_pad_is_linked(sinkpad) && gst_pad_link(pad, sinkpad) == GST_PAD_LINK_OK)
+        g_print("Relinked source %s\n", branch->url.c_str());
+    gst_object_unref(sinkpad);
+    gst_object_unref(depay);
+}
+
+void RtspPipelineHandler::setup_source_failover(void) {
+    guint generation = failover_generation;
+
+    source_branches[0].url = rtsp_url;
+    source_branches[0].source_name = "rtspsource";
+    source_branches[0].depay_name = "rtspdepay";
+    source_branches[1].url = backup_rtsp_url;
+    source_branches[1].source_name = "backupsource";
+    source_branches[1].depay_name = "backupdepay";
+
+    //Kept until stop_streaming(), the branch probes switch it from the streaming threads
+    source_selector = gst_bin_get_by_name(GST_BIN (pipeline), "sourceselector");
+
+    for (int index = 0; index < 2; index++) {
+        SourceBranch &branch = source_branches[index];
+        GstElement *depay, *rtspsrc;
+        GstPad *srcpad;
+
+        branch.handler = this;
+        branch.index = index;
+        branch.last_buffer_time = g_get_monotonic_time();
+        branch.restarting = false;
+        if (branch.selector_pad)
+            gst_object_unref(branch.selector_pad);
+
+        depay = gst_bin_get_by_name(GST_BIN (pipeline), branch.depay_name.c_str());
+        srcpad = gst_element_get_static_pad(depay, "src");
+        branch.selector_pad = gst_pad_get_peer(srcpad);
+        g_assert_nonnull (branch.selector_pad);
+        gst_pad_add_probe(branch.selector_pad, GST_PAD_PROBE_TYPE_BUFFER, source_branch_probe, &branch, NULL);
+        gst_object_unref(srcpad);
+        gst_object_unref(depay);
+
+        rtspsrc = gst_bin_get_by_name(GST_BIN (pipeline), branch.source_name.c_str());
+        g_signal_connect (rtspsrc, "new-manager", G_CALLBACK(on_rtspsrc_new_manager), this);
+        g_signal_connect (rtspsrc, "pad-added", G_CALLBACK(on_source_branch_pad_added), &branch);
+        gst_object_unref(rtspsrc);
+    }
+
+    active_branch = 0;
+    pending_branch = -1;
+    g_object_set(source_selector, "active-pad", source_branches[0].selector_pad, NULL);
+    std::thread(&RtspPipelineHandler::failover_watchdog, this, generation).detach();
+    g_print("Source failover enabled for %s with standby %s\n", rtsp_url.c_str(), backup_rtsp_url.c_str());
+}
+
+void RtspPipelineHandler::failover_watchdog(guint generation) {
+    while (generation == failover_generation) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (pipelineState != PLAYING)
+            continue;
+
+        gint64 now = g_get_monotonic_time();
+        gint64 timeout = (gint64) FAILOVER_TIMEOUT * 1000;
+        int active = active_branch;
+        int standby = 1 - active;
+        gboolean active_stalled = now - source_branches[active].last_buffer_time > timeout;
+        gboolean standby_alive = now - source_branches[standby].last_buffer_time <= timeout;
+
+        if (active_stalled && standby_alive && pending_branch != standby) {
+            g_print("No buffers from %s for %d ms, switching to %s at its next keyframe\n",
+                    source_branches[active].url.c_str(), FAILOVER_TIMEOUT, source_branches[standby].url.c_str());
+            pending_branch = standby;
+            //Ask the standby camera for a keyframe instead of waiting for the end of its GOP
+            gst_pad_push_event(source_branches[standby].selector_pad,
+                               gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                                    gst_structure_new("GstForceKeyUnit", "all-headers",
+                                                                      G_TYPE_BOOLEAN, TRUE, NULL)));
+        } else if (!active_stalled && pending_branch != -1) {
+            pending_branch = -1;
+        }
+    }
+}
+
+gboolean RtspPipelineHandler::handle_source_error(GstMessage *message) {
+    if (backup_rtsp_url.empty() || !pipeline)
+        return FALSE;
+
+    for (int index = 0; index < 2; index++) {
+        GstElement *source = gst_bin_get_by_name(GST_BIN (pipeline), source_branches[index].source_name.c_str());
+        if (!source)
+            continue;
+        gboolean from_branch = gst_object_has_as_ancestor(GST_MESSAGE_SRC(message), GST_OBJECT(source));
+        gst_object_unref(source);
+        if (!from_branch)
+            continue;
+
+        //With both sources gone fall back to restarting the whole pipeline
+        if (g_get_monotonic_time() - source_branches[1 - index].last_buffer_time > (gint64) FAILOVER_TIMEOUT * 1000)
+            return FALSE;
+        if (!source_branches[index].restarting.exchange(true))
+            std::thread(&RtspPipelineHandler::restart_source_branch, this, index, failover_generation.load()).detach();
+        return TRUE;
+    }
+    return FALSE;
+}
+
+void RtspPipelineHandler::restart_source_branch(int index, guint generation) {
+    SourceBranch &branch = source_branches[index];
+
+    g_print("Source %s failed, reconnecting it in standby\n", branch.url.c_str());
+    while (generation == failover_generation && !check_rtsp_socket(branch.url)) {
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+    }
+    if (generation == failover_generation) {
+        GstElement *source = gst_bin_get_by_name(GST_BIN (pipeline), branch.source_name.c_str());
+        if (source) {
+            gst_element_set_state(source, GST_STATE_NULL);
+            gst_element_sync_state_with_parent(source);
+            gst_object_unref(source);
+        }
+    }
+    branch.restarting = false;
+}
+
+static void free_h264_framing(gpointer data) {
+    delete static_cast<H264Framing *>(data);
+}
+
+/* Inserts the wallclock SEI into each access unit in front of the videotee, the client reads it back
+ * after depayloading. The access unit memory is shared, only the SEI (and a leading AUD) are new */
+static GstPadProbeReturn sei_timestamp_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    H264Framing *framing = static_cast<H264Framing *>(user_data);
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+        if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            if (!gst_structure_has_name(gst_caps_get_structure(caps, 0), "video/x-h264")) {
+                g_print("No SEI timestamps, the camera does not send H264\n");
+                return GST_PAD_PROBE_REMOVE;
+            }
+            update_h264_framing(caps, framing);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstMapInfo map;
+    gsize offset;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_PAD_PROBE_OK;
+    offset = sei_timestamp_insert_offset(map.data, map.size, *framing);
+    gst_buffer_unmap(buffer, &map);
+
+    std::vector<uint8_t> sei = sei_timestamp_nal(g_get_real_time(), *framing);
+    GstBuffer *out = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_ALL, offset,
+                                            gst_buffer_get_size(buffer) - offset);
+    gpointer sei_data = g_memdup2(sei.data(), sei.size());
+    gst_buffer_prepend_memory(out, gst_memory_new_wrapped((GstMemoryFlags) 0, sei_data, sei.size(), 0, sei.size(),
+                                                          sei_data, g_free));
+    if (offset > 0) {
+        GstBuffer *head = gst_buffer_copy_region(buffer, GST_BUFFER_COPY_MEMORY, 0, offset);
+        gst_buffer_prepend_memory(out, gst_buffer_get_all_memory(head));
+        gst_buffer_unref(head);
+    }
+    gst_buffer_unref(buffer);
+    GST_PAD_PROBE_INFO_DATA (info) = out;
+    return GST_PAD_PROBE_OK;
+}
+
+gboolean PcapReplay::open(const std::string &path, const std::string &src_ip, const std::string &src_port) {
+    reader = std::make_shared<PcapReader>();
+    if (!reader->open(path)) {
+        g_printerr("PcapReplay: %s\n", reader->error().c_str());
+        return FALSE;
+    }
+    if (!filter.set(src_ip, src_port)) {
+        g_printerr("PcapReplay: invalid source filter %s:%s\n", src_ip.c_str(), src_port.c_str());
+        return FALSE;
+    }
+    g_print("PcapReplay: mapped %s (%" G_GSIZE_FORMAT " bytes)\n", path.c_str(), reader->size());
+    return TRUE;
+}
+
+void PcapReplay::start(GstElement *element) {
+    GstCaps *caps = gst_caps_from_string(PCAP_RTP_CAPS);
+    gboolean live = mode != PCAP_REPLAY_MAX_SPEED;
+
+    appsrc = GST_ELEMENT (gst_object_ref(element)); //Released by stop() once the feeder is joined
+    /* Paced modes wait on the pipeline clock and stamp each packet with its due time, so a test clock
+     * drives the replay deterministically. Max speed blocks instead of queueing the capture */
+    g_object_set(appsrc, "caps", caps, "format", GST_FORMAT_TIME, "is-live", live, "do-timestamp", FALSE,
+                 "block", !live, "max-bytes", (guint64) 4 * 1024 * 1024, NULL);
+    gst_caps_unref(caps);
+    clock = gst_element_get_clock(appsrc);
+    base_time = gst_element_get_base_time(appsrc);
+    if (!clock)
+        clock = gst_system_clock_obtain();
+
+    running = true;
+    feeder = std::thread(&PcapReplay::run, this);
+}
+
+void PcapReplay::stop(void) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = false;
+        if (pending)
+            gst_clock_id_unschedule(pending);
+    }
+    if (feeder.joinable())
+        feeder.join();
+    if (clock)
+        gst_object_unref(clock);
+    clock = NULL;
+    if (appsrc)
+        gst_object_unref(appsrc);
+    appsrc = NULL;
+}
+
+static void release_capture_mapping(gpointer data) {
+    delete static_cast<std::shared_ptr<PcapReader> *>(data);
+}
+
+gboolean PcapReplay::push(GstBuffer *buffer) {
+    GstFlowReturn ret;
+    g_signal_emit_by_name(appsrc, "push-buffer", buffer, &ret);
+    gst_buffer_unref(buffer);
+    return ret == GST_FLOW_OK;
+}
+
+void PcapReplay::run(void) {
+    PcapPacket packet;
+    gboolean have_first = FALSE;
+    guint64 first_capture = 0, last_capture = 0, pass_offset = 0;
+    guint16 first_seq = 0, last_seq = 0, seq_offset = 0;
+    guint32 first_ts = 0, last_ts = 0, ts_offset = 0, frame_ts = 0;
+    guint64 pass = 0, packets = 0, bytes = 0;
+    GstClockTime start = gst_clock_get_time(clock), due = start;
+    std::chrono::steady_clock::time_point pass_start = std::chrono::steady_clock::now();
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!running)
+                break;
+        }
+        if (!reader->next_udp_packet(&packet)) {
+            gdouble elapsed = std::chrono::duration<gdouble>(std::chrono::steady_clock::now() - pass_start).count();
+            g_print("PcapReplay pass %" G_GUINT64_FORMAT ": %" G_GUINT64_FORMAT " packets, %.1f MB in %.3f s "
+                    "(%.0f packets/s, %.1f Mbit/s)\n", pass, packets, bytes / 1e6, elapsed,
+                    elapsed > 0 ? packets / elapsed : 0, elapsed > 0 ? bytes * 8 / elapsed / 1e6 : 0);
+            if (mode != PCAP_REPLAY_LOOP || !have_first) {
+                GstFlowReturn ret;
+                g_signal_emit_by_name(appsrc, "end-of-stream", &ret);
+                break;
+            }
+            /* The next pass continues one frame interval after the last packet of this one, so
+             * sequence numbers, RTP time and pacing stay continuous for the depayloader */
+            if (frame_ts == 0)
+                frame_ts = PCAP_RTP_CLOCK_RATE / 25;
+            seq_offset += (guint16) (last_seq - first_seq + 1);
+            ts_offset += last_ts - first_ts + frame_ts;
+            pass_offset += last_capture - first_capture + (guint64) frame_ts * GST_SECOND / PCAP_RTP_CLOCK_RATE;
+            pass++;
+            packets = bytes = 0;
+            pass_start = std::chrono::steady_clock::now();
+            reader->rewind();
+            continue;
+        }
+        if (!filter.matches(packet) || packet.payload_len < 12 || (packet.payload[0] >> 6) != 2)
+            continue;
+
+        guint16 seq = (guint16) ((packet.payload[2] << 8) | packet.payload[3]);
+        guint32 ts = ((guint32) packet.payload[4] << 24) | ((guint32) packet.payload[5] << 16) |
+                     ((guint32) packet.payload[6] << 8) | packet.payload[7];
+        if (!have_first) {
+            have_first = TRUE;
+            first_capture = packet.timestamp_ns;
+            first_seq = seq;
+            first_ts = ts;
+        } else if (pass == 0 && (gint32) (ts - last_ts) > 0) {
+            frame_ts = ts - last_ts;
+        }
+        if (pass == 0) {
+            last_capture = packet.timestamp_ns;
+            last_seq = seq;
+            last_ts = ts;
+        }
+
+        if (mode != PCAP_REPLAY_MAX_SPEED) {
+            GstClockReturn wait;
+            due = start + packet.timestamp_ns - first_capture + pass_offset;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!running)
+                    break;
+                pending = gst_clock_new_single_shot_id(clock, due);
+            }
+            wait = gst_clock_id_wait(pending, NULL);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                gst_clock_id_unref(pending);
+                pending = NULL;
+            }
+            if (wait == GST_CLOCK_UNSCHEDULED)
+                break;
+        }
+
+        GstBuffer *buffer;
+        if (seq_offset == 0 && ts_offset == 0) {
+            buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, (gpointer) packet.payload,
+                                                 packet.payload_len, 0, packet.payload_len,
+                                                 new std::shared_ptr<PcapReader>(reader), release_capture_mapping);
+        } else {
+            GstMapInfo map;
+            guint16 out_seq = seq + seq_offset;
+            guint32 out_ts = ts + ts_offset;
+            buffer = gst_buffer_new_allocate(NULL, packet.payload_len, NULL);
+            gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+            memcpy(map.data, packet.payload, packet.payload_len);
+            map.data[2] = out_seq >> 8;
+            map.data[3] = out_seq & 0xff;
+            map.data[4] = out_ts >> 24;
+            map.data[5] = (out_ts >> 16) & 0xff;
+            map.data[6] = (out_ts >> 8) & 0xff;
+            map.data[7] = out_ts & 0xff;
+            gst_buffer_unmap(buffer, &map);
         }
-        default: {
-            //g_print("pipeline_bus_callback:default Got %s message \n", GST_MESSAGE_TYPE_NAME (message));
+        if (mode == PCAP_REPLAY_MAX_SPEED)
+            GST_BUFFER_PTS(buffer) = GST_BUFFER_DTS(buffer) = packet.timestamp_ns - first_capture;
+        else
+            GST_BUFFER_PTS(buffer) = GST_BUFFER_DTS(buffer) = due > base_time ? due - base_time : 0;
+
+        packets++;
+        bytes += packet.payload_len;
+        if (!push(buffer))
             break;
-        }
     }
-    return TRUE;
+    g_print("PcapReplay finished after %" G_GUINT64_FORMAT " passes\n", pass + 1);
 }
 
 gboolean RtspPipelineHandler::start_streaming() {
@@ -1146,20 +4691,62 @@ gboolean RtspPipelineHandler::start_streaming() {
      * inside the same pipeline. We start by connecting it to a fakesink so that
      * we can preroll early. */
     std::string pipeline_string = "";
-    if (FROM_PCAP) {
-        pipeline_string = string("tee name=videotee ! queue ! fakesink ") +
-                          string("filesrc location=") + PCAP_PATH +
-                          string(" ! pcapparse src-ip=") + PCAP_SRC_IP +
-                          string(" src-port=") + PCAP_SRC_PORT +
-                          string(" ! ") +
-                          string(" application/x-rtp,payload=96 ! rtpjitterbuffer latency=100 ! rtph264depay name=rtspdepay ! videotee. ");
+    std::string latency = std::to_string(JITTERBUFFER_LATENCY);
+    gint codec = CODEC_H264; //Of the pcap and failover ingest, the rtsp ingest finds it on its pads
+    failover_generation++;
+    {
+        std::lock_guard<std::mutex> guard(ingest_lock);
+        jitterbuffer_tuners.clear();
+        for (GstElement *udpsrc : ingest_udpsrcs)
+            gst_object_unref(udpsrc);
+        ingest_udpsrcs.clear();
+        ingest_socket_drops = 0;
+    }
+    lossy_windows = 0;
+    if (INGEST_MODE == INGEST_PCAP) {
+        pcap_replay = std::make_shared<PcapReplay>();
+        pcap_replay->mode = PCAP_REPLAY_MODE;
+        if (!pcap_replay->open(PCAP_PATH, PCAP_SRC_IP, PCAP_SRC_PORT))
+            goto err;
+        //Packets arrive in capture order at max speed and waiting for gaps would only throttle it
+        pipeline_string = string("tee name=videotee ! queue ! fakesink sync=FALSE ") +
+                          string("appsrc name=pcapsrc ! ") +
+                          (PCAP_REPLAY_MODE == PCAP_REPLAY_MAX_SPEED ? string("") :
+                           string("rtpjitterbuffer name=jitterbuffer latency=") + latency + string(" ! ")) +
+                          string("rtph264depay name=rtspdepay ! videotee. ");
+    } else if (INGEST_MODE == INGEST_MULTICAST) {
+        codec = caps_video_codec(MULTICAST_CAPS.c_str());
+        /* reuse lets every rtsp2webrtc_1_n process on the host join the same group, the camera
+         * sends the stream once regardless of how many of them consume it */
+        pipeline_string = string("tee name=videotee ! queue ! fakesink sync=FALSE ") +
+                          string("udpsrc name=multicastsrc address=") + MULTICAST_ADDRESS +
+                          string(" port=") + std::to_string(MULTICAST_PORT) +
+                          string(" auto-multicast=TRUE reuse=TRUE buffer-size=") +
+                          std::to_string(ingest_udp_buffer_size()) +
+                          (MULTICAST_IFACE.empty() ? string("") : string(" multicast-iface=") + MULTICAST_IFACE) +
+                          string(" ! rtpjitterbuffer name=jitterbuffer latency=") + latency + string(" ! ") +
+                          VIDEO_CODECS[codec].depay + string(" name=rtspdepay ! videotee. ");
+    } else if (!backup_rtsp_url.empty()) {
+        /* Both cameras stay connected, the selector forwards one of them and drops the other
+         * until the watchdog switches over at a keyframe */
+        pipeline_string = string("tee name=videotee ! queue ! fakesink sync=FALSE ") +
+                          string("input-selector name=sourceselector sync-streams=FALSE ! videotee. ") +
+                          rtsp_source_description("rtspsource", rtsp_url, "rtspdepay") + " ! sourceselector. " +
+                          rtsp_source_description("backupsource", backup_rtsp_url, "backupdepay") +
+                          " ! sourceselector. ";
     } else {
-        pipeline_string = string("tee name=videotee ! queue ! fakesink ") +
-                          string("rtspsrc name=rtspsource location=" + rtsp_url +
-                                 " latency=100 drop-on-latency=TRUE ! rtph264depay name=rtspdepay ! videotee. ");
+        //Linked from the camera's caps, whatever codec it sends
+        pipeline_string = string("tee name=videotee ! queue ! fakesink sync=FALSE ") +
+                          rtsp_source_description("rtspsource", rtsp_url, "") + " ";
+        if (AUDIO)
+            pipeline_string += "tee name=audiotee ! queue ! fakesink sync=FALSE ";
     }
 
-    pipeline = gst_parse_launch(pipeline_string.c_str(), &error);
+    pipeline_string += rendition_ladder_description();
+    {
+        std::lock_guard<std::mutex> guard(handlers_lock);
+        pipeline = gst_parse_launch(pipeline_string.c_str(), &error);
+    }
 
     if (error) {
         g_printerr("Failed to parse launch: %s\n", error->message);
@@ -1167,15 +4754,78 @@ gboolean RtspPipelineHandler::start_streaming() {
         goto err;
     }
 
+    if (INGEST_MODE == INGEST_MULTICAST) {
+        //Caps are set here as sprop-parameter-sets from an SDP file do not survive gst_parse quoting
+        GstElement *udpsrc = gst_bin_get_by_name(GST_BIN (pipeline), "multicastsrc");
+        GstCaps *caps = gst_caps_from_string(MULTICAST_CAPS.c_str());
+        g_object_set(udpsrc, "caps", caps, NULL);
+        gst_caps_unref(caps);
+        add_ingest_udpsrc(udpsrc);
+        gst_object_unref(udpsrc);
+    }
+
+    if (INGEST_MODE != INGEST_RTSP) {
+        GstElement *jitterbuffer = gst_bin_get_by_name(GST_BIN (pipeline), "jitterbuffer");
+        if (jitterbuffer) {
+            add_jitterbuffer_tuner(jitterbuffer);
+            gst_object_unref(jitterbuffer);
+        }
+    } else if (!backup_rtsp_url.empty()) {
+        setup_source_failover();
+        g_signal_connect (pipeline, "deep-element-added", G_CALLBACK(on_deep_element_added), this);
+    } else {
+        //rtspsrc creates one jitterbuffer per stream inside its rtpbin
+        GstElement *rtspsrc = gst_bin_get_by_name(GST_BIN (pipeline), "rtspsource");
+        g_signal_connect (rtspsrc, "new-manager", G_CALLBACK(on_rtspsrc_new_manager), this);
+        g_signal_connect (rtspsrc, "pad-added", G_CALLBACK(on_rtspsrc_pad_added), pipeline);
+        if (AUDIO)
+            g_signal_connect (rtspsrc, "no-more-pads", G_CALLBACK(on_rtspsrc_no_more_pads), pipeline);
+        gst_object_unref(rtspsrc);
+        g_signal_connect (pipeline, "deep-element-added", G_CALLBACK(on_deep_element_added), this);
+    }
+
+    g_object_set_data(G_OBJECT (pipeline), "video-codec", GINT_TO_POINTER (codec));
+
+    if (SEI_TIMESTAMP) {
+        GstElement *tee = gst_bin_get_by_name(GST_BIN (pipeline), "videotee");
+        GstPad *pad = gst_element_get_static_pad(tee, "sink");
+        gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                          sei_timestamp_probe, new H264Framing(), free_h264_framing);
+        gst_object_unref(pad);
+        gst_object_unref(tee);
+    }
+
+    if (RTX_MODE == RTX_SHARED)
+        g_object_set_data_full(G_OBJECT (pipeline), "rtx-store", new RtxStorePtr(std::make_shared<RtxStore>()),
+                               free_rtx_store);
+
+    //After the SEI probe, the cached frames carry it
+    for (const Rendition &rendition : RENDITIONS) {
+        GstElement *tee = gst_bin_get_by_name(GST_BIN (pipeline), rendition.tee_name.c_str());
+        KeyframeArbiter *arbiter = new KeyframeArbiter();
+        GstPad *pad = gst_element_get_static_pad(tee, "sink");
+        g_object_set_data_full(G_OBJECT (tee), "keyframe-arbiter", arbiter, free_keyframe_arbiter);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_cache_probe, arbiter, NULL);
+        gst_object_unref(pad);
+        gst_object_unref(tee);
+    }
+
+    if (PIPELINE_CLOCK)
+        gst_pipeline_use_clock(GST_PIPELINE (pipeline), PIPELINE_CLOCK);
+
     bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
     gst_bus_enable_sync_message_emission(bus);
     gst_bus_set_sync_handler(bus, (GstBusSyncHandler) pipeline_bus_callback, this, NULL);
     gst_object_unref(GST_OBJECT(bus));
 
     start_recording_video(prepare_next_file_name(), pipeline); //Need to check this
+    set_recorder_codec(pipeline, codec);
 
     g_print("Starting pipeline, not transmitting yet\n");
-    if (START_WEBRTC) {
+    if (START_WEBRTC && INGEST_MODE == INGEST_RTSP && backup_rtsp_url.empty()) {
+        //Offered with the camera's codec, which rtspsrc only tells once it links the video
+        startup_peer_pending = true;
+    } else if (START_WEBRTC) {
         /*std::string peer_id;
         cout << "Please enter peer id \n";
         getline(cin, peer_id);
@@ -1191,22 +4841,39 @@ gboolean RtspPipelineHandler::start_streaming() {
     if (ret == GST_STATE_CHANGE_FAILURE)
         goto err;
 
+    if (pcap_replay) {
+        //appsrc refuses buffers before it is started
+        GstElement *appsrc = gst_bin_get_by_name(GST_BIN (pipeline), "pcapsrc");
+        pcap_replay->start(appsrc);
+        gst_object_unref(appsrc);
+    }
+
     g_print("Started pipeline... \n");
     pipelineState = PLAYING;
     return TRUE;
 
     err:
     g_print("State change failure\n");
-    if (pipeline)
+    g_clear_object (&source_selector);
+    if (pipeline) {
+        std::lock_guard<std::mutex> guard(handlers_lock);
         g_clear_object (&pipeline);
+    }
     return FALSE;
 }
 
 gboolean RtspPipelineHandler::stop_streaming() {
     g_print("stop_recording_video file \n");
+    failover_generation++; //Stops the failover watchdog and pending branch restarts
     GstElement *queue;
     GstPad *queue_src_pad;
 
+    //The feeder pushes into appsrc and waits on the pipeline clock, both go away with the pipeline
+    if (pcap_replay) {
+        pcap_replay->stop();
+        pcap_replay.reset();
+    }
+
     queue = gst_bin_get_by_name(GST_BIN (pipeline), "queue-recorder");
     queue_src_pad = gst_element_get_static_pad(queue, "sink");
     g_print("pushing EOS event on pad %s:%s\n", GST_DEBUG_PAD_NAME (queue_src_pad));
@@ -1218,17 +4885,24 @@ gboolean RtspPipelineHandler::stop_streaming() {
     gst_pad_send_event(queue_src_pad, gst_event_new_eos());
     gst_object_unref(queue_src_pad);
     gst_object_unref(queue);
-    g_print("stopped_recording_video file \n");
 
-    auto it = pipelineHandlers.find(pipeline_execution_id);
-    if (it != pipelineHandlers.end()) {
-        for (auto elem : it->second->peers) {
-            WebrtcViewer webrtcViewer = *(elem.second);
-            webrtcViewer.close_peer_from_server();
-        }
+    queue = gst_bin_get_by_name(GST_BIN (pipeline), "queue-recorder-audio");
+    if (queue) {
+        queue_src_pad = gst_element_get_static_pad(queue, "sink");
+        gst_pad_send_event(queue_src_pad, gst_event_new_eos());
+        gst_object_unref(queue_src_pad);
+        gst_object_unref(queue);
     }
+    g_print("stopped_recording_video file \n");
 
-    peers.clear();
+    std::map<std::string, WebrtcViewerPtr> closing;
+    {
+        std::lock_guard<std::mutex> guard(peers_lock);
+        closing.swap(peers);
+    }
+    for (auto elem : closing) {
+        elem.second->close_peer_from_server();
+    }
     gst_element_send_event(pipeline, gst_event_new_eos());
     g_print("Removed peers for pipeline \n");
 
@@ -1237,8 +4911,11 @@ gboolean RtspPipelineHandler::stop_streaming() {
         g_print("Pipeline Ref Count %d\n", GST_OBJECT_REFCOUNT_VALUE(pipeline));
         gst_element_set_state(GST_ELEMENT (pipeline), GST_STATE_PAUSED);
         gst_element_set_state(GST_ELEMENT (pipeline), GST_STATE_NULL);
-        gst_object_unref(pipeline);
-        g_clear_object (&pipeline);
+        g_clear_object (&source_selector);
+        {
+            std::lock_guard<std::mutex> guard(handlers_lock);
+            g_clear_object (&pipeline);
+        }
         g_print("Pipeline stopped for rtsp url %s\n", rtsp_url.c_str());
     }
     return TRUE;
@@ -1257,13 +4934,841 @@ void add_webrtc_peer(RtspPipelineHandler *pipelineHandlerPtr, std::string peer_i
             webrtcViewerPtr->disable_ssl = TRUE;
         gst_uri_unref(uri);
     }
-    WebRTC_Launch_Task *webRTC_launch_task = new WebRTC_Launch_Task();
-    std::thread th(&WebRTC_Launch_Task::execute, webRTC_launch_task, webrtcViewerPtr);
+    std::thread th(&WebRTC_Launch_Task::execute, WebRTC_Launch_Task(), webrtcViewerPtr);
     th.detach();
     webrtcViewerPtr->pipeline_execution_id = pipelineHandlerPtr->pipeline_execution_id;
+    std::lock_guard<std::mutex> guard(pipelineHandlerPtr->peers_lock);
     pipelineHandlerPtr->peers[webrtcViewerPtr->peer_id] = webrtcViewerPtr;
 }
 
+static WebrtcViewerPtr find_peer(RtspPipelineHandler *pipelineHandlerPtr, const gchar *peer_id) {
+    std::lock_guard<std::mutex> guard(pipelineHandlerPtr->peers_lock);
+    auto it = pipelineHandlerPtr->peers.find(peer_id);
+    return it != pipelineHandlerPtr->peers.end() ? it->second : WebrtcViewerPtr();
+}
+
+/* "rendition ID HEIGHT" moves a viewer to the rendition of that height, 0 for the native stream */
+static void switch_peer_rendition(RtspPipelineHandler *pipelineHandlerPtr, const std::string &line) {
+    gchar **words = g_strsplit(line.c_str(), " ", -1);
+    WebrtcViewerPtr viewer;
+    gint index = -1;
+
+    if (g_strv_length(words) == 3) {
+        index = find_rendition(g_ascii_strtoll(words[2], NULL, 10));
+        viewer = find_peer(pipelineHandlerPtr, words[1]);
+    }
+    if (!viewer || index < 0 || !viewer->switch_rendition(index))
+        g_printerr("Cannot switch: %s (renditions are set with --renditions)\n", line.c_str());
+    g_strfreev(words);
+}
+
+/* "thin ID none|disposable|keyframes" sets the thinning a viewer asks for, e.g. when shown in a grid */
+static void thin_peer(RtspPipelineHandler *pipelineHandlerPtr, const std::string &line) {
+    gchar **words = g_strsplit(line.c_str(), " ", -1);
+    WebrtcViewerPtr viewer;
+    gint level = -1;
+
+    if (g_strv_length(words) == 3) {
+        for (gint index = THIN_NONE; index <= THIN_KEYFRAMES; index++) {
+            if (g_strcmp0(words[2], THINNING_NAMES[index]) == 0)
+                level = index;
+        }
+        viewer = find_peer(pipelineHandlerPtr, words[1]);
+    }
+    if (viewer && level >= 0)
+        viewer->set_thinning(level);
+    else
+        g_printerr("Cannot thin: %s\n", line.c_str());
+    g_strfreev(words);
+}
+
+/* "impair ID KBPS [LOSS]" changes the link of a viewer in the impairment stage */
+static void impair_peer(RtspPipelineHandler *pipelineHandlerPtr, const std::string &line) {
+    gchar **words = g_strsplit(line.c_str(), " ", -1);
+    guint count = g_strv_length(words);
+    WebrtcViewerPtr viewer;
+
+    if (IMPAIR_KBPS <= 0 && IMPAIR_LOSS <= 0)
+        g_printerr("The impairment stage is enabled by --impair-kbps or --impair-loss\n");
+    else if ((count == 3 || count == 4) && (viewer = find_peer(pipelineHandlerPtr, words[1]))) {
+        viewer->impairment.kbps = (gint) MAX(g_ascii_strtoll(words[2], NULL, 10), 0);
+        if (count == 4)
+            viewer->impairment.loss = CLAMP(g_ascii_strtod(words[3], NULL), 0.0, 100.0);
+        g_print("Peer %s egress limited to %d kbps with %.1f%% loss\n", words[1], (gint) viewer->impairment.kbps,
+                (gdouble) viewer->impairment.loss);
+    } else
+        g_printerr("Cannot impair: %s\n", line.c_str());
+    g_strfreev(words);
+}
+
+/* Adds a viewer per peer id of "ID" or "FIRST-LAST", ranges at PEER_RAMP_RATE for load tests.
+ * "joins" prints the join timeline percentiles instead, "rendition ID HEIGHT" moves a viewer,
+ * "thin ID LEVEL" thins its frames and "impair ID KBPS [LOSS]" shapes its egress */
+static void add_webrtc_peers(RtspPipelineHandler *pipelineHandlerPtr, const std::string &line) {
+    gint64 first, last;
+    gchar *end;
+
+    if (line == "joins") {
+        print_join_percentiles();
+        return;
+    }
+    if (g_str_has_prefix(line.c_str(), "rendition ")) {
+        switch_peer_rendition(pipelineHandlerPtr, line);
+        return;
+    }
+    if (g_str_has_prefix(line.c_str(), "thin ")) {
+        thin_peer(pipelineHandlerPtr, line);
+        return;
+    }
+    if (g_str_has_prefix(line.c_str(), "impair ")) {
+        impair_peer(pipelineHandlerPtr, line);
+        return;
+    }
+    first = g_ascii_strtoll(line.c_str(), &end, 10);
+    if (end == line.c_str())
+        return;
+    last = *end == '-' ? g_ascii_strtoll(end + 1, &end, 10) : first;
+    if (*end != '\0' || last < first) {
+        g_printerr("Invalid peer id or range %s\n", line.c_str());
+        return;
+    }
+    g_print("Adding %" G_GINT64_FORMAT " viewers\n", last - first + 1);
+    for (gint64 id = first; id <= last; id++) {
+        std::string peer_id = std::to_string(id);
+        gboolean known;
+        {
+            std::lock_guard<std::mutex> guard(pipelineHandlerPtr->peers_lock);
+            known = pipelineHandlerPtr->peers.find(peer_id) != pipelineHandlerPtr->peers.end();
+        }
+        if (known) {
+            g_print("Peer %s is already a viewer\n", peer_id.c_str());
+            continue;
+        }
+        add_webrtc_peer(pipelineHandlerPtr, peer_id);
+        if (id < last)
+            std::this_thread::sleep_for(std::chrono::microseconds((gint64) (1e6 / PEER_RAMP_RATE)));
+    }
+}
+
+#define SOAK_TEARDOWN_TIMEOUT 10 //Seconds to wait for the viewers of a cycle to be destroyed
+#define SOAK_SETTLE_MS 1000 //After teardown, before RSS and object counts are sampled
+#define SOAK_MAX_OBJECTS_PER_CYCLE 0.5 //Instances of one type gained per cycle that count as a leak
+#define SOAK_TOP_TYPES 10
+
+/* Resident set size in KB */
+static gint64 resident_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return (gint64) resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+/* Live instances per type under G_TYPE_OBJECT, all 0 unless GOBJECT_DEBUG=instance-count was set at startup */
+static void count_instances(GType type, std::map<std::string, gint> &counts) {
+    guint n_children;
+    gint count = g_type_get_instance_count(type);
+    if (count > 0)
+        counts[g_type_name(type)] = count;
+    GType *children = g_type_children(type, &n_children);
+    for (guint i = 0; i < n_children; i++)
+        count_instances(children[i], counts);
+    g_free(children);
+}
+
+/* Drops every viewer and waits for their signalling threads and WebrtcViewer objects to be gone */
+static gboolean close_soak_viewers(RtspPipelineHandler *pipelineHandlerPtr) {
+    std::map<std::string, WebrtcViewerPtr> closing;
+    {
+        std::lock_guard<std::mutex> guard(pipelineHandlerPtr->peers_lock);
+        closing.swap(pipelineHandlerPtr->peers);
+    }
+    for (auto elem : closing)
+        elem.second->close_peer_from_server();
+    closing.clear();
+
+    gint64 deadline = g_get_monotonic_time() + SOAK_TEARDOWN_TIMEOUT * G_USEC_PER_SEC;
+    while ((live_viewers > 0 || live_launch_tasks > 0) && g_get_monotonic_time() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::this_thread::sleep_for(std::chrono::milliseconds(SOAK_SETTLE_MS));
+    return live_viewers == 0 && live_launch_tasks == 0;
+}
+
+/*
+ * Soak mode: SOAK_CYCLES times adds the viewers of PEER_ID (ID or FIRST-LAST, as on stdin), keeps them
+ * SOAK_DWELL seconds and drops them again. After each teardown RSS and the live GObject instances per
+ * type are sampled. From the end of the warmup on, growth per cycle above SOAK_MAX_GROWTH KB, a type
+ * gaining instances every other cycle or viewers that are never destroyed fail the run.
+ * Returns the exit status.
+ */
+static int run_soak(RtspPipelineHandler *pipelineHandlerPtr) {
+    std::map<std::string, gint> baseline_counts, counts;
+    gint64 baseline_kb = 0, idle_kb = 0, footprint_kb = 0;
+    guint footprint_samples = 0;
+    gboolean counting, leaked_viewers = FALSE;
+
+    counting = g_type_get_instance_count(GST_TYPE_PIPELINE) > 0;
+    if (!counting)
+        g_printerr("Soak: run with GOBJECT_DEBUG=instance-count for per type object counts, tracking RSS only\n");
+
+    for (gint cycle = 1; cycle <= SOAK_CYCLES; cycle++) {
+        add_webrtc_peers(pipelineHandlerPtr, PEER_ID);
+        std::this_thread::sleep_for(std::chrono::seconds(SOAK_DWELL));
+        gint viewers = live_viewers;
+        gint64 loaded_kb = resident_kb();
+
+        if (!close_soak_viewers(pipelineHandlerPtr)) {
+            g_printerr("Soak cycle %d: %d viewers and %d signalling threads still alive after teardown\n", cycle,
+                       live_viewers.load(), live_launch_tasks.load());
+            leaked_viewers = TRUE;
+        }
+        idle_kb = resident_kb();
+        counts.clear();
+        if (counting)
+            count_instances(G_TYPE_OBJECT, counts);
+
+        if (cycle == SOAK_WARMUP) {
+            baseline_kb = idle_kb;
+            baseline_counts = counts;
+        }
+        if (viewers > 0 && cycle > SOAK_WARMUP) {
+            footprint_kb += (loaded_kb - idle_kb) / viewers;
+            footprint_samples++;
+        }
+        if (cycle <= SOAK_WARMUP) {
+            g_print("Soak cycle %d/%d (warmup): %d viewers, rss %" G_GINT64_FORMAT " KB loaded, %" G_GINT64_FORMAT
+                    " KB idle\n", cycle, SOAK_CYCLES, viewers, loaded_kb, idle_kb);
+        } else {
+            g_print("Soak cycle %d/%d: %d viewers, rss %" G_GINT64_FORMAT " KB loaded, %" G_GINT64_FORMAT
+                    " KB idle, %+.1f KB/cycle since warmup\n", cycle, SOAK_CYCLES, viewers, loaded_kb, idle_kb,
+                    (gdouble) (idle_kb - baseline_kb) / (cycle - SOAK_WARMUP));
+        }
+    }
+
+    gint measured = SOAK_CYCLES - SOAK_WARMUP;
+    gdouble growth_kb = (gdouble) (idle_kb - baseline_kb) / measured;
+    gboolean failed = leaked_viewers || growth_kb > SOAK_MAX_GROWTH;
+    g_print("Soak: %d cycles, rss %" G_GINT64_FORMAT " KB after warmup, %" G_GINT64_FORMAT " KB at the end, "
+            "%.1f KB/cycle (limit %d), %" G_GINT64_FORMAT " KB per connected viewer\n", SOAK_CYCLES, baseline_kb,
+            idle_kb, growth_kb, SOAK_MAX_GROWTH, footprint_samples ? footprint_kb / footprint_samples : 0);
+
+    if (counting) {
+        std::vector<std::pair<gint, std::string> > grown;
+        for (auto &count : counts) {
+            gint gained = count.second - baseline_counts[count.first];
+            if (gained > 0)
+                grown.push_back(std::make_pair(gained, count.first));
+        }
+        std::sort(grown.rbegin(), grown.rend());
+        g_print("Soak: %u types gained instances since warmup\n", (guint) grown.size());
+        for (size_t i = 0; i < grown.size() && i < SOAK_TOP_TYPES; i++)
+            g_print("  %s +%d (%.2f/cycle, %d live)\n", grown[i].second.c_str(), grown[i].first,
+                    (gdouble) grown[i].first / measured, counts[grown[i].second]);
+        if (!grown.empty() && (gdouble) grown[0].first / measured >= SOAK_MAX_OBJECTS_PER_CYCLE)
+            failed = TRUE;
+    }
+    g_print("Soak %s\n", failed ? "FAILED" : "passed");
+    return failed ? 1 : 0;
+}
+
+/*
+ * Serves per source and per viewer counters in Prometheus text format on localhost. Viewer values
+ * come from the "get-stats" promise of every webrtcbin, source values from the jitterbuffer tuners
+ * and queue levels, all collected every METRICS_INTERVAL seconds on the collector's own main
+ * context so that nothing is added to the streaming threads.
+ */
+class MetricsCollector {
+
+public:
+    //Methods
+    void start(guint port, guint interval);
+
+private:
+    struct ViewerMetrics {
+        int pipeline_execution_id = 0;
+        std::string peer_id;
+        guint64 bytes_sent = 0;
+        guint64 packets_sent = 0;
+        guint64 nack_received = 0;
+        guint64 pli_received = 0;
+        guint64 fir_received = 0;
+        gdouble packets_lost = 0; //Reported by the viewer
+        gdouble fraction_lost = 0;
+        gdouble rtt = 0; //Seconds
+        gdouble bitrate_kbps = 0;
+        gint64 updated = 0; //Monotonic us of the last stats
+        guint generation = 0; //Collection round that last saw the viewer
+    };
+
+    struct QueueLevel {
+        std::string name;
+        guint buffers;
+        guint bytes;
+        guint64 time;
+    };
+
+    struct SourceMetrics {
+        std::string rtsp_url;
+        guint viewers = 0;
+        guint64 bytes_received = 0;
+        gdouble bitrate_kbps = 0;
+        guint64 jitterbuffer_pushed = 0;
+        guint64 jitterbuffer_lost = 0;
+        guint64 jitterbuffer_late = 0;
+        guint jitterbuffer_latency = 0;
+        gdouble jitter_ms = 0;
+        guint64 socket_drops = 0;
+        guint64 keyframe_requests = 0; //From the viewers, summed over the tees
+        guint64 keyframes_served = 0;
+        guint64 keyframe_requests_forwarded = 0;
+        gint64 updated = 0;
+        std::vector<QueueLevel> queues;
+    };
+
+    struct StatsRequest {
+        MetricsCollector *collector;
+        WebrtcViewerPtr viewer; //Keeps the viewer alive until webrtcbin replies
+        GstElement *webrtc; //Reference taken under the viewer's webrtc_lock
+        std::string key;
+    };
+
+    std::mutex lock;
+    std::map<std::string, ViewerMetrics> viewers; //Key pipeline_execution_id/peer_id
+    std::map<int, SourceMetrics> sources;
+    guint generation = 0;
+    guint interval = 5;
+    GMainContext *context = NULL;
+
+    void run(guint port);
+
+    void collect(void);
+
+    void collect_source(RtspPipelineHandler *handler, GstElement *pipeline, SourceMetrics &source);
+
+    void update_viewer(const std::string &key, const GstStructure *stats);
+
+    std::string render(void);
+
+    static gboolean on_timer(gpointer data);
+
+    static void on_stats(GstPromise *promise, gpointer data);
+
+    static void free_stats_request(gpointer data);
+
+    static void on_request(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                           SoupClientContext *client, gpointer data);
+};
+
+static MetricsCollector metricsCollector;
+
+void MetricsCollector::start(guint port, guint interval) {
+    this->interval = interval;
+    std::thread(&MetricsCollector::run, this, port).detach();
+}
+
+void MetricsCollector::run(guint port) {
+    GError *error = NULL;
+    GMainLoop *loop;
+    SoupServer *server;
+    GSource *timer;
+
+    context = g_main_context_new();
+    g_main_context_push_thread_default(context);
+    loop = g_main_loop_new(context, FALSE);
+
+    //The server attaches its sockets to the thread default context
+    server = soup_server_new(SOUP_SERVER_SERVER_HEADER, "rtsp2webrtc_1_n", NULL);
+    soup_server_add_handler(server, "/metrics", on_request, this, NULL);
+    if (!soup_server_listen_local(server, port, SOUP_SERVER_LISTEN_IPV4_ONLY, &error)) {
+        g_printerr("Metrics endpoint cannot listen on port %u: %s\n", port, error->message);
+        g_error_free(error);
+        goto out;
+    }
+    g_print("Metrics endpoint at http://127.0.0.1:%u/metrics\n", port);
+
+    timer = g_timeout_source_new_seconds(interval);
+    g_source_set_callback(timer, on_timer, this, NULL);
+    g_source_attach(timer, context);
+    g_source_unref(timer);
+    g_main_loop_run(loop);
+
+    out:
+    g_object_unref(server);
+    g_main_loop_unref(loop);
+    g_main_context_pop_thread_default(context);
+    g_main_context_unref(context);
+}
+
+gboolean MetricsCollector::on_timer(gpointer data) {
+    static_cast<MetricsCollector *>(data)->collect();
+    return G_SOURCE_CONTINUE;
+}
+
+void MetricsCollector::collect(void) {
+    guint round;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        round = ++generation;
+    }
+
+    //Handlers and their pipelines are referenced under handlers_lock, a restart replaces the pipeline
+    std::vector<std::pair<int, RtspPipelineHandlerPtr>> handlers;
+    {
+        std::lock_guard<std::mutex> guard(handlers_lock);
+        handlers.assign(pipelineHandlers.begin(), pipelineHandlers.end());
+    }
+    for (auto &it : handlers) {
+        RtspPipelineHandler *handler = it.second.get();
+        std::vector<WebrtcViewerPtr> current;
+        GstElement *pipeline = NULL;
+        {
+            std::lock_guard<std::mutex> guard(handlers_lock);
+            if (handler->pipeline)
+                pipeline = GST_ELEMENT (gst_object_ref(handler->pipeline));
+        }
+        {
+            std::lock_guard<std::mutex> guard(handler->peers_lock);
+            for (auto &peer : handler->peers)
+                current.push_back(peer.second);
+        }
+
+        SourceMetrics source;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            source = sources[it.first];
+        }
+        source.viewers = (guint) current.size();
+        collect_source(handler, pipeline, source);
+        if (pipeline)
+            gst_object_unref(pipeline);
+
+        std::vector<StatsRequest *> requests;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            sources[it.first] = source;
+            for (auto &viewer : current) {
+                //Stats exist once the call has been negotiated
+                if (viewer->app_state < PEER_CALL_NEGOTIATING)
+                    continue;
+                GstElement *webrtc = NULL;
+                {
+                    std::lock_guard<std::mutex> webrtc_guard(viewer->webrtc_lock);
+                    if (viewer->webrtc1)
+                        webrtc = GST_ELEMENT (gst_object_ref(viewer->webrtc1));
+                }
+                if (!webrtc)
+                    continue;
+                std::string key = std::to_string(it.first) + "/" + viewer->peer_id;
+                ViewerMetrics &metrics = viewers[key];
+                metrics.pipeline_execution_id = it.first;
+                metrics.peer_id = viewer->peer_id;
+                metrics.generation = round;
+                requests.push_back(new StatsRequest{this, viewer, webrtc, key});
+            }
+        }
+        //webrtcbin may reply right away, on_stats takes the lock
+        for (StatsRequest *request : requests) {
+            GstPromise *promise = gst_promise_new_with_change_func(on_stats, request, free_stats_request);
+            g_signal_emit_by_name(request->webrtc, "get-stats", NULL, promise);
+            gst_promise_unref(promise);
+        }
+    }
+
+    //Viewers that left
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = viewers.begin(); it != viewers.end();) {
+        if (it->second.generation != round)
+            it = viewers.erase(it);
+        else
+            ++it;
+    }
+}
+
+void MetricsCollector::collect_source(RtspPipelineHandler *handler, GstElement *pipeline, SourceMetrics &source) {
+    gint64 now = g_get_monotonic_time();
+    guint64 previous_bytes = source.bytes_received;
+    GstIterator *iterator;
+    GValue item = G_VALUE_INIT;
+
+    source.rtsp_url = INGEST_MODE == INGEST_PCAP ? PCAP_PATH : handler->rtsp_url;
+    source.bytes_received = source.jitterbuffer_pushed = source.jitterbuffer_lost = source.jitterbuffer_late = 0;
+    source.jitterbuffer_latency = 0;
+    source.jitter_ms = 0;
+    {
+        std::lock_guard<std::mutex> guard(handler->ingest_lock);
+        for (auto &tuner : handler->jitterbuffer_tuners) {
+            std::lock_guard<std::mutex> tuner_guard(tuner->lock);
+            source.bytes_received += tuner->bytes_received;
+            source.jitterbuffer_pushed += tuner->num_pushed;
+            source.jitterbuffer_lost += tuner->num_lost;
+            source.jitterbuffer_late += tuner->num_late;
+            source.jitterbuffer_latency = MAX(source.jitterbuffer_latency, tuner->latency);
+            source.jitter_ms = MAX(source.jitter_ms, tuner->jitter_ms);
+        }
+        source.socket_drops = handler->ingest_socket_drops;
+    }
+    //Tuners are recreated with the pipeline, a restart is not negative throughput
+    if (source.updated && source.bytes_received >= previous_bytes)
+        source.bitrate_kbps = (source.bytes_received - previous_bytes) * 8.0 / ((now - source.updated) / 1e3);
+    source.updated = now;
+
+    source.queues.clear();
+    source.keyframe_requests = source.keyframes_served = source.keyframe_requests_forwarded = 0;
+    if (!pipeline)
+        return;
+    iterator = gst_bin_iterate_recurse(GST_BIN (pipeline));
+    while (gst_iterator_next(iterator, &item) == GST_ITERATOR_OK) {
+        GstElement *element = GST_ELEMENT (g_value_get_object(&item));
+        GstElementFactory *factory = gst_element_get_factory(element);
+        if (factory && g_strcmp0(GST_OBJECT_NAME (factory), "queue") == 0) {
+            QueueLevel level;
+            gchar *name = gst_element_get_name(element);
+            level.name = name;
+            g_free(name);
+            g_object_get(element, "current-level-buffers", &level.buffers, "current-level-bytes", &level.bytes,
+                         "current-level-time", &level.time, NULL);
+            source.queues.push_back(level);
+        }
+        KeyframeArbiter *arbiter = static_cast<KeyframeArbiter *>(g_object_get_data(G_OBJECT (element),
+                                                                                    "keyframe-arbiter"));
+        if (arbiter) {
+            std::lock_guard<std::mutex> arbiter_guard(arbiter->lock);
+            source.keyframe_requests += arbiter->requests;
+            source.keyframes_served += arbiter->served;
+            source.keyframe_requests_forwarded += arbiter->forwarded;
+        }
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(iterator);
+}
+
+void MetricsCollector::free_stats_request(gpointer data) {
+    StatsRequest *request = static_cast<StatsRequest *>(data);
+    gst_object_unref(request->webrtc);
+    delete request;
+}
+
+void MetricsCollector::on_stats(GstPromise *promise, gpointer data) {
+    StatsRequest *request = static_cast<StatsRequest *>(data);
+    if (gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED)
+        return;
+    const GstStructure *reply = gst_promise_get_reply(promise);
+    if (reply)
+        request->collector->update_viewer(request->key, reply);
+}
+
+void MetricsCollector::update_viewer(const std::string &key, const GstStructure *reply) {
+    gint64 now = g_get_monotonic_time();
+    FeedbackStats totals;
+
+    read_feedback_stats(reply, &totals);
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = viewers.find(key);
+    if (it == viewers.end())
+        return;
+    ViewerMetrics &metrics = it->second;
+    if (metrics.updated && (guint64) totals.bytes_sent >= metrics.bytes_sent)
+        metrics.bitrate_kbps = (totals.bytes_sent - metrics.bytes_sent) * 8.0 / ((now - metrics.updated) / 1e3);
+    metrics.bytes_sent = (guint64) totals.bytes_sent;
+    metrics.packets_sent = (guint64) totals.packets_sent;
+    metrics.nack_received = (guint64) totals.nack;
+    metrics.pli_received = (guint64) totals.pli;
+    metrics.fir_received = (guint64) totals.fir;
+    metrics.packets_lost = totals.packets_lost;
+    metrics.fraction_lost = totals.fraction_lost;
+    metrics.rtt = totals.rtt;
+    metrics.updated = now;
+}
+
+/* Label value of the Prometheus text format, where backslash, double quote and line feed are escaped */
+static std::string prometheus_label_escape(const std::string &value) {
+    std::string escaped;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+std::string MetricsCollector::render(void) {
+    std::ostringstream text;
+    std::lock_guard<std::mutex> guard(lock);
+
+#define METRIC_HEADER(name, type, help) \
+    text << "# HELP rtsp2webrtc_" name " " help "\n# TYPE rtsp2webrtc_" name " " type "\n"
+
+    METRIC_HEADER("source_viewers", "gauge", "Connected viewers");
+    for (auto &it : sources)
+        text << "rtsp2webrtc_source_viewers{pipeline=\"" << it.first << "\",source=\""
+             << prometheus_label_escape(it.second.rtsp_url) << "\"} " << it.second.viewers << "\n";
+
+#define SOURCE_METRIC(name, type, help, field) \
+    METRIC_HEADER("source_" name, type, help); \
+    for (auto &it : sources) \
+        text << "rtsp2webrtc_source_" name "{pipeline=\"" << it.first << "\"} " << it.second.field << "\n"
+
+    SOURCE_METRIC("received_bytes_total", "counter", "RTP bytes into the ingest jitterbuffers", bytes_received);
+    SOURCE_METRIC("bitrate_kbps", "gauge", "Ingest bitrate over the last collection interval", bitrate_kbps);
+    SOURCE_METRIC("jitterbuffer_pushed_total", "counter", "Packets pushed by the ingest jitterbuffers",
+                  jitterbuffer_pushed);
+    SOURCE_METRIC("jitterbuffer_lost_total", "counter", "Packets the ingest jitterbuffers gave up on",
+                  jitterbuffer_lost);
+    SOURCE_METRIC("jitterbuffer_late_total", "counter", "Packets dropped for arriving too late", jitterbuffer_late);
+    SOURCE_METRIC("jitterbuffer_latency_ms", "gauge", "Ingest jitterbuffer latency", jitterbuffer_latency);
+    SOURCE_METRIC("jitter_ms", "gauge", "Ingest interarrival jitter", jitter_ms);
+    SOURCE_METRIC("socket_drops_total", "counter", "Kernel drops on the ingest sockets", socket_drops);
+    SOURCE_METRIC("keyframe_requests_total", "counter", "PLI and FIR of the viewers", keyframe_requests);
+    SOURCE_METRIC("keyframes_served_total", "counter", "Keyframe requests answered from the cached frames",
+                  keyframes_served);
+    SOURCE_METRIC("keyframe_requests_forwarded_total", "counter", "Keyframe requests sent upstream",
+                  keyframe_requests_forwarded);
+
+    METRIC_HEADER("queue_level_buffers", "gauge", "Buffers queued");
+    for (auto &it : sources)
+        for (auto &queue : it.second.queues)
+            text << "rtsp2webrtc_queue_level_buffers{pipeline=\"" << it.first << "\",queue=\""
+                 << prometheus_label_escape(queue.name) << "\"} " << queue.buffers << "\n";
+    METRIC_HEADER("queue_level_bytes", "gauge", "Bytes queued");
+    for (auto &it : sources)
+        for (auto &queue : it.second.queues)
+            text << "rtsp2webrtc_queue_level_bytes{pipeline=\"" << it.first << "\",queue=\""
+                 << prometheus_label_escape(queue.name) << "\"} " << queue.bytes << "\n";
+    METRIC_HEADER("queue_level_seconds", "gauge", "Duration queued");
+    for (auto &it : sources)
+        for (auto &queue : it.second.queues)
+            text << "rtsp2webrtc_queue_level_seconds{pipeline=\"" << it.first << "\",queue=\""
+                 << prometheus_label_escape(queue.name) << "\"} " << queue.time / 1e9 << "\n";
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    METRIC_HEADER("process_cpu_seconds_total", "counter", "User and system CPU of the process");
+    text << "rtsp2webrtc_process_cpu_seconds_total " << usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                                                        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6
+         << "\n";
+    if (BATCHED_EGRESS) {
+        METRIC_HEADER("egress_packets_total", "counter", "Datagrams sent by the batched egress");
+        text << "rtsp2webrtc_egress_packets_total " << batchedEgress.packets << "\n";
+        METRIC_HEADER("egress_bytes_total", "counter", "Bytes sent by the batched egress");
+        text << "rtsp2webrtc_egress_bytes_total " << batchedEgress.bytes << "\n";
+        METRIC_HEADER("egress_syscalls_total", "counter", "sendmmsg calls of the batched egress");
+        text << "rtsp2webrtc_egress_syscalls_total " << batchedEgress.syscalls << "\n";
+        METRIC_HEADER("egress_dropped_total", "counter", "Datagrams the batched egress could not send");
+        text << "rtsp2webrtc_egress_dropped_total " << batchedEgress.dropped << "\n";
+    }
+
+#define VIEWER_METRIC(name, type, help, field) \
+    METRIC_HEADER("viewer_" name, type, help); \
+    for (auto &it : viewers) \
+        if (it.second.updated) \
+            text << "rtsp2webrtc_viewer_" name "{pipeline=\"" << it.second.pipeline_execution_id \
+                 << "\",peer=\"" << prometheus_label_escape(it.second.peer_id) << "\"} " << it.second.field << "\n"
+
+    VIEWER_METRIC("sent_bytes_total", "counter", "RTP bytes sent", bytes_sent);
+    VIEWER_METRIC("sent_packets_total", "counter", "RTP packets sent", packets_sent);
+    VIEWER_METRIC("bitrate_kbps", "gauge", "Send bitrate over the last collection interval", bitrate_kbps);
+    VIEWER_METRIC("nack_received_total", "counter", "NACKs received", nack_received);
+    VIEWER_METRIC("pli_received_total", "counter", "PLIs received", pli_received);
+    VIEWER_METRIC("fir_received_total", "counter", "FIRs received", fir_received);
+    VIEWER_METRIC("packets_lost", "gauge", "Cumulative loss reported by the viewer", packets_lost);
+    VIEWER_METRIC("fraction_lost", "gauge", "Fraction lost of the last receiver report", fraction_lost);
+    VIEWER_METRIC("rtt_seconds", "gauge", "Round trip time from receiver reports", rtt);
+
+#undef VIEWER_METRIC
+#undef SOURCE_METRIC
+#undef METRIC_HEADER
+    return text.str();
+}
+
+void MetricsCollector::on_request(SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query,
+                                  SoupClientContext *client, gpointer data) {
+    if (msg->method != SOUP_METHOD_GET) {
+        soup_message_set_status(msg, SOUP_STATUS_NOT_IMPLEMENTED);
+        return;
+    }
+    std::string text = static_cast<MetricsCollector *>(data)->render();
+    soup_message_set_status(msg, SOUP_STATUS_OK);
+    soup_message_set_response(msg, "text/plain; version=0.0.4", SOUP_MEMORY_COPY, text.c_str(), text.size());
+}
+
+/* Takes group, port and caps of the first video stream of an SDP file as written by most encoders
+ * and by gst-rtsp-server for multicast streams */
+static gboolean load_multicast_sdp(const gchar *path) {
+    gchar *contents;
+    gsize length;
+    GError *error = NULL;
+    GstSDPMessage *sdp;
+    gboolean found = FALSE;
+
+    if (!g_file_get_contents(path, &contents, &length, &error)) {
+        g_printerr("Failed to read sdp file %s: %s\n", path, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    gst_sdp_message_new(&sdp);
+    if (gst_sdp_message_parse_buffer((guint8 *) contents, length, sdp) != GST_SDP_OK) {
+        g_printerr("Failed to parse sdp file %s\n", path);
+        gst_sdp_message_free(sdp);
+        g_free(contents);
+        return FALSE;
+    }
+
+    for (guint index = 0; index < gst_sdp_message_medias_len(sdp) && !found; index++) {
+        const GstSDPMedia *media = gst_sdp_message_get_media(sdp, index);
+        if (g_strcmp0(gst_sdp_media_get_media(media), "video") != 0 || gst_sdp_media_formats_len(media) == 0)
+            continue;
+
+        const GstSDPConnection *connection = gst_sdp_media_connections_len(media) > 0 ?
+                                             gst_sdp_media_get_connection(media, 0) :
+                                             gst_sdp_message_get_connection(sdp);
+        if (connection && connection->address)
+            MULTICAST_ADDRESS = connection->address;
+        MULTICAST_PORT = gst_sdp_media_get_port(media);
+
+        gint pt = atoi(gst_sdp_media_get_format(media, 0));
+        GstCaps *caps = gst_sdp_media_get_caps_from_media(media, pt);
+        if (!caps)
+            continue;
+        gst_structure_set_name(gst_caps_get_structure(caps, 0), "application/x-rtp");
+        gchar *caps_string = gst_caps_to_string(caps);
+        MULTICAST_CAPS = caps_string;
+        g_free(caps_string);
+        gst_caps_unref(caps);
+        found = TRUE;
+    }
+    gst_sdp_message_free(sdp);
+    g_free(contents);
+
+    if (!found) {
+        g_printerr("No video stream in sdp file %s\n", path);
+        return FALSE;
+    }
+    g_print("Multicast ingest from sdp %s: %s:%d %s\n", path, MULTICAST_ADDRESS.c_str(), MULTICAST_PORT,
+            MULTICAST_CAPS.c_str());
+    return TRUE;
+}
+
+gchar *INGEST_ARG = NULL;
+gchar *PCAP_MODE_ARG = NULL;
+gchar *RTSP_URL_ARG = NULL;
+gchar *RTSP_TRANSPORT_ARG = NULL;
+gchar *BACKUP_RTSP_URL_ARG = NULL;
+gchar *MULTICAST_ADDRESS_ARG = NULL;
+gchar *MULTICAST_IFACE_ARG = NULL;
+gchar *MULTICAST_CAPS_ARG = NULL;
+gchar *SDP_FILE_ARG = NULL;
+gchar *RENDITIONS_ARG = NULL;
+gchar *THINNING_ARG = NULL;
+gchar *RTX_MODE_ARG = NULL;
+gchar *FALLBACK_CODEC_ARG = NULL;
+gint DEFAULT_RENDITION_HEIGHT = 0;
+
+static GOptionEntry entries[] = {
+        {"ingest", 0, 0, G_OPTION_ARG_STRING, &INGEST_ARG, "Ingest source: pcap (default), rtsp or multicast",
+                "MODE"},
+        {"pcap-mode", 0, 0, G_OPTION_ARG_STRING, &PCAP_MODE_ARG,
+                "PCAP replay: paced (default, capture timing), loop (paced, forever) or max-speed", "MODE"},
+        {"peer-ramp-rate", 0, 0, G_OPTION_ARG_DOUBLE, &PEER_RAMP_RATE,
+                "Viewers added per second for a peer id range entered on stdin (default 10)", "N"},
+        {"sei-timestamp", 0, 0, G_OPTION_ARG_NONE, &SEI_TIMESTAMP,
+                "Insert a wallclock timestamp SEI into every frame for glass-to-glass latency measurement", NULL},
+        {"metrics-port", 0, 0, G_OPTION_ARG_INT, &METRICS_PORT,
+                "Serve Prometheus metrics on http://127.0.0.1:PORT/metrics (default off)", "PORT"},
+        {"metrics-interval", 0, 0, G_OPTION_ARG_INT, &METRICS_INTERVAL,
+                "Seconds between metrics collections (default 5)", "SECONDS"},
+        {"rtsp-url", 0, 0, G_OPTION_ARG_STRING, &RTSP_URL_ARG, "Camera url for rtsp ingest", "URL"},
+        {"backup-rtsp-url", 0, 0, G_OPTION_ARG_STRING, &BACKUP_RTSP_URL_ARG,
+                "Hot standby camera url, kept connected and switched to at a keyframe when the primary stalls", "URL"},
+        {"audio", 0, 0, G_OPTION_ARG_NONE, &AUDIO,
+                "Send the camera's audio to every viewer as Opus, transcoded once when the camera has another codec,"
+                " and record it", NULL},
+        {"failover-timeout", 0, 0, G_OPTION_ARG_INT, &FAILOVER_TIMEOUT,
+                "Time without buffers from the active camera before switching to the standby (default 500)", "MS"},
+        {"rtsp-transport", 0, 0, G_OPTION_ARG_STRING, &RTSP_TRANSPORT_ARG,
+                "RTSP lower transport: auto (default, falls back to TCP on loss), udp, tcp or multicast", "TRANSPORT"},
+        {"sdp-file", 0, 0, G_OPTION_ARG_STRING, &SDP_FILE_ARG,
+                "SDP describing the multicast stream, replaces the multicast address, port and caps options", "FILE"},
+        {"multicast-address", 0, 0, G_OPTION_ARG_STRING, &MULTICAST_ADDRESS_ARG, "Group for multicast ingest",
+                "ADDRESS"},
+        {"multicast-port", 0, 0, G_OPTION_ARG_INT, &MULTICAST_PORT, "Port for multicast ingest", "PORT"},
+        {"multicast-iface", 0, 0, G_OPTION_ARG_STRING, &MULTICAST_IFACE_ARG,
+                "Network interface to join the multicast group on", "IFACE"},
+        {"multicast-caps", 0, 0, G_OPTION_ARG_STRING, &MULTICAST_CAPS_ARG,
+                "RTP caps of the multicast stream (default H264, payload 96)", "CAPS"},
+        {"fallback-codec", 0, 0, G_OPTION_ARG_STRING, &FALLBACK_CODEC_ARG,
+                "Offered next to the camera's codec, viewers that only take it get one shared transcode: h264 "
+                "(default), h265, vp8, vp9 or none", "CODEC"},
+        {"transcode-bitrate", 0, 0, G_OPTION_ARG_INT, &TRANSCODE_BITRATE,
+                "Bitrate of the shared transcode into the fallback codec (default 2000)", "KBPS"},
+        {"udp-buffer-size", 0, 0, G_OPTION_ARG_INT, &UDP_BUFFER_SIZE,
+                "Ingest socket receive buffer, default sized from --ingest-bitrate", "BYTES"},
+        {"ingest-bitrate", 0, 0, G_OPTION_ARG_INT, &INGEST_BITRATE, "Expected peak ingest bitrate (default 8000)",
+                "KBPS"},
+        {"transport-fallback-loss", 0, 0, G_OPTION_ARG_DOUBLE, &TRANSPORT_FALLBACK_LOSS,
+                "Loss percentage sustained for 3 s that makes auto transport fall back to TCP (default 2)", "PERCENT"},
+        {"adaptive-jitterbuffer", 0, 0, G_OPTION_ARG_NONE, &ADAPTIVE_JITTERBUFFER,
+                "Size the ingest jitterbuffer from measured jitter and reordering", NULL},
+        {"jitterbuffer-latency", 0, 0, G_OPTION_ARG_INT, &JITTERBUFFER_LATENCY,
+                "Ingest jitterbuffer latency, initial value in adaptive mode (default 100)", "MS"},
+        {"jitterbuffer-min-latency", 0, 0, G_OPTION_ARG_INT, &JITTERBUFFER_MIN_LATENCY,
+                "Lower bound of the adaptive jitterbuffer latency (default 20)", "MS"},
+        {"jitterbuffer-max-latency", 0, 0, G_OPTION_ARG_INT, &JITTERBUFFER_MAX_LATENCY,
+                "Upper bound of the adaptive jitterbuffer latency (default 500)", "MS"},
+        {"renditions", 0, 0, G_OPTION_ARG_STRING, &RENDITIONS_ARG,
+                "Transcoding ladder next to the native stream, e.g. 720:2500,360:800 (KBPS defaults to 3 x HEIGHT)",
+                "HEIGHT[:KBPS],..."},
+        {"default-rendition", 0, 0, G_OPTION_ARG_INT, &DEFAULT_RENDITION_HEIGHT,
+                "Rendition new viewers start on, 0 for the native stream (default)", "HEIGHT"},
+        {"thinning", 0, 0, G_OPTION_ARG_STRING, &THINNING_ARG,
+                "Frames every viewer gets: none (default), disposable (drops non-reference frames) or keyframes",
+                "LEVEL"},
+        {"rtx", 0, 0, G_OPTION_ARG_STRING, &RTX_MODE_ARG,
+                "Retransmission of NACKed packets: webrtcbin (default, RTX, one history per viewer), shared (one per source) or off",
+                "MODE"},
+        {"rtx-history", 0, 0, G_OPTION_ARG_INT, &RTX_HISTORY, "Time packets are kept for retransmission (default 1000)",
+                "MS"},
+        {"adaptive-fec", 0, 0, G_OPTION_ARG_NONE, &ADAPTIVE_FEC,
+                "Negotiate ULPFEC/RED and size every viewer's protection from its loss and RTT", NULL},
+        {"keyframe-request-interval", 0, 0, G_OPTION_ARG_INT, &KEYFRAME_REQUEST_INTERVAL,
+                "Minimum time between keyframe requests sent upstream, the viewers' PLI/FIR in between are merged (default 1000)",
+                "MS"},
+        {"keyframe-cache-age", 0, 0, G_OPTION_ARG_INT, &KEYFRAME_CACHE_AGE,
+                "Answer a viewer's PLI/FIR from the cached frames while the last keyframe is at most this old, 0 disables it (default 1000)",
+                "MS"},
+        {"adaptive-renditions", 0, 0, G_OPTION_ARG_NONE, &ADAPTIVE_RENDITIONS,
+                "Move every viewer between the renditions and thinning levels on a bandwidth estimate from its RTCP feedback",
+                NULL},
+        {"batched-egress", 0, 0, G_OPTION_ARG_NONE, &BATCHED_EGRESS,
+                "Send the media of all viewers from one thread with sendmmsg and UDP GSO instead of nicesink", NULL},
+        {"pacing", 0, 0, G_OPTION_ARG_NONE, &PACING,
+                "Pace every viewer's datagrams at 2.5x its bandwidth estimate instead of sending frames as bursts",
+                NULL},
+        {"impair-kbps", 0, 0, G_OPTION_ARG_INT, &IMPAIR_KBPS,
+                "Egress link rate of every viewer in the impairment stage, excess packets are dropped", "KBPS"},
+        {"impair-loss", 0, 0, G_OPTION_ARG_DOUBLE, &IMPAIR_LOSS,
+                "Random egress loss of every viewer in the impairment stage", "PERCENT"},
+        {"soak-cycles", 0, 0, G_OPTION_ARG_INT, &SOAK_CYCLES,
+                "Soak test: add and drop the viewers of the peer id argument N times, then exit (default off)", "N"},
+        {"soak-dwell", 0, 0, G_OPTION_ARG_INT, &SOAK_DWELL,
+                "Seconds the soak viewers stay connected in each cycle (default 5)", "SECONDS"},
+        {"soak-warmup", 0, 0, G_OPTION_ARG_INT, &SOAK_WARMUP,
+                "Soak cycles before the memory baseline is taken (default 3)", "N"},
+        {"soak-max-growth", 0, 0, G_OPTION_ARG_INT, &SOAK_MAX_GROWTH,
+                "RSS growth per soak cycle that fails the run (default 256)", "KB"},
+        {NULL}
+};
+
+#ifndef RTSP_WEBRTC_NO_MAIN //Defined by the benchmarks that include this file
+
 int
 main(int argc, char *argv[]) {
     signal(SIGSEGV, handler);
@@ -1272,6 +5777,7 @@ main(int argc, char *argv[]) {
 
     context = g_option_context_new("- gstreamer rtsp -> webrtc demo");
 
+    g_option_context_add_main_entries(context, entries, NULL);
     g_option_context_add_group(context, gst_init_get_option_group());
     if (!g_option_context_parse(context, &argc, &argv, &error)) {
         g_printerr("Error initializing: %s\n", error->message);
@@ -1281,32 +5787,212 @@ main(int argc, char *argv[]) {
     if (!check_plugins())
         return -1;
 
-    if (argc < 6) {
+    if (INGEST_ARG) {
+        if (g_strcmp0(INGEST_ARG, "pcap") == 0) {
+            INGEST_MODE = INGEST_PCAP;
+        } else if (g_strcmp0(INGEST_ARG, "rtsp") == 0) {
+            INGEST_MODE = INGEST_RTSP;
+        } else if (g_strcmp0(INGEST_ARG, "multicast") == 0) {
+            INGEST_MODE = INGEST_MULTICAST;
+        } else {
+            g_printerr("Unknown ingest %s\n", INGEST_ARG);
+            return -1;
+        }
+    }
+    if (PCAP_MODE_ARG) {
+        if (g_strcmp0(PCAP_MODE_ARG, "paced") == 0) {
+            PCAP_REPLAY_MODE = PCAP_REPLAY_PACED;
+        } else if (g_strcmp0(PCAP_MODE_ARG, "loop") == 0) {
+            PCAP_REPLAY_MODE = PCAP_REPLAY_LOOP;
+        } else if (g_strcmp0(PCAP_MODE_ARG, "max-speed") == 0) {
+            PCAP_REPLAY_MODE = PCAP_REPLAY_MAX_SPEED;
+        } else {
+            g_printerr("Unknown pcap mode %s\n", PCAP_MODE_ARG);
+            return -1;
+        }
+    }
+    if (RTSP_URL_ARG)
+        RTSP_URL = RTSP_URL_ARG;
+    if (RTSP_TRANSPORT_ARG)
+        RTSP_TRANSPORT = RTSP_TRANSPORT_ARG;
+    if (BACKUP_RTSP_URL_ARG) {
+        if (INGEST_MODE != INGEST_RTSP) {
+            g_printerr("--backup-rtsp-url needs --ingest=rtsp\n");
+            return -1;
+        }
+        BACKUP_RTSP_URL = BACKUP_RTSP_URL_ARG;
+    }
+    if (AUDIO && (INGEST_MODE != INGEST_RTSP || BACKUP_RTSP_URL_ARG)) {
+        g_printerr("--audio needs --ingest=rtsp without --backup-rtsp-url\n");
+        return -1;
+    }
+    if (MULTICAST_ADDRESS_ARG)
+        MULTICAST_ADDRESS = MULTICAST_ADDRESS_ARG;
+    if (MULTICAST_IFACE_ARG)
+        MULTICAST_IFACE = MULTICAST_IFACE_ARG;
+    if (MULTICAST_CAPS_ARG)
+        MULTICAST_CAPS = MULTICAST_CAPS_ARG;
+    if (SDP_FILE_ARG && !load_multicast_sdp(SDP_FILE_ARG))
+        return -1;
+    if (INGEST_MODE == INGEST_MULTICAST && (MULTICAST_ADDRESS.empty() || MULTICAST_PORT <= 0)) {
+        g_printerr("Multicast ingest needs --sdp-file or --multicast-address and --multicast-port\n");
+        return -1;
+    }
+    if (INGEST_MODE == INGEST_MULTICAST && caps_video_codec(MULTICAST_CAPS.c_str()) < 0) {
+        g_printerr("Unsupported video codec in multicast caps %s, expected H264, H265, VP8 or VP9\n",
+                   MULTICAST_CAPS.c_str());
+        return -1;
+    }
+    if (FALLBACK_CODEC_ARG) {
+        FALLBACK_CODEC = -1;
+        for (gint codec = 0; codec < CODEC_COUNT; codec++) {
+            if (g_strcmp0(FALLBACK_CODEC_ARG, VIDEO_CODECS[codec].name) == 0)
+                FALLBACK_CODEC = codec;
+        }
+        if (FALLBACK_CODEC < 0 && g_strcmp0(FALLBACK_CODEC_ARG, "none") != 0) {
+            g_printerr("Invalid fallback codec %s, expected h264, h265, vp8, vp9 or none\n", FALLBACK_CODEC_ARG);
+            return -1;
+        }
+    }
+    if (TRANSCODE_BITRATE < 1) {
+        g_printerr("Invalid transcode bitrate %d\n", TRANSCODE_BITRATE);
+        return -1;
+    }
+    if (RTSP_TRANSPORT != "auto" && RTSP_TRANSPORT != "udp" && RTSP_TRANSPORT != "tcp" &&
+        RTSP_TRANSPORT != "multicast") {
+        g_printerr("Unknown rtsp transport %s\n", RTSP_TRANSPORT.c_str());
+        return -1;
+    }
+
+    if (argc < 3 || (INGEST_MODE == INGEST_PCAP && argc < 6)) {
         g_printerr("Invalid no of args \n");
         return -1;
     }
 
+    if (METRICS_PORT < 0 || METRICS_PORT > 65535 || METRICS_INTERVAL < 1) {
+        g_printerr("Invalid metrics port %d or interval %d\n", METRICS_PORT, METRICS_INTERVAL);
+        return -1;
+    }
+
+    if (PEER_RAMP_RATE <= 0) {
+        g_printerr("Invalid peer ramp rate %f\n", PEER_RAMP_RATE);
+        return -1;
+    }
+
+    if (JITTERBUFFER_MIN_LATENCY < 0 || JITTERBUFFER_MIN_LATENCY > JITTERBUFFER_MAX_LATENCY) {
+        g_printerr("Invalid jitterbuffer latency bounds %d - %d ms\n", JITTERBUFFER_MIN_LATENCY,
+                   JITTERBUFFER_MAX_LATENCY);
+        return -1;
+    }
+
+    if (RENDITIONS_ARG && (!parse_renditions(RENDITIONS_ARG) || !check_ladder_elements()))
+        return -1;
+    if (RENDITIONS.size() > 1 && INGEST_MODE == INGEST_MULTICAST &&
+        caps_video_codec(MULTICAST_CAPS.c_str()) != CODEC_H264) {
+        g_printerr("--renditions needs an H264 camera\n");
+        return -1;
+    }
+    if (KEYFRAME_REQUEST_INTERVAL < 0 || KEYFRAME_CACHE_AGE < 0) {
+        g_printerr("Invalid keyframe request interval %d or cache age %d\n", KEYFRAME_REQUEST_INTERVAL,
+                   KEYFRAME_CACHE_AGE);
+        return -1;
+    }
+    //The egress flushes whole frames at once, which is what the pacer spreads out
+    if (BATCHED_EGRESS && PACING) {
+        g_printerr("--batched-egress and --pacing cannot be combined\n");
+        return -1;
+    }
+    if (RTX_MODE_ARG) {
+        RTX_MODE = -1;
+        for (gint index = RTX_OFF; index <= RTX_SHARED; index++) {
+            if (g_strcmp0(RTX_MODE_ARG, RTX_MODE_NAMES[index]) == 0)
+                RTX_MODE = index;
+        }
+    }
+    //ulpfecenc renumbers the media packets behind the payloader, which the shared history cannot follow
+    if (ADAPTIVE_FEC && RTX_MODE == RTX_SHARED) {
+        g_printerr("--adaptive-fec needs --rtx=webrtcbin or --rtx=off\n");
+        return -1;
+    }
+    if (RTX_MODE < 0 || RTX_HISTORY < 1) {
+        g_printerr("Invalid rtx mode %s or history %d, expected webrtcbin, shared or off\n", RTX_MODE_ARG,
+                   RTX_HISTORY);
+        return -1;
+    }
+    if (THINNING_ARG) {
+        THINNING = -1;
+        for (gint index = THIN_NONE; index <= THIN_KEYFRAMES; index++) {
+            if (g_strcmp0(THINNING_ARG, THINNING_NAMES[index]) == 0)
+                THINNING = index;
+        }
+        if (THINNING < 0) {
+            g_printerr("Invalid thinning %s, expected none, disposable or keyframes\n", THINNING_ARG);
+            return -1;
+        }
+    }
+    if (IMPAIR_KBPS < 0 || IMPAIR_LOSS < 0 || IMPAIR_LOSS > 100) {
+        g_printerr("Invalid impairment of %d kbps and %f%% loss\n", IMPAIR_KBPS, IMPAIR_LOSS);
+        return -1;
+    }
+    DEFAULT_RENDITION = find_rendition(DEFAULT_RENDITION_HEIGHT);
+    if (DEFAULT_RENDITION < 0) {
+        g_printerr("No rendition of height %d for --default-rendition\n", DEFAULT_RENDITION_HEIGHT);
+        return -1;
+    }
+
+    if (SOAK_CYCLES > 0 && (SOAK_WARMUP < 1 || SOAK_WARMUP >= SOAK_CYCLES || SOAK_DWELL < 0)) {
+        g_printerr("Soak needs more cycles than warmup cycles (at least 1), got %d and %d\n", SOAK_CYCLES,
+                   SOAK_WARMUP);
+        return -1;
+    }
+
     SIGNAL_SERVER = argv[1];
     PEER_ID = argv[2];
-    PCAP_PATH = argv[3];
-    PCAP_SRC_IP = argv[4];
-    PCAP_SRC_PORT = argv[5];
+    if (INGEST_MODE == INGEST_PCAP) {
+        PCAP_PATH = argv[3];
+        PCAP_SRC_IP = argv[4];
+        PCAP_SRC_PORT = argv[5];
+    } else {
+        check_udp_buffer_limit();
+    }
+
+    //The soak cycles add the viewers themselves
+    if (SOAK_CYCLES > 0)
+        START_WEBRTC = false;
 
     //Start base pipeline
     RtspPipelineHandlerPtr rtspPipelineHandlerPtr = std::make_shared<RtspPipelineHandler>();
     rtspPipelineHandlerPtr->pipeline_execution_id = generate_random_int();
     rtspPipelineHandlerPtr->device_id = "";
-    rtspPipelineHandlerPtr->rtsp_url = "rtsp://10.142.138.91/z3-1.mp4";
+    rtspPipelineHandlerPtr->rtsp_url = RTSP_URL;
+    rtspPipelineHandlerPtr->backup_rtsp_url = BACKUP_RTSP_URL;
+    //Before the startup viewer can attach and spawn the egress thread
+    if (BATCHED_EGRESS)
+        batchedEgress.start();
     rtspPipelineHandlerPtr->start_streaming();
     if (rtspPipelineHandlerPtr->pipeline == NULL) {
         g_print("Pipeline cannot be created \n");
         return 0;
     }
-    pipelineHandlers[rtspPipelineHandlerPtr->pipeline_execution_id] = rtspPipelineHandlerPtr;
+    {
+        std::lock_guard<std::mutex> guard(handlers_lock);
+        pipelineHandlers[rtspPipelineHandlerPtr->pipeline_execution_id] = rtspPipelineHandlerPtr;
+    }
+    if (METRICS_PORT > 0)
+        metricsCollector.start(METRICS_PORT, METRICS_INTERVAL);
+    if (SOAK_CYCLES > 0)
+        return run_soak(rtspPipelineHandlerPtr.get());
     while (true) {
-        cout << "Blocking here \n";
-        std::string example;
-        getline(cin, example);
+        cout << "Enter a peer id or a range FIRST-LAST of peer ids to add viewers, joins, rendition ID HEIGHT, thin ID LEVEL or impair ID KBPS [LOSS] \n";
+        std::string line;
+        if (!getline(cin, line)) {
+            //No terminal, keep serving the viewers we have
+            while (true)
+                std::this_thread::sleep_for(std::chrono::seconds(60));
+        }
+        add_webrtc_peers(rtspPipelineHandlerPtr.get(), line);
     }
     return 0;
 }
+
+#endif //RTSP_WEBRTC_NO_MAIN
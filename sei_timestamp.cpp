@@ -0,0 +1,185 @@
+//
+// H.264 user data unregistered SEI carrying a wallclock timestamp.
+//
+#include "sei_timestamp.h"
+
+#include <string.h>
+
+#define NAL_TYPE_SEI 6
+#define NAL_TYPE_AUD 9
+#define SEI_USER_DATA_UNREGISTERED 5
+#define SEI_TIMESTAMP_PAYLOAD_SIZE 24 //UUID and 64 bit timestamp
+
+//Identifies our SEI among others an encoder may add
+static const uint8_t SEI_TIMESTAMP_UUID[16] = {
+        0x8e, 0x5c, 0x2a, 0x61, 0x3f, 0x0b, 0x4d, 0x7e, 0x9a, 0x14, 0xc2, 0x55, 0x6d, 0x31, 0xe0, 0x47
+};
+
+bool h264_avc_length_size(const uint8_t *codec_data, size_t size, unsigned *length_size) {
+    if (size < 5 || codec_data[0] != 1)
+        return false;
+    *length_size = (codec_data[4] & 0x03) + 1;
+    return *length_size != 3;
+}
+
+void update_h264_framing(GstCaps *caps, H264Framing *framing) {
+    GstStructure *structure = gst_caps_get_structure(caps, 0);
+    const GValue *codec_data = gst_structure_get_value(structure, "codec_data");
+
+    framing->byte_stream = g_strcmp0(gst_structure_get_string(structure, "stream-format"), "byte-stream") == 0;
+    framing->length_size = 4;
+    if (!framing->byte_stream && codec_data && GST_VALUE_HOLDS_BUFFER (codec_data)) {
+        GstMapInfo map;
+        GstBuffer *buffer = gst_value_get_buffer(codec_data);
+        if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            h264_avc_length_size(map.data, map.size, &framing->length_size);
+            gst_buffer_unmap(buffer, &map);
+        }
+    }
+}
+
+std::vector<uint8_t> sei_timestamp_nal(int64_t wallclock_us, const H264Framing &framing) {
+    std::vector<uint8_t> rbsp, nal;
+
+    rbsp.push_back(SEI_USER_DATA_UNREGISTERED);
+    rbsp.push_back(SEI_TIMESTAMP_PAYLOAD_SIZE);
+    rbsp.insert(rbsp.end(), SEI_TIMESTAMP_UUID, SEI_TIMESTAMP_UUID + sizeof(SEI_TIMESTAMP_UUID));
+    for (int shift = 56; shift >= 0; shift -= 8)
+        rbsp.push_back((uint8_t) ((uint64_t) wallclock_us >> shift));
+    rbsp.push_back(0x80); //rbsp_trailing_bits
+
+    //Emulation prevention, no 00 00 0x (x <= 3) inside the NAL
+    nal.push_back(NAL_TYPE_SEI);
+    unsigned zeros = 0;
+    for (uint8_t byte : rbsp) {
+        if (zeros == 2 && byte <= 3) {
+            nal.push_back(3);
+            zeros = 0;
+        }
+        nal.push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+
+    std::vector<uint8_t> framed;
+    if (framing.byte_stream) {
+        framed = {0, 0, 0, 1};
+    } else {
+        for (int i = (int) framing.length_size - 1; i >= 0; i--)
+            framed.push_back((uint8_t) (nal.size() >> (8 * i)));
+    }
+    framed.insert(framed.end(), nal.begin(), nal.end());
+    return framed;
+}
+
+/* Walks the NALs of an access unit, calling visit(nal, nal_size, nal_offset) until it returns false */
+template<typename Visitor>
+static void for_each_nal(const uint8_t *au, size_t size, const H264Framing &framing, Visitor visit) {
+    if (!framing.byte_stream) {
+        size_t offset = 0;
+        while (offset + framing.length_size <= size) {
+            size_t nal_size = 0;
+            for (unsigned i = 0; i < framing.length_size; i++)
+                nal_size = (nal_size << 8) | au[offset + i];
+            size_t nal_offset = offset + framing.length_size;
+            if (nal_size == 0 || nal_offset + nal_size > size)
+                return;
+            if (!visit(au + nal_offset, nal_size, offset))
+                return;
+            offset = nal_offset + nal_size;
+        }
+        return;
+    }
+
+    //Start codes, the NAL ends where the next start code begins
+    size_t start = size, prefix_start = 0;
+    for (size_t i = 0; i + 2 < size; i++) {
+        if (au[i] != 0 || au[i + 1] != 0 || au[i + 2] != 1)
+            continue;
+        size_t prefix = i > 0 && au[i - 1] == 0 ? i - 1 : i;
+        if (start < size && !visit(au + start, prefix - start, prefix_start))
+            return;
+        start = i + 3;
+        prefix_start = prefix;
+        i += 2;
+    }
+    if (start < size)
+        visit(au + start, size - start, prefix_start);
+}
+
+int h264_au_nal_ref_idc(const uint8_t *au, size_t size, const H264Framing &framing) {
+    int ref_idc = -1;
+    for_each_nal(au, size, framing, [&](const uint8_t *nal, size_t nal_size, size_t) {
+        unsigned type = nal[0] & 0x1f;
+        if (nal_size > 0 && type >= 1 && type <= 5 && (int) (nal[0] >> 5) > ref_idc)
+            ref_idc = nal[0] >> 5;
+        return ref_idc <= 0;
+    });
+    return ref_idc;
+}
+
+size_t sei_timestamp_insert_offset(const uint8_t *au, size_t size, const H264Framing &framing) {
+    size_t offset = 0;
+    bool first = true;
+    for_each_nal(au, size, framing, [&](const uint8_t *nal, size_t, size_t nal_offset) {
+        if (first && (nal[0] & 0x1f) == NAL_TYPE_AUD) {
+            first = false;
+            return true;
+        }
+        offset = first ? 0 : nal_offset;
+        return false;
+    });
+    return offset;
+}
+
+bool sei_timestamp_find(const uint8_t *au, size_t size, const H264Framing &framing, int64_t *wallclock_us) {
+    bool found = false;
+    for_each_nal(au, size, framing, [&](const uint8_t *nal, size_t nal_size, size_t) {
+        unsigned type = nal[0] & 0x1f;
+        if (type >= 1 && type <= 5)
+            return false; //SEI precede the slices
+        if (type != NAL_TYPE_SEI)
+            return true;
+
+        //Undo emulation prevention
+        std::vector<uint8_t> rbsp;
+        unsigned zeros = 0;
+        for (size_t i = 1; i < nal_size; i++) {
+            if (zeros == 2 && nal[i] == 3) {
+                zeros = 0;
+                continue;
+            }
+            rbsp.push_back(nal[i]);
+            zeros = nal[i] == 0 ? zeros + 1 : 0;
+        }
+
+        //sei_message()s up to the trailing bits
+        size_t offset = 0;
+        while (offset + 2 <= rbsp.size() && rbsp[offset] != 0x80) {
+            unsigned payload_type = 0, payload_size = 0;
+            while (offset < rbsp.size() && rbsp[offset] == 0xff)
+                payload_type += rbsp[offset++];
+            if (offset >= rbsp.size())
+                break;
+            payload_type += rbsp[offset++];
+            while (offset < rbsp.size() && rbsp[offset] == 0xff)
+                payload_size += rbsp[offset++];
+            if (offset >= rbsp.size())
+                break;
+            payload_size += rbsp[offset++];
+            if (offset + payload_size > rbsp.size())
+                break;
+            if (payload_type == SEI_USER_DATA_UNREGISTERED && payload_size == SEI_TIMESTAMP_PAYLOAD_SIZE &&
+                memcmp(&rbsp[offset], SEI_TIMESTAMP_UUID, sizeof(SEI_TIMESTAMP_UUID)) == 0) {
+                uint64_t value = 0;
+                for (size_t i = 0; i < 8; i++)
+                    value = (value << 8) | rbsp[offset + sizeof(SEI_TIMESTAMP_UUID) + i];
+                *wallclock_us = (int64_t) value;
+                found = true;
+                return false;
+            }
+            offset += payload_size;
+        }
+        return true;
+    });
+    return found;
+}
@@ -0,0 +1,37 @@
+//
+// H.264 user data unregistered SEI carrying a wallclock timestamp, inserted by rtsp2webrtc_1_n in front of the
+// videotee and read back by webrtc_client_peer after depayloading to measure glass-to-glass latency.
+//
+#ifndef GST_WEBRTC_EXAMPLE_SEI_TIMESTAMP_H
+#define GST_WEBRTC_EXAMPLE_SEI_TIMESTAMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <gst/gst.h>
+
+/* Access unit framing, as in the stream-format of video/x-h264 caps */
+struct H264Framing {
+    bool byte_stream = false;
+    unsigned length_size = 4; //NAL length prefix bytes of stream-format=avc, from codec_data
+};
+
+/* Framing from video/x-h264 caps, for the SEI to match the access units */
+void update_h264_framing(GstCaps *caps, H264Framing *framing);
+
+/* Reads the NAL length size of avc codec_data (AVCDecoderConfigurationRecord), false when malformed */
+bool h264_avc_length_size(const uint8_t *codec_data, size_t size, unsigned *length_size);
+
+/* Highest nal_ref_idc of the slices of an access unit, 0 when no other frame references it, -1 without slices */
+int h264_au_nal_ref_idc(const uint8_t *au, size_t size, const H264Framing &framing);
+
+/* SEI NAL with the timestamp (us) including its start code or length prefix */
+std::vector<uint8_t> sei_timestamp_nal(int64_t wallclock_us, const H264Framing &framing);
+
+/* Offset in the access unit to insert the SEI at, after an access unit delimiter if there is one */
+size_t sei_timestamp_insert_offset(const uint8_t *au, size_t size, const H264Framing &framing);
+
+/* Finds our SEI in the NALs of an access unit before its first slice */
+bool sei_timestamp_find(const uint8_t *au, size_t size, const H264Framing &framing, int64_t *wallclock_us);
+
+#endif //GST_WEBRTC_EXAMPLE_SEI_TIMESTAMP_H
@@ -0,0 +1,735 @@
+//
+// Deterministic timing tests of the pipeline built by start_streaming(). A GstTestClock drives the
+// pcap replay and the jitterbuffer, a synthetic capture is the camera and stand-in branches take the
+// place of the webrtcbin viewers, so per-buffer times, drops and latency are exact and repeatable.
+//
+#define RTSP_WEBRTC_NO_MAIN
+
+#include "rtsp_webrtc_1_n.cpp"
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gsttestclock.h>
+#include <glib/gstdio.h>
+#include <set>
+
+#define TEST_FPS 30
+#define TEST_FRAMES 60 //Two seconds, the tests stop before the replay loops
+#define TEST_LATENCY_MS 100
+#define TEST_LATENCY_BUDGET (120 * GST_MSECOND) //Worst case from ingest to a viewer
+#define TEST_SRC_IP "10.0.0.1"
+#define TEST_SRC_PORT 5004
+#define TEST_SETTLE_ROUNDS 4 //Unchanged polls after which the pipeline counts as idle
+#define TEST_REPLAY_JOIN 5 //Frame after which the viewer of the replay test joins, within the replay window
+#define TEST_PACING_KBPS 2 //Far below the keyframe burst, so the pacer holds its datagrams
+#define TEST_DRAIN_MS 5000 //Real time the replay and the pacer may still sleep after the last crank
+
+static GstClockTime frame_due(guint frame) {
+    return gst_util_uint64_scale(frame, GST_SECOND, TEST_FPS);
+}
+
+/* Exp-Golomb writer for the handful of parameter sets and slice headers of the synthetic stream */
+class BitWriter {
+
+public:
+    std::vector<guint8> bytes;
+
+    void put(guint32 value, guint bits) {
+        for (gint i = bits - 1; i >= 0; i--) {
+            if (used % 8 == 0)
+                bytes.push_back(0);
+            bytes.back() |= ((value >> i) & 1) << (7 - used % 8);
+            used++;
+        }
+    }
+
+    void ue(guint32 value) {
+        guint bits = g_bit_storage(value + 1);
+        put(0, bits - 1);
+        put(value + 1, bits);
+    }
+
+    void se(gint32 value) {
+        ue(value > 0 ? 2 * value - 1 : -2 * value);
+    }
+
+    void trailing(void) {
+        put(1, 1);
+        while (used % 8)
+            put(0, 1);
+    }
+
+private:
+    guint used = 0;
+};
+
+static std::vector<guint8> nal_unit(guint8 header, BitWriter &rbsp) {
+    std::vector<guint8> nal(1, header);
+    guint zeros = 0;
+    for (guint8 byte : rbsp.bytes) {
+        //Emulation prevention
+        if (zeros == 2 && byte <= 3) {
+            nal.push_back(3);
+            zeros = 0;
+        }
+        nal.push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+    return nal;
+}
+
+/* Baseline 320x240, poc type 2 and a 4 bit frame_num */
+static std::vector<guint8> make_sps(void) {
+    BitWriter rbsp;
+    rbsp.put(66, 8); //profile_idc
+    rbsp.put(0xc0, 8); //constraint_set0/1
+    rbsp.put(13, 8); //level_idc
+    rbsp.ue(0); //seq_parameter_set_id
+    rbsp.ue(0); //log2_max_frame_num_minus4
+    rbsp.ue(2); //pic_order_cnt_type
+    rbsp.ue(1); //max_num_ref_frames
+    rbsp.put(0, 1); //gaps_in_frame_num_value_allowed_flag
+    rbsp.ue(320 / 16 - 1);
+    rbsp.ue(240 / 16 - 1);
+    rbsp.put(1, 1); //frame_mbs_only_flag
+    rbsp.put(1, 1); //direct_8x8_inference_flag
+    rbsp.put(0, 1); //frame_cropping_flag
+    rbsp.put(0, 1); //vui_parameters_present_flag
+    rbsp.trailing();
+    return nal_unit(0x67, rbsp);
+}
+
+static std::vector<guint8> make_pps(void) {
+    BitWriter rbsp;
+    rbsp.ue(0); //pic_parameter_set_id
+    rbsp.ue(0); //seq_parameter_set_id
+    rbsp.put(0, 1); //entropy_coding_mode_flag
+    rbsp.put(0, 1); //bottom_field_pic_order_in_frame_present_flag
+    rbsp.ue(0); //num_slice_groups_minus1
+    rbsp.ue(0); //num_ref_idx_l0_default_active_minus1
+    rbsp.ue(0); //num_ref_idx_l1_default_active_minus1
+    rbsp.put(0, 1); //weighted_pred_flag
+    rbsp.put(0, 2); //weighted_bipred_idc
+    rbsp.se(0); //pic_init_qp_minus26
+    rbsp.se(0); //pic_init_qs_minus26
+    rbsp.se(0); //chroma_qp_index_offset
+    rbsp.put(1, 1); //deblocking_filter_control_present_flag
+    rbsp.put(0, 1); //constrained_intra_pred_flag
+    rbsp.put(0, 1); //redundant_pic_cnt_present_flag
+    rbsp.trailing();
+    return nal_unit(0x68, rbsp);
+}
+
+/* Slice header of a whole frame followed by filler standing in for the macroblocks */
+static std::vector<guint8> make_slice(gboolean idr, guint frame_num) {
+    BitWriter rbsp;
+    rbsp.ue(0); //first_mb_in_slice
+    rbsp.ue(idr ? 7 : 5); //I or P, all slices of the picture
+    rbsp.ue(0); //pic_parameter_set_id
+    rbsp.put(frame_num % 16, 4);
+    if (idr) {
+        rbsp.ue(0); //idr_pic_id
+        rbsp.put(0, 1); //no_output_of_prior_pics_flag
+        rbsp.put(0, 1); //long_term_reference_flag
+    } else {
+        rbsp.put(0, 1); //num_ref_idx_active_override_flag
+        rbsp.put(0, 1); //ref_pic_list_modification_flag_l0
+        rbsp.put(0, 1); //adaptive_ref_pic_marking_mode_flag
+    }
+    rbsp.se(0); //slice_qp_delta
+    rbsp.ue(1); //disable_deblocking_filter_idc
+    rbsp.trailing();
+    rbsp.bytes.insert(rbsp.bytes.end(), idr ? 400 : 80, 0x5a);
+    return nal_unit(idr ? 0x65 : 0x41, rbsp);
+}
+
+struct TestPacket {
+    GstClockTime capture; //Offset from the first packet
+    std::vector<guint8> rtp;
+};
+
+/* One single NAL unit packet per NAL, SPS, PPS and the IDR share the first frame */
+static std::vector<TestPacket> make_stream(const std::set<guint> &dropped_frames) {
+    std::vector<TestPacket> packets;
+    guint16 seq = 0;
+
+    for (guint frame = 0; frame < TEST_FRAMES; frame++) {
+        std::vector<std::vector<guint8> > nals;
+        if (frame == 0) {
+            nals.push_back(make_sps());
+            nals.push_back(make_pps());
+        }
+        nals.push_back(make_slice(frame == 0, frame));
+        for (size_t i = 0; i < nals.size(); i++) {
+            guint32 rtptime = frame * (PCAP_RTP_CLOCK_RATE / TEST_FPS);
+            guint8 header[12] = {0x80, (guint8) (96 | (i + 1 == nals.size() ? 0x80 : 0)),
+                                 (guint8) (seq >> 8), (guint8) seq,
+                                 (guint8) (rtptime >> 24), (guint8) (rtptime >> 16), (guint8) (rtptime >> 8),
+                                 (guint8) rtptime, 0x11, 0x22, 0x33, 0x44};
+            seq++;
+            //Dropped frames keep their sequence numbers, the gap is what the jitterbuffer sees
+            if (dropped_frames.count(frame))
+                continue;
+            TestPacket packet;
+            packet.capture = frame_due(frame);
+            packet.rtp.assign(header, header + sizeof(header));
+            packet.rtp.insert(packet.rtp.end(), nals[i].begin(), nals[i].end());
+            packets.push_back(packet);
+        }
+    }
+    return packets;
+}
+
+static void put_le32(std::string &out, guint32 value) {
+    value = GUINT32_TO_LE(value);
+    out.append((const char *) &value, 4);
+}
+
+static void put_le16(std::string &out, guint16 value) {
+    value = GUINT16_TO_LE(value);
+    out.append((const char *) &value, 2);
+}
+
+static void put_be16(std::string &out, guint16 value) {
+    value = GUINT16_TO_BE(value);
+    out.append((const char *) &value, 2);
+}
+
+/* Nanosecond libpcap file of Ethernet/IPv4/UDP frames from TEST_SRC_IP:TEST_SRC_PORT */
+static void write_pcap(const std::string &path, const std::vector<TestPacket> &packets) {
+    std::string out;
+    guint64 epoch = 1700000000ull * GST_SECOND;
+    guint16 ip_id = 0;
+
+    put_le32(out, 0xa1b23c4d);
+    put_le16(out, 2);
+    put_le16(out, 4);
+    put_le32(out, 0);
+    put_le32(out, 0);
+    put_le32(out, 65535);
+    put_le32(out, 1); //Ethernet
+    for (const TestPacket &packet : packets) {
+        guint64 timestamp = epoch + packet.capture;
+        guint udp_len = 8 + packet.rtp.size();
+        guint frame_len = 14 + 20 + udp_len;
+        const guint8 ip_header[] = {10, 0, 0, 1, 10, 0, 0, 2};
+
+        put_le32(out, (guint32) (timestamp / GST_SECOND));
+        put_le32(out, (guint32) (timestamp % GST_SECOND));
+        put_le32(out, frame_len);
+        put_le32(out, frame_len);
+        out.append(12, '\0'); //MAC addresses
+        put_be16(out, 0x0800);
+        out.push_back(0x45);
+        out.push_back(0);
+        put_be16(out, 20 + udp_len);
+        put_be16(out, ip_id++);
+        put_be16(out, 0); //Not fragmented
+        out.push_back(64);
+        out.push_back(17);
+        put_be16(out, 0);
+        out.append((const char *) ip_header, sizeof(ip_header));
+        put_be16(out, TEST_SRC_PORT);
+        put_be16(out, TEST_SRC_PORT);
+        put_be16(out, udp_len);
+        put_be16(out, 0);
+        out.append((const char *) packet.rtp.data(), packet.rtp.size());
+    }
+    fail_unless(g_file_set_contents(path.c_str(), out.data(), out.size(), NULL));
+}
+
+/* Running times at which buffers passed a pad, with their PTS */
+struct PadTimes {
+    std::vector<GstClockTime> arrival;
+    std::vector<GstClockTime> pts;
+    std::vector<gboolean> keyframe;
+    std::vector<gint64> wall; //Monotonic us, the replay and the pacer sleep in real time
+};
+
+static std::mutex test_lock; //Guards the PadTimes below and test_events
+static guint64 test_events = 0; //Buffers seen by any probe, part of the idle check
+static PadTimes jitterbuffer_in;
+static PadTimes jitterbuffer_out;
+static std::map<std::string, PadTimes> standin_frames; //Access units reaching each stand-in payloader
+static std::map<std::string, std::vector<guint16> > standin_packets; //RTP sequence numbers reaching each stand-in sink
+
+/* Fixture setup, the recordings are process globals and CK_FORK=no runs every test in one process */
+static void reset_recordings(void) {
+    std::lock_guard<std::mutex> guard(test_lock);
+    test_events = 0;
+    jitterbuffer_in = PadTimes();
+    jitterbuffer_out = PadTimes();
+    standin_frames.clear();
+    standin_packets.clear();
+}
+
+static GstClockTime running_time(GstPad *pad) {
+    GstElement *element = gst_pad_get_parent_element(pad);
+    GstClockTime now = gst_clock_get_time(PIPELINE_CLOCK) - gst_element_get_base_time(element);
+    gst_object_unref(element);
+    return now;
+}
+
+static GstPadProbeReturn record_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    PadTimes *times = static_cast<PadTimes *>(user_data);
+    GstClockTime now = running_time(pad);
+    std::lock_guard<std::mutex> guard(test_lock);
+    times->arrival.push_back(now);
+    times->pts.push_back(GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info)));
+    times->keyframe.push_back(!GST_BUFFER_FLAG_IS_SET (GST_PAD_PROBE_INFO_BUFFER (info), GST_BUFFER_FLAG_DELTA_UNIT));
+    times->wall.push_back(g_get_monotonic_time());
+    test_events++;
+    return GST_PAD_PROBE_OK;
+}
+
+static gboolean record_sequence(GstBuffer **buffer, guint idx, gpointer user_data) {
+    guint8 header[4];
+    if (gst_buffer_extract(*buffer, 0, header, sizeof(header)) == sizeof(header))
+        static_cast<std::vector<guint16> *>(user_data)->push_back(GST_READ_UINT16_BE (header + 2));
+    return TRUE;
+}
+
+static GstPadProbeReturn record_packets_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    std::lock_guard<std::mutex> guard(test_lock);
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+        gst_buffer_list_foreach(GST_PAD_PROBE_INFO_BUFFER_LIST (info), record_sequence, user_data);
+    } else {
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+        record_sequence(&buffer, 0, user_data);
+    }
+    test_events++;
+    return GST_PAD_PROBE_OK;
+}
+
+static void add_record_probe(GstElement *pipeline, const gchar *element_name, const gchar *pad_name,
+                             PadTimes *times) {
+    GstElement *element = gst_bin_get_by_name(GST_BIN (pipeline), element_name);
+    fail_unless(element != NULL, "no %s in the pipeline", element_name);
+    GstPad *pad = gst_element_get_static_pad(element, pad_name);
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, record_probe, times, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(element);
+}
+
+/* Everything start_webrtcbin() puts in front of webrtcbin, ending in a fakesink instead. With a viewer, its
+ * keyframe request and replay probes go on the queue and its pacer on the fakesink, where nicesink would be */
+static void add_standin_viewer(GstElement *pipeline, const std::string &peer_id, WebrtcViewer *viewer = NULL) {
+    gchar *description = g_strdup_printf("queue name=queue-%s ! rtph264pay name=rtph264pay-%s config-interval=-1 "
+                                         "pt=96 ! fakesink name=%s sync=FALSE async=FALSE",
+                                         peer_id.c_str(), peer_id.c_str(), peer_id.c_str());
+    GstElement *branch = gst_parse_bin_from_description(description, TRUE, NULL);
+    g_free(description);
+    fail_unless(branch != NULL);
+    gst_bin_add(GST_BIN (pipeline), branch);
+
+    PadTimes *times;
+    {
+        std::lock_guard<std::mutex> guard(test_lock);
+        times = &standin_frames[peer_id];
+    }
+    GstElement *pay = gst_bin_get_by_name(GST_BIN (branch), ("rtph264pay-" + peer_id).c_str());
+    GstPad *pad = gst_element_get_static_pad(pay, "sink");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, record_probe, times, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(pay);
+
+    if (viewer) {
+        GstElement *queue = gst_bin_get_by_name(GST_BIN (branch), ("queue-" + peer_id).c_str());
+        pad = gst_element_get_static_pad(queue, "src");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_EVENT_UPSTREAM, keyframe_request_probe, viewer, NULL);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_replay_probe, viewer, NULL);
+        gst_object_unref(pad);
+        gst_object_unref(queue);
+    }
+
+    std::vector<guint16> *packets;
+    {
+        std::lock_guard<std::mutex> guard(test_lock);
+        packets = &standin_packets[peer_id];
+    }
+    GstElement *sink = gst_bin_get_by_name(GST_BIN (branch), peer_id.c_str());
+    pad = gst_element_get_static_pad(sink, "sink");
+    if (viewer)
+        gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                          pacing_probe, viewer, NULL);
+    gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+                      record_packets_probe, packets, NULL);
+    gst_object_unref(pad);
+    gst_object_unref(sink);
+
+    GstElement *tee = gst_bin_get_by_name(GST_BIN (pipeline), "videotee");
+    GstPad *srcpad = gst_element_get_request_pad(tee, "src_%u");
+    GstPad *sinkpad = gst_element_get_static_pad(branch, "sink");
+    fail_unless_equals_int(gst_pad_link(srcpad, sinkpad), GST_PAD_LINK_OK);
+    gst_object_unref(sinkpad);
+    gst_object_unref(srcpad);
+    gst_object_unref(tee);
+    fail_unless(gst_element_sync_state_with_parent(branch));
+}
+
+static PadTimes standin(const std::string &peer_id) {
+    std::lock_guard<std::mutex> guard(test_lock);
+    return standin_frames[peer_id];
+}
+
+static std::vector<guint16> standin_sequences(const std::string &peer_id) {
+    std::lock_guard<std::mutex> guard(test_lock);
+    return standin_packets[peer_id];
+}
+
+/* A viewer whose probes are on a stand-in branch, connected as far as the probes are concerned */
+static WebrtcViewerPtr make_probed_viewer(GstElement *pipeline, const std::string &peer_id) {
+    WebrtcViewerPtr viewer = std::make_shared<WebrtcViewer>();
+    viewer->peer_id = peer_id;
+    viewer->pipeline = pipeline;
+    viewer->webrtc1 = NULL;
+    viewer->timeline.mark(JOIN_DTLS_CONNECTED);
+    return viewer;
+}
+
+/* PLI of a viewer as webrtcbin turns it into an event, upstream from the payloader */
+static void send_keyframe_request(GstElement *pipeline, const std::string &peer_id) {
+    GstElement *pay = gst_bin_get_by_name(GST_BIN (pipeline), ("rtph264pay-" + peer_id).c_str());
+    GstPad *pad = gst_element_get_static_pad(pay, "sink");
+    gst_pad_push_event(pad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                                 gst_structure_new("GstForceKeyUnit", "all-headers",
+                                                                   G_TYPE_BOOLEAN, TRUE, NULL)));
+    gst_object_unref(pad);
+    gst_object_unref(pay);
+}
+
+/* The replay and the pacer sleep on the streaming thread in real time, past the last crank of the clock */
+static void wait_for_packets(const std::string &peer_id, size_t count) {
+    gint64 deadline = g_get_monotonic_time() + TEST_DRAIN_MS * 1000;
+    while (standin_sequences(peer_id).size() < count && g_get_monotonic_time() < deadline)
+        g_usleep(2000);
+    fail_unless_equals_int(standin_sequences(peer_id).size(), count);
+}
+
+/* Waits in real time until the streaming threads are done with the last crank: no buffers move,
+ * appsrc is drained and the set of clock waits is stable */
+static void settle(GstTestClock *clock, GstElement *appsrc) {
+    guint64 last = G_MAXUINT64;
+    guint stable = 0;
+
+    for (guint round = 0; round < 2000 && stable < TEST_SETTLE_ROUNDS; round++) {
+        guint64 queued, events;
+        g_object_get(appsrc, "current-level-bytes", &queued, NULL);
+        {
+            std::lock_guard<std::mutex> guard(test_lock);
+            events = test_events;
+        }
+        guint64 snapshot = (events << 24) ^ (gst_test_clock_peek_id_count(clock) << 16) ^ queued;
+        stable = snapshot == last && queued == 0 ? stable + 1 : 0;
+        last = snapshot;
+        g_usleep(2000);
+    }
+    fail_unless(stable >= TEST_SETTLE_ROUNDS, "pipeline did not settle");
+}
+
+/* Releases every clock wait up to target in time order, letting the pipeline settle after each */
+static void run_until(GstTestClock *clock, GstElement *appsrc, GstClockTime target) {
+    GstClockID id;
+
+    settle(clock, appsrc);
+    while (gst_test_clock_peek_next_pending_id(clock, &id)) {
+        GstClockTime time = gst_clock_id_get_time(id);
+        gst_clock_id_unref(id);
+        if (time > target)
+            break;
+        gst_test_clock_crank(clock);
+        settle(clock, appsrc);
+    }
+    if (gst_clock_get_time(GST_CLOCK (clock)) < target)
+        gst_test_clock_set_time(clock, target);
+    settle(clock, appsrc);
+}
+
+/* The server pipeline on a test clock, replaying the synthetic capture without webrtc peers */
+class TimingPipeline {
+
+public:
+    RtspPipelineHandlerPtr handler;
+    GstTestClock *clock = NULL;
+    GstElement *appsrc = NULL;
+    gchar *directory = NULL;
+
+    explicit TimingPipeline(const std::set<guint> &dropped_frames, PcapReplayMode mode = PCAP_REPLAY_LOOP) {
+        directory = g_dir_make_tmp("pipeline-timing-XXXXXX", NULL);
+        fail_unless(directory != NULL);
+        std::string pcap = std::string(directory) + "/camera.pcap";
+        write_pcap(pcap, make_stream(dropped_frames));
+
+        clock = GST_TEST_CLOCK (gst_test_clock_new());
+        PIPELINE_CLOCK = GST_CLOCK (clock);
+        INGEST_MODE = INGEST_PCAP;
+        PCAP_REPLAY_MODE = mode; //Looping never reaches EOS
+        PCAP_PATH = pcap;
+        PCAP_SRC_IP = TEST_SRC_IP;
+        PCAP_SRC_PORT = std::to_string(TEST_SRC_PORT);
+        JITTERBUFFER_LATENCY = TEST_LATENCY_MS;
+        START_WEBRTC = false;
+        BASE_RECORDING_PATH = std::string(directory) + "/";
+
+        handler = std::make_shared<RtspPipelineHandler>();
+        handler->device_id = "test";
+        handler->pipeline_execution_id = 1;
+        fail_unless(handler->start_streaming());
+        appsrc = gst_bin_get_by_name(GST_BIN (handler->pipeline), "pcapsrc");
+        add_record_probe(handler->pipeline, "jitterbuffer", "sink", &jitterbuffer_in);
+        add_record_probe(handler->pipeline, "jitterbuffer", "src", &jitterbuffer_out);
+    }
+
+    ~TimingPipeline() {
+        //Not PLAYING so the EOS of stop_streaming() does not restart it
+        handler->pipelineState = STOPPED;
+        gst_object_unref(appsrc);
+        handler->stop_streaming();
+        PIPELINE_CLOCK = NULL;
+        gst_object_unref(clock);
+
+        GDir *dir = g_dir_open(directory, 0, NULL);
+        const gchar *name;
+        while (dir && (name = g_dir_read_name(dir))) {
+            gchar *path = g_build_filename(directory, name, NULL);
+            g_unlink(path);
+            g_free(path);
+        }
+        if (dir)
+            g_dir_close(dir);
+        g_rmdir(directory);
+        g_free(directory);
+    }
+
+    void run_until(GstClockTime target) {
+        ::run_until(clock, appsrc, target);
+    }
+
+    guint64 jitterbuffer_stat(const gchar *field) {
+        GstElement *jitterbuffer = gst_bin_get_by_name(GST_BIN (handler->pipeline), "jitterbuffer");
+        GstStructure *stats;
+        guint64 value = 0;
+        g_object_get(jitterbuffer, "stats", &stats, NULL);
+        gst_structure_get_uint64(stats, field, &value);
+        gst_structure_free(stats);
+        gst_object_unref(jitterbuffer);
+        return value;
+    }
+};
+
+/* Due running time of each access unit, the first is held for the jitterbuffer latency and every
+ * later one leaves as soon as its last packet arrives */
+static GstClockTime expected_release(guint frame) {
+    return MAX(frame_due(frame), TEST_LATENCY_MS * GST_MSECOND);
+}
+
+GST_START_TEST (test_first_packet_held_for_latency)
+    {
+        TimingPipeline test((std::set<guint>()));
+        add_standin_viewer(test.handler->pipeline, "viewer");
+        test.run_until(frame_due(TEST_FRAMES - 1));
+
+        PadTimes in, out, viewer = standin("viewer");
+        {
+            std::lock_guard<std::mutex> guard(test_lock);
+            in = jitterbuffer_in;
+            out = jitterbuffer_out;
+        }
+        //SPS and PPS are packets of their own
+        fail_unless_equals_int(in.arrival.size(), TEST_FRAMES + 2);
+        fail_unless_equals_int(out.arrival.size(), TEST_FRAMES + 2);
+        for (guint i = 0; i < in.arrival.size(); i++) {
+            guint frame = i < 3 ? 0 : i - 2;
+            //The replay is paced exactly on the capture timing and stamps arrival as PTS
+            fail_unless_equals_uint64(in.arrival[i], frame_due(frame));
+            fail_unless_equals_uint64(in.pts[i], frame_due(frame));
+            fail_unless_equals_uint64(out.arrival[i], expected_release(frame));
+        }
+
+        fail_unless_equals_int(viewer.arrival.size(), TEST_FRAMES);
+        for (guint frame = 0; frame < TEST_FRAMES; frame++) {
+            fail_unless_equals_uint64(viewer.arrival[frame], expected_release(frame));
+            fail_unless(viewer.arrival[frame] - frame_due(frame) <= TEST_LATENCY_BUDGET);
+            //Skew correction may move the PTS by rounding of the 90 kHz timestamps only
+            fail_unless(ABS((gint64) viewer.pts[frame] - (gint64) frame_due(frame)) < (gint64) GST_MSECOND,
+                        "frame %u PTS %" GST_TIME_FORMAT, frame, GST_TIME_ARGS (viewer.pts[frame]));
+        }
+
+        //What the sinks have to compensate for, webrtcbin adds it to the playout delay
+        GstQuery *query = gst_query_new_latency();
+        gboolean live;
+        GstClockTime min_latency, max_latency;
+        fail_unless(gst_element_query(test.handler->pipeline, query));
+        gst_query_parse_latency(query, &live, &min_latency, &max_latency);
+        gst_query_unref(query);
+        fail_unless(live);
+        fail_unless(min_latency <= TEST_LATENCY_BUDGET, "pipeline latency %" GST_TIME_FORMAT,
+                    GST_TIME_ARGS (min_latency));
+        fail_unless_equals_uint64(test.jitterbuffer_stat("num-lost"), 0);
+    }
+GST_END_TEST;
+
+GST_START_TEST (test_lost_packets_counted_and_bounded)
+    {
+        std::set<guint> dropped = {20, 21};
+        TimingPipeline test(dropped);
+        add_standin_viewer(test.handler->pipeline, "viewer");
+        test.run_until(frame_due(TEST_FRAMES - 1));
+
+        PadTimes viewer = standin("viewer");
+        fail_unless_equals_uint64(test.jitterbuffer_stat("num-lost"), dropped.size());
+        fail_unless_equals_int(viewer.arrival.size(), TEST_FRAMES - dropped.size());
+
+        //The frame after the gap waits for the lost timers, never longer than the latency
+        for (guint i = 0; i < viewer.pts.size(); i++) {
+            guint frame = (guint) gst_util_uint64_scale_round(viewer.pts[i], TEST_FPS, GST_SECOND);
+            fail_if(dropped.count(frame), "dropped frame %u reached the viewer", frame);
+            fail_unless(viewer.arrival[i] >= frame_due(frame));
+            fail_unless(viewer.arrival[i] - frame_due(frame) <= TEST_LATENCY_MS * GST_MSECOND,
+                        "frame %u released %" GST_TIME_FORMAT " late", frame,
+                        GST_TIME_ARGS (viewer.arrival[i] - frame_due(frame)));
+        }
+        for (guint i = 1; i < viewer.arrival.size(); i++)
+            fail_unless(viewer.arrival[i] >= viewer.arrival[i - 1]);
+    }
+GST_END_TEST;
+
+GST_START_TEST (test_viewer_join_keeps_timing)
+    {
+        TimingPipeline test((std::set<guint>()));
+        add_standin_viewer(test.handler->pipeline, "first");
+        GstClockTime join = frame_due(TEST_FRAMES / 2);
+        test.run_until(join);
+        add_standin_viewer(test.handler->pipeline, "second");
+        test.run_until(frame_due(TEST_FRAMES - 1));
+
+        PadTimes first = standin("first"), second = standin("second");
+        fail_unless_equals_int(first.arrival.size(), TEST_FRAMES);
+        for (guint frame = 0; frame < TEST_FRAMES; frame++)
+            fail_unless_equals_uint64(first.arrival[frame], expected_release(frame));
+
+        //The late viewer gets every frame after its join at the same time as the first one
+        fail_unless_equals_int(second.arrival.size(), TEST_FRAMES - TEST_FRAMES / 2 - 1);
+        for (guint i = 0; i < second.arrival.size(); i++) {
+            guint frame = TEST_FRAMES / 2 + 1 + i;
+            fail_unless_equals_uint64(second.pts[i], first.pts[frame]);
+            fail_unless_equals_uint64(second.arrival[i], first.arrival[frame]);
+        }
+    }
+GST_END_TEST;
+
+GST_START_TEST (test_keyframe_replay_paced)
+    {
+        GstClockTime join = frame_due(TEST_REPLAY_JOIN);
+        gint cache_age = KEYFRAME_CACHE_AGE;
+        WebrtcViewerPtr viewer;
+        //The cache ages in real time, which the cranks of the test clock stretch
+        KEYFRAME_CACHE_AGE = 60000;
+        TimingPipeline test((std::set<guint>()));
+        viewer = make_probed_viewer(test.handler->pipeline, "late");
+        add_standin_viewer(test.handler->pipeline, "first");
+        test.run_until(join);
+        add_standin_viewer(test.handler->pipeline, "late", viewer.get());
+        send_keyframe_request(test.handler->pipeline, "late");
+        test.run_until(frame_due(TEST_FRAMES - 1));
+        wait_for_packets("late", standin_sequences("first").size());
+        KEYFRAME_CACHE_AGE = cache_age;
+
+        //The keyframe and the frames since are replayed ahead of the first frame after the join
+        PadTimes first = standin("first"), late = standin("late");
+        fail_unless_equals_int(late.arrival.size(), TEST_FRAMES);
+        fail_unless(late.keyframe[0]);
+        for (guint frame = 1; frame < TEST_FRAMES; frame++)
+            fail_if(late.keyframe[frame], "frame %u replayed as a keyframe", frame);
+        //Restamped into the gap before that frame, rising
+        for (guint frame = 0; frame <= TEST_REPLAY_JOIN; frame++) {
+            fail_unless(late.pts[frame] < first.pts[TEST_REPLAY_JOIN + 1]);
+            fail_unless(frame == 0 || late.pts[frame] > late.pts[frame - 1]);
+        }
+        for (guint frame = TEST_REPLAY_JOIN + 1; frame < TEST_FRAMES; frame++)
+            fail_unless_equals_uint64(late.pts[frame], first.pts[frame]);
+        //At the frame interval of the stream rather than in one burst
+        fail_unless(late.wall[TEST_REPLAY_JOIN] - late.wall[0] >=
+                    TEST_REPLAY_JOIN * (G_USEC_PER_SEC / TEST_FPS - 1000),
+                    "replay took %" G_GINT64_FORMAT " us", late.wall[TEST_REPLAY_JOIN] - late.wall[0]);
+
+        GstElement *tee = gst_bin_get_by_name(GST_BIN (test.handler->pipeline), "videotee");
+        KeyframeArbiter *arbiter = static_cast<KeyframeArbiter *>(g_object_get_data(G_OBJECT (tee),
+                                                                                   "keyframe-arbiter"));
+        {
+            std::lock_guard<std::mutex> guard(arbiter->lock);
+            fail_unless_equals_uint64(arbiter->served, 1);
+            fail_unless_equals_uint64(arbiter->forwarded, 0);
+        }
+        gst_object_unref(tee);
+    }
+GST_END_TEST;
+
+GST_START_TEST (test_pacing_holds_bursts_in_order)
+    {
+        WebrtcViewerPtr viewer;
+        TimingPipeline test((std::set<guint>()));
+        viewer = make_probed_viewer(test.handler->pipeline, "paced");
+        viewer->pacer.kbps = TEST_PACING_KBPS;
+        add_standin_viewer(test.handler->pipeline, "unpaced");
+        add_standin_viewer(test.handler->pipeline, "paced", viewer.get());
+        test.run_until(frame_due(TEST_FRAMES - 1));
+        wait_for_packets("paced", standin_sequences("unpaced").size());
+
+        //Every datagram leaves, in order
+        std::vector<guint16> paced = standin_sequences("paced");
+        fail_unless(paced.size() > TEST_FRAMES);
+        for (guint i = 1; i < paced.size(); i++)
+            fail_unless_equals_int((guint16) (paced[i] - paced[i - 1]), 1);
+
+        //The keyframe burst is held, never longer than the pacer may run behind
+        std::lock_guard<std::mutex> guard(viewer->pacer.lock);
+        fail_unless_equals_uint64(viewer->pacer.packets, paced.size());
+        fail_unless(viewer->pacer.held >= 1);
+        fail_unless(viewer->pacer.longest_us <= PACING_MAX_DELAY * 1000, "held %" G_GINT64_FORMAT " us",
+                    viewer->pacer.longest_us);
+        fail_unless(viewer->pacer.held_us >= viewer->pacer.longest_us);
+        fail_unless_equals_int(standin("paced").arrival.size(), TEST_FRAMES);
+    }
+GST_END_TEST;
+
+GST_START_TEST (test_paced_replay_ends_without_restart)
+    {
+        TimingPipeline test((std::set<guint>()), PCAP_REPLAY_PACED);
+        GstElement *pipeline = test.handler->pipeline;
+        add_standin_viewer(pipeline, "viewer");
+        test.run_until(frame_due(TEST_FRAMES - 1));
+
+        //The feeder ends the stream after the last packet of the capture instead of looping
+        GstPad *pad = gst_element_get_static_pad(test.appsrc, "src");
+        gint64 deadline = g_get_monotonic_time() + TEST_DRAIN_MS * 1000;
+        while (!GST_PAD_IS_EOS (pad) && g_get_monotonic_time() < deadline)
+            g_usleep(2000);
+        fail_unless(GST_PAD_IS_EOS (pad));
+        gst_object_unref(pad);
+        fail_unless_equals_int(standin("viewer").arrival.size(), TEST_FRAMES);
+
+        //The EOS of the pipeline leaves it stopped, the same one
+        gst_element_post_message(pipeline, gst_message_new_eos(GST_OBJECT (pipeline)));
+        fail_unless_equals_int(test.handler->pipelineState, STOPPED);
+        fail_unless(test.handler->pipeline == pipeline);
+    }
+GST_END_TEST;
+
+static Suite *pipeline_timing_suite(void) {
+    Suite *s = suite_create("pipeline_timing");
+    TCase *tc = tcase_create("general");
+
+    //stop_streaming() waits two seconds for the recording to finish
+    tcase_set_timeout(tc, 60);
+    tcase_add_checked_fixture(tc, reset_recordings, NULL);
+    suite_add_tcase(s, tc);
+    tcase_add_test(tc, test_first_packet_held_for_latency);
+    tcase_add_test(tc, test_lost_packets_counted_and_bounded);
+    tcase_add_test(tc, test_viewer_join_keeps_timing);
+    tcase_add_test(tc, test_keyframe_replay_paced);
+    tcase_add_test(tc, test_pacing_holds_bursts_in_order);
+    tcase_add_test(tc, test_paced_replay_ends_without_restart);
+    return s;
+}
+
+GST_CHECK_MAIN (pipeline_timing);
@@ -2,7 +2,9 @@
 // Created by user001 on 13-03-2019.
 //
 #include <gst/gst.h>
+#include <glib-unix.h>
 #include <gst/sdp/sdp.h>
+#include <gst/rtp/rtp.h>
 
 #define GST_USE_UNSTABLE_API
 
@@ -22,6 +24,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
+#include <math.h>
 #include <execinfo.h>
 #include <signal.h>
 #include <time.h>
@@ -30,6 +33,12 @@
 #include <iostream>
 #include <list>
 #include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+
+#include "sei_timestamp.h"
 
 enum AppState {
     APP_STATE_UNKNOWN = 0,
@@ -56,6 +65,23 @@ static void on_offer_created(GstPromise *promise, gpointer user_data);
 
 std::string SIGNAL_SERVER = "wss://127.0.0.1:8443";
 
+//Load generator
+gint SESSIONS = 1;
+gdouble RAMP_RATE = 10; //Sessions started per second
+gint PEER_ID_BASE = 0; //Register ids PEER_ID_BASE .. PEER_ID_BASE + SESSIONS - 1 instead of random ones
+gboolean NO_DECODE = FALSE;
+gint DURATION = 0; //Seconds, 0 runs until interrupted
+gint REPORT_INTERVAL = 5; //Seconds
+gboolean VERBOSE = TRUE;
+gdouble MAX_FREEZE_PERCENT = -1; //Fail the run when a session was frozen longer, negative disables
+
+//Receive side QoE
+#define QOE_WINDOW_MS 1000
+#define QOE_WARMUP_FRAMES 10
+#define FREEZE_MIN_EXTRA_MS 150 //Freeze: frame interval > max(3 x average, average + 150 ms) as in webrtc-stats
+#define FPS_DROP_RATIO 0.75 //Window below 75% of the nominal frame rate
+#define LATENCY_MAX_SAMPLES 100000 //Glass-to-glass samples kept per session for its percentiles
+
 //CONSTANTS
 const std::string LEVEL_ASYMMETRY_ALLOWED = ";level-asymmetry-allowed=1";
 const std::string PROFILE_LEVEL_ID_REGEX = "profile-level-id=*[A-za-z0-9]*;";
@@ -64,6 +90,55 @@ const bool CHANGE_PROFILE_LEVEL_ID = false;
 
 #define RTP_CAPS_H264 "application/x-rtp,media=video,encoding-name=H264,payload=96"
 
+/* One QOE_WINDOW_MS of playback and the transport events seen in it */
+struct QoeWindow {
+    guint frames;
+    guint freezes;
+    gboolean fps_drop;
+    guint64 lost; //Sequence gaps left after the jitterbuffer
+    guint64 late; //Packets arriving after their playout time
+    guint64 nacks; //Retransmission requests of the jitterbuffer
+};
+
+/* Frame arrival and presentation intervals at the video sink, freezes, frame rate drops and their correlation
+ * with loss, NACK and late packets */
+class QoeAnalyzer {
+
+public:
+    //Methods
+    void on_frame(GstClockTime pts);
+
+    void sample(GstElement *webrtc, guint64 lost);
+
+    gdouble frozen_percent(void);
+
+    void print_summary(gint session_index, const std::string &peer_id);
+
+private:
+    std::mutex lock; //Frame counters are written from the streaming thread
+    gint64 first_arrival = 0;
+    gint64 last_arrival = 0;
+    GstClockTime last_pts = GST_CLOCK_TIME_NONE;
+    gdouble avg_interval_ms = 0;
+    gdouble pts_interval_ms = 0; //Nominal frame interval from the PTS
+    guint64 frames = 0;
+    guint64 intervals = 0;
+    gdouble interval_sum_ms = 0;
+    gdouble interval_square_sum_ms = 0;
+    guint64 pts_skips = 0;
+    guint freezes = 0;
+    gdouble freeze_ms = 0;
+    gdouble longest_freeze_ms = 0;
+    guint window_frames = 0;
+    guint window_freezes = 0;
+
+    //Main loop only
+    guint64 last_lost = 0;
+    guint64 last_late = 0;
+    guint64 last_nacks = 0;
+    std::vector<QoeWindow> windows;
+};
+
 class WebrtcViewer {
 
 public:
@@ -78,6 +153,40 @@ public:
     std::string peer_id;
     std::string server_url = SIGNAL_SERVER.c_str();
     gboolean disable_ssl = FALSE;
+    gint session_index = 0;
+    std::string register_id; //Random when empty
+
+    //Join timeline, monotonic us, 0 until reached
+    gint64 connect_started = 0;
+    gint64 server_connected = 0;
+    gint64 registered = 0;
+    gint64 offer_received = 0;
+    gint64 answer_sent = 0;
+    std::atomic<gint64> ice_connected{0};
+    std::atomic<gint64> first_packet{0};
+    std::atomic<gint64> first_frame{0};
+
+    //Receive counters, written from the streaming thread
+    std::atomic<guint64> packets{0};
+    std::atomic<guint64> bytes{0};
+    std::atomic<guint64> lost{0};
+    std::atomic<guint64> keyframe_packets{0}; //Of frames with an IDR, SPS or PPS
+    std::atomic<guint64> keyframe_lost{0};
+    guint64 reported_bytes = 0;
+    gboolean have_seq = FALSE;
+    guint16 last_seq = 0;
+    guint32 last_rtp_time = 0; //Frame of the last packet
+    gboolean last_marker = FALSE;
+    gboolean last_keyframe = FALSE;
+
+    //Glass-to-glass latency from the server's SEI timestamps
+    H264Framing framing;
+    std::mutex latency_lock;
+    std::vector<gfloat> latency_ms; //Of the whole run, guarded by latency_lock, a uniform sample once it is full
+    std::vector<gfloat> interval_latency_ms; //Since the last report
+    guint64 latency_frames = 0;
+
+    QoeAnalyzer qoe;
 
     //Methods
     gboolean start_webrtcbin(void);
@@ -107,7 +216,7 @@ gboolean cleanup_and_quit_loop(const gchar *msg, enum AppState state, WebrtcView
             /* This will call us again */
             soup_websocket_connection_close(webrtcViewer->ws_conn, 1000, "");
         else
-            g_object_unref(webrtcViewer->ws_conn);
+            g_clear_object(&webrtcViewer->ws_conn);
     }
 
     /* To allow usage as a GSourceFunc */
@@ -152,6 +261,7 @@ on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataType type,
             goto out;
         }
         webrtcViewer->app_state = SERVER_REGISTERED;
+        webrtcViewer->registered = g_get_monotonic_time();
         g_print("Registered with server, waiting to receive with peerid %s \n", webrtcViewer->peer_id.c_str());
         /* Ask signalling server to connect us with a specific peer */
         /*if (!webrtcViewer->setup_call()) {
@@ -242,7 +352,9 @@ on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataType type,
 
             text = json_object_get_string_member(child, "sdp");
 
-            g_print("Received offer:\n%s\n", text);
+            if (VERBOSE)
+                g_print("Received offer:\n%s\n", text);
+            webrtcViewer->offer_received = g_get_monotonic_time();
 
             ret = gst_sdp_message_new(&sdp);
             g_assert_cmphex (ret, ==, GST_SDP_OK);
@@ -276,7 +388,8 @@ on_server_message(SoupWebsocketConnection *conn, SoupWebsocketDataType type,
             child = json_object_get_object_member(object, "ice");
             candidate = json_object_get_string_member(child, "candidate");
             sdpmlineindex = json_object_get_int_member(child, "sdpMLineIndex");
-            g_print("Received ICE \n %s \n", candidate);
+            if (VERBOSE)
+                g_print("Received ICE \n %s \n", candidate);
             /* Add ice candidate sent by remote peer */
             g_signal_emit_by_name(webrtcViewer->webrtc1, "add-ice-candidate", sdpmlineindex,
                                   candidate);
@@ -398,6 +511,17 @@ on_incoming_stream(GstElement *webrtc, GstPad *pad, GstElement *pipe) {
     caps = gst_pad_get_current_caps(pad);
     name = gst_structure_get_name(gst_caps_get_structure(caps, 0));
     g_print("on_incoming_stream caps name %s \n", name);
+    //Audio of rtsp2webrtc_1_n --audio is received but not played
+    if (g_strcmp0(gst_structure_get_string(gst_caps_get_structure(caps, 0), "media"), "audio") == 0) {
+        GstElement *audiosink = gst_element_factory_make("fakesink", NULL);
+        g_object_set(audiosink, "sync", FALSE, "async", FALSE, NULL);
+        gst_bin_add(GST_BIN (pipe), audiosink);
+        gst_element_sync_state_with_parent(audiosink);
+        gst_element_link_pads(webrtc, dynamic_pad_name, audiosink, "sink");
+        gst_caps_unref(caps);
+        g_free(dynamic_pad_name);
+        return;
+    }
     //if (g_str_has_prefix(name, "video")) {
     rtph264depay = gst_bin_get_by_name(GST_BIN (pipe), "rtpdepay");
     if (gst_element_link_pads(webrtc, dynamic_pad_name, rtph264depay, "sink")) {
@@ -427,7 +551,8 @@ void static send_ice_candidate_message(GstElement *webrtc G_GNUC_UNUSED, guint m
     json_object_set_object_member(msg, "ice", ice);
     text = get_string_from_json_object(msg);
     json_object_unref(msg);
-    g_print("Sending ICE \n %s \n", text);
+    if (VERBOSE)
+        g_print("Sending ICE \n %s \n", text);
     soup_websocket_connection_send_text(user_data->ws_conn, text);
     g_free(text);
 }
@@ -442,7 +567,8 @@ void static send_sdp_offer(GstWebRTCSessionDescription *offer, WebrtcViewer *web
     }
 
     text = gst_sdp_message_as_text(offer->sdp);
-    g_print("Sending answer:\n%s\n", text);
+    if (VERBOSE)
+        g_print("Sending answer:\n%s\n", text);
 
     sdp = json_object_new();
     json_object_set_string_member(sdp, "type", "answer");
@@ -456,6 +582,7 @@ void static send_sdp_offer(GstWebRTCSessionDescription *offer, WebrtcViewer *web
 
     soup_websocket_connection_send_text(webrtcViewer->ws_conn, text);
     g_free(text);
+    webrtcViewer->answer_sent = g_get_monotonic_time();
 }
 
 /* Offer created by our pipeline, to be sent to the peer */
@@ -529,6 +656,263 @@ void static on_negotiation_needed(GstElement *element, WebrtcViewer *user_data)
     g_signal_emit_by_name(webrtcViewer->webrtc1, "create-offer", NULL, promise);
 }
 
+/* H264 payload (RFC 6184) of a keyframe: IDR slice, SPS or PPS, alone, fragmented or aggregated */
+static gboolean h264_payload_is_keyframe(const guint8 *payload, guint len) {
+    guint8 type;
+
+    if (len < 2)
+        return FALSE;
+    type = payload[0] & 0x1f;
+    if (type == 28) //FU-A, every fragment carries the type
+        type = payload[1] & 0x1f;
+    if (type == 24) //STAP-A, SPS and PPS travel with the IDR
+        type = len >= 4 ? payload[3] & 0x1f : 0;
+    return type == 5 || type == 7 || type == 8;
+}
+
+/*
+ * Counts received RTP and sequence gaps ahead of the depayloader. A gap inside a frame or right after
+ * the last packet of one belongs to the frame of the next packet, otherwise to the tail of the frame
+ * before it, which tells the loss of keyframes from that of the other frames.
+ */
+static GstPadProbeReturn
+rtp_receive_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    GstRTPBuffer rtp = GST_RTP_BUFFER_INIT;
+    gint64 expected = 0;
+
+    if (!gst_rtp_buffer_map(buffer, GST_MAP_READ, &rtp))
+        return GST_PAD_PROBE_OK;
+    guint16 seq = gst_rtp_buffer_get_seq(&rtp);
+    guint32 rtp_time = gst_rtp_buffer_get_timestamp(&rtp);
+    gboolean marker = gst_rtp_buffer_get_marker(&rtp);
+    gboolean keyframe = h264_payload_is_keyframe((const guint8 *) gst_rtp_buffer_get_payload(&rtp),
+                                                 gst_rtp_buffer_get_payload_len(&rtp));
+    gst_rtp_buffer_unmap(&rtp);
+
+    if (webrtcViewer->have_seq) {
+        gint16 delta = (gint16) (seq - webrtcViewer->last_seq);
+        if (rtp_time == webrtcViewer->last_rtp_time)
+            keyframe |= webrtcViewer->last_keyframe;
+        if (delta > 1) {
+            webrtcViewer->lost += delta - 1;
+            gboolean next_frame = rtp_time == webrtcViewer->last_rtp_time || webrtcViewer->last_marker;
+            if (next_frame ? keyframe : webrtcViewer->last_keyframe)
+                webrtcViewer->keyframe_lost += delta - 1;
+        }
+        if (delta > 0) {
+            webrtcViewer->last_seq = seq;
+            webrtcViewer->last_rtp_time = rtp_time;
+            webrtcViewer->last_marker = marker;
+            webrtcViewer->last_keyframe = keyframe;
+        }
+    } else {
+        webrtcViewer->have_seq = TRUE;
+        webrtcViewer->last_seq = seq;
+        webrtcViewer->last_rtp_time = rtp_time;
+        webrtcViewer->last_marker = marker;
+        webrtcViewer->last_keyframe = keyframe;
+        webrtcViewer->first_packet.compare_exchange_strong(expected, g_get_monotonic_time());
+    }
+    webrtcViewer->packets++;
+    webrtcViewer->keyframe_packets += keyframe;
+    webrtcViewer->bytes += gst_buffer_get_size(buffer);
+    return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+first_frame_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    webrtcViewer->first_frame = g_get_monotonic_time();
+    return GST_PAD_PROBE_REMOVE;
+}
+
+/* Glass-to-glass latency of every frame carrying the timestamp SEI of rtsp2webrtc_1_n --sei-timestamp,
+ * both clocks are the same on a single host */
+static GstPadProbeReturn
+sei_latency_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    GstMapInfo map;
+    gint64 sent_us;
+    gboolean found;
+
+    if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+        GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+        if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS) {
+            GstCaps *caps;
+            gst_event_parse_caps(event, &caps);
+            update_h264_framing(caps, &webrtcViewer->framing);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ))
+        return GST_PAD_PROBE_OK;
+    found = sei_timestamp_find(map.data, map.size, webrtcViewer->framing, &sent_us);
+    gst_buffer_unmap(buffer, &map);
+    if (found) {
+        gfloat latency = (g_get_real_time() - sent_us) / 1000.0f;
+        std::lock_guard<std::mutex> guard(webrtcViewer->latency_lock);
+        webrtcViewer->interval_latency_ms.push_back(latency);
+        //Reservoir sampling, the percentiles of the run stay unbiased with bounded memory
+        guint64 slot = webrtcViewer->latency_frames++;
+        if (slot >= LATENCY_MAX_SAMPLES)
+            slot = (guint64) (g_random_double() * webrtcViewer->latency_frames);
+        if (slot < webrtcViewer->latency_ms.size())
+            webrtcViewer->latency_ms[slot] = latency;
+        else if (slot < LATENCY_MAX_SAMPLES)
+            webrtcViewer->latency_ms.push_back(latency);
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+void QoeAnalyzer::on_frame(GstClockTime pts) {
+    gint64 now = g_get_monotonic_time();
+    std::lock_guard<std::mutex> guard(lock);
+
+    frames++;
+    window_frames++;
+    if (!first_arrival)
+        first_arrival = now;
+    if (last_arrival) {
+        gdouble interval_ms = (now - last_arrival) / 1000.0;
+        intervals++;
+        interval_sum_ms += interval_ms;
+        interval_square_sum_ms += interval_ms * interval_ms;
+        if (frames > QOE_WARMUP_FRAMES &&
+            interval_ms > MAX(3 * avg_interval_ms, avg_interval_ms + FREEZE_MIN_EXTRA_MS)) {
+            freezes++;
+            window_freezes++;
+            freeze_ms += interval_ms;
+            longest_freeze_ms = MAX(longest_freeze_ms, interval_ms);
+        } else if (intervals <= QOE_WARMUP_FRAMES) {
+            avg_interval_ms = interval_sum_ms / intervals;
+        } else {
+            //Freezes stay out of the average so the next one is still detected
+            avg_interval_ms += (interval_ms - avg_interval_ms) / 16;
+        }
+    }
+    last_arrival = now;
+
+    if (GST_CLOCK_TIME_IS_VALID (pts) && GST_CLOCK_TIME_IS_VALID (last_pts) && pts > last_pts) {
+        gdouble pts_ms = (pts - last_pts) / 1e6;
+        if (pts_interval_ms > 0 && pts_ms > 1.5 * pts_interval_ms)
+            pts_skips++; //Frames missing from the stream, not just late
+        else
+            pts_interval_ms = pts_interval_ms > 0 ? pts_interval_ms + (pts_ms - pts_interval_ms) / 16 : pts_ms;
+    }
+    if (GST_CLOCK_TIME_IS_VALID (pts))
+        last_pts = pts;
+}
+
+/* Late packets and NACKs of all jitterbuffers of the webrtcbin */
+static void read_jitterbuffer_stats(GstElement *webrtc, guint64 *late, guint64 *nacks) {
+    GstIterator *iterator;
+    GValue item = G_VALUE_INIT;
+
+    *late = 0;
+    *nacks = 0;
+    iterator = gst_bin_iterate_recurse(GST_BIN (webrtc));
+    while (gst_iterator_next(iterator, &item) == GST_ITERATOR_OK) {
+        GstElement *element = GST_ELEMENT (g_value_get_object(&item));
+        GstElementFactory *factory = gst_element_get_factory(element);
+        if (factory && g_strcmp0(GST_OBJECT_NAME (factory), "rtpjitterbuffer") == 0) {
+            GstStructure *stats;
+            guint64 value;
+            g_object_get(element, "stats", &stats, NULL);
+            if (gst_structure_get_uint64(stats, "num-late", &value))
+                *late += value;
+            if (gst_structure_get_uint64(stats, "rtx-count", &value))
+                *nacks += value;
+            gst_structure_free(stats);
+        }
+        g_value_reset(&item);
+    }
+    g_value_unset(&item);
+    gst_iterator_free(iterator);
+}
+
+/* Closes the current window, called every QOE_WINDOW_MS from the main loop */
+void QoeAnalyzer::sample(GstElement *webrtc, guint64 lost) {
+    QoeWindow window;
+    guint64 late = 0, nacks = 0;
+
+    if (webrtc)
+        read_jitterbuffer_stats(webrtc, &late, &nacks);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!first_arrival)
+            return;
+        window.frames = window_frames;
+        window.freezes = window_freezes;
+        window.fps_drop = frames > QOE_WARMUP_FRAMES && pts_interval_ms > 0 &&
+                          window_frames < FPS_DROP_RATIO * QOE_WINDOW_MS / pts_interval_ms;
+        window_frames = 0;
+        window_freezes = 0;
+    }
+    window.lost = lost - last_lost;
+    window.late = late - last_late;
+    window.nacks = nacks - last_nacks;
+    last_lost = lost;
+    last_late = late;
+    last_nacks = nacks;
+    windows.push_back(window);
+}
+
+gdouble QoeAnalyzer::frozen_percent(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    gint64 playing_us = last_arrival - first_arrival;
+    return playing_us > 0 ? 100.0 * freeze_ms * 1000 / playing_us : 0;
+}
+
+void QoeAnalyzer::print_summary(gint session_index, const std::string &peer_id) {
+    guint impaired = 0, after_loss = 0, after_nack = 0, after_late = 0, clean_with_loss = 0, fps_drops = 0;
+
+    //A window is impaired by the transport when the events fall into it or the one before
+    for (gsize i = 0; i < windows.size(); i++) {
+        const QoeWindow &window = windows[i];
+        const QoeWindow *previous = i > 0 ? &windows[i - 1] : NULL;
+        fps_drops += window.fps_drop;
+        if (!window.freezes && !window.fps_drop) {
+            clean_with_loss += window.lost > 0;
+            continue;
+        }
+        impaired++;
+        after_loss += window.lost > 0 || (previous && previous->lost > 0);
+        after_nack += window.nacks > 0 || (previous && previous->nacks > 0);
+        after_late += window.late > 0 || (previous && previous->late > 0);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    gdouble mean_ms = intervals ? interval_sum_ms / intervals : 0;
+    gdouble stddev_ms = intervals ? sqrt(MAX(0, interval_square_sum_ms / intervals - mean_ms * mean_ms)) : 0;
+    gint64 playing_us = last_arrival - first_arrival;
+    g_print("%d %s %" G_GUINT64_FORMAT " %.1f %.1f %.1f %u %.0f %.0f %.2f %u %" G_GUINT64_FORMAT
+            " %u/%u %u/%u %u/%u %u\n",
+            session_index, peer_id.c_str(), frames, playing_us > 0 ? frames * 1e6 / playing_us : 0.0,
+            mean_ms, stddev_ms, freezes, freeze_ms, longest_freeze_ms,
+            playing_us > 0 ? 100.0 * freeze_ms * 1000 / playing_us : 0.0, fps_drops, pts_skips,
+            after_loss, impaired, after_nack, impaired, after_late, impaired, clean_with_loss);
+}
+
+static GstPadProbeReturn
+qoe_frame_probe(GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+    WebrtcViewer *webrtcViewer = static_cast<WebrtcViewer *>(user_data);
+    webrtcViewer->qoe.on_frame(GST_BUFFER_PTS (GST_PAD_PROBE_INFO_BUFFER (info)));
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+on_ice_connection_state(GstElement *webrtc, GParamSpec *pspec, WebrtcViewer *webrtcViewer) {
+    GstWebRTCICEConnectionState state;
+    gint64 expected = 0;
+    g_object_get(webrtc, "ice-connection-state", &state, NULL);
+    if (state == GST_WEBRTC_ICE_CONNECTION_STATE_CONNECTED || state == GST_WEBRTC_ICE_CONNECTION_STATE_COMPLETED)
+        webrtcViewer->ice_connected.compare_exchange_strong(expected, g_get_monotonic_time());
+}
+
 gboolean WebrtcViewer::start_webrtcbin(void) {
 
     GstWebRTCRTPTransceiver *trans;
@@ -538,22 +922,50 @@ gboolean WebrtcViewer::start_webrtcbin(void) {
     GstElement *rtph264depay, *avdec_h264, *videosink;
 
     /* Create Elements */
-    pipeline = gst_pipeline_new(g_strdup_printf("pipeline-%s", peer_id.c_str()));
+    pipeline = gst_pipeline_new(("pipeline-" + peer_id).c_str());
     webrtc1 = gst_element_factory_make("webrtcbin", "rtspsource");
     rtph264depay = gst_element_factory_make("rtph264depay", "rtpdepay");
-    avdec_h264 = gst_element_factory_make("avdec_h264", "avdec_h264");
-    videosink = gst_element_factory_make("autovideosink", "autovideosink");
+    if (NO_DECODE) {
+        //Load generation only needs the stream to be received and depayloaded
+        videosink = gst_element_factory_make("fakesink", "fakesink");
+        g_object_set(videosink, "sync", FALSE, "async", FALSE, NULL);
+        gst_bin_add_many(GST_BIN (pipeline), webrtc1, rtph264depay, videosink, NULL);
+        if (!gst_element_link(rtph264depay, videosink)) {
+            g_printerr("start_webrtcbin: Error linking rtph264depay to fakesink for device %s \n",
+                       peer_id.c_str());
+            return FALSE;
+        }
+    } else {
+        avdec_h264 = gst_element_factory_make("avdec_h264", "avdec_h264");
+        videosink = gst_element_factory_make("autovideosink", "autovideosink");
 
-    //Add elements to pipeline
-    gst_bin_add_many(GST_BIN (pipeline), webrtc1, rtph264depay, avdec_h264, videosink, NULL);
+        //Add elements to pipeline
+        gst_bin_add_many(GST_BIN (pipeline), webrtc1, rtph264depay, avdec_h264, videosink, NULL);
 
-    if (!gst_element_link_many(rtph264depay, avdec_h264, videosink, NULL)) {
-        g_printerr("start_webrtcbin: Error linking rtph264depay to avdech264 for device %s \n",
-                   peer_id.c_str());
-        return FALSE;
+        if (!gst_element_link_many(rtph264depay, avdec_h264, videosink, NULL)) {
+            g_printerr("start_webrtcbin: Error linking rtph264depay to avdech264 for device %s \n",
+                       peer_id.c_str());
+            return FALSE;
+        }
     }
     g_assert_nonnull (webrtc1);
 
+    {
+        GstPad *pad = gst_element_get_static_pad(rtph264depay, "sink");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, rtp_receive_probe, this, NULL);
+        gst_object_unref(pad);
+        pad = gst_element_get_static_pad(rtph264depay, "src");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, first_frame_probe, this, NULL);
+        gst_pad_add_probe(pad, (GstPadProbeType) (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+                          sei_latency_probe, this, NULL);
+        gst_object_unref(pad);
+        //Frames as they reach the sink, decoded unless --no-decode
+        pad = gst_element_get_static_pad(videosink, "sink");
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, qoe_frame_probe, this, NULL);
+        gst_object_unref(pad);
+    }
+    g_signal_connect (webrtc1, "notify::ice-connection-state", G_CALLBACK(on_ice_connection_state), this);
+
     /* This is the gstwebrtc entry point where we create the offer and so on. It
      * will be called when the pipeline goes to PLAYING. */
     //No required when acting as receiver
@@ -620,10 +1032,13 @@ register_with_server(WebrtcViewer *webrtcViewer) {
         SOUP_WEBSOCKET_STATE_OPEN)
         return FALSE;
 
-    our_id = g_random_int_range(10, 10000);
+    if (webrtcViewer->register_id.empty())
+        our_id = g_random_int_range(10, 10000);
+    else
+        our_id = atoi(webrtcViewer->register_id.c_str());
     g_print("Registering id %i with server\n", our_id);
     webrtcViewer->app_state = SERVER_REGISTERING;
-    webrtcViewer->peer_id = std::string(g_strdup_printf("%i", our_id));
+    webrtcViewer->peer_id = std::to_string(our_id);
 
     /* Register with the server with a random integer id. Reply will be received
      * by on_server_message() */
@@ -649,6 +1064,7 @@ on_server_connected(SoupSession *session, GAsyncResult *res,
     g_assert_nonnull (webrtcViewer->ws_conn);
 
     webrtcViewer->app_state = SERVER_CONNECTED;
+    webrtcViewer->server_connected = g_get_monotonic_time();
     g_print("Connected to signalling server\n");
 
     g_signal_connect (webrtcViewer->ws_conn, "closed", G_CALLBACK(on_server_closed), webrtcViewer);
@@ -668,13 +1084,16 @@ void WebrtcViewer::connect_to_websocket_server_async(void) {
             //SOUP_SESSION_SSL_CA_FILE, "/etc/ssl/certs/ca-bundle.crt",
                                             SOUP_SESSION_HTTPS_ALIASES, https_aliases, NULL);
 
-    logger = soup_logger_new(SOUP_LOGGER_LOG_BODY, -1);
-    soup_session_add_feature(session, SOUP_SESSION_FEATURE (logger));
-    g_object_unref(logger);
+    if (VERBOSE) {
+        logger = soup_logger_new(SOUP_LOGGER_LOG_BODY, -1);
+        soup_session_add_feature(session, SOUP_SESSION_FEATURE (logger));
+        g_object_unref(logger);
+    }
 
     message = soup_message_new(SOUP_METHOD_GET, server_url.c_str());
 
     g_print("Connecting to server...\n");
+    connect_started = g_get_monotonic_time();
 
     /* Once connected, we will register */
     soup_session_websocket_connect_async(session, message, NULL, NULL, NULL,
@@ -706,6 +1125,132 @@ check_plugins(void) {
     return ret;
 }
 
+std::vector<WebrtcViewerPtr> VIEWERS;
+GMainLoop *LOOP = NULL;
+gint64 RUN_STARTED = 0;
+gint EXIT_STATUS = 0;
+
+static gdouble elapsed_ms(gint64 from, gint64 to) {
+    return from && to ? (to - from) / 1000.0 : -1;
+}
+
+static gfloat latency_percentile(std::vector<gfloat> &sorted, gdouble p) {
+    return sorted.empty() ? -1 : sorted[MIN(sorted.size() - 1, (gsize) (p * (sorted.size() - 1) + 0.5))];
+}
+
+static void print_latency_percentiles(const gchar *what, std::vector<gfloat> &samples) {
+    if (samples.empty())
+        return;
+    std::sort(samples.begin(), samples.end());
+    g_print("Glass-to-glass latency %s over %" G_GSIZE_FORMAT " frames: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, "
+            "max %.1f ms\n", what, samples.size(), latency_percentile(samples, 0.5),
+            latency_percentile(samples, 0.9), latency_percentile(samples, 0.99), samples.back());
+}
+
+static gboolean start_next_session(gpointer data) {
+    WebrtcViewerPtr webrtcViewerPtr = std::make_shared<WebrtcViewer>();
+    webrtcViewerPtr->loop = LOOP;
+    webrtcViewerPtr->disable_ssl = TRUE;
+    webrtcViewerPtr->session_index = (gint) VIEWERS.size();
+    if (PEER_ID_BASE > 0)
+        webrtcViewerPtr->register_id = std::to_string(PEER_ID_BASE + webrtcViewerPtr->session_index);
+    VIEWERS.push_back(webrtcViewerPtr);
+    webrtcViewerPtr->connect_to_websocket_server_async();
+    return (gint) VIEWERS.size() < SESSIONS ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean sample_qoe(gpointer data) {
+    for (auto &viewer : VIEWERS)
+        viewer->qoe.sample(viewer->webrtc1, viewer->lost);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Aggregate of all sessions since the previous report */
+static gboolean report_sessions(gpointer data) {
+    gint registered = 0, negotiated = 0, playing = 0, failed = 0;
+    guint64 interval_bytes = 0, lost = 0, received = 0;
+    std::vector<gfloat> latency;
+
+    for (auto &viewer : VIEWERS) {
+        {
+            std::lock_guard<std::mutex> guard(viewer->latency_lock);
+            latency.insert(latency.end(), viewer->interval_latency_ms.begin(), viewer->interval_latency_ms.end());
+            viewer->interval_latency_ms.clear();
+        }
+        guint64 bytes = viewer->bytes;
+        registered += viewer->registered != 0;
+        negotiated += viewer->answer_sent != 0;
+        playing += viewer->first_frame != 0;
+        failed += viewer->app_state == APP_STATE_ERROR || viewer->app_state == SERVER_CONNECTION_ERROR ||
+                  viewer->app_state == SERVER_REGISTRATION_ERROR || viewer->app_state == PEER_CALL_ERROR ||
+                  viewer->app_state == SERVER_CLOSED;
+        interval_bytes += bytes - viewer->reported_bytes;
+        viewer->reported_bytes = bytes;
+        lost += viewer->lost;
+        received += viewer->packets;
+    }
+    g_print("Sessions started %d/%d registered %d negotiated %d playing %d failed %d, %.1f Mbit/s, loss %.2f%%\n",
+            (gint) VIEWERS.size(), SESSIONS, registered, negotiated, playing, failed,
+            interval_bytes * 8.0 / REPORT_INTERVAL / 1e6,
+            received + lost > 0 ? 100.0 * lost / (received + lost) : 0.0);
+    print_latency_percentiles("of the last interval", latency);
+    return G_SOURCE_CONTINUE;
+}
+
+/* Per session join, first frame, bitrate and loss, times relative to the start of the session */
+static void print_session_report(gdouble duration_s) {
+    std::vector<gfloat> all_latency;
+
+    g_print("session peer_id connect_ms register_ms offer_ms answer_ms ice_ms first_packet_ms first_frame_ms "
+            "kbps packets lost keyframe_loss_percent other_loss_percent g2g_p50_ms g2g_p99_ms\n");
+    for (auto &viewer : VIEWERS) {
+        std::vector<gfloat> latency;
+        {
+            std::lock_guard<std::mutex> guard(viewer->latency_lock);
+            latency = viewer->latency_ms;
+        }
+        all_latency.insert(all_latency.end(), latency.begin(), latency.end());
+        std::sort(latency.begin(), latency.end());
+        gint64 start = viewer->connect_started;
+        gint64 first_packet = viewer->first_packet;
+        gdouble receive_s = first_packet ? (g_get_monotonic_time() - first_packet) / 1e6 : 0;
+        guint64 keyframe_sent = viewer->keyframe_packets + viewer->keyframe_lost;
+        guint64 other_sent = viewer->packets + viewer->lost - keyframe_sent;
+        g_print("%d %s %.1f %.1f %.1f %.1f %.1f %.1f %.1f %.1f %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT
+                " %.2f %.2f %.1f %.1f\n",
+                viewer->session_index, viewer->peer_id.c_str(), elapsed_ms(start, viewer->server_connected),
+                elapsed_ms(start, viewer->registered), elapsed_ms(start, viewer->offer_received),
+                elapsed_ms(start, viewer->answer_sent), elapsed_ms(start, viewer->ice_connected),
+                elapsed_ms(start, first_packet), elapsed_ms(start, viewer->first_frame),
+                receive_s > 0 ? viewer->bytes * 8.0 / receive_s / 1000 : 0.0, (guint64) viewer->packets,
+                (guint64) viewer->lost, keyframe_sent ? 100.0 * viewer->keyframe_lost / keyframe_sent : 0.0,
+                other_sent ? 100.0 * (viewer->lost - viewer->keyframe_lost) / other_sent : 0.0,
+                latency_percentile(latency, 0.5), latency_percentile(latency, 0.99));
+    }
+    print_latency_percentiles("of the run", all_latency);
+
+    //Impaired windows had a freeze or a frame rate drop, loss/nack/late count those with the event around them
+    g_print("session peer_id frames fps interval_ms interval_stddev_ms freezes freeze_ms longest_freeze_ms "
+            "frozen_percent fps_drops pts_skips impaired_after_loss impaired_after_nack impaired_after_late "
+            "clean_windows_with_loss\n");
+    for (auto &viewer : VIEWERS) {
+        viewer->qoe.print_summary(viewer->session_index, viewer->peer_id);
+        if (MAX_FREEZE_PERCENT >= 0 && viewer->qoe.frozen_percent() > MAX_FREEZE_PERCENT) {
+            g_printerr("Session %d frozen %.2f%% of the time, above %.2f%%\n", viewer->session_index,
+                       viewer->qoe.frozen_percent(), MAX_FREEZE_PERCENT);
+            EXIT_STATUS = 1;
+        }
+    }
+    g_print("Load run finished after %.0f s\n", duration_s);
+}
+
+static gboolean finish_load_run(gpointer data) {
+    sample_qoe(NULL);
+    print_session_report((g_get_monotonic_time() - RUN_STARTED) / 1e6);
+    g_main_loop_quit(LOOP);
+    return G_SOURCE_REMOVE;
+}
+
 void handler(int sig) {
     void *array[10];
     size_t size;
@@ -725,8 +1270,27 @@ main(int argc, char *argv[]) {
     GOptionContext *context;
     GError *error = NULL;
 
-    context = g_option_context_new("- gstreamer webrtc peer demo");
-
+    static GOptionEntry entries[] = {
+            {"sessions", 0, 0, G_OPTION_ARG_INT, &SESSIONS,
+                    "Number of viewer sessions to run in this process (default 1)", "N"},
+            {"ramp-rate", 0, 0, G_OPTION_ARG_DOUBLE, &RAMP_RATE,
+                    "Sessions started per second (default 10)", "N"},
+            {"peer-id-base", 0, 0, G_OPTION_ARG_INT, &PEER_ID_BASE,
+                    "Register sessions as PEER_ID_BASE, PEER_ID_BASE+1, ... instead of random ids", "ID"},
+            {"no-decode", 0, 0, G_OPTION_ARG_NONE, &NO_DECODE,
+                    "Depayload to fakesink instead of decoding to a window", NULL},
+            {"duration", 0, 0, G_OPTION_ARG_INT, &DURATION,
+                    "Stop after SECONDS and print the per session report (default run forever)", "SECONDS"},
+            {"report-interval", 0, 0, G_OPTION_ARG_INT, &REPORT_INTERVAL,
+                    "Seconds between aggregate reports (default 5)", "SECONDS"},
+            {"max-freeze-percent", 0, 0, G_OPTION_ARG_DOUBLE, &MAX_FREEZE_PERCENT,
+                    "Exit with status 1 when a session was frozen longer than PERCENT of its playback", "PERCENT"},
+            {NULL}
+    };
+
+    context = g_option_context_new("[SIGNALLING SERVER URL] - gstreamer webrtc peer demo");
+
+    g_option_context_add_main_entries(context, entries, NULL);
     g_option_context_add_group(context, gst_init_get_option_group());
     if (!g_option_context_parse(context, &argc, &argv, &error)) {
         g_printerr("Error initializing: %s\n", error->message);
@@ -736,15 +1300,34 @@ main(int argc, char *argv[]) {
     if (!check_plugins())
         return -1;
 
-    WebrtcViewerPtr webrtcViewerPtr = std::make_shared<WebrtcViewer>();
-    webrtcViewerPtr->loop = g_main_loop_new(NULL, FALSE);
-    webrtcViewerPtr->disable_ssl = TRUE;
-    webrtcViewerPtr->connect_to_websocket_server_async();
-    g_main_loop_run(webrtcViewerPtr->loop);
-
-    if (webrtcViewerPtr->loop) {
-        g_main_quit(webrtcViewerPtr->loop);
+    if (SESSIONS < 1 || RAMP_RATE <= 0 || REPORT_INTERVAL < 1 || DURATION < 0) {
+        g_printerr("Invalid load options\n");
+        return -1;
+    }
+    if (argc > 1)
+        SIGNAL_SERVER = argv[1];
+
+    //All sessions share the default main context
+    LOOP = g_main_loop_new(NULL, FALSE);
+    RUN_STARTED = g_get_monotonic_time();
+    if (SESSIONS > 1) {
+        //Hundreds of SDP and ICE dumps would hide the reports
+        VERBOSE = FALSE;
+        g_print("Starting %d sessions at %.1f per second%s\n", SESSIONS, RAMP_RATE,
+                PEER_ID_BASE > 0 ? "" : ", random peer ids");
+        g_timeout_add(MAX(1, (guint) (1000 / RAMP_RATE)), start_next_session, NULL);
+    } else {
+        start_next_session(NULL);
     }
-    return 0;
+    g_timeout_add_seconds(REPORT_INTERVAL, report_sessions, NULL);
+    g_timeout_add(QOE_WINDOW_MS, sample_qoe, NULL);
+    if (DURATION > 0)
+        g_timeout_add_seconds(DURATION, finish_load_run, NULL);
+    //Ctrl+C also ends with the summary
+    g_unix_signal_add(SIGINT, finish_load_run, NULL);
+    g_main_loop_run(LOOP);
+
+    g_main_loop_unref(LOOP);
+    return EXIT_STATUS;
 
 }
\ No newline at end of file